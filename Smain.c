@@ -1,1279 +1,4597 @@
-// Include necessary header files for the program
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-#include <sys/wait.h>
-#include <dirent.h>
-#include <fcntl.h>
-#include <pwd.h>
-#include <errno.h>
-#include <libgen.h>
-#include <tar.h>
-#include <netinet/in.h>
-#include <arpa/inet.h>
-
-// Define constants
-#define MAX_BUFFER 1000024 // Maximum buffer size for data transfer
-#define SPDF_PORT 4533  // Port number for the PDF server
-#define STEXT_PORT 4532 // Port number for the text server
-#define SMAIN_PORT 4530 // Port number for the main server
-#define CHUNK_SIZE 8192 // Size of chunks for file transfer
-
-// Function prototypes
-void prcclient(int client_socket);
-void handle_ufile(int client_socket, char *filename, char *path);
-void handle_dfile(int client_socket, char *filepath);
-void handle_rmfile(int client_socket, char *filepath);
-int forward_to_stext(const char *filename, const char *path);
-int forward_to_spdf(const char *filename, const char *path);
-void request_and_forward_file(int client_socket, const char *file_path, const char *server_name, int server_port);
-char *replace_smain_with_stext(const char *path);
-char *replace_smain_with_spdf(const char *path);
-void send_file(int client_socket, const char *filename);
-int forward_delete_request(int client_socket, const char *filepath, int port);
-void handle_display(int client_socket, char *pathname);
-int get_files_from_stext(const char *pathname, char *txt_files);
-int get_files_from_spdf(const char *pathname, char *pdf_files);
-int receive_file(int client_socket, char *filename);
-int create_directory(const char *path);
-char *expand_path(const char *path);
-void handle_dtar(int client_socket, char *file_extension);
-void receive_and_forward_file(int from_socket, int to_socket, const char *filename);
-
-// Main function
-int main()
-{
-    int server_socket, client_socket;
-    struct sockaddr_in server_addr, client_addr;
-    socklen_t addr_size = sizeof(client_addr);
-    // Create a socket for the server
-    server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0)
-    {
-        perror("Error in socket creation");
-        exit(1);
-    }
-
-    // Set up the server address structure
-    server_addr.sin_family = AF_INET;         // Use IPv4 addresses
-    server_addr.sin_port = htons(SMAIN_PORT); // Set the server port
-    server_addr.sin_addr.s_addr = INADDR_ANY; // Allow connections from any IP address
-
-    // Bind the socket to the server address
-    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("Error in binding");
-        exit(1);
-    }
-    // Listen for incoming connections
-    if (listen(server_socket, 10) == 0)
-    {
-        printf("Smain server listening on port %d...\n", SMAIN_PORT);
-    }
-    else
-    {
-        perror("Error in listening");
-        exit(1);
-    }
-    // Main server loop to accept and handle client connections
-    while (1)
-    {
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_size);
-        if (client_socket < 0)
-        {
-            perror("Error accepting connection");
-            continue;
-        }
-        // Create a child process to handle the client
-        pid_t pid = fork();
-        if (pid == 0)
-        {
-            // Child process
-            close(server_socket);
-            prcclient(client_socket); // Process commands from the client
-            exit(0);
-        }
-        else if (pid > 0)
-        {
-            // Parent process
-            close(client_socket);
-        }
-        else
-        {
-            perror("Fork failed"); // Print error if fork fails
-        }
-    }
-
-    close(server_socket); // Close the server socket when exiting
-    return 0;
-}
-// Function to handle commands from a client
-void prcclient(int client_socket)
-{
-    char buffer[MAX_BUFFER]; // Buffer for receiving data
-    ssize_t bytes_received;  // Number of bytes received from the client
-
-    while (1)
-    {
-        // Receive data from the client
-        bytes_received = recv(client_socket, buffer, MAX_BUFFER - 1, 0);
-        if (bytes_received <= 0)
-        {
-            if (bytes_received == 0)
-            {
-                printf("Client disconnected.\n");
-            }
-            else
-            {
-                perror("recv failed");
-            }
-            break;
-        }
-
-        buffer[bytes_received] = '\0'; // Null-terminate the received data
-
-        // Parse the command from the received data
-        char *command = strtok(buffer, " ");
-        if (command == NULL)
-        {
-            send(client_socket, "Invalid command", 15, 0); // Send error message if command is invalid
-            continue;
-        }
-
-        // Handle different commands
-        if (strcmp(command, "ufile") == 0)
-        {
-            printf("handling ufile");
-            char *filename = strtok(NULL, " ");
-            char *path = strtok(NULL, "");
-            if (filename != NULL && path != NULL)
-            {
-                handle_ufile(client_socket, filename, path); // Handle the upload file command
-            }
-            else
-            {
-                const char *error_msg = "Error: Invalid ufile command format. Usage: ufile <filename> <path>";
-                send(client_socket, error_msg, strlen(error_msg), 0); // Send error message if command format is invalid
-            }
-        }
-        else if (strcmp(command, "dfile") == 0)
-        {
-            char *filepath = strtok(NULL, "");
-            handle_dfile(client_socket, filepath);
-        }
-        else if (strcmp(command, "rmfile") == 0)
-        {
-            char *filepath = strtok(NULL, "");
-            handle_rmfile(client_socket, filepath); // Handle the remove file command
-        }
-        else if (strncmp(buffer, "dtar", 4) == 0)
-        {
-            char *file_extension = buffer + 5; // Skip "dtar "
-            handle_dtar(client_socket, file_extension);
-        }
-        else if (strcmp(command, "display") == 0)
-        {
-            char *directory = strtok(NULL, "");
-            handle_display(client_socket, directory); // Handle the display command
-        }
-        else
-        {
-            send(client_socket, "Unknown command", 15, 0);
-        }
-
-        printf("\n");
-    }
-
-    close(client_socket); // Close the client socket when done
-}
-// Function to handle the upload file command
-void handle_ufile(int client_socket, char *filename, char *path)
-{
-    if (filename == NULL || path == NULL)
-    {
-        const char *error_msg = "Error: Invalid filename or path";
-        send(client_socket, error_msg, strlen(error_msg), 0); // Send error message if filename or path is invalid
-        return;
-    }
-
-    char *expanded_path = expand_path(path); // Expand the path to its full form
-    if (expanded_path == NULL)
-    {
-        char error_msg[MAX_BUFFER];
-        snprintf(error_msg, MAX_BUFFER, "Error: Unable to expand or create path %s", path);
-        send(client_socket, error_msg, strlen(error_msg), 0); // Send error message if path expansion fails
-        return;
-    }
-
-    char filepath[MAX_BUFFER] = {0};                                            // Buffer for storing the file path
-    snprintf(filepath, sizeof(filepath) - 1, "%s/%s", expanded_path, filename); // Construct the full file path
-
-    // Check if file already exists
-    if (access(filepath, F_OK) != -1)
-    {
-        char error_msg[MAX_BUFFER];
-        snprintf(error_msg, MAX_BUFFER, "Error: File %s already exists", filename);
-        send(client_socket, error_msg, strlen(error_msg), 0); // Send error message if file already exists
-        free(expanded_path);                                  // Free the expanded path memory
-        return;
-    }
-    // Receive the file from the client
-    int receive_result = receive_file(client_socket, filepath);
-    if (receive_result != 0)
-    {
-        char error_msg[MAX_BUFFER];
-        snprintf(error_msg, MAX_BUFFER, "Error storing file on Smain: %s", strerror(errno));
-        send(client_socket, error_msg, strlen(error_msg), 0); // Send error message if file storage fails
-                                                              // Free the expanded path memory
-        free(expanded_path);
-        return;
-    }
-    // Get the file extension
-    char *file_extension = strrchr(filename, '.');
-    if (file_extension == NULL)
-    {
-        const char *error_msg = "Error: File has no extension";
-        send(client_socket, error_msg, strlen(error_msg), 0); // Send error message if file has no extension
-        free(expanded_path);                                  // Free the expanded path memory
-        remove(filepath);                                     // Remove the file if it has no extension
-        return;
-    }
-
-    char success_msg[MAX_BUFFER];
-    if (strcmp(file_extension, ".txt") == 0) // handle .txt
-    {
-        if (forward_to_stext(filepath, "~/stext") == 0)
-        {
-            snprintf(success_msg, MAX_BUFFER, "File %s stored successfully on Smain", filename);
-            // Remove the file if it was successfully forwarded
-            remove(filepath);
-        }
-        else
-        {
-            snprintf(success_msg, MAX_BUFFER, "File %s stored unsuccessfully on Smain ", filename);
-        }
-    }
-    else if (strcmp(file_extension, ".c") == 0) // handle .c
-    {
-        snprintf(success_msg, MAX_BUFFER, "File %s stored successfully on Smain server", filename);
-    }
-    else if (strcmp(file_extension, ".pdf") == 0) // handle .pdf
-    {
-        if (forward_to_spdf(filepath, "~/spdf") == 0)
-        {
-            snprintf(success_msg, MAX_BUFFER, "File %s stored successfully on Smain", filename);
-            // Remove the file if it was successfully forwarded
-            remove(filepath);
-        }
-        else
-        {
-            snprintf(success_msg, MAX_BUFFER, "File %s stored unsuccessfully on Smain ", filename);
-        }
-    }
-    else
-    {
-        snprintf(success_msg, MAX_BUFFER, "File %s stored successfully on Smain server", filename);
-    }
-    send(client_socket, success_msg, strlen(success_msg), 0); // Send success message to the client
-    free(expanded_path);                                      // Free the expanded path memory
-}
-
-int receive_file(int client_socket, char *filename)
-{
-    // Buffer to receive the file size
-    char size_str[32];
-    ssize_t size_received = recv(client_socket, size_str, sizeof(size_str) - 1, 0); // Receive file size from client
-    if (size_received <= 0)                                                         // Check if receiving size was unsuccessful
-    {
-        perror("Error receiving file size");
-        return -1;
-    }
-    size_str[size_received] = '\0';                  // Null-terminate the size string
-    size_t file_size = strtoull(size_str, NULL, 10); // Convert size string to integer
-
-    // Send acknowledgment
-    send(client_socket, "ACK", 3, 0);
-
-    printf("Receiving file: %s\n", filename); // Log the filename being received
-
-    // Open file for writing
-    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (file < 0) // Check if file opening was unsuccessful
-    {
-        perror("Error opening file for writing");
-        return -1;
-    }
-
-    char buffer[MAX_BUFFER];           // Buffer for receiving file data
-    size_t total_received = 0;         // Track total bytes received
-    while (total_received < file_size) // Continue until full file is received
-    {
-        ssize_t bytes_received = recv(client_socket, buffer, sizeof(buffer), 0); // Receive file data
-        if (bytes_received <= 0)                                                 // Check if receiving data was unsuccessful
-        {
-            if (bytes_received < 0)
-            {
-                perror("Error receiving file data");
-            }
-            break;
-        }
-        ssize_t bytes_written = write(file, buffer, bytes_received); // Write data to file
-        if (bytes_written != bytes_received)                         // Check if all data was written
-        {
-            perror("Error writing to file");
-            close(file);
-            return -1;
-        }
-        total_received += bytes_received; // Update total bytes received
-    }
-
-    close(file);
-    // Check if the entire file was received
-    if (total_received == file_size)
-    {
-        printf("File received and saved: %s\n", filename);
-        return 0;
-    }
-    else
-    {
-        // printf("Error: Incomplete file transfer. Received %zu/%zu bytes\n", total_received, file_size);
-        return -1;
-    }
-}
-
-int forward_to_stext(const char *filepath, const char *base_path)
-{ // Create socket for Stext server
-    int stext_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (stext_socket < 0)
-    {
-        perror("Error creating socket for Stext");
-        return -1;
-    }
-
-    struct sockaddr_in stext_addr; // Server address structure
-    stext_addr.sin_family = AF_INET;
-    stext_addr.sin_port = htons(STEXT_PORT);
-    stext_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    if (connect(stext_socket, (struct sockaddr *)&stext_addr, sizeof(stext_addr)) < 0)
-    {
-        perror("Error connecting to Stext server");
-        close(stext_socket);
-        return -1;
-    }
-
-    // Remove filename from filepath
-    char *dir_path = strdup(filepath); // Duplicate the path to modify it
-    if (dir_path == NULL)
-    {
-        perror("Error duplicating filepath");
-        close(stext_socket);
-        return -1;
-    }
-
-    char *base_filename = basename(dir_path);        // Get the filename
-    char *path_without_filename = dirname(dir_path); // Get directory path without filename
-
-    // Construct the command to send to Stext
-    char command[MAX_BUFFER];
-    snprintf(command, sizeof(command), "store %s %s", base_filename, path_without_filename);
-
-    // Send the command to Stext
-    if (send(stext_socket, command, strlen(command), 0) < 0)
-    {
-        perror("Error sending command to Stext server");
-        free(dir_path);
-        close(stext_socket);
-        return -1;
-    }
-
-    // Receive acknowledgment from Stext server
-    char response[MAX_BUFFER];
-    ssize_t bytes_received = recv(stext_socket, response, MAX_BUFFER - 1, 0);
-    if (bytes_received > 0)
-    {
-        response[bytes_received] = '\0';
-        printf("Stext server response: %s\n", response);
-    }
-    else
-    {
-        perror("Error receiving response from Stext server");
-    }
-
-    // Forward the file content to Stext
-    int file = open(filepath, O_RDONLY);
-    if (file < 0)
-    {
-        perror("Error opening file to forward to Stext server");
-        free(dir_path);
-        close(stext_socket);
-        return -1;
-    }
-
-    ssize_t bytes_read;
-    char buffer[MAX_BUFFER];
-    while ((bytes_read = read(file, buffer, MAX_BUFFER)) > 0) // Read file content
-    {
-        if (send(stext_socket, buffer, bytes_read, 0) != bytes_read)
-        {
-            perror("Error forwarding file content to Stext server"); // Print error message
-            close(file);
-            free(dir_path);
-            close(stext_socket);
-            return -1;
-        }
-    }
-
-    if (bytes_read < 0)
-    {
-        perror("Error reading file");
-    }
-
-    close(file);         // Close the file
-    free(dir_path);      // Free allocated memory
-    close(stext_socket); // Close the socket
-
-    return 0;
-}
-
-int forward_to_spdf(const char *filepath, const char *base_path)
-{
-    // Create socket for Spdf server
-    int spdf_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (spdf_socket < 0)
-    {
-        perror("Error creating socket for Spdf");
-        return -1;
-    }
-
-    struct sockaddr_in spdf_addr;                       // Server address structure
-    spdf_addr.sin_family = AF_INET;                     // IPv4
-    spdf_addr.sin_port = htons(SPDF_PORT);              // Set port number
-    spdf_addr.sin_addr.s_addr = inet_addr("127.0.0.1"); // Set IP address to localhost
-
-    if (connect(spdf_socket, (struct sockaddr *)&spdf_addr, sizeof(spdf_addr)) < 0)
-    {
-        perror("Error connecting to Spdf server");
-        close(spdf_socket);
-        return -1;
-    }
-
-    // Duplicate the path to modify it and replace "smain" with "spdf"
-    char *dir_path = strdup(filepath);
-    if (dir_path == NULL)
-    {
-        perror("Error duplicating filepath");
-        close(spdf_socket);
-        return -1;
-    }
-    char *base_filename = basename(dir_path);        // Get the filename
-    char *path_without_filename = dirname(dir_path); // Get directory path without filename
-
-    // Construct the command to send to spdf
-    char command[MAX_BUFFER];
-    snprintf(command, sizeof(command), "store %s %s", base_filename, path_without_filename);
-
-    // Send the command to spdf
-    if (send(spdf_socket, command, strlen(command), 0) < 0)
-    {
-        perror("Error sending command to Spdf server");
-        free(dir_path);
-        close(spdf_socket);
-        return -1;
-    }
-
-    // Receive acknowledgment from Spdf server
-    char response[MAX_BUFFER];
-    ssize_t bytes_received = recv(spdf_socket, response, MAX_BUFFER - 1, 0);
-    if (bytes_received > 0)
-    {
-        response[bytes_received] = '\0';
-        printf("Spdf server response: %s\n", response);
-    }
-    else
-    {
-        perror("Error receiving response from Spdf server");
-    }
-
-    // Forward the file content to Spdf
-    int file = open(filepath, O_RDONLY);
-    if (file < 0)
-    {
-        perror("Error opening file to forward to Spdf server");
-        free(dir_path);
-        close(spdf_socket);
-        return -1;
-    }
-
-    ssize_t bytes_read;
-    char buffer[MAX_BUFFER];
-    while ((bytes_read = read(file, buffer, MAX_BUFFER)) > 0) // Read file content
-    {
-        if (send(spdf_socket, buffer, bytes_read, 0) != bytes_read)
-        {
-            perror("Error forwarding file content to Spdf server");
-            close(file);
-            free(dir_path);
-            close(spdf_socket);
-            return -1;
-        }
-    }
-
-    if (bytes_read < 0)
-    {
-        perror("Error reading file");
-    }
-
-    close(file);        // Close the file
-    free(dir_path);     // Free allocated memory
-    close(spdf_socket); // Close the socket
-
-    return 0;
-}
-
-char *expand_path(const char *path)
-{
-    if (path == NULL) // Check if the provided path is NULL
-    {
-        fprintf(stderr, "Error: NULL path provided\n");
-        return NULL;
-    }
-    const char *home;    // Pointer to store home directory path
-    char *expanded_path; // Pointer to store the expanded path
-
-    if (path[0] == '~' && path[1] == '/')
-    {
-        home = getenv("HOME"); // Get the value of the HOME environment variable
-        if (home == NULL)      // Check if HOME is not set
-        {
-            struct passwd *pwd = getpwuid(getuid());
-            if (pwd == NULL)
-            {
-                fprintf(stderr, "Error: Unable to determine home directory\n");
-                return NULL;
-            }
-            home = pwd->pw_dir; // Use the home directory from user information
-        }
-
-        expanded_path = malloc(strlen(home) + strlen(path) + 1); // Allocate memory for expanded path (+1 for null-terminator)
-        if (expanded_path == NULL)                               // Check if memory allocation failed
-        {
-            fprintf(stderr, "Error: Memory allocation failed\n");
-            return NULL;
-        }
-
-        strcpy(expanded_path, home);     // Copy home directory path to expanded_path
-        strcat(expanded_path, path + 1); // Skip the '~'
-    }
-    else
-    {
-        expanded_path = strdup(path); // Duplicate the path if it does not start with '~/'
-    }
-
-    // Ensure the directory exists
-    if (create_directory(expanded_path) != 0)
-    {
-        free(expanded_path);
-        return NULL;
-    }
-
-    return expanded_path;
-}
-
-int create_directory(const char *path)
-{
-    char tmp[256];  // Buffer to hold the path during directory creation
-    char *p = NULL; // Pointer used to traverse the path
-    size_t len;
-
-    snprintf(tmp, sizeof(tmp), "%s", path); // Copy the path to the buffer
-    len = strlen(tmp);
-    if (tmp[len - 1] == '/') // Check if the path ends with '/'
-        tmp[len - 1] = 0;    // Remove the trailing '/' for directory creation
-
-    // Traverse the path and create directories as needed
-    for (p = tmp + 1; *p; p++)
-    {
-        if (*p == '/') // Check for directory separators
-        {
-            *p = '\0'; // Temporarily end the string for directory creation
-            if (mkdir(tmp, S_IRWXU) != 0 && errno != EEXIST)
-            {
-                perror("mkdir failed");
-                return -1;
-            }
-            *p = '/'; // Restore the directory separator
-        }
-    }
-    // Create the final directory
-    if (mkdir(tmp, S_IRWXU) != 0 && errno != EEXIST) // Create the final directory (if it doesn't already exist)
-    {
-        perror("mkdir failed");
-        return -1;
-    }
-    return 0;
-}
-
-void send_file(int client_socket, const char *file_path)
-{
-    FILE *file = fopen(file_path, "rb"); // Open the file in binary read mode
-    if (!file)                           // Check if file opening failed
-    {
-        perror("Failed to open file");
-        send(client_socket, "Error: File not found.\n", 23, 0);
-        return;
-    }
-
-    fseek(file, 0, SEEK_END);     // Move file pointer to the end of the file
-    long file_size = ftell(file); // Get the size of the file
-    fseek(file, 0, SEEK_SET);     // Move file pointer back to the beginning of the file
-
-    char size_buffer[32];
-    snprintf(size_buffer, sizeof(size_buffer), "%ld", file_size); // Convert file size to string
-    send(client_socket, size_buffer, strlen(size_buffer), 0);
-
-    printf("Sending file: %s, size: %ld bytes\n", file_path, file_size);
-
-    char buffer[CHUNK_SIZE];                                          // Buffer to hold file data chunks
-    size_t bytes_read;                                                // Variable to store the number of bytes read
-    long total_sent = 0;                                              // Track the total number of bytes sent
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0) // Read file data in chunks
-    {
-        ssize_t bytes_sent = send(client_socket, buffer, bytes_read, 0);
-        if (bytes_sent < 0) // Check if sending data failed
-        {
-            perror("Error sending file data");
-            break;
-        }
-        total_sent += bytes_sent; // Update total bytes sent
-        // printf("Sent %zd bytes, total %ld/%ld\n", bytes_sent, total_sent, file_size);
-    }
-
-    fclose(file);
-
-    if (total_sent == file_size) // Check if the entire file was sent
-    {
-        printf("File sent successfully: %s\n", file_path);
-        send(client_socket, "File sent successfully.\n", 24, 0);
-    }
-    else
-    {
-        //   printf("Error: Incomplete file transfer. Sent %ld/%ld bytes\n", total_sent, file_size);
-        send(client_socket, "Error: Incomplete file transfer.\n", 32, 0);
-    }
-}
-
-void request_and_forward_file(int client_socket, const char *file_path, const char *server_name, int server_port)
-{
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0); // Create a socket for the server connection
-    struct sockaddr_in server_addr;                      // Structure to hold server address information
-
-    server_addr.sin_family = AF_INET;                     // Set address family to IPv4
-    server_addr.sin_port = htons(server_port);            // Set port number
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1"); // Set IP address to localhost (127.0.0.1)
-
-    printf("Connecting to %s server on port %d\n", server_name, server_port);
-    if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("Failed to connect to server");
-        send(client_socket, "Error: Unable to connect to server.\n", 36, 0); // Send error message to client
-        close(server_socket);
-        return;
-    }
-
-    char request[MAX_BUFFER];
-    snprintf(request, sizeof(request), "get %s", file_path); // Create the request message to get the file
-    printf("Sending request to %s: %s\n", server_name, request);
-    send(server_socket, request, strlen(request), 0); // Send request to server
-
-    // Forward the file size
-    char size_buffer[32];
-    ssize_t size_received = recv(server_socket, size_buffer, sizeof(size_buffer) - 1, 0);
-    if (size_received <= 0) // Check if receiving file size failed
-    {
-        perror("Error receiving file size");
-        close(server_socket);
-        return;
-    }
-    size_buffer[size_received] = '\0';                  // Null-terminate the size string
-    send(client_socket, size_buffer, size_received, 0); // Forward the file size to the client
-
-    // Forward the file content
-    char buffer[CHUNK_SIZE];
-    ssize_t bytes_received;
-    size_t total_sent = 0;
-    size_t file_size = atoll(size_buffer);
-
-    while (total_sent < file_size && (bytes_received = recv(server_socket, buffer, sizeof(buffer), 0)) > 0) // Receive file data in chunks
-    {
-        ssize_t bytes_sent = send(client_socket, buffer, bytes_received, 0);
-        if (bytes_sent < 0)
-        {
-            perror("Error sending file data to client");
-            break;
-        }
-        total_sent += bytes_sent; // Update total bytes sent
-
-        // printf("Forwarded %zd bytes, total %zu/%zu\n", bytes_sent, total_sent, file_size);
-    }
-
-    if (total_sent == file_size) // Check if the entire file was forwarded
-    {
-        printf("File %s forwarded successfully.\n", file_path);
-        char completion_msg[MAX_BUFFER]; // Buffer to hold completion message
-        snprintf(completion_msg, sizeof(completion_msg), "File %s downloaded successfully.\n", file_path);
-        send(client_socket, completion_msg, strlen(completion_msg), 0);
-    }
-    else
-    {
-        //  printf("Error: Incomplete file transfer. Forwarded %zu/%zu bytes\n", total_sent, file_size);
-        send(client_socket, "Error: Incomplete file transfer.\n", 32, 0);
-    }
-
-    close(server_socket);
-}
-
-void handle_dfile(int client_socket, char *file_path)
-{
-    char buffer[MAX_BUFFER];
-    // Get the file extension from the file path
-    const char *file_ext = strrchr(file_path, '.');
-    // Check if file extension is missing
-    if (file_ext == NULL)
-    {
-        snprintf(buffer, sizeof(buffer), "Error: Invalid file path.\n");
-        send(client_socket, buffer, strlen(buffer), 0);
-        return;
-    }
-
-    // Remove any trailing newline characters
-    char *newline = strchr(file_path, '\n');
-    if (newline)
-        *newline = '\0';
-
-    // Expand the path
-    char *expanded_path = expand_path(file_path);
-    if (expanded_path == NULL)
-    {
-        snprintf(buffer, sizeof(buffer), "Error: Unable to expand file path.\n");
-        send(client_socket, buffer, strlen(buffer), 0);
-        return;
-    }
-    // Handle different file types based on extension
-    if (strcmp(file_ext, ".c") == 0)
-    {
-        send_file(client_socket, expanded_path);
-    }
-    else if (strcmp(file_ext, ".pdf") == 0)
-    {
-        // Replace "smain" with "spdf" in the path and request the file
-        char *spdf_path = replace_smain_with_spdf(expanded_path);
-        request_and_forward_file(client_socket, spdf_path, "spdf", SPDF_PORT);
-        free(spdf_path);
-    }
-    else if (strcmp(file_ext, ".txt") == 0)
-    {
-        // Replace "smain" with "stext" in the path and request the file
-
-        char *stext_path = replace_smain_with_stext(expanded_path);
-        request_and_forward_file(client_socket, stext_path, "stext", STEXT_PORT);
-        free(stext_path);
-    }
-    else
-    {
-        snprintf(buffer, sizeof(buffer), "Error: Unsupported file type.\n");
-        send(client_socket, buffer, strlen(buffer), 0);
-    }
-
-    free(expanded_path); // Free the allocated memory
-}
-char *replace_smain_with_stext(const char *path)
-{
-    char *new_path = strdup(path); // Duplicate the path
-    if (new_path == NULL)
-    {
-        return NULL; // Return NULL if memory allocation fails
-    }
-    // Replace "smain" with "stext" in the duplicated path
-    char *smain_pos = strstr(new_path, "smain");
-    if (smain_pos != NULL)
-    {
-        memcpy(smain_pos, "stext", 5);
-    }
-
-    return new_path;
-}
-
-char *replace_smain_with_spdf(const char *path)
-{
-    char *new_path = strdup(path); // Duplicate the path
-    if (new_path == NULL)
-    {
-        return NULL; // Return NULL if memory allocation fails
-    }
-    // Replace "smain" with "spdf" in the duplicated path
-    char *smain_pos = strstr(new_path, "smain");
-    if (smain_pos != NULL)
-    {
-        memcpy(smain_pos, "spdf", 4);
-        memmove(smain_pos + 4, smain_pos + 5, strlen(smain_pos + 5) + 1); // Adjust the rest of the path
-    }
-
-    return new_path; // Return the modified path
-}
-
-void handle_rmfile(int client_socket, char *filepath)
-{
-    char *file_ext = strrchr(filepath, '.'); // Get the file extension
-    if (file_ext == NULL)
-    {
-        send(client_socket, "Error: Invalid file extension", 29, 0); // Send error message for missing file extension
-        return;
-    }
-
-    // Expand the path
-    char *expanded_path = expand_path(filepath);
-    if (expanded_path == NULL)
-    {
-        send(client_socket, "Error: Unable to expand file path", 33, 0); // Send error message for path expansion failure
-        return;
-    }
-
-    if (strcmp(file_ext, ".c") == 0)
-    {
-        // Handle .c file locally
-        if (remove(expanded_path) == 0)
-        {
-            send(client_socket, "File deleted successfully\n", 25, 0); // Send success message
-        }
-        else
-        {
-            send(client_socket, "Error deleting file", 19, 0); // Send error message for deletion failure
-        }
-    }
-    else if (strcmp(file_ext, ".txt") == 0)
-    {
-        // Forward request to Stext
-        if (forward_delete_request(client_socket, expanded_path, STEXT_PORT) == 0)
-        {
-            send(client_socket, "File deletion request forwarded to Stext", 39, 0); // Send success message
-        }
-        else
-        {
-            send(client_socket, "Error forwarding delete request to Stext", 39, 0); // Send error message for forwarding failure
-        }
-    }
-    else if (strcmp(file_ext, ".pdf") == 0)
-    {
-        // Forward request to Spdf
-        if (forward_delete_request(client_socket, expanded_path, SPDF_PORT) == 0)
-        {
-            send(client_socket, "File deletion request forwarded to Spdf", 38, 0); // Send success message
-        }
-        else
-        {
-            send(client_socket, "Error forwarding delete request to Spdf", 38, 0); // Send error message for forwarding failure
-        }
-    }
-    else
-    {
-        send(client_socket, "Error: Unsupported file type", 28, 0); // Send error message for unsupported file type
-    }
-
-    free(expanded_path); // Free the allocated memory
-}
-
-int forward_delete_request(int client_socket, const char *filepath, int port)
-{
-    // Create a socket for connecting to the server
-    int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (server_socket < 0)
-    {
-        perror("Socket creation failed");
-        return -1;
-    }
-    // Set up server address structure
-    struct sockaddr_in server_addr;
-    server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(port);
-    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-    // Connect to the server
-    if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-    {
-        perror("Connection failed");
-        close(server_socket);
-        return -1;
-    }
-    // Prepare the delete command
-    char command[MAX_BUFFER];
-    snprintf(command, sizeof(command), "rmfile %s", filepath);
-    // Send the delete command to the server
-    if (send(server_socket, command, strlen(command), 0) < 0)
-    {
-        perror("Send failed");
-        close(server_socket);
-        return -1;
-    }
-    printf("Command sent to server: %s\n", command);
-    // Receive and forward the server's response to the client
-    char response[MAX_BUFFER];
-    ssize_t bytes_received = recv(server_socket, response, sizeof(response) - 1, 0);
-    if (bytes_received > 0)
-    {
-        response[bytes_received] = '\0';
-        printf("Server response received: %s\n", response);
-        send(client_socket, response, strlen(response), 0);
-    }
-    else if (bytes_received == 0)
-    {
-        printf("Connection closed by server\n");
-        send(client_socket, "Error: No response from server", 30, 0);
-    }
-    else
-    {
-        perror("Error receiving response from server");
-        send(client_socket, "Error: No response from server", 30, 0);
-    }
-
-    close(server_socket);
-    return 0;
-}
-
-void receive_and_forward_file(int server_socket, int client_socket, const char *filename)
-{
-    FILE *file = fopen(filename, "wb"); // Open the file for writing
-    if (!file)
-    {
-        perror("Error opening file for writing");
-        return;
-    }
-
-    char buffer[MAX_BUFFER];
-    ssize_t bytes_received;
-    while ((bytes_received = recv(server_socket, buffer, sizeof(buffer), 0)) > 0)
-    {
-        fwrite(buffer, 1, bytes_received, file); // Write received data to the file
-    }
-    fclose(file); // Close the file
-}
-
-void handle_dtar(int client_socket, char *file_extension)
-{
-    fflush(stdout); // Flush stdout to ensure all output is written
-
-    char tar_filename[20];
-    char command[MAX_BUFFER];
-    int server_port;
-    // Determine the tar filename and server port based on file extension
-    if (strcmp(file_extension, ".c") == 0)
-    {
-        snprintf(tar_filename, sizeof(tar_filename), "c.tar");
-        snprintf(command, sizeof(command), "tar -cvf %s -C ~/smain $(find ~/smain -name '*.c')", tar_filename);
-        // fflush(stdout);
-        system(command); // Execute tar command to create a tarball of .c files
-    }
-    else if (strcmp(file_extension, ".pdf") == 0 || strcmp(file_extension, ".txt") == 0)
-    {
-        if (strcmp(file_extension, ".pdf") == 0)
-        {
-            snprintf(tar_filename, sizeof(tar_filename), "pdf.tar");
-            server_port = SPDF_PORT;
-        }
-        else if (strcmp(file_extension, ".txt") == 0)
-        {
-            snprintf(tar_filename, sizeof(tar_filename), "txt.tar");
-            server_port = STEXT_PORT;
-        }
-        // Create tarball file
-        snprintf(command, sizeof(command), "dtar %s", file_extension);
-        fflush(stdout);
-
-        // Connect to the appropriate server
-        int server_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (server_socket < 0)
-        {
-            perror("Error creating socket for server connection");
-            send(client_socket, "Error: Unable to connect to server", 34, 0);
-            return;
-        }
-
-        struct sockaddr_in server_addr;
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(server_port);
-        server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-
-        if (connect(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-        {
-            perror("Error connecting to server");
-            send(client_socket, "Error: Unable to connect to server", 34, 0);
-            close(server_socket);
-            return;
-        }
-
-        // Send tar command to server
-        if (send(server_socket, command, strlen(command), 0) < 0)
-        {
-            perror("Error sending command to server");
-            close(server_socket);
-            send(client_socket, "Error: Unable to send command to server", 38, 0);
-            return;
-        }
-
-        // Receive tar file from server
-        FILE *tar_file = fopen(tar_filename, "wb");
-        if (tar_file == NULL)
-        {
-            perror("Error creating tar file");
-            send(client_socket, "Error: Unable to create tar file", 32, 0);
-            close(server_socket);
-            return;
-        }
-
-        char buffer[MAX_BUFFER];
-        ssize_t bytes_received, bytes_sent;
-        size_t total_bytes_received = 0;
-        size_t total_bytes_sent = 0;
-        // Receive data from the Stext or Spdf server and write it to the tar file
-        while ((bytes_received = recv(server_socket, buffer, sizeof(buffer), 0)) > 0)
-        {
-            fwrite(buffer, 1, bytes_received, tar_file);
-            total_bytes_received += bytes_received;
-              printf("Received %zd bytes from server, total: %zu\n", bytes_received, total_bytes_received);
-            fflush(stdout);
-
-            // Send the received data to the client
-            bytes_sent = send(client_socket, buffer, bytes_received, 0);
-            if (bytes_sent < 0)
-            {
-                perror("Error sending data to client");
-                fclose(tar_file);
-                close(server_socket);
-                return;
-            }
-            total_bytes_sent += bytes_sent;
-              printf("Sent %zd bytes to client, total: %zu\n", bytes_sent, total_bytes_sent);
-            // fflush(stdout);
-        }
-
-           printf("Total bytes received from server: %zu\n", total_bytes_received);
-
-        fflush(stdout);
-
-        if (total_bytes_received == 0)
-        {
-            printf("Warning: No data received from server\n");
-            fflush(stdout);
-            send(client_socket, "Error: No data received from server", 35, 0);
-            remove(tar_filename);
-            return;
-        }
-
-        // Handle any error in receiving data from the server
-        if (bytes_received < 0)
-        {
-            perror("Error receiving file data from server");
-        }
-        else
-        {
-            printf("File transfer complete. Total bytes received from server: %zu\n", total_bytes_received);
-        }
-
-        // Clean up: close the file and the server socket
-        fclose(tar_file);
-        close(server_socket);
-
-        // Final message to client
-        if (total_bytes_received > 0)
-        {
-            printf("Tar file successfully transferred to client. Total bytes sent: %zu\n", total_bytes_sent);
-        }
-        else
-        {
-            send(client_socket, "Error: No data received from server", 35, 0);
-        }
-    }
-    else
-    {
-        send(client_socket, "Error: Invalid file extension for dtar", 37, 0);
-        return;
-    }
-}
-
-void handle_display(int client_socket, char *pathname)
-{
-    // Expand the given path to handle user directory shortcuts
-    char *expanded_path = expand_path(pathname);
-    if (expanded_path == NULL) // Check if path expansion was successful
-    {
-        send(client_socket, "Error: Invalid path", 20, 0);
-        printf("Error: Invalid path\n");
-        return;
-    }
-
-    // Get .c files
-    char c_files[MAX_BUFFER] = "";
-    DIR *dir = opendir(expanded_path);
-    if (dir)
-    {
-        struct dirent *entry;
-        // Iterate through directory entries
-        while ((entry = readdir(dir)) != NULL)
-        {
-            if (entry->d_type == DT_REG && strstr(entry->d_name, ".c")) // Check if entry is a regular file with a .c extension
-            {
-                strcat(c_files, entry->d_name);
-                strcat(c_files, "\n");
-            }
-        }
-        closedir(dir); // Close the directory stream
-    }
-    else
-    {
-        printf("Error opening directory for .c files: %s\n", strerror(errno));
-    }
-    //  printf("C files found:\n%s", c_files);
-
-    // Get .pdf files from spdf
-    char pdf_files[MAX_BUFFER] = "";
-    if (get_files_from_spdf(expanded_path, pdf_files) != 0)
-    {
-        printf("Error getting .pdf files from spdf\n");
-    }
-    //   printf("PDF files found:\n%s", pdf_files);
-
-    // Get .txt files from stext
-    char txt_files[MAX_BUFFER] = "";
-    if (get_files_from_stext(expanded_path, txt_files) != 0)
-    {
-        printf("Error getting .txt files from stext\n");
-    }
-    //   printf("TXT files found:\n%s", txt_files);
-
-    // Combine all files
-    char all_files[MAX_BUFFER * 3];
-    snprintf(all_files, sizeof(all_files), "%s%s%s", c_files, pdf_files, txt_files);
-    printf("\nAll files to be sent to client:\n\n%s", all_files);
-
-    if (send(client_socket, all_files, strlen(all_files), 0) < 0)
-    {
-        perror("Error sending file list to client");
-    }
-    else
-    {
-        //  printf("File list sent to client successfully\n");
-    }
-    free(expanded_path);
-}
-
-int get_files_from_stext(const char *pathname, char *txt_files)
-{ // Create a socket for communication with the Stext server
-    int stext_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (stext_socket < 0)
-    {
-        perror("Error creating socket for Stext");
-        return -1;
-    }
-    // Set up server address structure
-    struct sockaddr_in stext_addr;
-    stext_addr.sin_family = AF_INET;
-    stext_addr.sin_port = htons(STEXT_PORT);
-    stext_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    // Connect to the Stext server
-    if (connect(stext_socket, (struct sockaddr *)&stext_addr, sizeof(stext_addr)) < 0)
-    {
-        perror("Error connecting to Stext server");
-        close(stext_socket);
-        return -1;
-    }
-    // Replace "smain" with "stext" in the path
-    char *stext_path = replace_smain_with_stext(pathname);
-    char command[MAX_BUFFER];
-    snprintf(command, sizeof(command), "list %s", stext_path);
-    free(stext_path);
-
-    //  printf("Sending command to stext: %s\n", command);
-    // Send the command to the Stext server
-    if (send(stext_socket, command, strlen(command), 0) < 0)
-    {
-        perror("Error sending command to Stext server");
-        close(stext_socket);
-        return -1;
-    }
-    // Receive the response from the Stext server
-    ssize_t bytes_received = recv(stext_socket, txt_files, MAX_BUFFER - 1, 0);
-    if (bytes_received > 0)
-    {
-        txt_files[bytes_received] = '\0';
-        printf("Received .txt files:\n%s", txt_files);
-    }
-    else if (bytes_received == 0)
-    {
-        printf("Stext server closed the connection\n");
-        strcpy(txt_files, "");
-    }
-    else
-    {
-        perror("Error receiving data from Stext server");
-        strcpy(txt_files, "");
-    }
-
-    close(stext_socket);
-    return 0;
-}
-
-int get_files_from_spdf(const char *pathname, char *pdf_files)
-{ // Create a socket for communication with the Spdf server
-    int spdf_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (spdf_socket < 0)
-    {
-        perror("Error creating socket for Spdf");
-        return -1;
-    }
-    // Set up server address structure
-    struct sockaddr_in spdf_addr;
-    spdf_addr.sin_family = AF_INET;
-    spdf_addr.sin_port = htons(SPDF_PORT);
-    spdf_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-    // Connect to the Spdf server
-    if (connect(spdf_socket, (struct sockaddr *)&spdf_addr, sizeof(spdf_addr)) < 0)
-    {
-        perror("Error connecting to Spdf server");
-        close(spdf_socket);
-        return -1;
-    }
-    // Replace "smain" with "spdf" in the path
-    char *spdf_path = replace_smain_with_spdf(pathname);
-    char command[MAX_BUFFER];
-    snprintf(command, sizeof(command), "list %s", spdf_path);
-    free(spdf_path);
-
-    // printf("Sending command : %s\n", command);
-    // Send the command to the Spdf server
-    if (send(spdf_socket, command, strlen(command), 0) < 0)
-    {
-        perror("Error sending command to Spdf server");
-        close(spdf_socket);
-        return -1;
-    }
-    // Receive the response from the Spdf server
-    ssize_t bytes_received = recv(spdf_socket, pdf_files, MAX_BUFFER - 1, 0);
-    if (bytes_received > 0)
-    {
-        pdf_files[bytes_received] = '\0'; // Null-terminate the received data
-        printf("Received .pdf files:\n%s", pdf_files);
-    }
-    else
-    {
-        strcpy(pdf_files, ""); // Clear the buffer if no files are received
-        printf("No .pdf files received from spdf\n");
-    }
-
-    close(spdf_socket);
-    return 0;
-}
+// Include necessary header files for the program
+#define _GNU_SOURCE // accept4
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <pwd.h>
+#include <errno.h>
+#include <libgen.h>
+#include <signal.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <netdb.h>
+#include <time.h>
+#include "protocol.h"
+#include "tar_stream.h"
+#include "buffer_pool.h"
+#include "catalog.h"
+#include "compress.h"
+#include "metrics.h"
+#include "hash_ring.h"
+#include "chunk_store.h"
+#include "journal.h"
+#include "read_cache.h"
+
+// Define constants
+#define MAX_MESSAGE FS_MAX_MESSAGE // Replies and error messages sent to clients
+#define MAX_STATS (64 * 1024)      // Room for the stats of all three servers
+#define SPDF_PORT 4533  // Port number for the PDF server
+#define STEXT_PORT 4532 // Port number for the text server
+#define SMAIN_PORT 4530 // Port number for the main server
+#define MAX_EVENTS 256  // Events handled per epoll_wait call
+#define FRAMES_PER_WAKEUP 16                  // Frames read from one connection before yielding to others
+#define HIGH_WATERMARK (4 * FS_MAX_PAYLOAD)   // Stop producing into a connection above this many queued bytes
+#define LOW_WATERMARK FS_MAX_PAYLOAD          // Resume producing once its queue drains below this
+#define MAX_LISTING (16 * 1024 * 1024)        // Largest display listing buffered for one request
+#define BACKEND_CONNECTION_LIMIT 32           // Default connections per storage server per worker
+#define BACKEND_IDLE_TIMEOUT 60               // Seconds an unused pooled connection is kept open
+#define BACKEND_RETRY_DELAY 1                 // Seconds to fail fast after a storage server refused a connection
+#define RELAY_PIPE_SIZE (1024 * 1024)         // Pipe capacity requested for splice relays
+#define SMALL_CHUNK 4096                      // Payloads and output chunks up to this size are allocated exactly instead of pooled
+#define IDLE_BUFFERS 64                       // Released I/O buffers each worker keeps for reuse
+#define CATALOG_ENTRIES 65536                 // Default number of files the catalog can track
+#define CATALOG_TIMEOUT 5                     // Seconds to wait on a storage server sending its index
+#define CATALOG_RETRY_DELAY 5                 // Seconds between attempts to load a missing index
+#define DISPLAY_TIMEOUT 2000                  // Default milliseconds a storage server gets to list its files for display
+#define MAX_SHARDS HASH_RING_MAX_MEMBERS      // Instances of Stext or of Spdf files are spread over
+#define MAX_REPLICAS 8                        // Read replicas of one shard
+#define FORWARD_TIMEOUT 30                    // Seconds the forwarder lets a storage server stall a transfer
+#define FORWARD_RETRY_MAX 30                  // Longest wait, in seconds, between the forwarder's attempts
+#define FORWARD_REFUSALS 5                    // Refusals in a row after which a journaled upload is given up on
+#define DISK_SLOTS 32                         // io_uring buffers of a worker: its disk reads and writes in flight
+#define DISK_DEPTH 4                          // Of those, the most one request keeps in flight
+
+// A file or pipe that queued output is read from, shared by the chunks that refer to it
+struct shared_fd
+{
+    int fd;
+    int refs;
+    int is_pipe;    // Spliced from in order rather than sent with sendfile at an offset
+    size_t pending; // Pipe: bytes spliced in and not yet spliced out
+    int broken;     // Pipe: bytes were left behind in it, so it can no longer be used
+};
+
+// A block of encoded frames waiting to be written to a connection
+struct out_chunk
+{
+    struct out_chunk *next;
+    size_t len;               // Bytes in data, or taken from source
+    size_t off;               // Bytes already written
+    struct shared_fd *source; // When set the bytes come from this file or pipe instead of data
+    off_t offset;             // File position of the first byte, for sendfile
+    size_t footprint;         // Memory the chunk occupies
+    int pooled;               // Taken from the I/O buffer pool
+    char data[];
+};
+
+// Forwarder: a journaled upload its server refused, and how many times in a row
+struct forward_refusal
+{
+    struct forward_refusal *next;
+    char *rel;
+    ino_t ino; // The job refused; a newer upload of the path starts over
+    int count;
+};
+
+// A buffer of the worker's io_uring and the read or write using it
+struct disk_slot
+{
+    struct request *req; // Request it is lent to; NULL once that is freed
+    int used;            // Lent out, or still in flight for a freed request
+    int busy;            // The read or write is in flight
+    int write;
+    uint32_t length;     // Bytes asked for
+    int32_t result;      // Bytes transferred, or -errno
+};
+
+// Role of a connection in the event loop
+enum conn_role
+{
+    CONN_CLIENT,  // A client talking to Smain
+    CONN_BACKEND, // Smain talking to Stext or Spdf on behalf of a request
+};
+
+struct request;
+struct backend;
+
+// Per-connection state for the event loop
+struct connection
+{
+    int fd;
+    enum conn_role role;
+    uint32_t events; // Events currently registered with epoll
+    int connecting;  // Non-blocking connect still in progress
+    int read_paused; // Input suspended while a request is busy or for backpressure
+    int want_write;  // A request is streaming into this connection and wants to be told when it drains
+    int closed;      // Closed; freed at the end of the event loop iteration
+    // Frame reader: the header first, then exactly frame.length payload bytes
+    unsigned char header[FS_HEADER_SIZE];
+    size_t header_have;
+    struct fs_frame frame;
+    char *payload;
+    size_t payload_have;
+    int splicing; // The payload is being spliced to another connection instead of read into payload
+    int payload_slot; // Disk slot payload was read into, for an upload to write it from there; -1 if none
+    // Output queue
+    struct out_chunk *out_head, *out_tail;
+    size_t out_bytes;
+    size_t memory;      // Bytes of buffers and request state the connection holds
+    size_t peak_memory; // Largest value memory reached
+    struct request *request; // Active request (client) or owning request (backend)
+    struct backend *server;  // Pool a backend connection belongs to
+    struct connection *next_idle;
+    time_t idle_since;       // When a pooled connection was last released
+    struct connection *next_closed;
+};
+
+// A storage server and this worker's pool of keep-alive connections to it
+struct backend
+{
+    char name[64];            // "Stext" or "Spdf", followed by its address when the tier has several
+    char metrics_name[32];    // Its metrics segment, if it runs on this host
+    struct sockaddr_in addr;
+    int shard;                // Index in its shard set
+    int open;                                     // Connections open, idle or busy
+    struct connection *idle;                      // Idle connections, most recently used first
+    struct request *waiting_head, *waiting_tail;  // Requests waiting for a free connection slot
+    time_t down_until;                            // Fail fast until then after a failed connect
+    int forward_sock;                             // The forwarder's connection to it, or -1
+};
+
+// The instances of Stext or of Spdf, with the hash ring that places new files on them
+struct shard_set
+{
+    const char *name; // "Stext" or "Spdf"
+    const char *dir;  // "stext" or "spdf", as in its metrics segment's name
+    int location;     // Catalog location of the tier's files
+    int count;
+    struct backend members[MAX_SHARDS];    // The primary of each shard, which takes its writes
+    struct backend replicas[MAX_SHARDS][MAX_REPLICAS]; // Servers the primary copies its writes to, for reads
+    int replica_count[MAX_SHARDS];
+    unsigned read_turn;                    // Rotates this worker's reads over equally busy servers
+    struct hash_ring ring;
+};
+
+// Progress of a client request through its state machine
+enum request_state
+{
+    REQ_UFILE_RECEIVE, // Writing uploaded DATA frames to the local file
+    REQ_UFILE_FLUSH,   // Upload received; waiting for its writes still in flight
+    REQ_UFILE_DRAIN,   // Upload rejected; discarding DATA frames until EOF
+    REQ_UFILE_RELAY,   // Passing uploaded DATA frames straight through to Stext/Spdf
+    REQ_UFILE_NEED,    // Chunked upload: passing the backend's NEED bitmap to the client
+    REQ_SEND_FILE,     // Streaming a local file to the client
+    REQ_RELAY,         // Relaying a backend download to the client
+    REQ_DISPLAY,       // Streaming a listing while its backend parts arrive
+    REQ_DISPLAY_PART,  // Listing one storage server's files for a display
+    REQ_TAR_MERGE,     // Relaying the archives of several shards to the client as one
+    REQ_TAR_PART,      // Fetching one shard's archive for a merged dtar
+    REQ_WAIT_REPLY,    // Waiting for the backend REPLY (rmfile, end of a forward)
+};
+
+// Where a request's time goes, reported in its trace record
+enum request_stage
+{
+    STAGE_RECEIVE,  // Waiting for upload data from the client
+    STAGE_WRITE,    // Writing an upload under ~/smain
+    STAGE_READ,     // Opening a local file or archive for a download
+    STAGE_CONNECT,  // Getting a connection to Spdf/Stext, waiting for a pool slot included
+    STAGE_BACKEND,  // Waiting for the storage server's first answer
+    STAGE_TRANSFER, // Moving file data between Smain and the storage server
+    STAGE_COMMIT,   // Waiting for the storage server to confirm a store
+    STAGE_REPLY,    // Queueing the reply to the client
+    STAGE_COUNT
+};
+const char *stage_names[STAGE_COUNT] = {"receive", "write", "read", "connect", "backend", "transfer", "commit", "reply"};
+
+// One client command in flight; a connection runs at most one at a time
+struct request
+{
+    uint8_t opcode;
+    uint32_t id;              // Request id chosen by the client, used on frames to it
+    uint32_t trace_id;        // Id used on frames to Spdf/Stext and in the trace spans
+    enum request_state state;
+    struct connection *client;
+    struct connection *backend;
+    const char *backend_name; // Name of the storage server, for messages
+    struct backend *server;   // Storage server the backend request goes to
+    struct backend *primary;  // dfile: the shard's primary, when a replica was chosen to read from
+    uint64_t read_version;    // dfile: the write of the file a replica must have applied to serve it
+    char *backend_payload;    // Packed arguments of the backend request, kept for a retry
+    uint32_t backend_length;
+    uint8_t backend_opcode;
+    uint16_t backend_flags;   // FS_FLAG_COMPRESSED when the client decodes the backend's compressed DATA
+    int backend_reused;       // The request went out on a pooled connection
+    int backend_responded;    // The backend has sent at least one frame
+    int backend_retried;      // Already retried on a fresh connection
+    struct request *next_waiting;
+    int file;                 // Local file being received or sent, or -1
+    struct shared_fd *source; // Local file being sent with sendfile, instead of file
+    struct shared_fd *pipe;   // Pipe that relayed DATA payloads are spliced through
+    int pipe_in;              // Write end of pipe
+    size_t pipe_size;         // Capacity of pipe
+    struct tar_writer *tar;   // Archive being streamed instead of a file, for dtar .c; for a merged dtar, the journal's
+    struct tar_filter *filter; // Merged dtar: drops the shards' copies of the journaled uploads
+    long long size;           // Bytes expected in the transfer
+    long long offset;         // Where in the file a ranged download starts
+    int ranged;               // dfile asked for a range; SIZE also carries the file's size
+    long long done;           // Bytes transferred so far
+    int compress;             // The client decodes compressed DATA frames
+    struct compressor compressor; // Compression of the DATA stream sent to the client
+    int eof_sent;             // The DATA stream being produced has been terminated
+    uint32_t checksum;        // CRC32C of the file data received or sent so far
+    int checksum_stored;      // Download: checksum is the file's stored one, so it is not computed
+    int checksum_failed;      // Upload: the stream's checksum trailer did not match
+    long long disk_offset;    // Where the next write of an upload, or read-ahead of a download, goes in the file
+    int disk_writes;          // Upload: writes in flight through the worker's io_uring
+    int disk_paused;          // Upload: the client is paused until fewer writes are in flight
+    int disk_error;           // Upload: errno of a write that failed in flight
+    int ahead[DISK_DEPTH];    // Download: disk slots read ahead into, oldest first
+    int ahead_count;
+    int ahead_used;           // Download: the oldest read-ahead was handed out to be sent
+    int ahead_short;          // Download: a read came up short, so the file ends there
+    int disk_waiting;         // Download: waiting for the oldest read-ahead to complete
+    int relay_started;        // Some of the backend response already reached the client
+    int chunk_stage;          // Chunked upload: 1 while its chunk list is relayed, 2 once the chunks follow
+    char *journal_tmp;        // Write-behind upload: the journal file it is written to
+    struct journal_commit *commit; // Write-behind upload: its commit, while the committer has it
+    int journaled;            // rmfile: the file was in the journal when its delete was sent
+    struct chunk_record *chunks; // Write-behind chunked upload: its chunk list
+    char *cached;             // dfile answered from the read cache: the bytes to send
+    char *cache_path;         // dfile that may fill the read cache: the path it is cached under
+    char *cache_data;         // Its contents as they arrive, decoded, once the size is known to fit
+    long long cache_size, cache_have;
+    uint32_t cache_version;   // The path's cache version when the download started
+    size_t chunk_count, chunk_next;
+    char *filename;           // Name of the uploaded file
+    char *filepath;           // Path being written or read
+    char *error;              // Error reported once a rejected upload is drained
+    char *display_path;       // Expanded directory for display
+    struct request **parts;   // Backend listings still running for display, or shard archives for dtar
+    int part_slots;           // Entries in parts
+    int parts_pending;        // Entries of parts in use, plus one while they are being started
+    int current_part;         // dtar: the part whose archive is being relayed
+    char missing[128];        // Servers whose files are missing from the display
+    struct request *parent;   // Display or dtar a part belongs to
+    struct request *next_part; // Next in the worker's list of running listing parts
+    long long deadline;       // Monotonic milliseconds at which a listing part is given up
+    long long started;        // Monotonic microseconds at which the command arrived, for the metrics
+    long long stage_us[STAGE_COUNT]; // Microseconds spent in each stage
+    long long stage_mark;     // When the current stage began
+    unsigned stages;          // Bit set of the stages the request went through
+    char *listing;            // Display names not yet sent; for a part, the start of an incomplete line
+    size_t listing_len, listing_cap;
+};
+
+// Function prototypes
+void run_event_loop(int server_socket);
+void accept_clients(int server_socket);
+struct connection *conn_create(int fd, enum conn_role role);
+void conn_update_events(struct connection *conn);
+void conn_set_paused(struct connection *conn, int paused);
+void conn_close(struct connection *conn);
+void conn_failed(struct connection *conn);
+void conn_read(struct connection *conn);
+void conn_flush(struct connection *conn);
+void conn_writable(struct connection *conn);
+void conn_account(struct connection *conn, long delta);
+void conn_release_payload(struct connection *conn);
+struct out_chunk *chunk_alloc(struct connection *conn, size_t data_len);
+void chunk_free(struct connection *conn, struct out_chunk *chunk);
+ssize_t send_file_chunk(struct connection *conn, struct out_chunk *chunk);
+int conn_queue(struct connection *conn, struct out_chunk *chunk, int flush);
+int conn_send_frame(struct connection *conn, uint8_t opcode, uint16_t flags, uint32_t request_id, const void *payload, uint32_t length);
+int conn_send_header(struct connection *conn, uint8_t opcode, uint16_t flags, uint32_t request_id, uint32_t length);
+int conn_send_eof(struct connection *conn, uint32_t request_id, uint32_t crc);
+int conn_send_source(struct connection *conn, struct shared_fd *source, off_t offset, size_t len);
+struct connection *relay_destination(struct connection *conn);
+int conn_splice_payload(struct connection *conn);
+struct shared_fd *shared_fd_create(int fd, int is_pipe);
+void shared_fd_release(struct shared_fd *source);
+int request_open_pipe(struct request *req);
+void handle_frame(struct connection *conn);
+void prcclient(struct connection *client, struct fs_frame *frame, char *payload);
+struct request *request_create(struct connection *client, struct fs_frame *frame);
+void finish_request(struct request *req, int is_error, const char *message);
+void finish_request_flags(struct request *req, uint16_t flags, const char *message);
+void free_request(struct request *req);
+void request_stage(struct request *req, enum request_stage stage);
+void trace_request(struct request *req, const char *status);
+void request_client_frame(struct request *req, struct fs_frame *frame, char *payload);
+void request_backend_frame(struct request *req, struct fs_frame *frame, char *payload);
+void request_backend_failed(struct request *req);
+void read_from_primary(struct request *req, const char *reason);
+void request_writable(struct request *req, struct connection *conn);
+struct connection *connect_to_server(struct backend *server);
+void backend_request(struct request *req, struct backend *server, uint8_t opcode, int argc, const char *const argv[]);
+void backend_dispatch(struct request *req);
+void backend_wake_waiters(void);
+void backend_close_idle(time_t now);
+void release_backend(struct request *req, int reusable);
+void handle_ufile(struct request *req, char *filename, char *path, char *size_str, char *mode);
+void reject_upload(struct request *req, const char *error_msg);
+void receive_file(struct request *req, struct fs_frame *frame, char *payload);
+void forward_file(struct request *req, struct backend *server);
+void journal_upload(struct request *req);
+void journal_chunk_list(struct request *req, struct fs_frame *frame, const char *payload);
+void journal_finish(struct request *req);
+void journal_committed(void);
+int disk_slot_get(struct request *req);
+int disk_upload_slot(struct connection *conn);
+void disk_slot_put(int slot);
+int disk_write(struct request *req, const void *data, uint32_t length);
+ssize_t disk_read(struct request *req, size_t want, char *buffer, const char **data);
+void disk_completed(void);
+void finish_upload(struct request *req);
+void journal_catalog(void *ctx, const char *rel);
+void journal_catalog_put(const char *rel, long long size, long long mtime);
+void run_forwarder(void);
+void forward_job(void *ctx, const char *rel);
+int forward_refused(const char *rel, ino_t ino);
+void forward_forget(const char *rel);
+int forward_send(struct backend *server, uint8_t opcode, uint32_t trace_id, int argc, const char *argv[], int file,
+                 long long size, char *message, uint64_t *version);
+pid_t start_forwarder(void);
+void handle_dfile(struct request *req, char *filepath, char *offset_str, char *length_str);
+void send_file(struct request *req, const char *file_path);
+void send_cached(struct request *req, const char *file_path, long long file_size);
+void cache_on_download(struct request *req, const char *path);
+void cache_relayed_frame(struct request *req, struct fs_frame *frame, const char *payload);
+void send_tar(struct request *req, const char *store_path, const char *file_extension);
+void pump_file(struct request *req, struct connection *dest);
+void request_and_forward_file(struct request *req, uint8_t opcode, int argc, const char *const argv[],
+                              struct backend *server);
+void handle_rmfile(struct request *req, char *filepath);
+void forward_delete_request(struct request *req, const char *filepath, struct backend *server);
+void handle_dtar(struct request *req, char *file_extension);
+void handle_display(struct request *req, char *pathname);
+void handle_stats(struct request *req, int machine);
+void display_start_part(struct request *req, struct backend *server, int location, int slot);
+int start_parts(struct request *req, int slots);
+void display_part_data(struct request *part, const char *data, size_t len);
+void display_part_done(struct request *part, const char *failure);
+void display_finish(struct request *req);
+void tar_start_part(struct request *req, struct backend *server, const char *file_extension);
+void tar_part_frame(struct request *part, struct fs_frame *frame, char *payload);
+void tar_next_part(struct request *req);
+void tar_fail(struct request *req, const char *message);
+int tar_jobs(struct request *req, const char *file_extension);
+int tar_emit(void *ctx, const char *data, size_t len);
+void tar_finish(struct request *req);
+int display_flush(struct request *req, const char *data, size_t len);
+int display_wait_time(void);
+void display_expire_parts(void);
+long long monotonic_ms(void);
+int append_listing(struct request *req, const char *data, size_t len);
+char *replace_smain_with_stext(const char *path);
+char *replace_smain_with_spdf(const char *path);
+char *home_path(const char *path);
+int shard_configure(struct shard_set *set, const char *list, int default_port);
+struct backend *shard_for(struct shard_set *set, const char *path);
+int shard_add(struct shard_set *set, struct backend *server, const char *address, int default_port);
+struct backend *read_server(struct request *req, struct shard_set *set, const char *path);
+int backend_load(struct backend *server);
+int create_directory(const char *path);
+char *expand_path(const char *path);
+int file_location(const char *path);
+int catalog_covers(const char *path);
+int catalog_missing(const char *path);
+int catalog_load_local(void);
+int catalog_fetch_index(struct backend *server, struct catalog_record **records, size_t *count, size_t *capacity);
+int catalog_load_backend(struct shard_set *set);
+void catalog_load_missing(void);
+void display_catalog(void *ctx, const char *name);
+
+int epoll_fd = -1;                        // Event loop of this worker process
+struct connection *closed_connections;    // Connections to free once the current events are handled
+int backend_limit = BACKEND_CONNECTION_LIMIT; // Connections per storage server per worker
+struct shard_set stext_shards = {.name = "Stext", .dir = "stext", .location = CATALOG_STEXT}; // Where .txt files go
+struct shard_set spdf_shards = {.name = "Spdf", .dir = "spdf", .location = CATALOG_SPDF};     // Where .pdf files go
+struct backend *backends[2 * MAX_SHARDS * (1 + MAX_REPLICAS)]; // Every storage server, primaries and replicas
+int backend_count;
+int splice_supported = 1;                 // Cleared when the kernel refuses to splice between these descriptors
+char copy_buffer[FS_MAX_PAYLOAD];         // Bounce buffer for the copying fallbacks
+// Frame payloads and large output chunks; a buffer holds a whole frame
+struct buffer_pool io_buffers = BUFFER_POOL_INITIALIZER(sizeof(struct out_chunk) + FS_HEADER_SIZE + FS_MAX_PAYLOAD, IDLE_BUFFERS);
+struct catalog *catalog;                  // Files stored through Smain, shared by all workers
+struct metrics *metrics;                  // Request counters of all workers
+char *smain_root;                         // Expanded ~/smain, the tree the catalog covers
+int display_timeout = DISPLAY_TIMEOUT;    // Milliseconds a storage server gets to list its files
+long long trace_threshold;                // Microseconds a request must take to have its trace record logged
+struct request *display_parts;            // Listing parts of this worker waiting on a storage server
+struct journal journal;                   // Uploads acknowledged before reaching their storage server, with -J
+int journaling;                           // -J was given
+int use_uring;                            // -B: local disk I/O goes through io_uring where available
+struct uring *uring;                      // This worker's ring, or NULL for blocking reads and writes
+int uring_fd = -1;                        // Eventfd the ring signals completions on
+struct disk_slot disk_slots[DISK_SLOTS];  // The ring's buffers and the operations using them
+int disk_free[DISK_SLOTS];                // Slots not lent to a request
+int disk_free_count;
+struct read_cache *read_cache;            // Downloaded .txt and .pdf files, shared by all workers, with -c
+struct forward_refusal *forward_refusals; // Forwarder: uploads refused since they last got through
+
+// Main function
+int main(int argc, char *argv[])
+{
+    int server_socket;
+    struct sockaddr_in server_addr;
+    int workers = 1; // Number of event loop processes
+    long catalog_entries = CATALOG_ENTRIES;
+    const char *stext_list = NULL, *spdf_list = NULL; // host:port lists of the shards
+    const char *journal_dir = NULL;
+    long long cache_mb = 0;
+    pid_t forwarder = 0;
+    int opt;
+
+    // Parse command line options
+    while ((opt = getopt(argc, argv, "w:b:m:t:s:T:P:J:c:B")) != -1)
+    {
+        if (opt == 'w')
+        {
+            workers = atoi(optarg);
+        }
+        else if (opt == 'b')
+        {
+            backend_limit = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        }
+        else if (opt == 'm')
+        {
+            catalog_entries = atol(optarg) > 0 ? atol(optarg) : 1;
+        }
+        else if (opt == 't')
+        {
+            display_timeout = atoi(optarg) > 0 ? atoi(optarg) : 1;
+        }
+        else if (opt == 's')
+        {
+            trace_threshold = atoll(optarg) * 1000;
+        }
+        else if (opt == 'T')
+        {
+            stext_list = optarg;
+        }
+        else if (opt == 'P')
+        {
+            spdf_list = optarg;
+        }
+        else if (opt == 'J')
+        {
+            journal_dir = optarg;
+        }
+        else if (opt == 'c')
+        {
+            cache_mb = atoll(optarg) > 0 ? atoll(optarg) : 0;
+        }
+        else if (opt == 'B')
+        {
+            use_uring = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-w workers] [-b backend_connections] [-m catalog_entries] [-t display_timeout_ms] [-s slow_ms] [-T host:port[+replica...],...] [-P host:port[+replica...],...] [-J journal_dir] [-c cache_mb] [-B]  (-w 0 runs one worker per CPU)\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (shard_configure(&stext_shards, stext_list, STEXT_PORT) < 0 || shard_configure(&spdf_shards, spdf_list, SPDF_PORT) < 0)
+    {
+        exit(1);
+    }
+    if (workers <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? (int)cpus : 1;
+    }
+    setvbuf(stdout, NULL, _IOLBF, 0); // Keep log lines from different workers intact
+    signal(SIGPIPE, SIG_IGN);         // Broken connections are reported through send errors
+
+    // Create a socket for the server
+    server_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (server_socket < 0)
+    {
+        perror("Error in socket creation");
+        exit(1);
+    }
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    // Set up the server address structure
+    server_addr.sin_family = AF_INET;         // Use IPv4 addresses
+    server_addr.sin_port = htons(SMAIN_PORT); // Set the server port
+    server_addr.sin_addr.s_addr = INADDR_ANY; // Allow connections from any IP address
+
+    // Bind the socket to the server address
+    if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        perror("Error in binding");
+        exit(1);
+    }
+    // Listen for incoming connections
+    if (listen(server_socket, SOMAXCONN) == 0)
+    {
+        printf("Smain server listening on port %d with %d worker(s)...\n", SMAIN_PORT, workers);
+        // Each worker sets up its own ring; this one only checks that io_uring works here
+        struct uring *probe = use_uring ? uring_create(1, 0, 0) : NULL;
+        printf("File I/O: %s\n", probe != NULL ? "io_uring" : use_uring ? "blocking (no io_uring here)" : "blocking");
+        uring_destroy(probe);
+    }
+    else
+    {
+        perror("Error in listening");
+        exit(1);
+    }
+    // Workers share the listening socket; accept never blocks inside the event loop
+    fcntl(server_socket, F_SETFL, fcntl(server_socket, F_GETFL) | O_NONBLOCK);
+
+    // Build the catalog before forking so every worker shares it
+    smain_root = expand_path("~/smain");
+    catalog = catalog_create((uint32_t)catalog_entries);
+    if (smain_root == NULL || catalog == NULL)
+    {
+        perror("Error creating the catalog");
+        exit(1);
+    }
+    catalog_load_local();
+    catalog_load_missing();
+    metrics = metrics_create("smain");
+    if (metrics == NULL)
+    {
+        perror("Error creating the metrics");
+        exit(1);
+    }
+    if (cache_mb > 0)
+    {
+        read_cache = read_cache_create(cache_mb * 1024 * 1024);
+        if (read_cache == NULL)
+        {
+            perror("Error creating the read cache");
+            exit(1);
+        }
+        printf("Caching downloads in %lld MB, files up to %lld bytes\n", cache_mb, read_cache->object_max);
+    }
+    if (journal_dir != NULL)
+    {
+        char *journal_root = expand_path(journal_dir);
+        if (journal_root == NULL || catalog_covers(journal_root) || journal_open(&journal, journal_root) < 0)
+        {
+            fprintf(stderr, "Error: Unable to use %s as the journal (it must be outside ~/smain)\n", journal_dir);
+            exit(1);
+        }
+        free(journal_root);
+        journaling = 1;
+        // Uploads journaled before a restart are still waiting; the catalog lists them until they are sent
+        size_t pending = 0;
+        journal_scan(&journal, "", journal_catalog, &pending);
+        printf("Journal %s: %zu uploads waiting to be forwarded\n", journal.root, pending);
+        forwarder = start_forwarder();
+    }
+
+    // Start the worker processes, each running its own event loop
+    for (int i = 0; i < workers; i++)
+    {
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            run_event_loop(server_socket);
+            exit(1);
+        }
+        else if (pid < 0)
+        {
+            perror("Fork failed"); // Print error if fork fails
+        }
+    }
+
+    // Supervise the workers and replace any that die; until every storage
+    // server has sent its index, keep asking for it in between
+    while (1)
+    {
+        int status;
+        int complete = catalog_settled(catalog, CATALOG_STEXT) && catalog_settled(catalog, CATALOG_SPDF);
+        pid_t pid = waitpid(-1, &status, complete ? 0 : WNOHANG);
+        if (pid == 0)
+        {
+            sleep(CATALOG_RETRY_DELAY);
+            catalog_load_missing();
+            continue;
+        }
+        if (pid < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("waitpid failed");
+            break;
+        }
+        if (pid == forwarder)
+        {
+            printf("Forwarder %d exited (status %d), restarting it\n", (int)pid, status);
+            forwarder = start_forwarder();
+            continue;
+        }
+        printf("Worker %d exited (status %d), starting a replacement\n", (int)pid, status);
+        pid = fork();
+        if (pid == 0)
+        {
+            run_event_loop(server_socket);
+            exit(1);
+        }
+        else if (pid < 0)
+        {
+            perror("Fork failed");
+        }
+    }
+
+    close(server_socket); // Close the server socket when exiting
+    return 0;
+}
+
+// Serve all connections of this worker from a single epoll loop
+void run_event_loop(int server_socket)
+{
+    struct epoll_event events[MAX_EVENTS];
+
+    epoll_fd = epoll_create1(0);
+    if (epoll_fd < 0)
+    {
+        perror("Error creating epoll instance");
+        return;
+    }
+    // Wake only one worker per incoming connection
+    struct epoll_event listen_event = {.events = EPOLLIN | EPOLLEXCLUSIVE, .data.ptr = NULL};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &listen_event) < 0)
+    {
+        perror("Error watching the server socket");
+        return;
+    }
+    if (journaling)
+    {
+        // Write-behind uploads are committed by a thread of this worker, which reports back through a pipe
+        int committed = journal_start_committer(&journal);
+        struct epoll_event commit_event = {.events = EPOLLIN, .data.ptr = &journal};
+        if (committed < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, committed, &commit_event) < 0)
+        {
+            perror("Error starting the journal committer");
+            return;
+        }
+    }
+    if (use_uring)
+    {
+        // Uploads are written and local downloads read ahead through this worker's ring
+        uring = uring_create(DISK_SLOTS, DISK_SLOTS, FS_URING_SLOT);
+        uring_fd = uring != NULL ? uring_event_fd(uring) : -1;
+        struct epoll_event disk_event = {.events = EPOLLIN, .data.ptr = disk_slots};
+        if (uring_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, uring_fd, &disk_event) < 0)
+        {
+            uring_destroy(uring); // Blocking reads and writes do the job
+            uring = NULL;
+        }
+        for (int i = 0; i < DISK_SLOTS; i++)
+            disk_free[disk_free_count++] = i;
+    }
+
+    while (1)
+    {
+        // Wake up at least once a second to retire idle backend connections, and in time for display deadlines
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, display_wait_time());
+        if (ready < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("epoll_wait failed");
+            return;
+        }
+
+        for (int i = 0; i < ready; i++)
+        {
+            struct connection *conn = events[i].data.ptr;
+            if (conn == NULL)
+            {
+                accept_clients(server_socket);
+                continue;
+            }
+            if (conn == (void *)&journal)
+            {
+                journal_committed();
+                continue;
+            }
+            if (conn == (void *)disk_slots)
+            {
+                uint64_t signals;
+                if (read(uring_fd, &signals, sizeof(signals)) < 0 && errno != EAGAIN)
+                    perror("Error reading the io_uring eventfd");
+                continue; // Its completions are handled below
+            }
+            if (conn->closed)
+            {
+                continue; // Closed while handling an earlier event of this batch
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                conn_writable(conn);
+            }
+            if (!conn->closed && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+            {
+                if ((events[i].events & EPOLLIN) && !conn->read_paused)
+                {
+                    conn_read(conn);
+                }
+                else if (events[i].events & (EPOLLHUP | EPOLLERR))
+                {
+                    conn_failed(conn);
+                }
+            }
+        }
+
+        // Disk reads and writes that completed, including the ones that did while being submitted
+        if (uring != NULL)
+            disk_completed();
+
+        // Hand freed backend connections to waiting requests, then drop stale ones
+        backend_wake_waiters();
+        backend_close_idle(time(NULL));
+        display_expire_parts();
+
+        // Free connections closed during this iteration
+        while (closed_connections != NULL)
+        {
+            struct connection *conn = closed_connections;
+            closed_connections = conn->next_closed;
+            free(conn);
+        }
+    }
+}
+
+// Accept every pending client connection
+void accept_clients(int server_socket)
+{
+    while (1)
+    {
+        int client_socket = accept4(server_socket, NULL, NULL, SOCK_NONBLOCK);
+        if (client_socket < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+            {
+                perror("Error accepting connection");
+            }
+            return;
+        }
+        if (conn_create(client_socket, CONN_CLIENT) == NULL)
+        {
+            close(client_socket);
+            continue;
+        }
+        metrics_add(&metrics->connections, 1);
+        __atomic_fetch_add(&metrics->open_connections, 1, __ATOMIC_RELAXED);
+    }
+}
+
+// Register a non-blocking socket with the event loop
+struct connection *conn_create(int fd, enum conn_role role)
+{
+    struct connection *conn = calloc(1, sizeof(*conn));
+    if (conn == NULL)
+    {
+        perror("Error allocating connection");
+        return NULL;
+    }
+    conn->fd = fd;
+    conn->role = role;
+    conn->payload_slot = -1;
+    fs_set_nodelay(fd);
+    conn->events = EPOLLIN;
+    conn_account(conn, sizeof(*conn));
+    struct epoll_event event = {.events = conn->events, .data.ptr = conn};
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+    {
+        perror("Error adding connection to epoll");
+        free(conn);
+        return NULL;
+    }
+    return conn;
+}
+
+// Recompute the epoll interest set of a connection
+void conn_update_events(struct connection *conn)
+{
+    uint32_t events = 0;
+    if (!conn->read_paused && !conn->connecting)
+    {
+        events |= EPOLLIN;
+    }
+    if (conn->connecting || conn->out_bytes > 0 || conn->want_write)
+    {
+        events |= EPOLLOUT;
+    }
+    if (events != conn->events)
+    {
+        struct epoll_event event = {.events = events, .data.ptr = conn};
+        epoll_ctl(epoll_fd, EPOLL_CTL_MOD, conn->fd, &event);
+        conn->events = events;
+    }
+}
+
+// Suspend or resume reading frames from a connection
+void conn_set_paused(struct connection *conn, int paused)
+{
+    conn->read_paused = paused;
+    conn_update_events(conn);
+}
+
+// Close a connection and release its buffers; the struct itself is freed later
+void conn_close(struct connection *conn)
+{
+    if (conn->closed)
+    {
+        return;
+    }
+    conn->closed = 1;
+    if (conn->server != NULL)
+    {
+        // Leave the pool, freeing a connection slot for waiting requests
+        struct connection **link = &conn->server->idle;
+        while (*link != NULL && *link != conn)
+            link = &(*link)->next_idle;
+        if (*link != NULL)
+            *link = conn->next_idle;
+        conn->server->open--;
+    }
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, conn->fd, NULL);
+    close(conn->fd);
+    while (conn->out_head != NULL)
+    {
+        struct out_chunk *chunk = conn->out_head;
+        conn->out_head = chunk->next;
+        if (chunk->source != NULL)
+        {
+            if (chunk->source->is_pipe)
+            {
+                chunk->source->broken = 1; // Its unsent bytes stay stuck in the pipe
+            }
+            shared_fd_release(chunk->source);
+        }
+        chunk_free(conn, chunk);
+    }
+    conn_release_payload(conn);
+    if (conn->role == CONN_CLIENT)
+    {
+        __atomic_fetch_sub(&metrics->open_connections, 1, __ATOMIC_RELAXED);
+        printf("Client connection closed: peak memory %zu bytes, worker buffer pool %zu KB\n",
+               conn->peak_memory, buffer_pool_bytes(&io_buffers) / 1024);
+    }
+    conn->next_closed = closed_connections;
+    closed_connections = conn;
+}
+
+// A connection broke: abort or fail over whatever request it belongs to
+void conn_failed(struct connection *conn)
+{
+    struct request *req = conn->request;
+    if (conn->role == CONN_CLIENT)
+    {
+        if (req != NULL)
+        {
+            req->client = NULL; // Nobody to reply to any more
+            metrics_request(metrics, req->opcode, metrics_now_us() - req->started, 1);
+            trace_request(req, "aborted");
+            free_request(req);
+        }
+        conn_close(conn);
+    }
+    else
+    {
+        conn->request = NULL;
+        conn_close(conn);
+        if (req != NULL && req->backend == conn)
+        {
+            req->backend = NULL;
+            request_backend_failed(req);
+        }
+    }
+}
+
+// Read complete frames from a connection and dispatch them
+void conn_read(struct connection *conn)
+{
+    for (int frames = 0; frames < FRAMES_PER_WAKEUP && !conn->closed && !conn->read_paused; frames++)
+    {
+        // Read the fixed-size header
+        while (conn->header_have < FS_HEADER_SIZE)
+        {
+            ssize_t got = recv(conn->fd, conn->header + conn->header_have, FS_HEADER_SIZE - conn->header_have, 0);
+            if (got > 0)
+            {
+                conn->header_have += got;
+                continue;
+            }
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+                return;
+            }
+            if (got == 0 && conn->header_have == 0 && conn->role == CONN_CLIENT)
+            {
+                printf("Client disconnected.\n");
+            }
+            else if (got < 0)
+            {
+                perror("recv failed");
+            }
+            conn_failed(conn);
+            return;
+        }
+        if (conn->payload == NULL && !conn->splicing)
+        {
+            if (fs_decode_header(conn->header, &conn->frame) < 0)
+            {
+                fprintf(stderr, "Error: Malformed frame, closing connection\n");
+                conn_failed(conn);
+                return;
+            }
+            conn->payload_have = 0;
+            struct connection *dest = conn->frame.length > 0 ? relay_destination(conn) : NULL;
+            if (dest != NULL && request_open_pipe(conn->request) == 0)
+            {
+                // Relayed DATA: pass the header on now and splice the payload behind it
+                conn->splicing = 1;
+                struct request *req = conn->request;
+                conn_send_header(dest, FS_OP_DATA, conn->frame.flags, dest == req->client ? req->id : req->trace_id,
+                                 conn->frame.length);
+                if (conn->closed)
+                {
+                    return;
+                }
+            }
+        }
+        if (conn->splicing)
+        {
+            if (conn_splice_payload(conn) <= 0)
+            {
+                return;
+            }
+            conn->payload = NULL; // Tells the request the payload has already been forwarded
+            if (conn->role == CONN_CLIENT)
+                metrics_add(&metrics->bytes_in, FS_HEADER_SIZE + conn->frame.length);
+            handle_frame(conn);
+            if (!conn->closed)
+            {
+                conn->splicing = 0;
+                conn->header_have = 0;
+            }
+            continue;
+        }
+        if (conn->payload == NULL && (conn->payload_slot = disk_upload_slot(conn)) >= 0)
+        {
+            conn->payload = uring_buffer(uring, conn->payload_slot); // Written from where it lands
+        }
+        if (conn->payload == NULL)
+        {
+            // Data frames borrow a pooled buffer, commands get an exact allocation
+            size_t size = conn->frame.length > SMALL_CHUNK ? io_buffers.size : conn->frame.length + 1;
+            conn->payload = size == io_buffers.size ? buffer_get(&io_buffers) : malloc(size);
+            if (conn->payload == NULL)
+            {
+                perror("Error allocating frame payload");
+                conn_failed(conn);
+                return;
+            }
+            conn_account(conn, size);
+        }
+
+        // Read exactly the payload announced by the header
+        while (conn->payload_have < conn->frame.length)
+        {
+            ssize_t got = recv(conn->fd, conn->payload + conn->payload_have, conn->frame.length - conn->payload_have, 0);
+            if (got > 0)
+            {
+                conn->payload_have += got;
+                continue;
+            }
+            if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+            {
+                return;
+            }
+            if (got < 0)
+            {
+                perror("recv failed");
+            }
+            conn_failed(conn);
+            return;
+        }
+        conn->payload[conn->frame.length] = '\0';
+        if (conn->role == CONN_CLIENT)
+            metrics_add(&metrics->bytes_in, FS_HEADER_SIZE + conn->frame.length);
+
+        handle_frame(conn);
+
+        // Ready for the next frame
+        if (!conn->closed)
+        {
+            conn_release_payload(conn);
+            conn->header_have = 0;
+        }
+    }
+}
+
+// Write as much queued output as the socket accepts
+void conn_flush(struct connection *conn)
+{
+    while (conn->out_head != NULL)
+    {
+        struct out_chunk *chunk = conn->out_head;
+        ssize_t sent;
+        if (chunk->source == NULL)
+        {
+            // Hold back a header until the payload behind it can go in the same segment
+            int more = chunk->next != NULL ? MSG_MORE : 0;
+            sent = send(conn->fd, chunk->data + chunk->off, chunk->len - chunk->off, MSG_NOSIGNAL | more);
+        }
+        else if (chunk->source->is_pipe)
+        {
+            sent = splice(chunk->source->fd, NULL, conn->fd, NULL, chunk->len - chunk->off, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        }
+        else
+        {
+            sent = send_file_chunk(conn, chunk);
+        }
+        if (sent < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+            {
+                break;
+            }
+            perror("Error sending data");
+            conn_failed(conn);
+            return;
+        }
+        if (sent == 0)
+        {
+            fprintf(stderr, "Error: File shrank while it was being sent\n");
+            conn_failed(conn);
+            return;
+        }
+        if (chunk->source != NULL && chunk->source->is_pipe)
+        {
+            chunk->source->pending -= sent;
+        }
+        chunk->off += sent;
+        conn->out_bytes -= sent;
+        if (conn->role == CONN_CLIENT)
+            metrics_add(&metrics->bytes_out, sent);
+        if (chunk->off == chunk->len)
+        {
+            conn->out_head = chunk->next;
+            if (conn->out_head == NULL)
+                conn->out_tail = NULL;
+            if (chunk->source != NULL)
+                shared_fd_release(chunk->source);
+            chunk_free(conn, chunk);
+        }
+    }
+    conn_update_events(conn);
+}
+
+// Track the memory a connection holds and its high-water mark
+void conn_account(struct connection *conn, long delta)
+{
+    conn->memory += delta;
+    if (conn->memory > conn->peak_memory)
+    {
+        conn->peak_memory = conn->memory;
+    }
+}
+
+// Free the payload of the frame just handled
+void conn_release_payload(struct connection *conn)
+{
+    if (conn->payload == NULL)
+    {
+        return;
+    }
+    if (conn->payload_slot >= 0)
+    {
+        disk_slot_put(conn->payload_slot);
+        conn->payload_slot = -1;
+    }
+    else if (conn->frame.length > SMALL_CHUNK)
+    {
+        buffer_put(&io_buffers, conn->payload);
+        conn_account(conn, -(long)io_buffers.size);
+    }
+    else
+    {
+        free(conn->payload);
+        conn_account(conn, -(long)(conn->frame.length + 1));
+    }
+    conn->payload = NULL;
+}
+
+// Allocate an output chunk with room for data_len bytes: large ones come
+// from the I/O buffer pool, small control frames are allocated exactly.
+// Fails the connection and returns NULL when memory is exhausted.
+struct out_chunk *chunk_alloc(struct connection *conn, size_t data_len)
+{
+    size_t size = sizeof(struct out_chunk) + data_len;
+    int pooled = data_len > SMALL_CHUNK && size <= io_buffers.size;
+    struct out_chunk *chunk = pooled ? buffer_get(&io_buffers) : malloc(size);
+    if (chunk == NULL)
+    {
+        perror("Error allocating output buffer");
+        conn_failed(conn);
+        return NULL;
+    }
+    chunk->pooled = pooled;
+    chunk->footprint = pooled ? io_buffers.size : size;
+    conn_account(conn, chunk->footprint);
+    return chunk;
+}
+
+// Release an output chunk once it has been sent or dropped
+void chunk_free(struct connection *conn, struct out_chunk *chunk)
+{
+    conn_account(conn, -(long)chunk->footprint);
+    if (chunk->pooled)
+        buffer_put(&io_buffers, chunk);
+    else
+        free(chunk);
+}
+
+// Send part of a file chunk straight from the page cache, or through the
+// bounce buffer where sendfile is not supported; returns like send()
+ssize_t send_file_chunk(struct connection *conn, struct out_chunk *chunk)
+{
+    off_t position = chunk->offset + (off_t)chunk->off;
+    ssize_t sent = sendfile(conn->fd, chunk->source->fd, &position, chunk->len - chunk->off);
+    if (sent >= 0 || (errno != EINVAL && errno != ENOSYS))
+    {
+        return sent;
+    }
+    size_t want = chunk->len - chunk->off < sizeof(copy_buffer) ? chunk->len - chunk->off : sizeof(copy_buffer);
+    ssize_t got = pread(chunk->source->fd, copy_buffer, want, chunk->offset + (off_t)chunk->off);
+    if (got <= 0)
+    {
+        return got;
+    }
+    return send(conn->fd, copy_buffer, got, MSG_NOSIGNAL);
+}
+
+// The socket can take more data: finish a pending connect, flush, then let the request refill
+void conn_writable(struct connection *conn)
+{
+    if (conn->connecting)
+    {
+        int error = 0;
+        socklen_t len = sizeof(error);
+        getsockopt(conn->fd, SOL_SOCKET, SO_ERROR, &error, &len);
+        if (error != 0)
+        {
+            fprintf(stderr, "Error connecting to %s server: %s\n", conn->server->name, strerror(error));
+            conn->server->down_until = time(NULL) + BACKEND_RETRY_DELAY;
+            conn_failed(conn);
+            return;
+        }
+        conn->connecting = 0;
+        if (conn->request != NULL)
+            request_stage(conn->request, STAGE_CONNECT);
+    }
+    conn_flush(conn);
+    if (!conn->closed && conn->request != NULL && conn->out_bytes < LOW_WATERMARK)
+    {
+        request_writable(conn->request, conn);
+    }
+}
+
+// Queue one frame for sending. Returns -1 if the connection has failed, in
+// which case the request using it has already been completed or freed.
+int conn_send_frame(struct connection *conn, uint8_t opcode, uint16_t flags, uint32_t request_id, const void *payload, uint32_t length)
+{
+    if (conn == NULL || conn->closed)
+    {
+        return -1;
+    }
+    struct out_chunk *chunk = chunk_alloc(conn, FS_HEADER_SIZE + length);
+    if (chunk == NULL)
+    {
+        return -1;
+    }
+    chunk->len = FS_HEADER_SIZE + length;
+    chunk->source = NULL;
+    fs_encode_header((unsigned char *)chunk->data, opcode, flags, request_id, length);
+    if (length > 0)
+    {
+        memcpy(chunk->data + FS_HEADER_SIZE, payload, length);
+    }
+    return conn_queue(conn, chunk, 1);
+}
+
+// End a DATA stream with its checksum trailer
+int conn_send_eof(struct connection *conn, uint32_t request_id, uint32_t crc)
+{
+    unsigned char trailer[FS_CHECKSUM_SIZE];
+    fs_put_checksum(trailer, crc);
+    return conn_send_frame(conn, FS_OP_DATA, FS_FLAG_EOF | FS_FLAG_CHECKSUM, request_id, trailer, sizeof(trailer));
+}
+
+// Queue just the header of a frame whose payload follows as a file or pipe chunk
+int conn_send_header(struct connection *conn, uint8_t opcode, uint16_t flags, uint32_t request_id, uint32_t length)
+{
+    if (conn == NULL || conn->closed)
+    {
+        return -1;
+    }
+    struct out_chunk *chunk = chunk_alloc(conn, FS_HEADER_SIZE);
+    if (chunk == NULL)
+    {
+        return -1;
+    }
+    chunk->len = FS_HEADER_SIZE;
+    chunk->source = NULL;
+    fs_encode_header((unsigned char *)chunk->data, opcode, flags, request_id, length);
+    return conn_queue(conn, chunk, 0);
+}
+
+// Queue len bytes to be sent from a file at offset (sendfile) or from a pipe (splice)
+int conn_send_source(struct connection *conn, struct shared_fd *source, off_t offset, size_t len)
+{
+    if (conn == NULL || conn->closed)
+    {
+        return -1;
+    }
+    struct out_chunk *chunk = chunk_alloc(conn, 0);
+    if (chunk == NULL)
+    {
+        return -1;
+    }
+    chunk->len = len;
+    chunk->source = source;
+    chunk->offset = offset;
+    source->refs++;
+    return conn_queue(conn, chunk, 1);
+}
+
+// Append a chunk to the output queue and optionally start sending. Returns -1
+// if the connection has failed, in which case its request has been handled.
+int conn_queue(struct connection *conn, struct out_chunk *chunk, int flush)
+{
+    chunk->next = NULL;
+    chunk->off = 0;
+    if (conn->out_tail != NULL)
+        conn->out_tail->next = chunk;
+    else
+        conn->out_head = chunk;
+    conn->out_tail = chunk;
+    conn->out_bytes += chunk->len;
+
+    if (flush && !conn->connecting)
+    {
+        conn_flush(conn);
+    }
+    else
+    {
+        conn_update_events(conn);
+    }
+    return conn->closed ? -1 : 0;
+}
+
+// Connection the DATA payloads arriving on conn are relayed to, or NULL.
+// A download filling the read cache is not spliced: Smain needs its bytes.
+struct connection *relay_destination(struct connection *conn)
+{
+    struct request *req = conn->request;
+    struct connection *dest = NULL;
+    if (req == NULL || conn->frame.opcode != FS_OP_DATA)
+    {
+        return NULL;
+    }
+    if (conn->role == CONN_CLIENT && req->state == REQ_UFILE_RELAY)
+    {
+        dest = req->backend;
+    }
+    else if (conn->role == CONN_BACKEND && req->state == REQ_RELAY && req->backend == conn && req->cache_data == NULL)
+    {
+        dest = req->client;
+    }
+    return dest != NULL && !dest->closed ? dest : NULL;
+}
+
+// Move the payload of a relayed DATA frame to its destination through the
+// request's pipe, without copying it through user space. The bytes are copied
+// instead once splicing stops working, and discarded if the destination went
+// away. Returns 1 once the whole payload is through, 0 to wait for more input,
+// or -1 if conn failed.
+int conn_splice_payload(struct connection *conn)
+{
+    while (conn->payload_have < conn->frame.length && !conn->closed)
+    {
+        size_t want = conn->frame.length - conn->payload_have;
+        struct connection *dest = relay_destination(conn);
+        ssize_t got = -1;
+        if (dest != NULL && request_open_pipe(conn->request) == 0)
+        {
+            struct request *req = conn->request;
+            size_t room = req->pipe_size - req->pipe->pending;
+            if (want > room)
+            {
+                want = room;
+            }
+            got = want > 0 ? splice(conn->fd, NULL, req->pipe_in, NULL, want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK) : 0;
+            if (got > 0)
+            {
+                req->pipe->pending += got;
+                conn->payload_have += got;
+                conn_send_source(dest, req->pipe, 0, got);
+                continue;
+            }
+            int available = 0;
+            if ((got < 0 && errno == EAGAIN && ioctl(conn->fd, FIONREAD, &available) == 0 && available > 0) || want == 0)
+            {
+                // The pipe is full; resume once the destination has drained it
+                conn_set_paused(conn, 1);
+                return 0;
+            }
+            if (got < 0 && errno == EINVAL)
+            {
+                fprintf(stderr, "splice is not supported here, relaying by copy\n");
+                splice_supported = 0;
+                continue;
+            }
+        }
+        else
+        {
+            got = recv(conn->fd, copy_buffer, want < sizeof(copy_buffer) ? want : sizeof(copy_buffer), 0);
+            if (got > 0)
+            {
+                conn->payload_have += got;
+                if (dest != NULL)
+                {
+                    struct out_chunk *chunk = chunk_alloc(dest, got);
+                    if (chunk == NULL)
+                    {
+                        continue;
+                    }
+                    chunk->len = got;
+                    chunk->source = NULL;
+                    memcpy(chunk->data, copy_buffer, got);
+                    conn_queue(dest, chunk, 1);
+                }
+                continue;
+            }
+        }
+        if (got < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+        {
+            return 0;
+        }
+        if (got < 0)
+        {
+            perror("recv failed");
+        }
+        conn_failed(conn);
+        return -1;
+    }
+    return conn->closed ? -1 : 1;
+}
+
+// Route a complete frame to the request it belongs to
+void handle_frame(struct connection *conn)
+{
+    if (conn->role == CONN_CLIENT)
+    {
+        if (conn->request == NULL && conn->payload == NULL)
+        {
+            conn_failed(conn); // Upload data spliced past the end of its request
+        }
+        else if (conn->request == NULL)
+        {
+            prcclient(conn, &conn->frame, conn->payload);
+        }
+        else
+        {
+            request_client_frame(conn->request, &conn->frame, conn->payload);
+        }
+    }
+    else if (conn->request != NULL)
+    {
+        request_backend_frame(conn->request, &conn->frame, conn->payload);
+    }
+    else
+    {
+        conn_close(conn); // Idle or abandoned backend connections should not talk: drop it
+    }
+}
+
+// Function to handle commands from a client
+void prcclient(struct connection *client, struct fs_frame *frame, char *payload)
+{
+    // Split the payload into its arguments
+    char *args[FS_MAX_ARGS];
+    int argc = fs_unpack_args(payload, frame->length, args, FS_MAX_ARGS);
+
+    struct request *req = request_create(client, frame);
+    if (req == NULL)
+    {
+        conn_failed(client);
+        return;
+    }
+    // Pipelined commands wait until this one completes; ufile resumes reading for its data
+    conn_set_paused(client, 1);
+
+    // Handle different commands
+    if (frame->opcode == FS_OP_UFILE)
+    {
+        printf("handling ufile\n");
+        handle_ufile(req, argc >= 1 ? args[0] : NULL, argc >= 2 ? args[1] : NULL, argc >= 3 ? args[2] : NULL,
+                     argc >= 4 ? args[3] : NULL); // Handle the upload file command
+    }
+    else if (frame->opcode == FS_OP_DFILE)
+    {
+        handle_dfile(req, argc >= 1 ? args[0] : NULL, argc >= 2 ? args[1] : NULL, argc >= 3 ? args[2] : NULL);
+    }
+    else if (frame->opcode == FS_OP_RMFILE)
+    {
+        handle_rmfile(req, argc >= 1 ? args[0] : NULL); // Handle the remove file command
+    }
+    else if (frame->opcode == FS_OP_DTAR)
+    {
+        handle_dtar(req, argc >= 1 ? args[0] : "");
+    }
+    else if (frame->opcode == FS_OP_DISPLAY)
+    {
+        handle_display(req, argc >= 1 ? args[0] : NULL); // Handle the display command
+    }
+    else if (frame->opcode == FS_OP_STATS)
+    {
+        handle_stats(req, argc >= 1 && strcmp(args[0], "-m") == 0);
+    }
+    else
+    {
+        finish_request(req, 1, "Unknown command");
+    }
+}
+
+// Allocate the state for a new client request
+struct request *request_create(struct connection *client, struct fs_frame *frame)
+{
+    struct request *req = calloc(1, sizeof(*req));
+    if (req == NULL)
+    {
+        perror("Error allocating request");
+        return NULL;
+    }
+    req->opcode = frame->opcode;
+    req->id = frame->request_id;
+    req->trace_id = metrics_trace_id(metrics);
+    req->compress = (frame->flags & FS_FLAG_COMPRESSED) != 0;
+    req->client = client;
+    req->file = -1;
+    req->started = metrics_now_us();
+    req->stage_mark = req->started;
+    client->request = req;
+    conn_account(client, sizeof(*req));
+    return req;
+}
+
+// Send the REPLY that completes a request and get the client ready for its next command
+void finish_request(struct request *req, int is_error, const char *message)
+{
+    finish_request_flags(req, is_error ? FS_FLAG_ERROR : 0, message);
+}
+
+// Complete a request with a REPLY carrying the given flags
+void finish_request_flags(struct request *req, uint16_t flags, const char *message)
+{
+    struct connection *client = req->client;
+    uint32_t request_id = req->id;
+    if (client != NULL)
+    {
+        // Detach first so a failing send cannot free the request twice
+        client->request = NULL;
+        conn_account(client, -(long)sizeof(*req));
+        client->want_write = 0;
+        // Every reply tells the client that compressed uploads are understood here
+        conn_send_frame(client, FS_OP_REPLY, flags | FS_FLAG_COMPRESSED, request_id, message, strlen(message));
+        request_stage(req, STAGE_REPLY);
+        metrics_request(metrics, req->opcode, req->stage_mark - req->started, (flags & FS_FLAG_ERROR) != 0);
+        trace_request(req, (flags & FS_FLAG_ERROR) ? "error" : "ok");
+    }
+    req->client = NULL;
+    free_request(req);
+    if (client != NULL && !client->closed)
+    {
+        conn_set_paused(client, 0);
+    }
+}
+
+// Charge the time since the request's last stage ended to stage
+void request_stage(struct request *req, enum request_stage stage)
+{
+    long long now = metrics_now_us();
+    req->stage_us[stage] += now - req->stage_mark;
+    req->stage_mark = now;
+    req->stages |= 1u << stage;
+}
+
+// Log the span of a completed request, with where its time went, if it was slow enough
+void trace_request(struct request *req, const char *status)
+{
+    long long total = metrics_now_us() - req->started;
+    if (total < trace_threshold)
+    {
+        return;
+    }
+    char details[512];
+    int len = snprintf(details, sizeof(details), " client_id=%u", req->id);
+    for (int i = 0; i < STAGE_COUNT && len < (int)sizeof(details); i++)
+    {
+        if (req->stages & (1u << i))
+            len += snprintf(details + len, sizeof(details) - len, " %s=%lld", stage_names[i], req->stage_us[i]);
+    }
+    if (req->filepath != NULL && len < (int)sizeof(details))
+        snprintf(details + len, sizeof(details) - len, " bytes=%lld file=%s", req->done, req->filepath);
+    metrics_span("smain", req->trace_id, fs_opcode_name(req->opcode), total, status, details);
+}
+
+// Release everything a request holds
+void free_request(struct request *req)
+{
+    for (int i = 0; i < req->part_slots; i++)
+    {
+        if (req->parts[i] != NULL)
+        {
+            free_request(req->parts[i]); // The display or dtar is gone; stop working for it
+        }
+    }
+    free(req->parts);
+    if (req->parent != NULL)
+    {
+        for (int i = 0; i < req->parent->part_slots; i++)
+        {
+            if (req->parent->parts[i] == req)
+            {
+                req->parent->parts[i] = NULL;
+                req->parent->parts_pending--;
+            }
+        }
+        if (req->parent->client != NULL)
+        {
+            conn_account(req->parent->client, -(long)sizeof(*req));
+        }
+        struct request **link = &display_parts;
+        while (*link != NULL && *link != req)
+            link = &(*link)->next_part;
+        if (*link != NULL)
+            *link = req->next_part;
+    }
+    if (req->server != NULL)
+    {
+        // Stop waiting for a backend connection
+        struct request **link = &req->server->waiting_head;
+        struct request *prev = NULL;
+        while (*link != NULL && *link != req)
+        {
+            prev = *link;
+            link = &(*link)->next_waiting;
+        }
+        if (*link != NULL)
+        {
+            *link = req->next_waiting;
+            if (req->server->waiting_tail == req)
+                req->server->waiting_tail = prev;
+        }
+    }
+    release_backend(req, 0);
+    if (req->source != NULL)
+    {
+        shared_fd_release(req->source); // Closed once the queued chunks using it are sent
+    }
+    if (req->pipe != NULL)
+    {
+        close(req->pipe_in);
+        shared_fd_release(req->pipe);
+    }
+    // Reads and writes still in flight finish into their slots, which are freed then
+    for (int i = 0; uring != NULL && i < DISK_SLOTS; i++)
+    {
+        if (disk_slots[i].req == req)
+            disk_slot_put(i);
+    }
+    if (req->file >= 0)
+    {
+        close(req->file);
+        if ((req->state == REQ_UFILE_RECEIVE || req->state == REQ_UFILE_FLUSH) && req->journal_tmp == NULL)
+        {
+            remove(req->filepath); // Do not leave a partial upload behind
+        }
+    }
+    if (req->journal_tmp != NULL)
+    {
+        unlink(req->journal_tmp); // Never committed
+        free(req->journal_tmp);
+    }
+    if (req->commit != NULL)
+    {
+        journal_abandon(&journal, req->commit); // The upload is committed all the same
+    }
+    free(req->chunks);
+    free(req->cached);
+    free(req->cache_path);
+    free(req->cache_data);
+    if (req->client != NULL)
+    {
+        req->client->request = NULL;
+        conn_account(req->client, -(long)sizeof(*req));
+    }
+    free(req->filename);
+    free(req->filepath);
+    free(req->error);
+    free(req->display_path);
+    free(req->listing);
+    free(req->backend_payload);
+    if (req->tar != NULL)
+    {
+        tar_close(req->tar);
+        free(req->tar);
+        free(req->filter);
+    }
+    free(req);
+}
+
+// A frame arrived from the client while its request is active
+void request_client_frame(struct request *req, struct fs_frame *frame, char *payload)
+{
+    if (frame->opcode != FS_OP_DATA ||
+        (req->state != REQ_UFILE_RECEIVE && req->state != REQ_UFILE_DRAIN && req->state != REQ_UFILE_RELAY))
+    {
+        fprintf(stderr, "Error: Unexpected %s frame from client\n", fs_opcode_name(frame->opcode));
+        conn_failed(req->client);
+        return;
+    }
+    receive_file(req, frame, payload);
+}
+
+// A frame arrived from the backend serving a request
+void request_backend_frame(struct request *req, struct fs_frame *frame, char *payload)
+{
+    req->backend_responded = 1;
+    if (req->state == REQ_DISPLAY_PART)
+    {
+        if (frame->opcode == FS_OP_DATA)
+        {
+            display_part_data(req, payload, frame->length);
+        }
+        else if (frame->opcode == FS_OP_REPLY)
+        {
+            release_backend(req, 1);
+            display_part_done(req, (frame->flags & FS_FLAG_ERROR) ? payload : NULL);
+        }
+        return;
+    }
+    if (req->state == REQ_TAR_PART)
+    {
+        tar_part_frame(req, frame, payload);
+        return;
+    }
+
+    if (req->state == REQ_RELAY && frame->opcode != FS_OP_REPLY)
+    {
+        // Pass SIZE and DATA frames on under the client's request id
+        if (!req->relay_started)
+            request_stage(req, STAGE_BACKEND); // The storage server has the file open
+        req->relay_started = 1;
+        req->done += frame->opcode == FS_OP_DATA ? fs_data_length(frame) : 0;
+        if (req->cache_path != NULL)
+        {
+            cache_relayed_frame(req, frame, payload);
+        }
+        if (payload != NULL && conn_send_frame(req->client, frame->opcode, frame->flags, req->id, payload, frame->length) < 0)
+        {
+            return; // The client is gone and the request was freed with it
+        }
+        if (req->client->out_bytes > HIGH_WATERMARK)
+        {
+            conn_set_paused(req->backend, 1); // Resume once the client catches up
+        }
+        return;
+    }
+
+    if (req->state == REQ_UFILE_NEED && frame->opcode == FS_OP_NEED)
+    {
+        request_stage(req, STAGE_BACKEND);
+        // Tell the client which chunks to send; they follow once the bitmap is complete
+        if (conn_send_frame(req->client, FS_OP_NEED, frame->flags, req->id, payload, frame->length) < 0)
+        {
+            return; // The client is gone and the request was freed with it
+        }
+        if (frame->flags & FS_FLAG_EOF)
+        {
+            req->state = REQ_UFILE_RELAY;
+            conn_set_paused(req->client, 0);
+        }
+        return;
+    }
+
+    if (frame->opcode != FS_OP_REPLY)
+    {
+        return; // Nothing else is expected before the REPLY
+    }
+
+    int failed = (frame->flags & FS_FLAG_ERROR) != 0;
+    if (failed && req->primary != NULL && !req->relay_started)
+    {
+        // A replica may not have the file yet; the primary has the final word
+        release_backend(req, 1);
+        read_from_primary(req, payload);
+        return;
+    }
+    if (req->opcode == FS_OP_RMFILE && journaling && catalog_covers(req->filepath))
+    {
+        int dropped = journal_cancel(&journal, req->filepath + strlen(smain_root));
+        if (failed && dropped)
+        {
+            // The server has not received the upload yet; dropping it from the journal is the delete
+            printf("Server response received: %s\n", payload);
+            payload = "File deleted successfully\n";
+            failed = 0;
+        }
+        else if (failed && req->journaled)
+        {
+            // The forwarder delivered the upload meanwhile; now that the server has it, delete it again
+            req->journaled = 0;
+            release_backend(req, 1);
+            backend_dispatch(req);
+            return;
+        }
+    }
+    if (read_cache != NULL && (req->opcode == FS_OP_UFILE || req->opcode == FS_OP_RMFILE))
+    {
+        read_cache_invalidate(read_cache, req->filepath); // Failed writes too: they may have got part way
+    }
+    char message[MAX_MESSAGE];
+    request_stage(req, req->state == REQ_WAIT_REPLY && req->opcode == FS_OP_UFILE ? STAGE_COMMIT
+                       : req->relay_started                                  ? STAGE_TRANSFER
+                                                                             : STAGE_BACKEND);
+    if (req->state == REQ_UFILE_RELAY)
+    {
+        // The backend gave up before the upload finished; drain the rest from the client
+        printf("%s server response: %s\n", req->backend_name, payload);
+        snprintf(message, sizeof(message), "File %s stored unsuccessfully on Smain ", req->filename);
+        release_backend(req, 0); // Its DATA stream was cut short
+        reject_upload(req, message);
+        conn_set_paused(req->client, 0);
+        return;
+    }
+    if (req->opcode == FS_OP_UFILE)
+    {
+        printf("%s server response: %s\n", req->backend_name, payload);
+        if (!failed)
+        {
+            // The write's number from the primary lets its replicas serve the file once they have it
+            catalog_put(catalog, req->filepath, file_location(req->filepath), req->server->shard, req->size, time(NULL),
+                        fs_reply_sequence(frame, payload));
+            snprintf(message, sizeof(message), "File %s stored successfully on Smain", req->filename);
+        }
+        else
+        {
+            snprintf(message, sizeof(message), "File %s stored unsuccessfully on Smain ", req->filename);
+        }
+    }
+    else if (req->opcode == FS_OP_DTAR && !failed)
+    {
+        printf("Tar file successfully transferred to client.\n");
+        snprintf(message, sizeof(message), "%s", payload);
+    }
+    else if (req->opcode == FS_OP_RMFILE && !failed)
+    {
+        printf("Server response received: %s\n", payload);
+        catalog_remove(catalog, req->filepath, file_location(req->filepath));
+        snprintf(message, sizeof(message), "%s", payload);
+    }
+    else if (req->opcode == FS_OP_DFILE && !failed)
+    {
+        if (req->cache_data != NULL && req->cache_have == req->cache_size)
+        {
+            read_cache_put(read_cache, req->cache_path, req->cache_data, req->cache_size, req->cache_version);
+        }
+        printf("File %s forwarded successfully.\n", req->filepath);
+        snprintf(message, sizeof(message), "File %s downloaded successfully.\n", req->filepath);
+    }
+    else
+    {
+        printf("Server response received: %s\n", payload);
+        snprintf(message, sizeof(message), "%s", payload);
+    }
+    release_backend(req, 1); // The exchange is complete; keep the connection for the next request
+    finish_request(req, failed, message);
+}
+
+// Keep a copy of a relayed download's contents for the read cache. The SIZE
+// frame decides whether the file fits; compressed DATA is decoded into place,
+// and checked against the stream's checksum trailer.
+void cache_relayed_frame(struct request *req, struct fs_frame *frame, const char *payload)
+{
+    uint32_t expected;
+    if (fs_get_checksum(frame, payload, &expected))
+    {
+        // Only what the storage server vouches for is cached
+        if (req->cache_data != NULL && crc32c(0, req->cache_data, req->cache_have) != expected)
+        {
+            fprintf(stderr, "Error: Checksum mismatch in %s from %s, not cached\n", req->cache_path, req->backend_name);
+            free(req->cache_data);
+            req->cache_data = NULL;
+        }
+        return;
+    }
+    if (frame->opcode == FS_OP_SIZE && frame->length >= 8 && req->cache_data == NULL)
+    {
+        long long size = (long long)fs_get_u64((const unsigned char *)payload);
+        req->cache_data = read_cache_fits(read_cache, size) ? malloc(size > 0 ? size : 1) : NULL;
+        req->cache_size = size;
+        req->cache_have = 0;
+    }
+    else if (frame->opcode == FS_OP_DATA && req->cache_data != NULL && frame->length > 0)
+    {
+        long long room = req->cache_size - req->cache_have;
+        int len = -1;
+        if (frame->flags & FS_FLAG_COMPRESSED)
+        {
+            len = lz4_decompress((const unsigned char *)payload, (int)frame->length,
+                                 (unsigned char *)req->cache_data + req->cache_have, room < INT32_MAX ? (int)room : INT32_MAX);
+        }
+        else if (frame->length <= room)
+        {
+            memcpy(req->cache_data + req->cache_have, payload, frame->length);
+            len = (int)frame->length;
+        }
+        if (len < 0)
+        {
+            // More than the announced size, or undecodable: relay it but do not cache it
+            free(req->cache_data);
+            req->cache_data = NULL;
+            return;
+        }
+        req->cache_have += len;
+    }
+}
+
+// A replica could not serve a download: ask the shard's primary instead
+void read_from_primary(struct request *req, const char *reason)
+{
+    printf("%s could not serve %s (%s), reading it from %s\n", req->backend_name, req->filepath, reason,
+           req->primary->name);
+    req->server = req->primary;
+    req->backend_name = req->primary->name;
+    req->primary = NULL;
+    req->backend_retried = 0;
+    if (req->backend_flags & FS_FLAG_SEQUENCE)
+    {
+        // The primary has every write: drop the number the replica was given, the last argument
+        req->backend_flags &= ~FS_FLAG_SEQUENCE;
+        uint32_t length = req->backend_length - 1;
+        while (length > 0 && req->backend_payload[length - 1] != '\0')
+            length--;
+        req->backend_length = length;
+    }
+    backend_dispatch(req);
+}
+
+// The backend connection of a request failed or could not be established
+void request_backend_failed(struct request *req)
+{
+    char message[MAX_MESSAGE];
+    if (req->backend_reused && !req->backend_responded && !req->backend_retried && req->opcode != FS_OP_UFILE)
+    {
+        // The pooled connection went stale while idle; repeat the request once on another one
+        printf("Retrying request to %s on a new connection\n", req->backend_name);
+        req->backend_retried = 1;
+        backend_dispatch(req);
+        return;
+    }
+    if (req->primary != NULL && !req->relay_started)
+    {
+        read_from_primary(req, "connection failed");
+        return;
+    }
+    if (req->state == REQ_DISPLAY_PART)
+    {
+        display_part_done(req, "connection failed"); // List whatever the other servers have
+        return;
+    }
+    if (req->state == REQ_TAR_PART)
+    {
+        // An archive missing a shard's files would pass for complete; fail the whole dtar
+        struct request *parent = req->parent;
+        if (parent->relay_started)
+            snprintf(message, sizeof(message), "Error: Incomplete file transfer.\n");
+        else
+            snprintf(message, sizeof(message), "Error: Unable to connect to %s.\n", req->backend_name);
+        finish_request(parent, 1, message);
+        return;
+    }
+    if (req->opcode == FS_OP_UFILE)
+    {
+        fprintf(stderr, "Error forwarding file to %s server\n", req->backend_name);
+        snprintf(message, sizeof(message), "File %s stored unsuccessfully on Smain ", req->filename);
+        if (req->state == REQ_UFILE_RELAY)
+        {
+            // The client is still sending; discard the rest before replying
+            reject_upload(req, message);
+            conn_set_paused(req->client, 0);
+            return;
+        }
+    }
+    else if (req->opcode == FS_OP_RMFILE)
+    {
+        snprintf(message, sizeof(message), "Error forwarding delete request to %s", req->backend_name);
+    }
+    else if (req->relay_started)
+    {
+        snprintf(message, sizeof(message), "Error: Incomplete file transfer.\n");
+    }
+    else
+    {
+        snprintf(message, sizeof(message), "Error: Unable to connect to server.\n");
+    }
+    finish_request(req, 1, message);
+}
+
+// A connection of the request drained its output queue
+void request_writable(struct request *req, struct connection *conn)
+{
+    if (req->state == REQ_SEND_FILE && conn == req->client)
+    {
+        pump_file(req, conn);
+    }
+    else if (req->state == REQ_UFILE_RELAY && conn == req->backend && req->client->read_paused)
+    {
+        request_stage(req, STAGE_TRANSFER);
+        conn_set_paused(req->client, 0); // The backend caught up; accept more upload data
+    }
+    else if (req->state == REQ_RELAY && conn == req->client && req->backend != NULL && req->backend->read_paused)
+    {
+        conn_set_paused(req->backend, 0);
+    }
+    else if (req->state == REQ_TAR_MERGE && conn == req->client && req->relay_started)
+    {
+        struct request *part = req->current_part < req->part_slots ? req->parts[req->current_part] : NULL;
+        if (req->current_part == req->part_slots)
+            tar_finish(req);
+        else if (part != NULL && part->backend != NULL && part->backend->read_paused)
+            conn_set_paused(part->backend, 0);
+    }
+    else if (req->state == REQ_DISPLAY && conn == req->client)
+    {
+        for (int i = 0; i < req->part_slots; i++)
+        {
+            if (req->parts[i] != NULL && req->parts[i]->backend != NULL && req->parts[i]->backend->read_paused)
+            {
+                req->parts[i]->deadline = monotonic_ms() + display_timeout; // Its silence so far was ours
+                conn_set_paused(req->parts[i]->backend, 0);
+            }
+        }
+    }
+}
+
+// Start a non-blocking connection to a storage server for its pool
+struct connection *connect_to_server(struct backend *server)
+{
+    int server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (server_socket < 0)
+    {
+        perror("Error creating socket for server connection");
+        return NULL;
+    }
+
+    int connecting = 0;
+    if (connect(server_socket, (struct sockaddr *)&server->addr, sizeof(server->addr)) < 0)
+    {
+        if (errno != EINPROGRESS)
+        {
+            fprintf(stderr, "Error connecting to %s server: %s\n", server->name, strerror(errno));
+            close(server_socket);
+            return NULL;
+        }
+        connecting = 1;
+    }
+
+    struct connection *conn = conn_create(server_socket, CONN_BACKEND);
+    if (conn == NULL)
+    {
+        close(server_socket);
+        return NULL;
+    }
+    conn->connecting = connecting;
+    conn->server = server;
+    server->open++;
+    conn_update_events(conn);
+    return conn;
+}
+
+// Send a request to a storage server over a pooled connection, waiting for one if the pool is full
+void backend_request(struct request *req, struct backend *server, uint8_t opcode, int argc, const char *const argv[])
+{
+    req->server = server;
+    req->backend_name = server->name;
+    req->backend_opcode = opcode;
+    req->backend_retried = 0;
+    free(req->backend_payload);
+    req->backend_payload = NULL;
+    // Pack into a pooled buffer, then keep only the bytes used for a possible retry
+    char *packed = buffer_get(&io_buffers);
+    int length = packed != NULL ? fs_pack_args(packed, FS_MAX_PAYLOAD, argc, argv) : -1;
+    if (length >= 0 && (req->backend_payload = malloc(length > 0 ? length : 1)) != NULL)
+    {
+        memcpy(req->backend_payload, packed, length);
+    }
+    buffer_put(&io_buffers, packed);
+    if (length < 0 || req->backend_payload == NULL)
+    {
+        fprintf(stderr, "Error: Unable to build request for %s\n", server->name);
+        request_backend_failed(req);
+        return;
+    }
+    req->backend_length = (uint32_t)length;
+    backend_dispatch(req);
+}
+
+// Put the request's backend request on an idle or new connection
+void backend_dispatch(struct request *req)
+{
+    struct backend *server = req->server;
+    struct connection *conn = server->idle;
+    req->backend_responded = 0;
+    if (conn != NULL)
+    {
+        server->idle = conn->next_idle;
+        conn->next_idle = NULL;
+        req->backend_reused = 1;
+    }
+    else if (time(NULL) < server->down_until)
+    {
+        // Connecting just failed; do not hammer a server that is down
+        request_backend_failed(req);
+        return;
+    }
+    else if (server->open >= backend_limit)
+    {
+        // Wait for a connection to be released
+        req->next_waiting = NULL;
+        if (server->waiting_tail != NULL)
+            server->waiting_tail->next_waiting = req;
+        else
+            server->waiting_head = req;
+        server->waiting_tail = req;
+        if (req->state == REQ_UFILE_RELAY)
+        {
+            conn_set_paused(req->client, 1); // Hold the upload until it can be relayed
+        }
+        return;
+    }
+    else
+    {
+        conn = connect_to_server(server);
+        if (conn == NULL)
+        {
+            server->down_until = time(NULL) + BACKEND_RETRY_DELAY;
+            request_backend_failed(req);
+            return;
+        }
+        req->backend_reused = 0;
+    }
+
+    conn->request = req;
+    req->backend = conn;
+    if (!conn->connecting)
+    {
+        request_stage(req, STAGE_CONNECT);
+    }
+    if (conn_send_frame(conn, req->backend_opcode, req->backend_flags, req->trace_id, req->backend_payload,
+                        req->backend_length) == 0 &&
+        req->state == REQ_UFILE_RELAY && req->client->read_paused)
+    {
+        conn_set_paused(req->client, 0); // Relay the upload now that the store request is out
+    }
+}
+
+// Give released connections and free slots to requests waiting for a backend
+void backend_wake_waiters(void)
+{
+    for (int i = 0; i < backend_count; i++)
+    {
+        struct backend *server = backends[i];
+        while (server->waiting_head != NULL && (server->idle != NULL || server->open < backend_limit))
+        {
+            struct request *req = server->waiting_head;
+            server->waiting_head = req->next_waiting;
+            if (server->waiting_head == NULL)
+                server->waiting_tail = NULL;
+            req->next_waiting = NULL;
+            backend_dispatch(req);
+        }
+    }
+}
+
+// Close pooled connections that have been idle too long
+void backend_close_idle(time_t now)
+{
+    for (int i = 0; i < backend_count; i++)
+    {
+        struct connection *conn = backends[i]->idle;
+        while (conn != NULL)
+        {
+            struct connection *next = conn->next_idle;
+            if (now - conn->idle_since > BACKEND_IDLE_TIMEOUT)
+            {
+                conn_close(conn);
+            }
+            conn = next;
+        }
+    }
+}
+
+// Detach the backend connection from a request. A connection whose exchange
+// completed cleanly goes back to the pool; anything else is closed.
+void release_backend(struct request *req, int reusable)
+{
+    struct connection *conn = req->backend;
+    if (conn == NULL)
+    {
+        return;
+    }
+    req->backend = NULL;
+    conn->request = NULL;
+    if (!reusable || conn->closed || conn->out_bytes > 0)
+    {
+        conn_close(conn);
+        return;
+    }
+    conn->read_paused = 0; // Watch it for a close while idle
+    conn_update_events(conn);
+    conn->idle_since = time(NULL);
+    conn->next_idle = conn->server->idle;
+    conn->server->idle = conn;
+}
+
+// Function to handle the upload file command; mode "chunks" sends a chunk list first (.txt and .pdf)
+void handle_ufile(struct request *req, char *filename, char *path, char *size_str, char *mode)
+{
+    // Uploads stream in right behind the command, so keep reading the client
+    req->state = REQ_UFILE_RECEIVE;
+    conn_set_paused(req->client, 0);
+
+    if (filename == NULL || path == NULL || size_str == NULL)
+    {
+        reject_upload(req, "Error: Invalid ufile command format. Usage: ufile <filename> <path>");
+        return;
+    }
+
+    char *expanded_path = expand_path(path); // Expand the path to its full form
+    if (expanded_path == NULL)
+    {
+        char error_msg[MAX_MESSAGE];
+        snprintf(error_msg, sizeof(error_msg), "Error: Unable to expand or create path %s", path);
+        reject_upload(req, error_msg); // Send error message if path expansion fails
+        return;
+    }
+
+    char filepath[PATH_MAX] = {0};                                            // Buffer for storing the file path
+    snprintf(filepath, sizeof(filepath) - 1, "%s/%s", expanded_path, filename); // Construct the full file path
+    free(expanded_path);                                                        // Free the expanded path memory
+    req->filename = strdup(filename);
+    req->filepath = strdup(filepath);
+
+    // The declared size is passed on to the storage server, so it must be a plain byte count
+    char *end;
+    errno = 0;
+    req->size = strtoll(size_str, &end, 10);
+    if (errno != 0 || end == size_str || *end != '\0' || req->size < 0)
+    {
+        reject_upload(req, "Error: Invalid file size");
+        return;
+    }
+
+    // Get the file extension
+    const char *file_extension = strrchr(filename, '.');
+    if (file_extension == NULL)
+    {
+        reject_upload(req, "Error: File has no extension"); // Send error message if file has no extension
+        return;
+    }
+
+    req->chunk_stage = mode != NULL && strcmp(mode, "chunks") == 0;
+    if (req->chunk_stage && strcmp(file_extension, ".txt") != 0 && strcmp(file_extension, ".pdf") != 0)
+    {
+        reject_upload(req, "Error: Only .txt and .pdf files are uploaded as chunks");
+        return;
+    }
+
+    // With a journal, .txt and .pdf uploads are acknowledged once journaled
+    if (journaling && (strcmp(file_extension, ".txt") == 0 || strcmp(file_extension, ".pdf") == 0) &&
+        catalog_covers(filepath))
+    {
+        journal_upload(req);
+        return;
+    }
+    // Otherwise they are streamed straight through to their server
+    if (strcmp(file_extension, ".txt") == 0) // handle .txt
+    {
+        forward_file(req, shard_for(&stext_shards, filepath));
+        return;
+    }
+    else if (strcmp(file_extension, ".pdf") == 0) // handle .pdf
+    {
+        forward_file(req, shard_for(&spdf_shards, filepath));
+        return;
+    }
+
+    // Create the file, failing if it already exists
+    req->file = open(filepath, O_WRONLY | O_CREAT | O_EXCL, 0644);
+    if (req->file < 0)
+    {
+        char error_msg[MAX_MESSAGE];
+        if (errno == EEXIST)
+            snprintf(error_msg, sizeof(error_msg), "Error: File %s already exists", filename);
+        else
+            snprintf(error_msg, sizeof(error_msg), "Error storing file on Smain: %s", strerror(errno));
+        reject_upload(req, error_msg);
+        return;
+    }
+    printf("Receiving file: %s\n", filepath); // Log the filename being received
+}
+
+// Reject an upload: discard the DATA frames the client already queued, then report the error
+void reject_upload(struct request *req, const char *error_msg)
+{
+    req->state = REQ_UFILE_DRAIN;
+    free(req->error);
+    req->error = strdup(error_msg);
+}
+
+// Store or relay one uploaded DATA frame; on the EOF frame complete the upload
+void receive_file(struct request *req, struct fs_frame *frame, char *payload)
+{
+    if (req->state == REQ_UFILE_RELAY)
+    {
+        req->done += fs_data_length(frame); // The storage server checks the trailer
+        int timed = !req->backend->connecting; // Until then the time is the connect's
+        if (timed)
+            request_stage(req, STAGE_RECEIVE);
+        // A failed send switches the request to draining; a spliced payload is already on its way
+        if (payload == NULL || conn_send_frame(req->backend, FS_OP_DATA, frame->flags, req->trace_id, payload, frame->length) == 0)
+        {
+            if (timed)
+                request_stage(req, STAGE_TRANSFER);
+            if ((frame->flags & FS_FLAG_EOF) && req->chunk_stage == 1)
+            {
+                // The chunk list is through; the backend answers which chunks it needs
+                req->chunk_stage = 2;
+                req->state = REQ_UFILE_NEED;
+                conn_set_paused(req->client, 1);
+            }
+            else if (frame->flags & FS_FLAG_EOF)
+            {
+                // The store is confirmed by the backend's REPLY
+                req->state = REQ_WAIT_REPLY;
+                conn_set_paused(req->client, 1);
+            }
+            else if (req->backend->out_bytes > HIGH_WATERMARK)
+            {
+                conn_set_paused(req->client, 1); // Resume once the backend catches up
+            }
+            return;
+        }
+        if (!(frame->flags & FS_FLAG_EOF))
+        {
+            return;
+        }
+        conn_set_paused(req->client, 1);
+        finish_request(req, 1, req->error);
+        return;
+    }
+    struct fs_frame decoded = *frame; // The connection still needs the frame as received to free its payload
+    char *plain = NULL;
+    if (req->state == REQ_UFILE_RECEIVE && (frame->flags & FS_FLAG_COMPRESSED))
+    {
+        plain = buffer_get(&io_buffers);
+        if (plain == NULL || compress_decode(&decoded, &payload, plain) < 0)
+        {
+            fprintf(stderr, "Error: Corrupt compressed frame from client\n");
+            buffer_put(&io_buffers, plain);
+            conn_failed(req->client);
+            return;
+        }
+        frame = &decoded;
+    }
+    uint32_t expected;
+    if (fs_get_checksum(frame, payload, &expected))
+    {
+        // The trailer holds no file data; checked against what was received
+        req->checksum_failed = req->state == REQ_UFILE_RECEIVE && expected != req->checksum;
+        decoded = *frame;
+        decoded.length = 0;
+        frame = &decoded;
+    }
+    request_stage(req, STAGE_RECEIVE);
+    if (req->state == REQ_UFILE_RECEIVE && req->chunk_stage == 1)
+    {
+        journal_chunk_list(req, frame, payload); // Only write-behind uploads receive the chunk list here
+        buffer_put(&io_buffers, plain);
+        return;
+    }
+    if (req->state == REQ_UFILE_RECEIVE && req->chunk_stage == 2 && frame->length > 0)
+    {
+        // Each chunk must be the next one listed
+        unsigned char hash[32];
+        if (req->chunk_next < req->chunk_count && frame->length == req->chunks[req->chunk_next].length)
+            sha256(payload, frame->length, hash);
+        if (req->chunk_next == req->chunk_count || frame->length != req->chunks[req->chunk_next].length ||
+            memcmp(hash, req->chunks[req->chunk_next].hash, 32) != 0)
+        {
+            close(req->file);
+            req->file = -1;
+            reject_upload(req, "Error: Chunk does not match its hash");
+        }
+        req->chunk_next++;
+    }
+    if (req->state == REQ_UFILE_RECEIVE && frame->length > 0)
+    {
+        req->checksum = crc32c(req->checksum, payload, frame->length);
+        if (disk_write(req, payload, frame->length) < 0) // Write data to file
+        {
+            char error_msg[MAX_MESSAGE];
+            snprintf(error_msg, sizeof(error_msg), "Error storing file on Smain: %s", strerror(errno));
+            perror("Error writing to file");
+            close(req->file);
+            req->file = -1;
+            if (req->journal_tmp == NULL)
+                remove(req->filepath); // A journal file goes with the request
+            reject_upload(req, error_msg);
+        }
+    }
+    buffer_put(&io_buffers, plain);
+    req->done += frame->length;
+    if (!(frame->flags & FS_FLAG_EOF))
+    {
+        if (req->state == REQ_UFILE_RECEIVE)
+            request_stage(req, STAGE_WRITE);
+        return;
+    }
+
+    // The whole upload has arrived; no more input until the reply is sent
+    conn_set_paused(req->client, 1);
+    if (req->state == REQ_UFILE_DRAIN)
+    {
+        finish_request(req, 1, req->error);
+        return;
+    }
+    if (req->disk_writes > 0)
+    {
+        req->state = REQ_UFILE_FLUSH; // Completed by the last write's completion
+        return;
+    }
+    finish_upload(req);
+}
+
+// Complete an upload once all of it is written: check it, keep it and reply
+void finish_upload(struct request *req)
+{
+    if (req->disk_error != 0)
+    {
+        char error_msg[MAX_MESSAGE];
+        snprintf(error_msg, sizeof(error_msg), "Error storing file on Smain: %s", strerror(req->disk_error));
+        fprintf(stderr, "Error writing to file: %s\n", strerror(req->disk_error));
+        close(req->file);
+        req->file = -1;
+        if (req->journal_tmp == NULL)
+            remove(req->filepath);
+        finish_request(req, 1, error_msg);
+        return;
+    }
+    if (req->checksum_failed)
+    {
+        printf("Error: Checksum mismatch for %s, the upload was damaged on its way\n", req->filepath);
+        close(req->file);
+        req->file = -1;
+        if (req->journal_tmp == NULL)
+            remove(req->filepath);
+        finish_request(req, 1, "Error: Checksum mismatch");
+        return;
+    }
+    crc32c_store(req->file, req->checksum); // Sent with whole-file downloads
+    if (req->journal_tmp != NULL)
+    {
+        journal_finish(req);
+        return;
+    }
+    close(req->file);
+    req->file = -1;
+    request_stage(req, STAGE_WRITE);
+    if (req->done != req->size) // Check if the entire file was received
+    {
+        // printf("Error: Incomplete file transfer. Received %lld/%lld bytes\n", req->done, req->size);
+        remove(req->filepath); // Do not leave a truncated file behind
+        finish_request(req, 1, "Error storing file on Smain: Incomplete file transfer");
+        return;
+    }
+    printf("File received and saved: %s\n", req->filepath);
+    catalog_put(catalog, req->filepath, CATALOG_SMAIN, 0, req->size, time(NULL), 0);
+
+    // .c and anything else stays on Smain
+    char success_msg[MAX_MESSAGE];
+    snprintf(success_msg, sizeof(success_msg), "File %s stored successfully on Smain server", req->filename);
+    finish_request(req, 0, success_msg); // Send success message to the client
+}
+
+// Open a store request on a storage server; the upload's DATA frames are relayed to it as they arrive
+void forward_file(struct request *req, struct backend *server)
+{
+    req->state = REQ_UFILE_RELAY;
+
+    // Remove filename from filepath
+    char *dir_path = home_path(req->filepath);       // The server finds the directory under its own home
+    char *path_without_filename = dirname(dir_path); // Get directory path without filename
+    char size_str[32];
+    snprintf(size_str, sizeof(size_str), "%lld", req->size);
+
+    // Send the store command; the upload is held until it is on its way
+    printf("Relaying file %s to %s%s\n", req->filepath, server->name, req->chunk_stage ? " as chunks" : "");
+    const char *args[] = {req->filename, path_without_filename, size_str, "chunks"};
+    backend_request(req, server, FS_OP_STORE, req->chunk_stage ? 4 : 3, args);
+    free(dir_path);
+}
+
+// Write-behind: receive a .txt or .pdf upload into the journal; it is
+// acknowledged once journaled and sent on by the forwarder
+void journal_upload(struct request *req)
+{
+    char tmp[PATH_MAX];
+    req->file = journal_create(&journal, tmp, sizeof(tmp));
+    if (req->file < 0)
+    {
+        char error_msg[MAX_MESSAGE];
+        snprintf(error_msg, sizeof(error_msg), "Error storing file on Smain: %s", strerror(errno));
+        perror("Error creating a journal file");
+        reject_upload(req, error_msg);
+        return;
+    }
+    req->journal_tmp = strdup(tmp);
+    printf("Journaling file: %s%s\n", req->filepath, req->chunk_stage ? " (chunks)" : "");
+}
+
+// Write-behind chunked upload: collect the chunk list. At its end every
+// chunk is asked for, as a server without deduplication would, so the
+// journal holds the whole file
+void journal_chunk_list(struct request *req, struct fs_frame *frame, const char *payload)
+{
+    size_t n = frame->length / CHUNK_RECORD;
+    struct chunk_record *grown = n > 0 ? realloc(req->chunks, (req->chunk_count + n) * sizeof(*grown)) : req->chunks;
+    if (frame->length % CHUNK_RECORD != 0 || (n > 0 && grown == NULL))
+    {
+        reject_upload(req, "Error: Invalid chunk list");
+        return;
+    }
+    req->chunks = grown;
+    for (size_t i = 0; i < n; i++)
+    {
+        chunk_get_record((const unsigned char *)payload + i * CHUNK_RECORD, &req->chunks[req->chunk_count++]);
+    }
+    if (!(frame->flags & FS_FLAG_EOF))
+    {
+        return;
+    }
+
+    long long total = 0;
+    for (size_t i = 0; i < req->chunk_count; i++)
+    {
+        if (req->chunks[i].length == 0 || req->chunks[i].length > CHUNK_MAX)
+            total = -1;
+        else if (total >= 0)
+            total += req->chunks[i].length;
+    }
+    if (total != req->size)
+    {
+        // Answered like a storage server would, before any chunk is sent
+        conn_set_paused(req->client, 1);
+        finish_request(req, 1, "Error: Chunk list does not match the file size");
+        return;
+    }
+
+    // The NEED bitmap, all set; the last frame is flagged EOF. Compressed chunks are decoded on arrival
+    char *need = buffer_get(&io_buffers);
+    if (need == NULL)
+    {
+        conn_set_paused(req->client, 1);
+        finish_request(req, 1, "Error: Out of memory");
+        return;
+    }
+    memset(need, 0xff, FS_MAX_PAYLOAD);
+    size_t bytes = (req->chunk_count + 7) / 8, sent = 0;
+    do
+    {
+        size_t len = bytes - sent < FS_MAX_PAYLOAD ? bytes - sent : FS_MAX_PAYLOAD;
+        uint16_t flags = sent + len == bytes ? FS_FLAG_EOF : 0;
+        if (conn_send_frame(req->client, FS_OP_NEED, flags | FS_FLAG_COMPRESSED, req->id, need, (uint32_t)len) < 0)
+        {
+            buffer_put(&io_buffers, need);
+            return; // The client is gone and the request was freed with it
+        }
+        sent += len;
+    } while (sent < bytes);
+    buffer_put(&io_buffers, need);
+    req->chunk_stage = 2;
+}
+
+// Write-behind: hand a received upload to the committer; it is acknowledged
+// once it is on disk
+void journal_finish(struct request *req)
+{
+    int file = req->file;
+    req->file = -1;
+    if (req->done != req->size)
+    {
+        close(file);
+        finish_request(req, 1, "Error storing file on Smain: Incomplete file transfer");
+        return;
+    }
+    req->commit = journal_submit(&journal, file, req->journal_tmp, req->filepath + strlen(smain_root), req->size, req);
+    if (req->commit == NULL)
+    {
+        close(file);
+        finish_request(req, 1, "Error storing file on Smain: Out of memory");
+        return;
+    }
+    free(req->journal_tmp);
+    req->journal_tmp = NULL; // The committer renames it or removes it
+    req->state = REQ_WAIT_REPLY;
+}
+
+// Acknowledge the write-behind uploads the committer is done with
+void journal_committed(void)
+{
+    struct journal_commit *c = journal_collect(&journal);
+    while (c != NULL)
+    {
+        struct journal_commit *next = c->next;
+        struct request *req = c->owner;
+        if (c->result == 0)
+        {
+            // Listed from now on; the forwarder may be through with it already
+            journal_catalog_put(c->rel, c->size, time(NULL));
+        }
+        if (req != NULL)
+        {
+            req->commit = NULL;
+            request_stage(req, STAGE_WRITE);
+            char message[MAX_MESSAGE];
+            if (c->result < 0)
+            {
+                fprintf(stderr, "Error committing %s to the journal\n", req->filepath);
+                snprintf(message, sizeof(message), "File %s stored unsuccessfully on Smain ", req->filename);
+            }
+            else
+            {
+                printf("File journaled: %s\n", req->filepath);
+                snprintf(message, sizeof(message), "File %s stored successfully on Smain", req->filename);
+            }
+            finish_request(req, c->result < 0, message);
+        }
+        journal_commit_free(c);
+        c = next;
+    }
+}
+
+// Catalog a journaled upload at the shard it is going to
+void journal_catalog_put(const char *rel, long long size, long long mtime)
+{
+    char filepath[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s%s", smain_root, rel);
+    int location = file_location(filepath);
+    if (location != CATALOG_SMAIN)
+    {
+        struct backend *server = shard_for(location == CATALOG_STEXT ? &stext_shards : &spdf_shards, filepath);
+        catalog_put(catalog, filepath, location, server->shard, size, mtime, 0);
+        if (read_cache != NULL)
+            read_cache_invalidate(read_cache, filepath);
+    }
+}
+
+// At startup: catalog an upload still in the journal, which its server may not have yet
+void journal_catalog(void *ctx, const char *rel)
+{
+    char job[PATH_MAX];
+    journal_job(&journal, rel, job, sizeof(job));
+    struct stat st;
+    if (stat(job, &st) == 0)
+    {
+        journal_catalog_put(rel, st.st_size, st.st_mtime);
+        (*(size_t *)ctx)++;
+    }
+}
+
+// Fork the forwarder process; returns its pid
+pid_t start_forwarder(void)
+{
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        run_forwarder();
+        exit(1);
+    }
+    if (pid < 0)
+    {
+        perror("Fork failed");
+    }
+    return pid;
+}
+
+// The forwarder: send the journal's uploads to their storage servers, in
+// passes over the whole journal, over one kept-alive connection per server.
+// A pass that leaves jobs behind is repeated after a wait that doubles up to
+// FORWARD_RETRY_MAX seconds; otherwise the forwarder sleeps until the next
+// upload is committed.
+void run_forwarder(void)
+{
+    for (int i = 0; i < backend_count; i++)
+    {
+        backends[i]->forward_sock = -1;
+    }
+    printf("Forwarder %d sending journaled uploads on\n", (int)getpid());
+    if (use_uring)
+    {
+        fs_uring_start(); // Journal files are read ahead while the last frame goes out
+    }
+    int delay = 0; // Seconds until the next pass, after a failed one
+    while (1)
+    {
+        int failures = 0;
+        journal_scan(&journal, "", forward_job, &failures);
+        delay = failures == 0 ? 0 : delay == 0 ? 1 : delay * 2 > FORWARD_RETRY_MAX ? FORWARD_RETRY_MAX : delay * 2;
+        journal_wait(&journal, delay == 0 ? -1 : delay * 1000);
+    }
+}
+
+// Forwarder: send one request, and with file the store's DATA, to a storage
+// server; returns 0 on a success REPLY, 1 on an error REPLY (in message),
+// -1 if the connection failed. *version gets the number the primary gave the write
+int forward_send(struct backend *server, uint8_t opcode, uint32_t trace_id, int argc, const char *argv[], int file,
+                 long long size, char *message, uint64_t *version)
+{
+    if (server->forward_sock < 0)
+    {
+        int sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct timeval timeout = {FORWARD_TIMEOUT, 0};
+        if (sock >= 0)
+        {
+            setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+        if (sock < 0 || connect(sock, (struct sockaddr *)&server->addr, sizeof(server->addr)) < 0)
+        {
+            snprintf(message, MAX_MESSAGE, "%s", strerror(errno));
+            if (sock >= 0)
+                close(sock);
+            server->down_until = time(NULL) + BACKEND_RETRY_DELAY;
+            return -1;
+        }
+        fs_set_nodelay(sock);
+        server->forward_sock = sock;
+    }
+    int sock = server->forward_sock;
+    struct fs_frame frame;
+    int sent = fs_send_request(sock, opcode, trace_id, argc, argv);
+    if (sent == 0 && file >= 0)
+    {
+        sent = fs_send_stream(sock, file, trace_id, (uint64_t)size) < 0 ? -1 : 0;
+    }
+    if (sent < 0 || fs_recv_frame(sock, &frame, message, MAX_MESSAGE - 1) != 1 || frame.opcode != FS_OP_REPLY)
+    {
+        snprintf(message, MAX_MESSAGE, "connection lost");
+        close(sock);
+        server->forward_sock = -1; // A stale kept-alive connection is simply reopened next pass
+        return -1;
+    }
+    message[frame.length] = '\0';
+    *version = fs_reply_sequence(&frame, message);
+    return (frame.flags & FS_FLAG_ERROR) ? 1 : 0;
+}
+
+// Forwarder: store one journaled upload on its server and drop the job
+void forward_job(void *ctx, const char *rel)
+{
+    int *failures = ctx;
+    char filepath[PATH_MAX], job[PATH_MAX];
+    snprintf(filepath, sizeof(filepath), "%s%s", smain_root, rel);
+    journal_job(&journal, rel, job, sizeof(job));
+    int location = file_location(filepath);
+    if (location == CATALOG_SMAIN)
+    {
+        return; // Nothing Smain journals
+    }
+    struct backend *server = shard_for(location == CATALOG_STEXT ? &stext_shards : &spdf_shards, filepath);
+    if (time(NULL) < server->down_until)
+    {
+        (*failures)++; // Its server just refused a connection; the next pass tries again
+        return;
+    }
+    struct stat st;
+    int file = open(job, O_RDONLY);
+    if (file < 0 || fstat(file, &st) < 0)
+    {
+        if (file >= 0)
+            close(file);
+        forward_forget(rel);
+        return; // Cancelled since the scan saw it
+    }
+
+    long long started = metrics_now_us();
+    uint32_t trace_id = metrics_trace_id(metrics);
+    char *home = home_path(filepath);
+    char *dir_path = strdup(home);
+    char size_str[32], message[MAX_MESSAGE];
+    snprintf(size_str, sizeof(size_str), "%lld", (long long)st.st_size);
+    const char *slash = strrchr(filepath, '/');
+    const char *store_args[] = {slash + 1, dirname(dir_path), size_str};
+    uint64_t version;
+    int result = forward_send(server, FS_OP_STORE, trace_id, 3, store_args, file, st.st_size, message, &version);
+    close(file);
+    int settled = result == 0 ? journal_settle(&journal, rel, st.st_ino) : 1;
+    if (settled == 0)
+    {
+        // Downloads go to the server from now on, and to its replicas once they have applied the write
+        catalog_touch(catalog, filepath, time(NULL), version);
+    }
+    else if (result == 0 && settled < 0)
+    {
+        // rmfile dropped the job while it was on its way; its delete may have gone first
+        const char *remove_args[] = {home};
+        forward_send(server, FS_OP_REMOVE, trace_id, 1, remove_args, -1, 0, message, &version);
+    }
+    char details[PATH_MAX + 64];
+    snprintf(details, sizeof(details), " to=%s bytes=%lld file=%s", server->name, (long long)st.st_size, home);
+    metrics_span("smain", trace_id, "forward", metrics_now_us() - started,
+                 result == 0 ? "ok" : result == 1 ? "refused" : "error", details);
+    char dead[PATH_MAX];
+    if (result == 0)
+    {
+        forward_forget(rel);
+    }
+    else if (result == 1 && forward_refused(rel, st.st_ino) >= FORWARD_REFUSALS &&
+             journal_bury(&journal, rel, st.st_ino, dead, sizeof(dead)) == 0)
+    {
+        // Retrying will not help: stop listing and serving an upload that never got stored
+        fprintf(stderr, "Forwarding %s to %s refused %d times, moved it to %s: %s\n", filepath, server->name,
+                FORWARD_REFUSALS, dead, message);
+        forward_forget(rel);
+        catalog_remove(catalog, filepath, location);
+        if (read_cache != NULL)
+            read_cache_invalidate(read_cache, filepath);
+    }
+    else
+    {
+        // An unreachable server, or a refusal that may yet pass, is tried again on the next pass
+        printf("Forwarding %s to %s failed, keeping it in the journal: %s\n", filepath, server->name, message);
+        (*failures)++;
+    }
+    free(dir_path);
+    free(home);
+}
+
+// Forwarder: count a refusal of the job with inode ino; returns how many in a row
+int forward_refused(const char *rel, ino_t ino)
+{
+    struct forward_refusal *r = forward_refusals;
+    while (r != NULL && strcmp(r->rel, rel) != 0)
+        r = r->next;
+    if (r == NULL)
+    {
+        r = calloc(1, sizeof(*r));
+        if (r == NULL || (r->rel = strdup(rel)) == NULL)
+        {
+            free(r);
+            return 0; // Counted next time
+        }
+        r->next = forward_refusals;
+        forward_refusals = r;
+    }
+    if (r->ino != ino)
+    {
+        r->ino = ino;
+        r->count = 0;
+    }
+    return ++r->count;
+}
+
+// Forwarder: a job got through or is gone; forget its refusals
+void forward_forget(const char *rel)
+{
+    for (struct forward_refusal **link = &forward_refusals; *link != NULL; link = &(*link)->next)
+    {
+        if (strcmp((*link)->rel, rel) == 0)
+        {
+            struct forward_refusal *r = *link;
+            *link = r->next;
+            free(r->rel);
+            free(r);
+            return;
+        }
+    }
+}
+
+// Send a file, or the range given by offset and length, to the client
+void handle_dfile(struct request *req, char *file_path, char *offset_str, char *length_str)
+{
+    // Get the file extension from the file path
+    const char *file_ext = file_path != NULL ? strrchr(file_path, '.') : NULL;
+    // Check if file extension is missing
+    if (file_ext == NULL)
+    {
+        finish_request(req, 1, "Error: Invalid file path.\n");
+        return;
+    }
+
+    // Remove any trailing newline characters
+    char *newline = strchr(file_path, '\n');
+    if (newline)
+        *newline = '\0';
+
+    // The range is checked against the file by whichever server holds it
+    if (fs_parse_range(offset_str, length_str, &req->offset, &req->size) < 0)
+    {
+        finish_request(req, 1, "Error: Invalid range.\n");
+        return;
+    }
+    req->ranged = offset_str != NULL;
+    const char *get_args[] = {NULL, offset_str, length_str};
+    int get_argc = length_str != NULL ? 3 : offset_str != NULL ? 2 : 1;
+
+    // Expand the path
+    char *expanded_path = expand_path(file_path);
+    if (expanded_path == NULL)
+    {
+        finish_request(req, 1, "Error: Unable to expand file path.\n");
+        return;
+    }
+    // An upload still in the journal is read from there, since its server may not have it yet
+    char job[PATH_MAX] = "";
+    if (journaling && file_location(expanded_path) != CATALOG_SMAIN && catalog_covers(expanded_path))
+    {
+        journal_job(&journal, expanded_path + strlen(smain_root), job, sizeof(job));
+    }
+    int cacheable = read_cache != NULL && file_location(expanded_path) != CATALOG_SMAIN && catalog_covers(expanded_path);
+    long long file_size = 0;
+    // Handle different file types based on extension
+    if (strcmp(file_ext, ".c") == 0)
+    {
+        send_file(req, expanded_path);
+    }
+    else if (job[0] != '\0' && (req->file = open(job, O_RDONLY)) >= 0)
+    {
+        send_file(req, job); // Opened here, so the forwarder dropping the job meanwhile does not matter
+    }
+    else if (cacheable &&
+             (req->cached = read_cache_get(read_cache, expanded_path, req->offset, &req->size, &file_size)) != NULL)
+    {
+        send_cached(req, expanded_path, file_size);
+    }
+    else if ((strcmp(file_ext, ".pdf") == 0 || strcmp(file_ext, ".txt") == 0) && catalog_missing(expanded_path))
+    {
+        // No need to ask the storage server for a file it does not have
+        finish_request(req, 1, "Error: File not found.\n");
+    }
+    else if (strcmp(file_ext, ".pdf") == 0)
+    {
+        // Replace "smain" with "spdf" in the path and request the file
+        struct backend *server = read_server(req, &spdf_shards, expanded_path);
+        if (cacheable && !req->ranged && req->primary == NULL)
+            cache_on_download(req, expanded_path); // Filled only from primaries
+        char *home = home_path(expanded_path);
+        char *spdf_path = replace_smain_with_spdf(home);
+        req->filepath = strdup(spdf_path);
+        get_args[0] = spdf_path;
+        request_and_forward_file(req, FS_OP_GET, get_argc, get_args, server);
+        free(spdf_path);
+        free(home);
+    }
+    else if (strcmp(file_ext, ".txt") == 0)
+    {
+        // Replace "smain" with "stext" in the path and request the file
+        struct backend *server = read_server(req, &stext_shards, expanded_path);
+        if (cacheable && !req->ranged && req->primary == NULL)
+            cache_on_download(req, expanded_path); // Filled only from primaries
+        char *home = home_path(expanded_path);
+        char *stext_path = replace_smain_with_stext(home);
+        req->filepath = strdup(stext_path);
+        get_args[0] = stext_path;
+        request_and_forward_file(req, FS_OP_GET, get_argc, get_args, server);
+        free(stext_path);
+        free(home);
+    }
+    else
+    {
+        finish_request(req, 1, "Error: Unsupported file type.\n");
+    }
+
+    free(expanded_path); // Free the allocated memory
+}
+
+// Stream a local file, from req->offset for req->size bytes (-1: to the end),
+// to the client as SIZE, DATA frames and a REPLY
+void send_file(struct request *req, const char *file_path)
+{
+    struct stat file_stat;
+    if (req->file < 0)
+    {
+        req->file = open(file_path, O_RDONLY); // Open the file for reading, unless the caller has
+    }
+    if (req->file < 0 || fstat(req->file, &file_stat) < 0 || !S_ISREG(file_stat.st_mode))
+    {
+        perror("Failed to open file");
+        finish_request(req, 1, "Error: File not found.\n");
+        return;
+    }
+    if (req->offset > file_stat.st_size)
+    {
+        finish_request(req, 1, "Error: Offset beyond end of file");
+        return;
+    }
+
+    if (req->size < 0 || req->size > file_stat.st_size - req->offset)
+    {
+        req->size = file_stat.st_size - req->offset; // Up to the end of the file
+    }
+    if (req->offset > 0 && lseek(req->file, req->offset, SEEK_SET) < 0)
+    {
+        finish_request(req, 1, "Error: Offset beyond end of file");
+        return;
+    }
+    printf("Sending file: %s, size: %lld bytes from offset %lld\n", file_path, req->size, req->offset);
+    req->disk_offset = req->offset; // Where reading ahead starts
+    compress_init(&req->compressor, req->compress, file_path, NULL);
+    // A whole file goes with its stored checksum; anything else is read
+    // through a buffer and checksummed on the way
+    req->checksum_stored = req->offset == 0 && req->size == file_stat.st_size && crc32c_load(req->file, &req->checksum) == 0;
+    // A compressed download is read through a buffer; sendfile only serves plain ones
+    req->source = req->compressor.enabled || !req->checksum_stored ? NULL : shared_fd_create(req->file, 0);
+    if (req->source != NULL)
+    {
+        req->file = -1; // DATA payloads go out with sendfile, straight from the page cache
+    }
+    if (req->filepath == NULL)
+    {
+        req->filepath = strdup(file_path);
+    }
+    unsigned char size_payload[16];
+    fs_put_u64(size_payload, req->size);
+    fs_put_u64(size_payload + 8, file_stat.st_size);
+    request_stage(req, STAGE_READ);
+    if (conn_send_frame(req->client, FS_OP_SIZE, 0, req->id, size_payload, req->ranged ? 16 : 8) < 0)
+    {
+        return;
+    }
+    req->state = REQ_SEND_FILE;
+    req->client->want_write = 1;
+    pump_file(req, req->client);
+}
+
+// Answer a dfile from the read cache: req->cached holds the req->size bytes
+// asked for, of a file of file_size bytes
+void send_cached(struct request *req, const char *file_path, long long file_size)
+{
+    printf("Sending cached file: %s, size: %lld bytes from offset %lld\n", file_path, req->size, req->offset);
+    compress_init(&req->compressor, req->compress, file_path, NULL);
+    req->filepath = strdup(file_path);
+    unsigned char size_payload[16];
+    fs_put_u64(size_payload, req->size);
+    fs_put_u64(size_payload + 8, file_size);
+    request_stage(req, STAGE_READ);
+    if (conn_send_frame(req->client, FS_OP_SIZE, 0, req->id, size_payload, req->ranged ? 16 : 8) < 0)
+    {
+        return;
+    }
+    req->state = REQ_SEND_FILE;
+    req->client->want_write = 1;
+    pump_file(req, req->client);
+}
+
+// Have a download from a storage server fill the read cache on its way to the client
+void cache_on_download(struct request *req, const char *path)
+{
+    req->cache_path = strdup(path);
+    req->cache_version = read_cache_version(read_cache, path); // Taken before the server reads the file
+}
+
+// Stream an archive of the store's files with the given extension, generated on the fly
+void send_tar(struct request *req, const char *store_path, const char *file_extension)
+{
+    char *store_root = expand_path(store_path);
+    req->tar = malloc(sizeof(*req->tar));
+    if (store_root == NULL || req->tar == NULL || tar_open(req->tar, store_root, file_extension) < 0)
+    {
+        perror("Error reading the store for the tar file");
+        free(store_root);
+        free(req->tar);
+        req->tar = NULL;
+        finish_request(req, 1, "Error: Unable to create tar file");
+        return;
+    }
+    req->filepath = store_root;
+    req->size = req->tar->total;
+    compress_init(&req->compressor, req->compress, file_extension, NULL);
+    printf("Streaming tar of %zu files, size: %lld bytes\n", req->tar->count, req->size);
+    request_stage(req, STAGE_READ);
+
+    unsigned char size_payload[8];
+    fs_put_u64(size_payload, req->size);
+    if (conn_send_frame(req->client, FS_OP_SIZE, 0, req->id, size_payload, sizeof(size_payload)) < 0)
+    {
+        return;
+    }
+    req->state = REQ_SEND_FILE;
+    req->client->want_write = 1;
+    pump_file(req, req->client);
+}
+
+// Produce DATA frames from the request's file into dest until its queue is full,
+// completing the download once the whole file is queued
+void pump_file(struct request *req, struct connection *dest)
+{
+    while (req->source != NULL && !req->eof_sent && dest->out_bytes < HIGH_WATERMARK)
+    {
+        if (req->done == req->size)
+        {
+            req->eof_sent = 1;
+            if (conn_send_eof(dest, req->id, req->checksum) < 0)
+            {
+                return;
+            }
+            break;
+        }
+        // Queue a header and a reference to the file; conn_flush sends the bytes with sendfile
+        size_t want = req->size - req->done < FS_MAX_PAYLOAD ? (size_t)(req->size - req->done) : FS_MAX_PAYLOAD;
+        off_t offset = req->offset + req->done;
+        req->done += want;
+        if (conn_send_header(dest, FS_OP_DATA, 0, req->id, want) < 0 || conn_send_source(dest, req->source, offset, want) < 0)
+        {
+            return; // The failure has already been handled
+        }
+    }
+    char *buffer = req->source == NULL ? buffer_get(&io_buffers) : NULL;
+    if (req->source == NULL && buffer == NULL)
+    {
+        return; // Try again on the next writable event
+    }
+    // Room for compressed frames while this call produces them
+    char *packed = buffer != NULL && req->compressor.enabled ? buffer_get(&io_buffers) : NULL;
+    req->compressor.out = (unsigned char *)packed;
+    while (req->source == NULL && !req->eof_sent && !req->disk_waiting && dest->out_bytes < HIGH_WATERMARK)
+    {
+        ssize_t bytes_read = 0;
+        const char *data = buffer;
+        if (req->done < req->size)
+        {
+            size_t want = req->size - req->done < FS_MAX_PAYLOAD ? (size_t)(req->size - req->done) : FS_MAX_PAYLOAD;
+            if (req->cached != NULL)
+            {
+                data = req->cached + req->done; // Already in memory
+                bytes_read = (ssize_t)want;
+            }
+            else if (req->tar != NULL)
+            {
+                bytes_read = tar_read(req->tar, buffer, want);
+            }
+            else if ((bytes_read = disk_read(req, want, buffer, &data)) == -2)
+            {
+                req->disk_waiting = 1; // Resumed by the read's completion
+                break;
+            }
+            if (bytes_read < 0)
+            {
+                perror("Error reading file");
+            }
+        }
+        if (bytes_read > 0)
+        {
+            req->done += bytes_read;
+            if (!req->checksum_stored)
+                req->checksum = crc32c(req->checksum, data, (size_t)bytes_read);
+            uint32_t packed_len = compress_frame(&req->compressor, data, (uint32_t)bytes_read);
+            if (conn_send_frame(dest, FS_OP_DATA, packed_len > 0 ? FS_FLAG_COMPRESSED : 0, req->id,
+                                packed_len > 0 ? packed : data, packed_len > 0 ? packed_len : (uint32_t)bytes_read) < 0)
+            {
+                buffer_put(&io_buffers, buffer);
+                buffer_put(&io_buffers, packed);
+                return; // The failure has already been handled
+            }
+            continue;
+        }
+        // End of file (or a short file): terminate the stream
+        req->eof_sent = 1;
+        if (conn_send_eof(dest, req->id, req->checksum) < 0)
+        {
+            buffer_put(&io_buffers, buffer);
+            buffer_put(&io_buffers, packed);
+            return;
+        }
+    }
+    buffer_put(&io_buffers, buffer);
+    buffer_put(&io_buffers, packed);
+    req->compressor.out = NULL;
+    if (req->disk_waiting)
+    {
+        dest->want_write = 0; // Nothing to send until the disk catches up
+        conn_update_events(dest);
+        return;
+    }
+    if (!req->eof_sent)
+    {
+        return; // Continue when dest drains
+    }
+
+    dest->want_write = 0;
+    conn_update_events(dest);
+    request_stage(req, STAGE_TRANSFER);
+    if (req->done == req->size) // Check if the entire file was sent
+    {
+        printf("File sent successfully: %s\n", req->filepath);
+        if (req->compressor.wire_bytes < req->compressor.raw_bytes)
+        {
+            printf("Compressed %lld bytes to %lld\n", req->compressor.raw_bytes, req->compressor.wire_bytes);
+        }
+        finish_request(req, 0, "File sent successfully.\n");
+    }
+    else
+    {
+        //   printf("Error: Incomplete file transfer. Sent %lld/%lld bytes\n", req->done, req->size);
+        finish_request(req, 1, "Error: Incomplete file transfer.\n");
+    }
+}
+
+// Lend a disk slot of the worker's ring to a request; -1 if none is free
+int disk_slot_get(struct request *req)
+{
+    if (uring == NULL || disk_free_count == 0)
+    {
+        return -1;
+    }
+    int slot = disk_free[--disk_free_count];
+    disk_slots[slot] = (struct disk_slot){.req = req, .used = 1};
+    return slot;
+}
+
+// A slot for the payload of the DATA frame a client connection is about to
+// read, if it is upload data that will be written through the ring; -1 if not.
+// The connection holds it until the upload takes it over
+int disk_upload_slot(struct connection *conn)
+{
+    struct request *req = conn->request;
+    if (uring == NULL || conn->role != CONN_CLIENT || req == NULL || req->state != REQ_UFILE_RECEIVE ||
+        req->file < 0 || req->chunk_stage == 1 || req->disk_writes >= DISK_DEPTH || conn->frame.opcode != FS_OP_DATA ||
+        conn->frame.length <= SMALL_CHUNK || (conn->frame.flags & FS_FLAG_COMPRESSED))
+    {
+        return -1;
+    }
+    return disk_slot_get(NULL);
+}
+
+// Give a slot back; one still in flight is freed when it completes
+void disk_slot_put(int slot)
+{
+    disk_slots[slot].req = NULL;
+    if (!disk_slots[slot].busy && disk_slots[slot].used)
+    {
+        disk_slots[slot].used = 0;
+        disk_free[disk_free_count++] = slot;
+    }
+}
+
+// Queue a read or write of a slot's buffer at offset in the request's file.
+// It is submitted at once: the request may close the file before the next
+// submission, and a descriptor number can be reused. Returns -1 if it could
+// not be queued or submitted, leaving the caller to do it with a blocking call
+int disk_queue(struct request *req, int slot, int write, uint32_t length, long long offset)
+{
+    struct disk_slot *op = &disk_slots[slot];
+    op->write = write;
+    op->length = length;
+    if (uring_queue_file(uring, write, req->file, slot, uring_buffer(uring, slot), length, offset, slot) < 0)
+    {
+        perror("Error queueing disk I/O");
+        return -1;
+    }
+    if (uring_submit(uring, 0) < 0)
+    {
+        perror("Error submitting disk I/O");
+        uring_discard(uring); // Only this operation: every earlier one was submitted with its own call
+        return -1;
+    }
+    op->busy = 1;
+    return 0;
+}
+
+// Write an upload's data at its next offset: through the ring, from the
+// slot it was read into or else a copy in a free one while the request has
+// fewer than DISK_DEPTH writes in flight, or with pwrite(). Returns -1 if
+// this write, or one before it in flight, failed (errno is set)
+int disk_write(struct request *req, const void *data, uint32_t length)
+{
+    if (req->disk_error != 0)
+    {
+        errno = req->disk_error;
+        return -1;
+    }
+    int slot = -1;
+    struct connection *client = req->client;
+    if (client != NULL && client->payload_slot >= 0 && data == uring_buffer(uring, client->payload_slot))
+    {
+        // Read straight into a slot: the upload takes it over from the connection
+        slot = client->payload_slot;
+        client->payload_slot = -1;
+        client->payload = NULL;
+        disk_slots[slot].req = req;
+    }
+    else if (req->disk_writes < DISK_DEPTH && (slot = disk_slot_get(req)) >= 0)
+    {
+        memcpy(uring_buffer(uring, slot), data, length);
+    }
+    if (slot >= 0)
+    {
+        if (disk_queue(req, slot, 1, length, req->disk_offset) == 0)
+        {
+            req->disk_offset += length;
+            if (++req->disk_writes == DISK_DEPTH)
+            {
+                req->disk_paused = 1; // Read on as the writes complete
+                conn_set_paused(req->client, 1);
+            }
+            return 0;
+        }
+        disk_slot_put(slot);
+    }
+    for (uint32_t written = 0; written < length;)
+    {
+        ssize_t n = pwrite(req->file, (const char *)data + written, length - written, req->disk_offset);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            errno = n < 0 ? errno : ENOSPC;
+            return -1;
+        }
+        written += n;
+        req->disk_offset += n;
+    }
+    return 0;
+}
+
+// Read the next want bytes of a download. With a ring, DISK_DEPTH reads are
+// kept ahead of the one sent; without one, or with no slot free, read()
+// fills buffer. Returns the bytes read, which *data points at, 0 at the end
+// of the file, -1 on an error, or -2 if the next read is still in flight
+ssize_t disk_read(struct request *req, size_t want, char *buffer, const char **data)
+{
+    if (req->ahead_used)
+    {
+        // The buffer handed out last time has been sent
+        disk_slot_put(req->ahead[0]);
+        memmove(req->ahead, req->ahead + 1, (DISK_DEPTH - 1) * sizeof(req->ahead[0]));
+        req->ahead_count--;
+        req->ahead_used = 0;
+    }
+    if (req->ahead_short)
+    {
+        return 0; // Reads queued beyond the end are dropped with the request
+    }
+    long long end = req->offset + req->size;
+    while (req->ahead_count < DISK_DEPTH && req->disk_offset < end)
+    {
+        uint32_t length = end - req->disk_offset < FS_MAX_PAYLOAD ? (uint32_t)(end - req->disk_offset) : FS_MAX_PAYLOAD;
+        int slot = disk_slot_get(req);
+        if (slot < 0)
+        {
+            break;
+        }
+        if (disk_queue(req, slot, 0, length, req->disk_offset) < 0)
+        {
+            disk_slot_put(slot);
+            break;
+        }
+        req->ahead[req->ahead_count++] = slot;
+        req->disk_offset += length;
+    }
+    if (req->ahead_count == 0)
+    {
+        ssize_t n = pread(req->file, buffer, want, req->disk_offset);
+        if (n > 0)
+            req->disk_offset += n;
+        return n;
+    }
+    struct disk_slot *op = &disk_slots[req->ahead[0]];
+    if (op->busy)
+    {
+        return -2;
+    }
+    req->ahead_used = 1;
+    if (op->result < 0)
+    {
+        errno = -op->result;
+        return -1;
+    }
+    req->ahead_short = (uint32_t)op->result < op->length;
+    *data = uring_buffer(uring, req->ahead[0]);
+    return op->result;
+}
+
+// Account for the reads and writes the ring completed and move their
+// requests on. A write that falls short counts as a full disk
+void disk_completed(void)
+{
+    uint64_t slot;
+    int32_t res;
+    while (uring_reap(uring, &slot, &res))
+    {
+        struct disk_slot *op = &disk_slots[slot];
+        struct request *req = op->req;
+        op->busy = 0;
+        op->result = res;
+        if (req == NULL)
+        {
+            disk_slot_put((int)slot); // Its request is gone
+        }
+        else if (op->write)
+        {
+            disk_slot_put((int)slot);
+            req->disk_writes--;
+            if ((res < 0 || (uint32_t)res != op->length) && req->disk_error == 0)
+                req->disk_error = res < 0 ? -res : ENOSPC;
+            if (req->state == REQ_UFILE_FLUSH && req->disk_writes == 0)
+            {
+                finish_upload(req);
+            }
+            else if ((req->state == REQ_UFILE_RECEIVE || req->state == REQ_UFILE_DRAIN) && req->disk_paused)
+            {
+                req->disk_paused = 0;
+                conn_set_paused(req->client, 0);
+            }
+        }
+        else if (req->disk_waiting && req->ahead[0] == (int)slot)
+        {
+            // The read the download was waiting for
+            struct connection *client = req->client;
+            req->disk_waiting = 0;
+            client->want_write = 1;
+            pump_file(req, client);
+            if (!client->closed)
+                conn_update_events(client);
+        }
+    }
+}
+
+// Ask a storage server for a file or tarball and relay its response to the client
+void request_and_forward_file(struct request *req, uint8_t opcode, int argc, const char *const argv[],
+                              struct backend *server)
+{
+    printf("Sending request to %s: %s %s\n", server->name, fs_opcode_name(opcode), argv[0]);
+    req->state = REQ_RELAY;
+    req->backend_flags = req->compress ? FS_FLAG_COMPRESSED : 0; // The backend compresses what is worth it
+    const char *args[FS_MAX_ARGS];
+    char version[24];
+    if (req->primary != NULL && argc < FS_MAX_ARGS)
+    {
+        // A replica is told which write it must have applied to serve the file
+        memcpy(args, argv, argc * sizeof(*argv));
+        snprintf(version, sizeof(version), "%llu", (unsigned long long)req->read_version);
+        args[argc++] = version;
+        argv = args;
+        req->backend_flags |= FS_FLAG_SEQUENCE;
+    }
+    backend_request(req, server, opcode, argc, argv); // Send request to server
+}
+
+// Wrap a descriptor so queued chunks can keep using it after its request is freed
+struct shared_fd *shared_fd_create(int fd, int is_pipe)
+{
+    struct shared_fd *source = calloc(1, sizeof(*source));
+    if (source == NULL)
+    {
+        perror("Error allocating file reference");
+        return NULL;
+    }
+    source->fd = fd;
+    source->refs = 1;
+    source->is_pipe = is_pipe;
+    return source;
+}
+
+// Drop one reference, closing the descriptor with the last one
+void shared_fd_release(struct shared_fd *source)
+{
+    if (--source->refs == 0)
+    {
+        close(source->fd);
+        free(source);
+    }
+}
+
+// Make sure the request has a pipe to splice relayed payloads through; returns -1 to copy instead
+int request_open_pipe(struct request *req)
+{
+    if (!splice_supported)
+    {
+        return -1;
+    }
+    if (req->pipe != NULL)
+    {
+        return req->pipe->broken ? -1 : 0;
+    }
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0)
+    {
+        perror("Error creating relay pipe");
+        return -1;
+    }
+    // The pipe must hold everything the destination may have queued, so that
+    // the watermarks rather than a full pipe throttle the source
+    fcntl(fds[1], F_SETPIPE_SZ, RELAY_PIPE_SIZE);
+    int size = fcntl(fds[1], F_GETPIPE_SZ);
+    if (size < HIGH_WATERMARK + 2 * FS_MAX_PAYLOAD || (req->pipe = shared_fd_create(fds[0], 1)) == NULL)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        splice_supported = size >= HIGH_WATERMARK + 2 * FS_MAX_PAYLOAD;
+        return -1;
+    }
+    req->pipe_in = fds[1];
+    req->pipe_size = size;
+    return 0;
+}
+
+char *expand_path(const char *path)
+{
+    if (path == NULL) // Check if the provided path is NULL
+    {
+        fprintf(stderr, "Error: NULL path provided\n");
+        return NULL;
+    }
+    const char *home;    // Pointer to store home directory path
+    char *expanded_path; // Pointer to store the expanded path
+
+    if (path[0] == '~' && path[1] == '/')
+    {
+        home = getenv("HOME"); // Get the value of the HOME environment variable
+        if (home == NULL)      // Check if HOME is not set
+        {
+            struct passwd *pwd = getpwuid(getuid());
+            if (pwd == NULL)
+            {
+                fprintf(stderr, "Error: Unable to determine home directory\n");
+                return NULL;
+            }
+            home = pwd->pw_dir; // Use the home directory from user information
+        }
+
+        expanded_path = malloc(strlen(home) + strlen(path) + 1); // Allocate memory for expanded path (+1 for null-terminator)
+        if (expanded_path == NULL)                               // Check if memory allocation failed
+        {
+            fprintf(stderr, "Error: Memory allocation failed\n");
+            return NULL;
+        }
+
+        strcpy(expanded_path, home);     // Copy home directory path to expanded_path
+        strcat(expanded_path, path + 1); // Skip the '~'
+    }
+    else
+    {
+        expanded_path = strdup(path); // Duplicate the path if it does not start with '~/'
+    }
+
+    // Ensure the directory exists
+    if (create_directory(expanded_path) != 0)
+    {
+        free(expanded_path);
+        return NULL;
+    }
+
+    return expanded_path;
+}
+
+int create_directory(const char *path)
+{
+    char tmp[256];  // Buffer to hold the path during directory creation
+    char *p = NULL; // Pointer used to traverse the path
+    size_t len;
+
+    snprintf(tmp, sizeof(tmp), "%s", path); // Copy the path to the buffer
+    len = strlen(tmp);
+    if (tmp[len - 1] == '/') // Check if the path ends with '/'
+        tmp[len - 1] = 0;    // Remove the trailing '/' for directory creation
+
+    // Traverse the path and create directories as needed
+    for (p = tmp + 1; *p; p++)
+    {
+        if (*p == '/') // Check for directory separators
+        {
+            *p = '\0'; // Temporarily end the string for directory creation
+            if (mkdir(tmp, S_IRWXU) != 0 && errno != EEXIST)
+            {
+                perror("mkdir failed");
+                return -1;
+            }
+            *p = '/'; // Restore the directory separator
+        }
+    }
+    // Create the final directory
+    if (mkdir(tmp, S_IRWXU) != 0 && errno != EEXIST) // Create the final directory (if it doesn't already exist)
+    {
+        perror("mkdir failed");
+        return -1;
+    }
+    return 0;
+}
+
+
+char *replace_smain_with_stext(const char *path)
+{
+    char *new_path = strdup(path); // Duplicate the path
+    if (new_path == NULL)
+    {
+        return NULL; // Return NULL if memory allocation fails
+    }
+    // Replace "smain" with "stext" in the duplicated path
+    char *smain_pos = strstr(new_path, "smain");
+    if (smain_pos != NULL)
+    {
+        memcpy(smain_pos, "stext", 5);
+    }
+
+    return new_path;
+}
+
+char *replace_smain_with_spdf(const char *path)
+{
+    char *new_path = strdup(path); // Duplicate the path
+    if (new_path == NULL)
+    {
+        return NULL; // Return NULL if memory allocation fails
+    }
+    // Replace "smain" with "spdf" in the duplicated path
+    char *smain_pos = strstr(new_path, "smain");
+    if (smain_pos != NULL)
+    {
+        memcpy(smain_pos, "spdf", 4);
+        memmove(smain_pos + 4, smain_pos + 5, strlen(smain_pos + 5) + 1); // Adjust the rest of the path
+    }
+
+    return new_path; // Return the modified path
+}
+
+
+// The path of a file under ~/smain relative to the home directory, as
+// ~/smain/..., so a storage server finds its copy under its own home
+// whatever host or account it runs on; other paths are kept as they are
+char *home_path(const char *path)
+{
+    if (!catalog_covers(path))
+    {
+        return strdup(path);
+    }
+    size_t len = strlen(path + strlen(smain_root)) + sizeof("~/smain");
+    char *home = malloc(len);
+    if (home != NULL)
+    {
+        snprintf(home, len, "~/smain%s", path + strlen(smain_root));
+    }
+    return home;
+}
+
+// Point a storage server of the tier at host[:port]; returns -1 if the
+// address is invalid
+int shard_add(struct shard_set *set, struct backend *server, const char *address, int default_port)
+{
+    char host[256];
+    snprintf(host, sizeof(host), "%s", address);
+    char *colon = strrchr(host, ':');
+    int port = colon != NULL ? atoi(colon + 1) : default_port;
+    if (colon != NULL)
+        *colon = '\0';
+    struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *found = NULL;
+    if (port <= 0 || port > 65535 || getaddrinfo(host, NULL, &hints, &found) != 0)
+    {
+        return -1;
+    }
+    memcpy(&server->addr, found->ai_addr, sizeof(server->addr));
+    server->addr.sin_port = htons(port);
+    freeaddrinfo(found);
+    snprintf(server->name, sizeof(server->name), "%s %.48s:%d", set->name, host, port);
+    // A storage server names its metrics segment after its port unless it uses the default one
+    if (port == default_port)
+        snprintf(server->metrics_name, sizeof(server->metrics_name), "%s", set->dir);
+    else
+        snprintf(server->metrics_name, sizeof(server->metrics_name), "%s-%d", set->dir, port);
+    backends[backend_count++] = server;
+    return 0;
+}
+
+// Set up the members of a tier from a comma-separated list of shards, each a
+// host:port with optional +host:port read replicas, or a single local server
+// on the default port when list is NULL
+int shard_configure(struct shard_set *set, const char *list, int default_port)
+{
+    char *members = strdup(list != NULL ? list : "127.0.0.1");
+    char *save = NULL;
+    for (char *member = strtok_r(members, ",", &save); member != NULL; member = strtok_r(NULL, ",", &save))
+    {
+        char *replica_save = NULL;
+        char *address = strtok_r(member, "+", &replica_save);
+        struct backend *server = &set->members[set->count];
+        if (address == NULL || set->count == MAX_SHARDS || shard_add(set, server, address, default_port) < 0)
+        {
+            fprintf(stderr, "Error: Invalid %s server %s (at most %d, as host:port)\n", set->name,
+                    address != NULL ? address : member, MAX_SHARDS);
+            free(members);
+            return -1;
+        }
+        server->shard = set->count;
+        hash_ring_add(&set->ring, server->name + strlen(set->name) + 1, set->count);
+        while ((address = strtok_r(NULL, "+", &replica_save)) != NULL)
+        {
+            int *replicas = &set->replica_count[set->count];
+            struct backend *replica = &set->replicas[set->count][*replicas];
+            if (*replicas == MAX_REPLICAS || shard_add(set, replica, address, default_port) < 0)
+            {
+                fprintf(stderr, "Error: Invalid %s replica %s (at most %d per shard, as host:port)\n", set->name,
+                        address, MAX_REPLICAS);
+                free(members);
+                return -1;
+            }
+            replica->shard = set->count;
+            printf("%s: reading also from replica %s\n", server->name, replica->name + strlen(set->name) + 1);
+            (*replicas)++;
+        }
+        set->count++;
+    }
+    free(members);
+    if (set->count == 0)
+    {
+        fprintf(stderr, "Error: No %s server given\n", set->name);
+        return -1;
+    }
+    if (set->count == 1)
+    {
+        snprintf(set->members[0].name, sizeof(set->members[0].name), "%s", set->name); // Messages as without shards
+    }
+    else
+    {
+        printf("%s: %d shards\n", set->name, set->count);
+    }
+    return 0;
+}
+
+// The shard a file of the tier is on: where the catalog saw it, so files
+// stay put when members are added or removed, else where the ring places it
+struct backend *shard_for(struct shard_set *set, const char *path)
+{
+    if (set->count == 1)
+    {
+        return &set->members[0];
+    }
+    struct catalog_entry entry;
+    if (catalog_covers(path) && catalog_lookup(catalog, path, &entry) == 1 && entry.location == set->location &&
+        entry.shard < set->count)
+    {
+        return &set->members[entry.shard];
+    }
+    // Placed by the path below ~/smain, which is the same whoever runs Smain
+    const char *key = catalog_covers(path) ? path + strlen(smain_root) : path;
+    return &set->members[hash_ring_lookup(&set->ring, key)];
+}
+
+// Requests a storage server has in hand or queued from this worker
+int backend_load(struct backend *server)
+{
+    int load = server->open;
+    for (struct connection *conn = server->idle; conn != NULL; conn = conn->next_idle)
+        load--;
+    for (struct request *waiting = server->waiting_head; waiting != NULL; waiting = waiting->next_waiting)
+        load++;
+    return load;
+}
+
+// The server to read a file of the tier from: the least busy of its shard's
+// primary and replicas that is not down, taking turns among equals. A
+// replica is asked only for a file whose last write the catalog has the
+// primary's number for, and serves it only once it has applied that write;
+// any other file is read from the primary, as is any file when no replica is up.
+struct backend *read_server(struct request *req, struct shard_set *set, const char *path)
+{
+    struct backend *primary = shard_for(set, path);
+    int replicas = set->replica_count[primary->shard];
+    req->primary = NULL;
+    struct catalog_entry entry;
+    if (replicas == 0 || !catalog_covers(path) || catalog_lookup(catalog, path, &entry) != 1 || entry.version == 0)
+    {
+        return primary;
+    }
+    req->read_version = entry.version;
+    // Candidates in turn order, the primary counting as number 0, so equals take turns
+    time_t now = time(NULL);
+    struct backend *best = NULL;
+    int best_load = 0;
+    unsigned turn = set->read_turn++;
+    for (int i = 0; i <= replicas; i++)
+    {
+        int candidate = (int)((turn + i) % (unsigned)(replicas + 1));
+        struct backend *server = candidate == 0 ? primary : &set->replicas[primary->shard][candidate - 1];
+        int load = backend_load(server);
+        if ((server == primary || now >= server->down_until) && (best == NULL || load < best_load))
+        {
+            best = server;
+            best_load = load;
+        }
+    }
+    if (best != primary)
+        req->primary = primary; // Where to turn if the replica fails
+    return best;
+}
+
+void handle_rmfile(struct request *req, char *filepath)
+{
+    char *file_ext = filepath != NULL ? strrchr(filepath, '.') : NULL; // Get the file extension
+    if (file_ext == NULL)
+    {
+        finish_request(req, 1, "Error: Invalid file extension"); // Send error message for missing file extension
+        return;
+    }
+
+    // Expand the path
+    char *expanded_path = expand_path(filepath);
+    if (expanded_path == NULL)
+    {
+        finish_request(req, 1, "Error: Unable to expand file path"); // Send error message for path expansion failure
+        return;
+    }
+
+    if (strcmp(file_ext, ".c") == 0)
+    {
+        // Handle .c file locally
+        if (remove(expanded_path) == 0)
+        {
+            catalog_remove(catalog, expanded_path, CATALOG_SMAIN);
+            finish_request(req, 0, "File deleted successfully\n"); // Send success message
+        }
+        else
+        {
+            finish_request(req, 1, "Error deleting file"); // Send error message for deletion failure
+        }
+    }
+    else if ((strcmp(file_ext, ".txt") == 0 || strcmp(file_ext, ".pdf") == 0) && catalog_missing(expanded_path))
+    {
+        finish_request(req, 1, "Error deleting file: File not found");
+    }
+    else if (strcmp(file_ext, ".txt") == 0)
+    {
+        // Forward request to Stext; its reply completes the request
+        forward_delete_request(req, expanded_path, shard_for(&stext_shards, expanded_path));
+    }
+    else if (strcmp(file_ext, ".pdf") == 0)
+    {
+        // Forward request to Spdf; its reply completes the request
+        forward_delete_request(req, expanded_path, shard_for(&spdf_shards, expanded_path));
+    }
+    else
+    {
+        finish_request(req, 1, "Error: Unsupported file type"); // Send error message for unsupported file type
+    }
+
+    free(expanded_path); // Free the allocated memory
+}
+
+void forward_delete_request(struct request *req, const char *filepath, struct backend *server)
+{
+    // Send the delete command to the server; its success is applied to the catalog
+    req->state = REQ_WAIT_REPLY;
+    req->filepath = strdup(filepath);
+    if (journaling && catalog_covers(filepath))
+    {
+        char job[PATH_MAX];
+        journal_job(&journal, filepath + strlen(smain_root), job, sizeof(job));
+        req->journaled = access(job, F_OK) == 0;
+    }
+    char *server_path = home_path(filepath);
+    printf("Command sent to %s: rmfile %s\n", server->name, server_path);
+    const char *args[] = {server_path};
+    backend_request(req, server, FS_OP_REMOVE, 1, args);
+    free(server_path);
+}
+
+void handle_dtar(struct request *req, char *file_extension)
+{
+    // Local .c files are archived here; the other types by their storage server
+    const char *tar_args[] = {file_extension};
+    struct shard_set *set = strcmp(file_extension, ".pdf") == 0   ? &spdf_shards
+                            : strcmp(file_extension, ".txt") == 0 ? &stext_shards
+                                                                  : NULL;
+    if (set != NULL && journaling && tar_jobs(req, file_extension) < 0)
+    {
+        finish_request(req, 1, "Error: Unable to create tar file");
+        return;
+    }
+    if (strcmp(file_extension, ".c") == 0)
+    {
+        send_tar(req, "~/smain", file_extension);
+    }
+    else if (set != NULL && set->count == 1 && req->tar == NULL)
+    {
+        request_and_forward_file(req, FS_OP_TAR, 1, tar_args, &set->members[0]);
+    }
+    else if (set != NULL)
+    {
+        // Every shard archives its own files; the archives are sent one after
+        // the other, each but the last without its end-of-archive blocks.
+        // Uploads still in the journal come last, in place of the shards'
+        // copies of their paths
+        if (start_parts(req, set->count) < 0)
+        {
+            finish_request(req, 1, "Error: Out of memory");
+            return;
+        }
+        printf("Merging the %s archives of %d shards\n", file_extension, set->count);
+        req->state = REQ_TAR_MERGE;
+        req->parts_pending = 1; // Not finished before all parts have been asked
+        for (int i = 0; i < set->count && req->error == NULL; i++)
+        {
+            tar_start_part(req, &set->members[i], file_extension);
+        }
+        if (--req->parts_pending == 0)
+        {
+            finish_request(req, 1, req->error); // A part failed to start, and the others were stopped
+        }
+        else if (req->error == NULL)
+        {
+            tar_next_part(req);
+        }
+    }
+    else
+    {
+        finish_request(req, 1, "Error: Invalid file extension for dtar");
+    }
+}
+
+// Ask one shard for its archive; it is held after its SIZE until its turn comes
+void tar_start_part(struct request *req, struct backend *server, const char *file_extension)
+{
+    struct request *part = calloc(1, sizeof(*part));
+    if (part == NULL)
+    {
+        perror("Error allocating request");
+        tar_fail(req, "Error: Out of memory");
+        return;
+    }
+    part->opcode = FS_OP_DTAR;
+    part->id = req->id;
+    part->trace_id = req->trace_id;
+    part->state = REQ_TAR_PART;
+    part->file = -1;
+    part->size = -1; // Until its SIZE arrives
+    part->parent = req;
+    req->parts[server->shard] = part;
+    req->parts_pending++;
+    conn_account(req->client, sizeof(*part));
+    const char *args[] = {file_extension};
+    backend_request(part, server, FS_OP_TAR, 1, args); // Uncompressed, so the archives can be cut and joined
+}
+
+// A frame of one shard's archive: pass its DATA on, minus the end-of-archive
+// blocks unless it is the last archive, and move on to the next at its REPLY
+void tar_part_frame(struct request *part, struct fs_frame *frame, char *payload)
+{
+    struct request *req = part->parent;
+    if (frame->opcode == FS_OP_SIZE && part->size < 0)
+    {
+        part->size = frame->length >= 8 ? (long long)fs_get_u64((const unsigned char *)payload) : 0;
+        if (part->size < 2 * TAR_BLOCK)
+        {
+            tar_fail(req, "Error: Invalid archive from a storage server");
+            return;
+        }
+        conn_set_paused(part->backend, 1); // Waits for its turn
+        tar_next_part(req);
+    }
+    else if (frame->opcode == FS_OP_DATA && payload != NULL)
+    {
+        int last = part == req->parts[req->part_slots - 1] && req->tar == NULL;
+        long long keep = part->size - (last ? 0 : 2 * TAR_BLOCK);
+        long long len = keep - part->done < frame->length ? keep - part->done : frame->length;
+        part->done += frame->length;
+        if (len > 0)
+        {
+            if ((req->filter != NULL ? tar_filter_write(req->filter, payload, (size_t)len, tar_emit, req)
+                                     : tar_emit(req, payload, (size_t)len)) < 0)
+            {
+                return; // The client is gone and the dtar was freed with it
+            }
+            if (req->client->out_bytes > HIGH_WATERMARK)
+            {
+                conn_set_paused(part->backend, 1); // Resume once the client catches up
+            }
+        }
+    }
+    else if (frame->opcode == FS_OP_REPLY)
+    {
+        if ((frame->flags & FS_FLAG_ERROR) || part->done != part->size)
+        {
+            printf("Error getting the archive of %s: %s\n", part->backend_name, payload != NULL ? payload : "");
+            tar_fail(req, req->relay_started ? "Error: Incomplete file transfer.\n" : payload);
+            return;
+        }
+        release_backend(part, 1);
+        free_request(part);
+        req->current_part++;
+        tar_next_part(req);
+    }
+}
+
+// Send the merged SIZE once every shard announced its archive, then relay
+// the archives in turn; the last one completes the dtar
+void tar_next_part(struct request *req)
+{
+    if (!req->relay_started)
+    {
+        long long total = 0;
+        for (int i = 0; i < req->part_slots; i++)
+        {
+            if (req->parts[i] == NULL || req->parts[i]->size < 0)
+                return; // Still waiting for a SIZE
+            total += req->parts[i]->size - 2 * TAR_BLOCK;
+        }
+        total += req->tar != NULL ? req->tar->total : 2 * TAR_BLOCK; // The journal's archive ends the whole, if any
+        request_stage(req, STAGE_BACKEND);
+        unsigned char size_payload[8];
+        fs_put_u64(size_payload, (uint64_t)total);
+        req->size = total;
+        req->relay_started = 1;
+        if (conn_send_frame(req->client, FS_OP_SIZE, 0, req->id, size_payload, sizeof(size_payload)) < 0)
+        {
+            return;
+        }
+        req->client->want_write = 1;
+    }
+    if (req->current_part == req->part_slots)
+    {
+        tar_finish(req);
+        return;
+    }
+    struct request *part = req->parts[req->current_part];
+    if (part->size >= 0 && part->backend != NULL && req->client->out_bytes < HIGH_WATERMARK)
+    {
+        conn_set_paused(part->backend, 0);
+    }
+}
+
+// Give up on a merged dtar: stop all its parts and report message, once
+// the parts being started have returned
+void tar_fail(struct request *req, const char *message)
+{
+    if (req->error == NULL)
+    {
+        req->error = strdup(message != NULL ? message : "Error: Unable to create tar file");
+    }
+    for (int i = 0; i < req->part_slots; i++)
+    {
+        if (req->parts[i] != NULL)
+            free_request(req->parts[i]);
+    }
+    if (req->parts_pending == 0)
+    {
+        finish_request(req, 1, req->error != NULL ? req->error : "Error: Out of memory");
+    }
+}
+
+// Take the journaled uploads with the extension for a merged dtar, holding
+// their files open so the forwarder removing them does not matter; req->tar
+// stays NULL when there are none. Returns 0 or -1
+int tar_jobs(struct request *req, const char *file_extension)
+{
+    req->tar = malloc(sizeof(*req->tar));
+    req->filter = malloc(sizeof(*req->filter));
+    if (req->tar == NULL || req->filter == NULL || tar_open(req->tar, journal.root, file_extension) < 0)
+    {
+        perror("Error reading the journal for the tar file");
+        free(req->tar);
+        free(req->filter);
+        req->tar = NULL;
+        req->filter = NULL;
+        return -1;
+    }
+    if (req->tar->count == 0)
+    {
+        tar_close(req->tar);
+        free(req->tar);
+        free(req->filter);
+        req->tar = NULL;
+        req->filter = NULL;
+        return 0;
+    }
+    tar_hold(req->tar);
+    tar_filter_init(req->filter, req->tar);
+    printf("Adding %zu journaled uploads to the archive\n", req->tar->count);
+    return 0;
+}
+
+// Send bytes of a shard's archive on to the client of its dtar
+int tar_emit(void *ctx, const char *data, size_t len)
+{
+    struct request *req = ctx;
+    req->done += (long long)len;
+    return conn_send_frame(req->client, FS_OP_DATA, 0, req->id, data, (uint32_t)len);
+}
+
+// Once the shards' archives are relayed, send the journal's, if any, followed
+// by zero blocks making up for the shards' entries it replaced, and complete
+// the dtar; continued as the client drains
+void tar_finish(struct request *req)
+{
+    char *buffer = req->tar != NULL ? buffer_get(&io_buffers) : NULL;
+    if (req->tar != NULL && buffer == NULL)
+    {
+        return; // Try again on the next writable event
+    }
+    while (buffer != NULL && req->done < req->size && req->client->out_bytes < HIGH_WATERMARK)
+    {
+        size_t want = req->size - req->done < FS_MAX_PAYLOAD ? (size_t)(req->size - req->done) : FS_MAX_PAYLOAD;
+        ssize_t produced = tar_read(req->tar, buffer, want);
+        if (produced < 0)
+        {
+            perror("Error reading the journal for the tar file");
+            buffer_put(&io_buffers, buffer);
+            tar_fail(req, "Error: Incomplete file transfer.\n");
+            return;
+        }
+        if (produced == 0)
+        {
+            memset(buffer, 0, want); // Past the end-of-archive marker
+            produced = (ssize_t)want;
+        }
+        req->done += produced;
+        if (conn_send_frame(req->client, FS_OP_DATA, 0, req->id, buffer, (uint32_t)produced) < 0)
+        {
+            buffer_put(&io_buffers, buffer);
+            return; // The client is gone and the dtar was freed with it
+        }
+    }
+    buffer_put(&io_buffers, buffer);
+    if (req->tar != NULL && req->done < req->size)
+    {
+        return; // Continue when the client drains
+    }
+    request_stage(req, STAGE_TRANSFER);
+    printf("Tar file successfully transferred to client.\n");
+    if (conn_send_frame(req->client, FS_OP_DATA, FS_FLAG_EOF, req->id, NULL, 0) == 0)
+    {
+        finish_request(req, 0, "Tar file sent successfully");
+    }
+}
+
+void handle_display(struct request *req, char *pathname)
+{
+    // Expand the given path to handle user directory shortcuts
+    char *expanded_path = expand_path(pathname);
+    if (expanded_path == NULL) // Check if path expansion was successful
+    {
+        finish_request(req, 1, "Error: Invalid path");
+        printf("Error: Invalid path\n");
+        return;
+    }
+    req->display_path = expanded_path;
+    req->state = REQ_DISPLAY;
+
+    // Ask Spdf and Stext, every shard of them, at the same time, so display
+    // waits for the slowest rather than each in turn; their names are
+    // streamed as they arrive
+    if (start_parts(req, spdf_shards.count + stext_shards.count) < 0)
+    {
+        finish_request(req, 1, "Error: Out of memory");
+        return;
+    }
+    req->parts_pending = 1; // Not finished before all have been started
+    struct shard_set *sets[] = {&spdf_shards, &stext_shards};
+    for (int i = 0, slot = 0; i < 2; i++)
+    {
+        if (catalog_covers(expanded_path) && catalog_known(catalog, sets[i]->location) &&
+            !catalog_incomplete(catalog, expanded_path))
+        {
+            // Answered locally for every shard, no round trip
+            catalog_list(catalog, expanded_path, sets[i]->location, display_catalog, req);
+            continue;
+        }
+        for (int shard = 0; shard < sets[i]->count; shard++)
+        {
+            display_start_part(req, &sets[i]->members[shard], sets[i]->location, slot++);
+        }
+    }
+
+    // Get .c files, from the catalog once it holds all of Smain's files
+    DIR *dir = NULL;
+    if (catalog_covers(expanded_path) && catalog_known(catalog, CATALOG_SMAIN) &&
+        !catalog_incomplete(catalog, expanded_path))
+    {
+        catalog_list(catalog, expanded_path, CATALOG_SMAIN, display_catalog, req);
+    }
+    else if ((dir = opendir(expanded_path)) != NULL)
+    {
+        struct dirent *entry;
+        // Iterate through directory entries
+        while ((entry = readdir(dir)) != NULL)
+        {
+            if (entry->d_type == DT_REG && strstr(entry->d_name, ".c")) // Check if entry is a regular file with a .c extension
+            {
+                append_listing(req, entry->d_name, strlen(entry->d_name));
+                append_listing(req, "\n", 1);
+            }
+        }
+        closedir(dir); // Close the directory stream
+    }
+    else
+    {
+        printf("Error opening directory for .c files: %s\n", strerror(errno));
+    }
+
+    // Send what is known locally right away
+    if (display_flush(req, req->listing, req->listing_len) < 0)
+    {
+        return; // The client is gone, and the request with it
+    }
+    req->listing_len = 0;
+    if (--req->parts_pending == 0)
+    {
+        display_finish(req);
+    }
+}
+
+// Make room for the backend parts of a display or dtar
+int start_parts(struct request *req, int slots)
+{
+    req->parts = calloc(slots, sizeof(*req->parts));
+    if (req->parts == NULL)
+    {
+        perror("Error allocating request");
+        return -1;
+    }
+    req->part_slots = slots;
+    return 0;
+}
+
+// Start listing one storage server's files for a display
+void display_start_part(struct request *req, struct backend *server, int location, int slot)
+{
+    struct request *part = calloc(1, sizeof(*part));
+    if (part == NULL)
+    {
+        perror("Error allocating request");
+        snprintf(req->missing + strlen(req->missing), sizeof(req->missing) - strlen(req->missing), "%s%s",
+                 req->missing[0] ? ", " : "", server->name);
+        return;
+    }
+    part->opcode = FS_OP_DISPLAY;
+    part->id = req->id;
+    part->trace_id = req->trace_id;
+    part->state = REQ_DISPLAY_PART;
+    part->file = -1;
+    part->parent = req;
+    req->parts[slot] = part;
+    req->parts_pending++;
+    conn_account(req->client, sizeof(*part));
+    part->deadline = monotonic_ms() + display_timeout;
+    part->next_part = display_parts;
+    display_parts = part;
+
+    // Replace "smain" with the server's directory in the path
+    char *home = home_path(req->display_path);
+    char *server_path = location == CATALOG_SPDF ? replace_smain_with_spdf(home) : replace_smain_with_stext(home);
+    free(home);
+    const char *args[] = {server_path};
+    // Continues when the listing arrives; a failure or timeout only leaves out this server's files
+    backend_request(part, server, FS_OP_LIST, 1, args);
+    free(server_path);
+}
+
+// Stream the complete lines of a storage server's listing to the client
+void display_part_data(struct request *part, const char *data, size_t len)
+{
+    struct request *req = part->parent;
+    part->deadline = monotonic_ms() + display_timeout;
+
+    // A name split across frames is held back until its end arrives, so the
+    // names of different servers never interleave mid-line
+    const char *end = memrchr(data, '\n', len);
+    if (end == NULL)
+    {
+        append_listing(part, data, len);
+        return;
+    }
+    size_t complete = end - data + 1;
+    if (display_flush(req, part->listing, part->listing_len) < 0 || display_flush(req, data, complete) < 0)
+    {
+        return; // The client is gone, and the display with its parts
+    }
+    part->listing_len = 0;
+    append_listing(part, data + complete, len - complete);
+    if (req->client->out_bytes > HIGH_WATERMARK && part->backend != NULL)
+    {
+        conn_set_paused(part->backend, 1); // Resume once the client catches up
+    }
+}
+
+// A storage server finished its part of a display; failure says why it could not
+void display_part_done(struct request *part, const char *failure)
+{
+    struct request *req = part->parent;
+    if (failure != NULL)
+    {
+        printf("Error getting files from %s: %s\n", part->backend_name, failure);
+        snprintf(req->missing + strlen(req->missing), sizeof(req->missing) - strlen(req->missing), "%s%s",
+                 req->missing[0] ? ", " : "", part->backend_name);
+    }
+    else if (display_flush(req, part->listing, part->listing_len) < 0)
+    {
+        return; // The client is gone, and the display with its parts
+    }
+    free_request(part);
+    if (req->parts_pending == 0)
+    {
+        display_finish(req);
+    }
+}
+
+// End the listing; the REPLY is flagged partial if a server's files are missing
+void display_finish(struct request *req)
+{
+    if (conn_send_frame(req->client, FS_OP_DATA, FS_FLAG_EOF, req->id, NULL, 0) < 0)
+    {
+        return;
+    }
+    if (req->missing[0] == '\0')
+    {
+        finish_request(req, 0, "File list sent");
+        return;
+    }
+    char message[MAX_MESSAGE];
+    snprintf(message, sizeof(message), "File list incomplete: no answer from %s", req->missing);
+    printf("%s\n", message);
+    finish_request_flags(req, FS_FLAG_PARTIAL, message);
+}
+
+// Send display names to the client as DATA frames; returns -1 if the client is gone
+int display_flush(struct request *req, const char *data, size_t len)
+{
+    size_t sent = 0;
+    while (sent < len)
+    {
+        size_t chunk = len - sent < FS_MAX_PAYLOAD ? len - sent : FS_MAX_PAYLOAD;
+        if (conn_send_frame(req->client, FS_OP_DATA, 0, req->id, data + sent, (uint32_t)chunk) < 0)
+        {
+            return -1;
+        }
+        sent += chunk;
+    }
+    return 0;
+}
+
+// Send the metrics of Smain's workers and of the storage servers running on this host
+void handle_stats(struct request *req, int machine)
+{
+    char *text = malloc(MAX_STATS);
+    if (text == NULL)
+    {
+        finish_request(req, 1, "Error: Out of memory");
+        return;
+    }
+    size_t len = metrics_format(metrics, "smain", machine, text, MAX_STATS);
+    if (read_cache != NULL)
+    {
+        len += read_cache_format(read_cache, machine, text + len, MAX_STATS - len);
+    }
+    for (int i = 0; i < backend_count; i++)
+    {
+        struct backend *member = backends[i];
+        int local = (ntohl(member->addr.sin_addr.s_addr) >> 24) == 127;
+        const struct metrics *server = local ? metrics_open(member->metrics_name) : NULL;
+        if (server != NULL)
+        {
+            len += metrics_format(server, member->metrics_name, machine, text + len, MAX_STATS - len);
+            metrics_close(server);
+        }
+        else if (!machine)
+        {
+            len += snprintf(text + len, MAX_STATS - len, "%s: %s\n", local ? member->metrics_name : member->name,
+                            local ? "not running" : "on another host");
+        }
+        if (len >= MAX_STATS)
+            len = MAX_STATS - 1;
+    }
+    int sent = display_flush(req, text, len);
+    free(text);
+    if (sent < 0 || conn_send_frame(req->client, FS_OP_DATA, FS_FLAG_EOF, req->id, NULL, 0) < 0)
+    {
+        return; // The client is gone, and the request with it
+    }
+    finish_request(req, 0, "Stats sent");
+}
+
+// Milliseconds the event loop may sleep: a second, or until the next listing part is due
+int display_wait_time(void)
+{
+    long long wait = 1000, now = monotonic_ms();
+    for (struct request *part = display_parts; part != NULL; part = part->next_part)
+    {
+        if (part->backend != NULL && part->backend->read_paused)
+            continue; // Held back by a slow client, not late
+        if (part->deadline - now < wait)
+            wait = part->deadline - now;
+    }
+    return wait > 0 ? (int)wait : 0;
+}
+
+// Give up on storage servers that have sent nothing for the display timeout
+void display_expire_parts(void)
+{
+    long long now = monotonic_ms();
+    struct request *part = display_parts;
+    while (part != NULL)
+    {
+        if (now >= part->deadline && !(part->backend != NULL && part->backend->read_paused))
+        {
+            display_part_done(part, "timed out");
+            part = display_parts; // Finishing a display frees its other part too; start over
+            continue;
+        }
+        part = part->next_part;
+    }
+}
+
+// Milliseconds on a clock that never jumps
+long long monotonic_ms(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000LL + ts.tv_nsec / 1000000;
+}
+
+// Add names to the display listing, growing the buffer as needed
+int append_listing(struct request *req, const char *data, size_t len)
+{
+    if (req->listing_len + len > MAX_LISTING)
+    {
+        return -1; // Listing too large; keep what fits
+    }
+    if (req->listing_len + len > req->listing_cap)
+    {
+        size_t capacity = req->listing_cap ? req->listing_cap : 4096;
+        while (capacity < req->listing_len + len)
+            capacity *= 2;
+        char *listing = realloc(req->listing, capacity);
+        if (listing == NULL)
+        {
+            return -1;
+        }
+        req->listing = listing;
+        req->listing_cap = capacity;
+    }
+    memcpy(req->listing + req->listing_len, data, len);
+    req->listing_len += len;
+    return 0;
+}
+
+
+// Catalog location of a file, from its extension
+int file_location(const char *path)
+{
+    const char *ext = strrchr(path, '.');
+    if (ext != NULL && strcmp(ext, ".txt") == 0)
+        return CATALOG_STEXT;
+    if (ext != NULL && strcmp(ext, ".pdf") == 0)
+        return CATALOG_SPDF;
+    return CATALOG_SMAIN;
+}
+
+// Is the expanded path inside ~/smain, the tree the catalog describes?
+int catalog_covers(const char *path)
+{
+    size_t len = strlen(smain_root);
+    return strncmp(path, smain_root, len) == 0 && (path[len] == '/' || path[len] == '\0');
+}
+
+// Catalog the files stored on Smain itself
+int catalog_load_local(void)
+{
+    unsigned removals = catalog_removals(catalog, CATALOG_SMAIN);
+    struct tar_writer tree;
+    if (tar_open(&tree, smain_root, "") < 0)
+    {
+        perror("Error reading ~/smain for the catalog");
+        return -1;
+    }
+    struct catalog_record *records = calloc(tree.count + 1, sizeof(*records));
+    size_t count = 0;
+    for (size_t i = 0; records != NULL && i < tree.count; i++)
+    {
+        // Stray .txt/.pdf files here are never served; Stext and Spdf hold those
+        if (file_location(tree.entries[i].name) != CATALOG_SMAIN)
+            continue;
+        records[count].path = tree.entries[i].path;
+        records[count].size = tree.entries[i].size;
+        records[count].mtime = tree.entries[i].mtime;
+        count++;
+    }
+    int result = records != NULL ? catalog_merge(catalog, CATALOG_SMAIN, removals, records, count) : -1;
+    if (result == 0)
+        printf("Catalog: %zu files on Smain\n", count);
+    else if (result == -2)
+        fprintf(stderr, "Catalog: no room for the %zu files on Smain (see -m); they are listed from disk\n", count);
+    else
+        fprintf(stderr, "Error cataloging the files on Smain\n");
+    free(records);
+    tar_close(&tree);
+    return result;
+}
+
+// Fetch a storage server's index, appending its records to *records;
+// returns -1 if the index could not be had completely
+int catalog_fetch_index(struct backend *server, struct catalog_record **records, size_t *count, size_t *capacity)
+{
+    int sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0)
+    {
+        perror("Error creating socket for the index");
+        return -1;
+    }
+    // Neither startup nor the supervisor loop may hang on a stalled server
+    struct timeval timeout = {CATALOG_TIMEOUT, 0};
+    setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    if (connect(sock, (struct sockaddr *)&server->addr, sizeof(server->addr)) < 0 ||
+        fs_send_request(sock, FS_OP_INDEX, 0, 0, NULL) < 0)
+    {
+        fprintf(stderr, "Catalog: %s server unavailable (%s), asking it directly until it is back\n", server->name,
+                strerror(errno));
+        close(sock);
+        return -1;
+    }
+
+    char *payload = malloc(FS_MAX_PAYLOAD + 1);
+    struct fs_frame frame;
+    int result = payload != NULL ? -1 : -2;
+    while (result == -1 && fs_recv_frame(sock, &frame, payload, FS_MAX_PAYLOAD) == 1)
+    {
+        if (frame.opcode == FS_OP_REPLY)
+        {
+            result = (frame.flags & FS_FLAG_ERROR) ? -2 : 0;
+            break;
+        }
+        // Records of relative path, size and mtime
+        size_t pos = 0;
+        while (pos < frame.length)
+        {
+            char *fields[3];
+            int n = 0;
+            while (n < 3 && pos < frame.length)
+            {
+                fields[n++] = payload + pos;
+                pos += strnlen(payload + pos, frame.length - pos) + 1;
+            }
+            if (n < 3)
+            {
+                result = -2; // Malformed record
+                break;
+            }
+            if (*count == *capacity)
+            {
+                size_t grown_capacity = *capacity ? *capacity * 2 : 256;
+                struct catalog_record *grown = realloc(*records, grown_capacity * sizeof(**records));
+                if (grown == NULL)
+                {
+                    result = -2;
+                    break;
+                }
+                *records = grown;
+                *capacity = grown_capacity;
+            }
+            struct catalog_record *record = &(*records)[*count];
+            size_t path_len = strlen(smain_root) + strlen(fields[0]) + 2;
+            record->path = malloc(path_len);
+            if (record->path == NULL)
+            {
+                result = -2;
+                break;
+            }
+            snprintf(record->path, path_len, "%s/%s", smain_root, fields[0]);
+            record->shard = server->shard;
+            record->size = strtoll(fields[1], NULL, 10);
+            record->mtime = strtoll(fields[2], NULL, 10);
+            (*count)++;
+        }
+    }
+    close(sock);
+    free(payload);
+    if (result != 0)
+    {
+        fprintf(stderr, "Catalog: incomplete index from %s server, will retry\n", server->name);
+        return -1;
+    }
+    return 0;
+}
+
+// Fetch the index of every shard of a tier and merge them into the catalog;
+// the tier's files are known only once all its shards have answered
+int catalog_load_backend(struct shard_set *set)
+{
+    // Deletes from here on may be missing from the index; catalog_merge checks
+    unsigned removals = catalog_removals(catalog, set->location);
+    struct catalog_record *records = NULL;
+    size_t count = 0, capacity = 0;
+    int result = 0;
+    for (int i = 0; i < set->count && result == 0; i++)
+    {
+        result = catalog_fetch_index(&set->members[i], &records, &count, &capacity);
+    }
+    int merged = result == 0 ? catalog_merge(catalog, set->location, removals, records, count) : -1;
+    if (merged == 0)
+    {
+        printf("Catalog: %zu files on %s\n", count, set->name);
+    }
+    else if (merged == -2)
+    {
+        fprintf(stderr, "Catalog: no room for the %zu files on %s (see -m); they are asked for instead\n", count,
+                set->name);
+        result = -1;
+    }
+    else if (result == 0)
+    {
+        fprintf(stderr, "Catalog: %s changed while its index was read, will retry\n", set->name);
+        result = -1;
+    }
+    for (size_t i = 0; i < count; i++)
+        free(records[i].path);
+    free(records);
+    return result;
+}
+
+// Load the index of every storage server not yet in the catalog
+void catalog_load_missing(void)
+{
+    if (!catalog_settled(catalog, CATALOG_STEXT))
+        catalog_load_backend(&stext_shards);
+    if (!catalog_settled(catalog, CATALOG_SPDF))
+        catalog_load_backend(&spdf_shards);
+}
+
+// Does the catalog show that a file does not exist? False when it cannot tell
+int catalog_missing(const char *path)
+{
+    return catalog_covers(path) && catalog_known(catalog, file_location(path)) && catalog_lookup(catalog, path, NULL) == 0;
+}
+
+// Add a name from the catalog to a display listing
+void display_catalog(void *ctx, const char *name)
+{
+    struct request *req = ctx;
+    if (file_location(name) == CATALOG_SMAIN && strstr(name, ".c") == NULL)
+    {
+        return; // Only .c files of Smain's own are displayed
+    }
+    append_listing(req, name, strlen(name));
+    append_listing(req, "\n", 1);
+}
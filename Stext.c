@@ -12,24 +12,153 @@
 #include <pwd.h>
 #include <dirent.h>
 #include <sys/types.h>
+#include <pthread.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include "protocol.h"
+#include "tar_stream.h"
+#include "buffer_pool.h"
+#include "chunk_store.h"
+#include "compress.h"
+#include "metrics.h"
+#include "replica.h"
 
 // Define constants for buffer size and port number
-#define MAX_BUFFER 1000024
+#define MAX_MESSAGE FS_MAX_MESSAGE // Replies and error messages sent to Smain
 #define STEXT_PORT 4532
+#define DEFAULT_QUEUE_LIMIT 64 // Requests that may wait for a free worker
+#define LISTING_CHUNK 4096     // Growth step of a directory listing
+#define MAX_EVENTS 64
 // Function declarations
 int create_directory(const char *path);
 char *expand_path(const char *path);
 char *replace_smain_with_stext(const char *path);
-void handle_rmfile(char *filepath, char *response);
-void handle_list(int client_socket, char *command);
-void handle_create_tar(int client_socket);
-
-int main()
+int handle_rmfile(char *filepath, char *response);
+int handle_list(int client_socket, uint32_t request_id, char *command);
+int handle_create_tar(int client_socket, uint32_t request_id, int compress);
+int handle_index(int client_socket, uint32_t request_id);
+int handle_request(int client_socket, long long queued);
+int watch_connection(int client_socket, int op);
+int handle_get(int client_socket, uint32_t request_id, int compress, char *filepath, char *offset_str,
+               char *length_str);
+int handle_store_chunks(int client_socket, uint32_t request_id, const char *filename, const char *dirpath,
+                        const char *store_filepath, long long size, const char *error_msg);
+int reply_written(int client_socket, uint32_t request_id, uint8_t opcode, const char *path, const char *name,
+                  const char *local, const char *message);
+int handle_store(int client_socket, uint32_t request_id, char *filename, char *dirpath, char *size_str, char *mode);
+void *worker_thread(void *arg);
+
+// Smain connections with a request waiting for a worker thread
+struct connection_queue
+{
+    int *fds;     // Ring buffer of sockets with a pending request
+    long long *since; // When each of them was queued, in monotonic microseconds
+    int capacity; // Most requests allowed to wait
+    int head;     // Next connection to serve
+    int count;    // Requests waiting (queue depth)
+    int active;   // Requests being served
+    int workers;  // Concurrency limit: number of worker threads
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct connection_queue queue = {.lock = PTHREAD_MUTEX_INITIALIZER,
+                                 .not_empty = PTHREAD_COND_INITIALIZER,
+                                 .not_full = PTHREAD_COND_INITIALIZER};
+struct buffer_pool io_buffers = BUFFER_POOL_INITIALIZER(FS_MAX_PAYLOAD + 1, 64); // Request payloads and tar blocks
+int epoll_fd;              // Watches the listening socket and idle Smain connections
+struct metrics *metrics;   // Request counters, read by Smain for stats
+char server_name[32] = "stext"; // Names the metrics segment and the spans
+struct replica_set replicas;  // Servers completed stores and deletes are passed on to
+struct chunk_store store;  // ~/stext, holding plain files and chunked ones
+struct tar_source store_source = {&store, chunk_tar_size, chunk_tar_open, chunk_tar_read, chunk_tar_close};
+int use_uring;              // -B: worker threads pipeline file transfers through io_uring where available
+
+int main(int argc, char *argv[])
 {
     int server_socket, client_socket;
     struct sockaddr_in server_addr, client_addr;
     socklen_t addr_size = sizeof(client_addr);
-    char buffer[MAX_BUFFER];
+    int workers = 0; // Connections served at once; 0 picks two per CPU
+    int queue_limit = DEFAULT_QUEUE_LIMIT;
+    int dedup = 0; // Keep new uploads as deduplicated chunks
+    int port = STEXT_PORT; // Another port lets several shards run on one host
+    const char *replica_list = NULL;
+    int opt;
+
+    // Parse command line options
+    while ((opt = getopt(argc, argv, "c:q:dp:r:B")) != -1)
+    {
+        if (opt == 'c')
+        {
+            workers = atoi(optarg);
+        }
+        else if (opt == 'q')
+        {
+            queue_limit = atoi(optarg);
+        }
+        else if (opt == 'd')
+        {
+            dedup = 1;
+        }
+        else if (opt == 'p')
+        {
+            port = atoi(optarg);
+        }
+        else if (opt == 'r')
+        {
+            replica_list = optarg;
+        }
+        else if (opt == 'B')
+        {
+            use_uring = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-c concurrency] [-q queue_limit] [-d] [-p port] [-r host:port,...] [-B]\n", argv[0]);
+            exit(1);
+        }
+    }
+    if (workers <= 0)
+    {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cpus > 0 ? 2 * (int)cpus : 2;
+    }
+    if (queue_limit <= 0)
+    {
+        queue_limit = 1;
+    }
+
+    setvbuf(stdout, NULL, _IOLBF, 0); // Spans show up as requests finish, not when a buffer fills
+    signal(SIGPIPE, SIG_IGN); // A download cut short by Smain fails its sendfile() instead
+    // Smain finds the metrics of a shard on another port under the port's name
+    if (port != STEXT_PORT)
+        snprintf(server_name, sizeof(server_name), "stext-%d", port);
+    metrics = metrics_create(server_name);
+    if (metrics == NULL)
+    {
+        perror("Error creating the metrics");
+        exit(1);
+    }
+
+    // Count the references of chunked files before serving any of them
+    char *store_root = expand_path("~/stext");
+    size_t chunked_files;
+    if (store_root == NULL || create_directory(store_root) != 0 ||
+        chunk_store_open(&store, store_root, dedup, &chunked_files) < 0)
+    {
+        perror("Error opening the chunk store");
+        exit(1);
+    }
+    free(store_root);
+    printf("Chunk store: %zu chunked files, %zu chunks (%lld bytes), deduplication %s\n", chunked_files,
+           store.refs.count, store.chunk_bytes, dedup ? "on" : "off");
+    replica_init(&replicas);
+    if (replica_list != NULL && replica_start(&replicas, replica_list, STEXT_PORT, &store) < 0)
+    {
+        exit(1);
+    }
     // Create a socket
     server_socket = socket(AF_INET, SOCK_STREAM, 0);
     if (server_socket < 0)
@@ -37,9 +166,12 @@ int main()
         perror("Error in socket creation");
         exit(1);
     }
+    // Allow a quick restart while Smain's old pooled connections sit in TIME_WAIT
+    int reuse = 1;
+    setsockopt(server_socket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
     // Configure server address
     server_addr.sin_family = AF_INET;
-    server_addr.sin_port = htons(STEXT_PORT);
+    server_addr.sin_port = htons(port);
     server_addr.sin_addr.s_addr = INADDR_ANY;
     // Bind socket to the configured address
     if (bind(server_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
@@ -48,246 +180,534 @@ int main()
         exit(1);
     }
     // Start listening for incoming connections
-    if (listen(server_socket, 10) == 0)
+    if (listen(server_socket, SOMAXCONN) == 0)
     {
-        printf("Stext server listening on port %d...\n", STEXT_PORT);
+        printf("Stext server listening on port %d with %d workers...\n", port, workers);
+        // Each worker sets up its own ring; this one only checks that io_uring works here
+        struct uring *probe = use_uring ? uring_create(1, 0, 0) : NULL;
+        printf("File I/O: %s\n", probe != NULL ? "io_uring" : use_uring ? "blocking (no io_uring here)" : "blocking");
+        uring_destroy(probe);
     }
     else
     {
         perror("Error in listening");
         exit(1);
     }
-    while (1)
-    {
-        // Accept a new client connection
-        client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_size);
-        if (client_socket < 0)
-        {
-            perror("Error accepting connection");
-            continue;
-        }
-
-        printf("\nAccepted connection from Smain\n");
 
-        // Receive command
-        char command[MAX_BUFFER];
-        ssize_t bytes_received = recv(client_socket, command, MAX_BUFFER - 1, 0);
-        if (bytes_received <= 0)
+    // Start the worker pool
+    queue.fds = malloc(queue_limit * sizeof(int));
+    queue.since = malloc(queue_limit * sizeof(long long));
+    if (queue.fds == NULL || queue.since == NULL)
+    {
+        perror("Error allocating connection queue");
+        exit(1);
+    }
+    queue.capacity = queue_limit;
+    queue.workers = workers;
+    for (int i = 0; i < workers; i++)
+    {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, worker_thread, NULL) != 0)
         {
-            perror("Error receiving command");
-            close(client_socket);
-            continue;
+            perror("Error creating worker thread");
+            exit(1);
         }
-        command[bytes_received] = '\0';
+        pthread_detach(thread);
+    }
 
-        // Parse command
-        char *cmd = strtok(command, " ");
-        char *filepath = strtok(NULL, ""); // Get the rest of the string as filepath
+    // Idle keep-alive connections wait in epoll, not in a worker thread
+    epoll_fd = epoll_create1(0);
+    struct epoll_event listen_event = {.events = EPOLLIN, .data.fd = server_socket};
+    if (epoll_fd < 0 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, server_socket, &listen_event) < 0)
+    {
+        perror("Error setting up epoll");
+        exit(1);
+    }
 
-        if (cmd == NULL || filepath == NULL)
+    struct epoll_event events[MAX_EVENTS];
+    while (1)
+    {
+        int ready = epoll_wait(epoll_fd, events, MAX_EVENTS, -1);
+        if (ready < 0)
         {
-            send(client_socket, "Invalid command", 15, 0);
-            close(client_socket);
+            if (errno != EINTR)
+                perror("epoll_wait failed");
             continue;
         }
-
-        // In the main loop of stext.c, add:
-        if (strcmp(command, "dtar") == 0)
-        {
-            handle_create_tar(client_socket);
-        }
-        else if (strncmp(command, "list", 4) == 0)
-        {
-            char *pathname = command + 5; // Skip "list "
-            handle_list(client_socket, pathname);
-        }
-        else if (strncmp(command, "rmfile", 6) == 0)
-        {
-            char response[MAX_BUFFER];
-            handle_rmfile(filepath, response);
-            printf("Response from handle_rmfile: %s\n", response);
-            send(client_socket, response, strlen(response), 0);
-        }
-        else if (strcmp(cmd, "get") == 0)
+        for (int i = 0; i < ready; i++)
         {
-            // Handle get command (for dfile)
-            char *expanded_path = expand_path(filepath);
-            if (expanded_path == NULL)
-            {
-                send(client_socket, "Error: Unable to expand path", 28, 0);
-                close(client_socket);
-                continue;
-            }
-
-            // Get file size
-            struct stat file_stat;
-            if (stat(expanded_path, &file_stat) < 0)
-            {
-                char error_msg[MAX_BUFFER];
-                snprintf(error_msg, sizeof(error_msg), "Error: Unable to get file stats: %s", strerror(errno));
-                send(client_socket, error_msg, strlen(error_msg), 0);
-                printf("%s\n", error_msg);
-                free(expanded_path);
-                close(client_socket);
-                continue;
-            }
-
-            size_t file_size = file_stat.st_size;
-            char size_msg[32];
-            snprintf(size_msg, sizeof(size_msg), "%zu", file_size);
-            send(client_socket, size_msg, strlen(size_msg), 0);
-            // printf("Sent file size: %s bytes\n", size_msg);
-
-            // Send file contents
-            int file = open(expanded_path, O_RDONLY);
-            if (file < 0)
-            {
-                char error_msg[MAX_BUFFER];
-                snprintf(error_msg, sizeof(error_msg), "Error: Unable to open file: %s", strerror(errno));
-                send(client_socket, error_msg, strlen(error_msg), 0);
-                printf("%s\n", error_msg);
-                free(expanded_path);
-                close(client_socket);
-                continue;
-            }
-
-            char buffer[MAX_BUFFER];
-            ssize_t bytes_read;
-            size_t total_sent = 0;
-            while (total_sent < file_size)
+            if (events[i].data.fd == server_socket)
             {
-                bytes_read = read(file, buffer, sizeof(buffer));
-                if (bytes_read <= 0)
+                // Accept a new client connection
+                client_socket = accept(server_socket, (struct sockaddr *)&client_addr, &addr_size);
+                if (client_socket < 0)
                 {
-                    if (bytes_read < 0)
-                    {
-                        perror("Error reading file");
-                    }
-                    break;
+                    perror("Error accepting connection");
+                    continue;
                 }
-                ssize_t bytes_sent = 0;
-                while (bytes_sent < bytes_read)
+                fs_set_nodelay(client_socket);
+                printf("\nAccepted connection from Smain\n");
+                if (watch_connection(client_socket, EPOLL_CTL_ADD) < 0)
                 {
-                    ssize_t sent = send(client_socket, buffer + bytes_sent, bytes_read - bytes_sent, 0);
-                    if (sent < 0)
-                    {
-                        perror("Error sending file data");
-                        break;
-                    }
-                    bytes_sent += sent;
+                    close(client_socket);
+                    continue;
                 }
-                total_sent += bytes_sent;
-                // printf("Sent %zd bytes, total %zu/%zu\n", bytes_sent, total_sent, file_size);
+                metrics_add(&metrics->connections, 1);
+                __atomic_fetch_add(&metrics->open_connections, 1, __ATOMIC_RELAXED);
+                continue;
             }
 
-            close(file);
-            free(expanded_path);
-            // Handle "store" command to receive and save a file
-            if (total_sent == file_size)
+            // A request (or a close) arrived on an idle connection: hand it to the pool,
+            // stopping to wait while the queue is full
+            pthread_mutex_lock(&queue.lock);
+            if (queue.count == queue.capacity)
             {
-                printf("File sent successfully: %s\n", filepath);
+                printf("All %d workers busy and %d requests queued, waiting\n", queue.workers, queue.count);
             }
-            else
+            while (queue.count == queue.capacity)
             {
-                printf("Error: Incomplete file transfer for %s. Sent %zu/%zu bytes\n", filepath, total_sent, file_size);
+                pthread_cond_wait(&queue.not_full, &queue.lock);
             }
+            queue.fds[(queue.head + queue.count) % queue.capacity] = events[i].data.fd;
+            queue.since[(queue.head + queue.count) % queue.capacity] = metrics_now_us();
+            queue.count++;
+            printf("Request from Smain queued (active %d/%d, queued %d, buffers %zu KB)\n", queue.active, queue.workers,
+                   queue.count, buffer_pool_bytes(&io_buffers) / 1024);
+            pthread_cond_signal(&queue.not_empty);
+            pthread_mutex_unlock(&queue.lock);
+        }
+    }
+    close(server_socket);
+    return 0;
+}
+
+// Serve queued requests one at a time; the pool size bounds concurrency
+void *worker_thread(void *arg)
+{
+    (void)arg;
+    if (use_uring)
+    {
+        fs_uring_start(); // Stays NULL where io_uring is unavailable: transfers block instead
+    }
+    while (1)
+    {
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == 0)
+        {
+            pthread_cond_wait(&queue.not_empty, &queue.lock);
         }
-        else if (strcmp(cmd, "store") == 0)
+        int client_socket = queue.fds[queue.head];
+        long long queued = queue.since[queue.head];
+        queue.head = (queue.head + 1) % queue.capacity;
+        queue.count--;
+        queue.active++;
+        pthread_cond_signal(&queue.not_full);
+        pthread_mutex_unlock(&queue.lock);
+
+        // Keep the connection for Smain's next request, or drop it once it closed
+        if (handle_request(client_socket, queued) < 0 || watch_connection(client_socket, EPOLL_CTL_MOD) < 0)
         {
-            // Send acknowledgment
-            if (send(client_socket, "ACK", 3, 0) != 3)
-            {
-                perror("Error sending ACK");
-                close(client_socket);
-                continue;
-            }
+            close(client_socket);
+            __atomic_fetch_sub(&metrics->open_connections, 1, __ATOMIC_RELAXED);
+        }
 
-            // Extract filename and directory path
-            char *filename = strtok(filepath, " ");
-            char *dirpath = strtok(NULL, "");
+        pthread_mutex_lock(&queue.lock);
+        queue.active--;
+        pthread_mutex_unlock(&queue.lock);
+    }
+    return NULL;
+}
 
-            if (filename == NULL || dirpath == NULL)
-            {
-                send(client_socket, "Error: Invalid filepath", 24, 0);
-                close(client_socket);
-                continue;
-            }
+// Wait for the next request on a connection; EPOLLONESHOT hands it to exactly one worker
+int watch_connection(int client_socket, int op)
+{
+    struct epoll_event event = {.events = EPOLLIN | EPOLLONESHOT, .data.fd = client_socket};
+    if (epoll_ctl(epoll_fd, op, client_socket, &event) < 0)
+    {
+        perror("Error watching connection");
+        return -1;
+    }
+    return 0;
+}
 
-            // Replace ~/smain with ~/stext in the path
-            char *stext_path = replace_smain_with_stext(dirpath);
-            if (stext_path == NULL)
-            {
-                send(client_socket, "Error: Unable to process path", 29, 0);
-                close(client_socket);
-                continue;
-            }
+// Serve one framed request from Smain, queued at the given monotonic time. Returns -1 once the connection is closed or unusable
+int handle_request(int client_socket, long long queued)
+{
+    char *payload = buffer_get(&io_buffers); // Request arguments
+    if (payload == NULL)
+    {
+        perror("Error allocating request buffer");
+        return -1;
+    }
 
-            // Expand path
-            char *expanded_path = expand_path(stext_path);
-            free(stext_path);
-            if (expanded_path == NULL)
-            {
-                send(client_socket, "Error: Unable to expand path", 28, 0);
-                close(client_socket);
-                continue;
-            }
+    struct fs_io_counters io = fs_io;
+    struct fs_frame frame;
+    int rc = fs_recv_frame(client_socket, &frame, payload, FS_MAX_PAYLOAD);
+    long long started = metrics_now_us();
+    long long wait = started - queued; // Includes receiving the request frame
+    if (rc != 1)
+    {
+        if (rc < 0)
+        {
+            perror("Error receiving command");
+        }
+        buffer_put(&io_buffers, payload);
+        return -1;
+    }
 
-            //  printf("Expanded path: %s\n", expanded_path);
+    char *args[FS_MAX_ARGS];
+    int argc = fs_unpack_args(payload, frame.length, args, FS_MAX_ARGS);
+    int result = 0;
+    // As a replica: a write's number and the one the primary sent before it, or the write a read needs
+    uint64_t sequence = 0, previous = 0;
+    int missing = 0; // A replicated delete of a file this replica never got
+    if ((frame.flags & FS_FLAG_SEQUENCE) && (frame.opcode == FS_OP_STORE || frame.opcode == FS_OP_REMOVE) && argc >= 3)
+    {
+        previous = strtoull(args[--argc], NULL, 10);
+        sequence = strtoull(args[--argc], NULL, 10);
+    }
+    else if ((frame.flags & FS_FLAG_SEQUENCE) && frame.opcode == FS_OP_GET && argc >= 2)
+    {
+        sequence = strtoull(args[--argc], NULL, 10);
+    }
 
-            // Create directory if it doesn't exist
-            if (create_directory(expanded_path) != 0)
-            {
-                send(client_socket, "Error: Unable to create directory", 33, 0);
-                free(expanded_path);
-                close(client_socket);
-                continue;
-            }
+    if (frame.opcode == FS_OP_TAR)
+    {
+        result = handle_create_tar(client_socket, frame.request_id, (frame.flags & FS_FLAG_COMPRESSED) != 0);
+    }
+    else if (frame.opcode == FS_OP_INDEX)
+    {
+        result = handle_index(client_socket, frame.request_id);
+    }
+    else if (frame.opcode == FS_OP_LIST && argc >= 1)
+    {
+        result = handle_list(client_socket, frame.request_id, args[0]);
+    }
+    else if (frame.opcode == FS_OP_REMOVE && argc >= 1)
+    {
+        char response[MAX_MESSAGE];
+        int error = handle_rmfile(args[0], response);
+        printf("Response from handle_rmfile: %s\n", response);
+        missing = sequence != 0 && error == ENOENT;
+        if (error == 0)
+            result = reply_written(client_socket, frame.request_id, FS_OP_REMOVE, args[0], NULL, NULL, response);
+        else
+            result = fs_send_reply(client_socket, frame.request_id, 1, response);
+    }
+    else if (frame.opcode == FS_OP_GET && sequence != 0 && !replica_has(&replicas, sequence))
+    {
+        // Smain reads from the primary instead
+        result = fs_send_reply(client_socket, frame.request_id, 1, "Error: Replica has not applied the latest write");
+    }
+    else if (frame.opcode == FS_OP_GET && argc >= 1)
+    {
+        // Handle get command (for dfile)
+        result = handle_get(client_socket, frame.request_id, (frame.flags & FS_FLAG_COMPRESSED) != 0, args[0],
+                            argc >= 2 ? args[1] : NULL, argc >= 3 ? args[2] : NULL);
+    }
+    else if (frame.opcode == FS_OP_STORE)
+    {
+        // Handle store command to receive and save a file
+        result = handle_store(client_socket, frame.request_id, argc >= 1 ? args[0] : NULL, argc >= 2 ? args[1] : NULL,
+                              argc >= 3 ? args[2] : NULL, argc >= 4 ? args[3] : NULL);
+    }
+    else
+    {
+        result = fs_send_reply(client_socket, frame.request_id, 1, "Invalid command");
+    }
 
-            // Construct filepath
-            char store_filepath[MAX_BUFFER];
-            snprintf(store_filepath, sizeof(store_filepath), "%s/%s", expanded_path, filename);
+    // Failed if an error REPLY went out or the connection broke
+    long long duration = metrics_now_us() - started;
+    int failed = result < 0 || fs_io.error_replies != io.error_replies;
+    if (sequence != 0 && frame.opcode != FS_OP_GET && result == 0)
+    {
+        replica_applied(&replicas, sequence, previous, !failed || missing); // A broken connection has it sent again
+    }
+    buffer_put(&io_buffers, payload);
+    metrics_request(metrics, frame.opcode, duration, failed);
+    metrics_add(&metrics->bytes_in, fs_io.received - io.received);
+    metrics_add(&metrics->bytes_out, fs_io.sent - io.sent);
+    // The span of the request under the trace id Smain gave it
+    char details[128];
+    snprintf(details, sizeof(details), " queue_us=%lld bytes_in=%llu bytes_out=%llu", wait,
+             (unsigned long long)(fs_io.received - io.received), (unsigned long long)(fs_io.sent - io.sent));
+    metrics_span(server_name, frame.request_id, fs_opcode_name(frame.opcode), duration,
+                 result < 0 ? "aborted" : failed ? "error" : "ok", details);
+    return result < 0 ? -1 : 0;
+}
 
-            //  printf("Storing file: %s\n", store_filepath);
+// Answer a store or delete that succeeded. With replicas it is numbered
+// and queued for them first, and the number goes with the reply for Smain
+// to pass to a replica it reads the file from
+int reply_written(int client_socket, uint32_t request_id, uint8_t opcode, const char *path, const char *name,
+                  const char *local, const char *message)
+{
+    if (replicas.count == 0)
+    {
+        return fs_send_reply(client_socket, request_id, 0, message);
+    }
+    uint64_t sequence = replica_push(&replicas, opcode, request_id, path, name, local);
+    return fs_send_reply_sequence(client_socket, request_id, message, sequence);
+}
 
-            // Open file for writing
-            int file = open(store_filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-            if (file < 0)
-            {
-                perror("Error creating file");
-                send(client_socket, "Error creating file", 19, 0);
-                free(expanded_path);
-                close(client_socket);
-                continue;
-            }
+// Send a stored file, or the range of it given by offset and length, as SIZE, DATA frames and a REPLY.
+// The DATA frames are compressed if Smain passed on that the client decodes them.
+int handle_get(int client_socket, uint32_t request_id, int compress, char *filepath, char *offset_str,
+               char *length_str)
+{
+    long long offset, length;
+    if (fs_parse_range(offset_str, length_str, &offset, &length) < 0)
+    {
+        return fs_send_reply(client_socket, request_id, 1, "Error: Invalid range");
+    }
+    char *expanded_path = expand_path(filepath);
+    if (expanded_path == NULL)
+    {
+        return fs_send_reply(client_socket, request_id, 1, "Error: Unable to expand path");
+    }
 
-            // Receive and write file content
-            char buffer[MAX_BUFFER];
-            ssize_t bytes_read;
-            while ((bytes_read = recv(client_socket, buffer, MAX_BUFFER, 0)) > 0)
-            {
-                if (write(file, buffer, bytes_read) != bytes_read)
-                {
-                    perror("Error writing to file");
-                    send(client_socket, "Error writing to file", 21, 0);
-                    close(file);
-                    free(expanded_path);
-                    close(client_socket);
-                    continue;
-                }
-            }
+    // Get file size
+    struct stat file_stat;
+    if (stat(expanded_path, &file_stat) < 0)
+    {
+        char error_msg[MAX_MESSAGE];
+        snprintf(error_msg, sizeof(error_msg), "Error: Unable to get file stats: %s", strerror(errno));
+        printf("%s\n", error_msg);
+        free(expanded_path);
+        return fs_send_reply(client_socket, request_id, 1, error_msg);
+    }
+
+    // Open before announcing the size so an open failure is still a clean error reply.
+    // A chunked file's chunks stay pinned until it has been sent
+    struct chunk_reader reader;
+    int chunked = chunk_reader_open(&store, expanded_path, &reader);
+    free(expanded_path);
+    if (chunked < 0)
+    {
+        char error_msg[MAX_MESSAGE];
+        snprintf(error_msg, sizeof(error_msg), "Error: Unable to open file: %s", strerror(errno));
+        printf("%s\n", error_msg);
+        return fs_send_reply(client_socket, request_id, 1, error_msg);
+    }
+
+    long long total_size = chunked ? reader.m.size : (long long)file_stat.st_size;
+    if (offset > total_size)
+    {
+        chunk_reader_close(&reader);
+        return fs_send_reply(client_socket, request_id, 1, "Error: Offset beyond end of file");
+    }
+    if (length < 0 || length > total_size - offset)
+    {
+        length = total_size - offset;
+    }
+    size_t file_size = (size_t)length;
+    int ranged = offset_str != NULL;
+    if ((ranged ? fs_send_range_size(client_socket, request_id, file_size, total_size)
+                : fs_send_size(client_socket, request_id, file_size)) < 0)
+    {
+        perror("Error sending file size");
+        chunk_reader_close(&reader);
+        return -1;
+    }
 
-            close(file);
-            send(client_socket, "File stored successfully", 24, 0);
-            printf("File stored successfully: %s\n", store_filepath);
+    // Text compresses well, but costs a copy through user space: buffers for a frame before and after
+    struct compressor compressor;
+    char *raw = compress ? buffer_get(&io_buffers) : NULL;
+    char *packed = raw != NULL ? buffer_get(&io_buffers) : NULL;
+    compress_init(&compressor, packed != NULL, filepath, (unsigned char *)packed);
 
-            free(expanded_path);
+    // A whole plain file is sent with its stored checksum, so it can still go
+    // out with sendfile(); a range or chunks are checksummed on the way
+    uint32_t crc = 0;
+    uint32_t *sum = !chunked && !ranged && crc32c_load(reader.fd, &crc) == 0 ? NULL : &crc;
 
-            close(client_socket);
-            printf("\n");
+    // Send file contents from offset, a chunk at a time for a chunked file
+    long long total_sent = 0;
+    if (!chunked && lseek(reader.fd, offset, SEEK_SET) >= 0)
+    {
+        total_sent = compress_send_file_data(client_socket, reader.fd, request_id, file_size, &compressor, raw, sum);
+    }
+    uint32_t skip = chunked ? chunk_reader_seek(&reader, offset) : 0;
+    uint32_t chunk_length;
+    int chunk;
+    while (chunked && total_sent >= 0 && (size_t)total_sent < file_size &&
+           (chunk = chunk_reader_next(&reader, &chunk_length)) >= 0)
+    {
+        // Only the first chunk starts part way in, and only the last is cut short
+        long long want = chunk_length - skip;
+        if (want > (long long)file_size - total_sent)
+            want = (long long)file_size - total_sent;
+        long long sent = lseek(chunk, skip, SEEK_SET) < 0
+                             ? 0
+                             : compress_send_file_data(client_socket, chunk, request_id, want, &compressor, raw, sum);
+        skip = 0;
+        total_sent = sent < 0 ? -1 : total_sent + sent;
+        if (sent >= 0 && sent < want)
+            break; // A damaged chunk; the size check below reports it
+    }
+    chunk_reader_close(&reader);
+    buffer_put(&io_buffers, raw);
+    buffer_put(&io_buffers, packed);
+    if (total_sent >= 0 && fs_send_eof(client_socket, request_id, &crc) < 0)
+    {
+        total_sent = -1;
+    }
+    if (total_sent < 0)
+    {
+        perror("Error sending file data");
+        return -1;
+    }
+
+    if ((size_t)total_sent == file_size)
+    {
+        printf("File sent successfully: %s\n", filepath);
+        if (compressor.wire_bytes < compressor.raw_bytes)
+        {
+            printf("Compressed %lld bytes to %lld\n", compressor.raw_bytes, compressor.wire_bytes);
         }
+        return fs_send_reply(client_socket, request_id, 0, "File sent successfully");
     }
-    close(server_socket);
-    return 0;
+    printf("Error: Incomplete file transfer for %s. Sent %lld/%zu bytes\n", filepath, total_sent, file_size);
+    return fs_send_reply(client_socket, request_id, 1, "Error: Incomplete file transfer");
+}
+
+// Receive a file as a DATA stream, or as chunks when mode is "chunks", and save it under ~/stext
+int handle_store(int client_socket, uint32_t request_id, char *filename, char *dirpath, char *size_str, char *mode)
+{
+    int chunked = mode != NULL && strcmp(mode, "chunks") == 0;
+    if (chunked && (filename == NULL || dirpath == NULL || size_str == NULL))
+    {
+        // Refused once the chunk list has been read
+        return handle_store_chunks(client_socket, request_id, NULL, NULL, NULL, -1, "Error: Invalid filepath");
+    }
+    if (filename == NULL || dirpath == NULL)
+    {
+        // The payload still follows the request, consume it to stay in sync
+        if (fs_recv_stream(client_socket, -1, NULL, 0, NULL) == -1)
+            return -1;
+        return fs_send_reply(client_socket, request_id, 1, "Error: Invalid filepath");
+    }
+
+    // Replace ~/smain with ~/stext in the path
+    char *stext_path = replace_smain_with_stext(dirpath);
+    char *expanded_path = stext_path != NULL ? expand_path(stext_path) : NULL;
+    free(stext_path);
+
+    //  printf("Expanded path: %s\n", expanded_path);
+
+    // Create directory if it doesn't exist
+    const char *error_msg = NULL;
+    if (expanded_path == NULL)
+    {
+        error_msg = "Error: Unable to expand path";
+    }
+    else if (create_directory(expanded_path) != 0)
+    {
+        error_msg = "Error: Unable to create directory";
+    }
+
+    // Construct filepath and open file for writing
+    char store_filepath[PATH_MAX];
+    int file = -1;
+    if (error_msg == NULL)
+    {
+        snprintf(store_filepath, sizeof(store_filepath), "%s/%s", expanded_path, filename);
+    }
+    if (chunked)
+    {
+        free(expanded_path);
+        return handle_store_chunks(client_socket, request_id, filename, dirpath, store_filepath,
+                                   strtoll(size_str, NULL, 10), error_msg);
+    }
+    if (error_msg == NULL)
+    {
+        //  printf("Storing file: %s\n", store_filepath);
+        chunk_file_remove(&store, store_filepath); // A chunked copy gives up its chunks
+        file = open(store_filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+        {
+            perror("Error creating file");
+            error_msg = "Error creating file";
+        }
+    }
+    free(expanded_path);
+
+    // Receive and write file content (discarded if the file could not be opened)
+    uint32_t crc;
+    long long received = fs_recv_stream(client_socket, file, NULL, 0, &crc);
+    if (file >= 0)
+    {
+        if (received >= 0)
+            crc32c_store(file, crc); // Sent with whole-file downloads
+        close(file);
+    }
+    if (received == -1 || received == -2)
+    {
+        // Socket failure or the sender gave up mid-transfer: drop the partial file
+        if (file >= 0)
+            remove(store_filepath);
+        return received == -1 ? -1 : 0;
+    }
+    if (error_msg == NULL && received == -3)
+    {
+        perror("Error writing to file");
+        remove(store_filepath);
+        error_msg = "Error writing to file";
+    }
+    else if (error_msg == NULL && received == -4)
+    {
+        printf("Error: Checksum mismatch for %s, the upload was damaged on its way\n", store_filepath);
+        remove(store_filepath);
+        error_msg = "Error: Checksum mismatch";
+    }
+    else if (error_msg == NULL && size_str != NULL && received != strtoll(size_str, NULL, 10))
+    {
+        printf("Error: Incomplete file transfer for %s. Received %lld/%s bytes\n", store_filepath, received, size_str);
+        remove(store_filepath);
+        error_msg = "Error: Incomplete file transfer";
+    }
+    if (error_msg != NULL)
+    {
+        return fs_send_reply(client_socket, request_id, 1, error_msg);
+    }
+
+    printf("File stored successfully: %s\n", store_filepath);
+    printf("\n");
+    return reply_written(client_socket, request_id, FS_OP_STORE, dirpath, filename, store_filepath,
+                         "File stored successfully");
+}
+
+// Receive a chunked upload: the chunk list, a NEED bitmap back, then the
+// chunks this store lacks
+int handle_store_chunks(int client_socket, uint32_t request_id, const char *filename, const char *dirpath,
+                        const char *store_filepath, long long size, const char *error_msg)
+{
+    char *buffer = buffer_get(&io_buffers);
+    if (buffer == NULL)
+    {
+        perror("Error allocating transfer buffer");
+        return -1;
+    }
+    const char *error;
+    struct chunk_upload upload;
+    int result = chunk_receive(&store, client_socket, request_id, error_msg == NULL ? store_filepath : NULL, size,
+                               buffer, &error, &upload);
+    buffer_put(&io_buffers, buffer);
+    if (result < 0)
+    {
+        // Socket failure, or Smain gave up on the upload
+        return result == -1 ? -1 : 0;
+    }
+    if (result > 0)
+    {
+        printf("%s\n", error_msg != NULL ? error_msg : error);
+        return fs_send_reply(client_socket, request_id, 1, error_msg != NULL ? error_msg : error);
+    }
+    printf("File stored successfully: %s (%zu chunks, %zu sent, %lld bytes as %lld on the wire)\n", store_filepath,
+           upload.chunks, upload.sent, upload.bytes, upload.wire_bytes);
+    printf("\n");
+    return reply_written(client_socket, request_id, FS_OP_STORE, dirpath, filename, store_filepath,
+                         "File stored successfully");
 }
 
 int create_directory(const char *path)
@@ -377,15 +797,16 @@ char *replace_smain_with_stext(const char *path)
     return new_path;
 }
 
-void handle_rmfile(char *filepath, char *response)
+// Returns 0, or the errno of a failed delete (-1 if the path is invalid)
+int handle_rmfile(char *filepath, char *response)
 {
 
     char *expanded_path = expand_path(filepath);
     if (expanded_path == NULL)
     {
-        snprintf(response, MAX_BUFFER, "Error: Unable to expand file path");
+        snprintf(response, MAX_MESSAGE, "Error: Unable to expand file path");
         printf("%s\n", response);
-        return;
+        return -1;
     }
     //   printf("Expanded path: %s\n", expanded_path);
 
@@ -394,38 +815,47 @@ void handle_rmfile(char *filepath, char *response)
     free(expanded_path);
     if (stext_path == NULL)
     {
-        snprintf(response, MAX_BUFFER, "Error: Unable to process path");
+        snprintf(response, MAX_MESSAGE, "Error: Unable to process path");
         printf("%s\n", response);
-        return;
+        return -1;
     }
     //    printf("Stext path: %s\n", stext_path);
 
-    if (remove(stext_path) == 0)
+    int error = chunk_file_remove(&store, stext_path) == 0 ? 0 : errno;
+    if (error == 0)
     {
-        snprintf(response, MAX_BUFFER, "File deleted successfully: %s\n", filepath);
+        snprintf(response, MAX_MESSAGE, "File deleted successfully: %s\n", filepath);
     }
     else
     {
-        snprintf(response, MAX_BUFFER, "Error deleting file: %s (%s)", filepath, strerror(errno));
+        snprintf(response, MAX_MESSAGE, "Error deleting file: %s (%s)", filepath, strerror(error));
     }
     printf("%s\n", response);
 
     free(stext_path);
+    return error;
 }
 
-void handle_list(int client_socket, char *command)
+int handle_list(int client_socket, uint32_t request_id, char *command)
 {
 
     char *expanded_path = expand_path(command);
     if (expanded_path == NULL)
     {
-        send(client_socket, "Error: Invalid path", 20, 0);
         printf("Error: Invalid path\n");
-        return;
+        return fs_send_reply(client_socket, request_id, 1, "Error: Invalid path");
     }
     //   printf("Expanded path: %s\n", expanded_path);
 
-    char files[MAX_BUFFER] = "";
+    // The listing grows on the heap as entries are found
+    size_t files_len = 0, files_cap = LISTING_CHUNK;
+    char *files = malloc(files_cap);
+    if (files == NULL)
+    {
+        free(expanded_path);
+        return fs_send_reply(client_socket, request_id, 1, "Error: Out of memory");
+    }
+    files[0] = '\0';
     DIR *dir = opendir(expanded_path);
     if (dir)
     {
@@ -434,8 +864,22 @@ void handle_list(int client_socket, char *command)
         {
             if (entry->d_type == DT_REG && strstr(entry->d_name, ".txt"))
             {
-                strcat(files, entry->d_name);
-                strcat(files, "\n");
+                size_t name_len = strlen(entry->d_name);
+                if (files_len + name_len + 2 > files_cap)
+                {
+                    size_t new_cap = files_cap + name_len + LISTING_CHUNK;
+                    char *grown = realloc(files, new_cap);
+                    if (grown == NULL)
+                    {
+                        break; // Send what fits
+                    }
+                    files = grown;
+                    files_cap = new_cap;
+                }
+                memcpy(files + files_len, entry->d_name, name_len);
+                files_len += name_len;
+                files[files_len++] = '\n';
+                files[files_len] = '\0';
             }
         }
         closedir(dir);
@@ -446,70 +890,115 @@ void handle_list(int client_socket, char *command)
     }
 
     printf("Files found:\n%s", files);
-    if (send(client_socket, files, strlen(files), 0) < 0)
+    free(expanded_path);
+    int sent = fs_send_buffer(client_socket, request_id, files, files_len);
+    free(files);
+    if (sent < 0)
     {
         perror("Error sending file list to smain");
+        return -1;
     }
-    else
-    {
-        printf("File list sent to smain successfully\n");
-    }
-    free(expanded_path);
+    printf("File list sent to smain successfully\n");
+    return fs_send_reply(client_socket, request_id, 0, "File list sent");
 }
 
-void handle_create_tar(int client_socket)
+int handle_create_tar(int client_socket, uint32_t request_id, int compress)
 {
-    char command[MAX_BUFFER];
-    snprintf(command, sizeof(command), "tar -cvf text.tar -C ~/stext $(find ~/stext -name '*.txt')");
-    //  printf("Generated command for .txt files: %s\n", command);
-    system(command);
-
-    FILE *tar_file = fopen("text.tar", "rb");
-    if (tar_file == NULL)
+    // Archive every .txt file under ~/stext, streamed straight from the store
+    char *store_root = expand_path("~/stext");
+    struct tar_writer tar;
+    int opened = store_root != NULL ? tar_open_source(&tar, store_root, ".txt", &store_source) : -1;
+    free(store_root);
+    if (opened < 0)
     {
-        perror("Error opening tar file");
-        send(client_socket, "Error: Unable to open tar file", 30, 0);
-        return;
+        perror("Error reading the store for the tar file");
+        return fs_send_reply(client_socket, request_id, 1, "Error: Unable to create tar file");
     }
+    long long file_size = tar.total;
+    printf("Streaming tar of %zu files (%lld bytes)\n", tar.count, file_size);
 
-    fseek(tar_file, 0, SEEK_END);
-    long file_size = ftell(tar_file);
-    fseek(tar_file, 0, SEEK_SET);
+    if (fs_send_size(client_socket, request_id, file_size) < 0)
+    {
+        perror("Error sending tar file to client");
+        tar_close(&tar);
+        return -1;
+    }
 
-    // printf("Tar file size: %ld bytes\n", file_size);
+    char *buffer = buffer_get(&io_buffers);
+    struct compressor compressor;
+    char *packed = compress ? buffer_get(&io_buffers) : NULL;
+    compress_init(&compressor, compress, ".tar", (unsigned char *)packed);
+    long long total_bytes_sent = buffer != NULL ? 0 : -1;
+    ssize_t produced;
+    while (total_bytes_sent >= 0 && (produced = tar_read(&tar, buffer, FS_MAX_PAYLOAD)) > 0)
+    {
+        if (compress_send(client_socket, &compressor, request_id, 0, buffer, (uint32_t)produced) < 0)
+            total_bytes_sent = -1;
+        else
+            total_bytes_sent += produced;
+    }
+    buffer_put(&io_buffers, buffer);
+    buffer_put(&io_buffers, packed);
+    tar_close(&tar);
+    if (total_bytes_sent < 0 || fs_send_frame(client_socket, FS_OP_DATA, FS_FLAG_EOF, request_id, NULL, 0) < 0)
+    {
+        perror("Error sending tar file to client");
+        return -1;
+    }
+    if (total_bytes_sent == file_size)
+    {
+        printf("Tar file sent to client successfully\n");
+        return fs_send_reply(client_socket, request_id, 0, "Tar file sent successfully");
+    }
+    printf("Error: Incomplete file transfer. Sent %lld/%lld bytes\n", total_bytes_sent, file_size);
+    return fs_send_reply(client_socket, request_id, 1, "Error: Incomplete file transfer");
+}
 
-    char buffer[MAX_BUFFER];
-    size_t bytes_read;
-    long total_bytes_sent = 0;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), tar_file)) > 0)
+// Describe every stored file so Smain can rebuild its catalog: DATA frames
+// packed with (path, size, mtime) records, paths relative to ~/stext
+int handle_index(int client_socket, uint32_t request_id)
+{
+    char *store_root = expand_path("~/stext");
+    struct tar_writer tar;
+    int opened = store_root != NULL ? tar_open_source(&tar, store_root, ".txt", &store_source) : -1;
+    free(store_root);
+    if (opened < 0)
     {
-        ssize_t bytes_sent = send(client_socket, buffer, bytes_read, 0);
-        if (bytes_sent < 0)
-        {
-            perror("Error sending tar file to client");
-            fclose(tar_file);
-            remove("text.tar");
-            return;
-        }
-        total_bytes_sent += bytes_sent;
-        //  printf("Sent %zd bytes to client, total: %ld/%ld\n", bytes_sent, total_bytes_sent, file_size);
+        perror("Error reading the store for the index");
+        return fs_send_reply(client_socket, request_id, 1, "Error: Unable to index the store");
+    }
 
-        if (bytes_sent != bytes_read)
+    char *buffer = buffer_get(&io_buffers);
+    int result = buffer != NULL ? 0 : -1;
+    size_t used = 0;
+    for (size_t i = 0; result == 0 && i < tar.count; i++)
+    {
+        char size_str[24], mtime_str[24];
+        snprintf(size_str, sizeof(size_str), "%lld", tar.entries[i].size);
+        snprintf(mtime_str, sizeof(mtime_str), "%lld", (long long)tar.entries[i].mtime);
+        const char *record[] = {tar.entries[i].name, size_str, mtime_str};
+        int length = fs_pack_args(buffer + used, FS_MAX_PAYLOAD - used, 3, record);
+        if (length < 0)
         {
-            printf("Warning: Only %zd of %zd bytes sent. Retrying...\n", bytes_sent, bytes_read);
-            fseek(tar_file, total_bytes_sent, SEEK_SET); // Retry from last position
+            // Records never straddle frames: send the full one and retry
+            result = fs_send_frame(client_socket, FS_OP_DATA, 0, request_id, buffer, (uint32_t)used);
+            used = 0;
+            length = fs_pack_args(buffer, FS_MAX_PAYLOAD, 3, record);
         }
+        used += length > 0 ? length : 0;
     }
-
-    fclose(tar_file);
-    remove("text.tar"); // Remove the temporary tar file
-
-    if (total_bytes_sent == file_size)
+    if (result == 0 && used > 0)
     {
-        printf("Tar file sent to client successfully: text.tar\n");
+        result = fs_send_frame(client_socket, FS_OP_DATA, 0, request_id, buffer, (uint32_t)used);
     }
-    else
+    buffer_put(&io_buffers, buffer);
+    size_t count = tar.count;
+    tar_close(&tar);
+    if (result < 0 || fs_send_frame(client_socket, FS_OP_DATA, FS_FLAG_EOF, request_id, NULL, 0) < 0)
     {
-        printf("Error: Incomplete file transfer. Sent %ld/%ld bytes\n", total_bytes_sent, file_size);
+        perror("Error sending the index to smain");
+        return -1;
     }
+    printf("Index of %zu files sent to smain\n", count);
+    return fs_send_reply(client_socket, request_id, 0, "Index sent");
 }
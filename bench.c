@@ -0,0 +1,527 @@
+// Load generator for a local Smain/Spdf/Stext deployment: many concurrent
+// sessions issue a weighted mix of commands against Smain, and the latency
+// of each command is reported as percentiles per command type
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include "protocol.h"
+
+#define SMAIN_PORT 4530      // Port number for server connection
+#define MAX_MESSAGE FS_MAX_MESSAGE
+#define MAX_WEIGHTS 16       // Entries in a -m, -s or -e list
+#define PRELOAD_FILES 8      // Files each session uploads before the timed run
+
+// Commands the benchmark issues
+enum bench_op
+{
+    OP_UFILE,
+    OP_DFILE,
+    OP_RMFILE,
+    OP_DISPLAY,
+    OP_DTAR,
+    OP_COUNT,
+};
+
+static const char *op_names[OP_COUNT] = {"ufile", "dfile", "rmfile", "display", "dtar"};
+
+// A weighted choice: "name:weight,name:weight,..."
+struct weights
+{
+    int count;
+    char names[MAX_WEIGHTS][16];
+    long long values[MAX_WEIGHTS]; // Parsed value of each name where it is a size
+    int weight[MAX_WEIGHTS];
+    int total;
+};
+
+// Latencies of one command type
+struct op_stats
+{
+    double *latencies; // Milliseconds
+    size_t count, capacity;
+    size_t errors;
+    long long bytes;   // File bytes moved
+};
+
+// A file a session has stored
+struct bench_file
+{
+    char name[32];
+    long long size;
+};
+
+// One benchmark session: a connection to Smain and the files it stored
+struct bench_session
+{
+    int id;
+    int socket;
+    unsigned int seed;
+    uint32_t next_request_id;
+    unsigned sequence;           // Numbers the files it uploads
+    struct bench_file *files;
+    size_t file_count, file_capacity;
+    struct op_stats stats[OP_COUNT];
+    char *buffer;                // Receives one frame
+    int failed;                  // Smain could not be reached
+};
+
+// Function prototypes
+int parse_weights(struct weights *w, const char *spec, int sizes);
+int pick(const struct weights *w, unsigned int *seed);
+void *run_session(void *arg);
+int bench_connect(struct bench_session *b);
+int run_op(struct bench_session *b, enum bench_op op, long long *bytes);
+int bench_ufile(struct bench_session *b, long long *bytes);
+int bench_request(struct bench_session *b, uint8_t opcode, const char *arg, long long *bytes);
+int wait_reply(struct bench_session *b, long long *bytes);
+void record(struct op_stats *stats, double ms, int failed, long long bytes);
+int compare_doubles(const void *a, const void *b);
+double percentile(const struct op_stats *stats, double p);
+double now_ms(void);
+
+// The run's settings, fixed before the sessions start
+struct weights op_mix, size_mix, type_mix;
+long long total_ops = 2000; // Commands over all sessions, unless a duration is set
+double duration_ms = 0;     // Run this long instead of a number of commands
+int keep_files = 0;         // Leave the files behind instead of removing them
+char *text_data, *binary_data; // Upload contents, as large as the largest size
+double start_ms;
+
+pthread_mutex_t ops_lock = PTHREAD_MUTEX_INITIALIZER;
+long long ops_started = 0;
+
+int main(int argc, char *argv[])
+{
+    signal(SIGPIPE, SIG_IGN);
+    int sessions = 16;
+    unsigned int seed = (unsigned int)time(NULL);
+    const char *mix = "ufile:30,dfile:50,rmfile:5,display:13,dtar:2";
+    const char *sizes = "4k:60,64k:30,1m:9,8m:1";
+    const char *types = "c:40,txt:40,pdf:20";
+    int opt;
+    while ((opt = getopt(argc, argv, "c:n:d:m:s:e:r:k")) != -1)
+    {
+        switch (opt)
+        {
+        case 'c':
+            sessions = atoi(optarg);
+            break;
+        case 'n':
+            total_ops = atoll(optarg);
+            break;
+        case 'd':
+            duration_ms = atof(optarg) * 1000;
+            break;
+        case 'm':
+            mix = optarg;
+            break;
+        case 's':
+            sizes = optarg;
+            break;
+        case 'e':
+            types = optarg;
+            break;
+        case 'r':
+            seed = (unsigned int)strtoul(optarg, NULL, 10);
+            break;
+        case 'k':
+            keep_files = 1;
+            break;
+        default:
+            fprintf(stderr,
+                    "Usage: %s [-c sessions] [-n commands | -d seconds] [-m command:weight,...] "
+                    "[-s size:weight,...] [-e extension:weight,...] [-r seed] [-k]\n",
+                    argv[0]);
+            exit(1);
+        }
+    }
+    if (sessions <= 0 || parse_weights(&op_mix, mix, 0) < 0 || parse_weights(&size_mix, sizes, 1) < 0 ||
+        parse_weights(&type_mix, types, 0) < 0)
+    {
+        fprintf(stderr, "Invalid -c, -m, -s or -e\n");
+        exit(1);
+    }
+    for (int i = 0; i < op_mix.count; i++)
+    {
+        int known = 0;
+        for (int op = 0; op < OP_COUNT; op++)
+            known |= strcmp(op_mix.names[i], op_names[op]) == 0;
+        if (!known)
+        {
+            fprintf(stderr, "Unknown command in -m: %s\n", op_mix.names[i]);
+            exit(1);
+        }
+    }
+
+    // Text compresses like source code; binary data stands in for PDFs
+    long long largest = 0;
+    for (int i = 0; i < size_mix.count; i++)
+        largest = size_mix.values[i] > largest ? size_mix.values[i] : largest;
+    text_data = malloc(largest + 1);
+    binary_data = malloc(largest + 1);
+    if (text_data == NULL || binary_data == NULL)
+    {
+        perror("Error allocating file contents");
+        exit(1);
+    }
+    static const char *words[] = {"int ", "return ", "buffer", "size", "(", ");\n", "{\n", "}\n", "    ", "file", " = ", "0"};
+    unsigned int fill_seed = seed;
+    for (long long i = 0; i < largest;)
+    {
+        const char *word = words[rand_r(&fill_seed) % (sizeof(words) / sizeof(words[0]))];
+        for (; *word != '\0' && i < largest; word++)
+            text_data[i++] = *word;
+    }
+    for (long long i = 0; i < largest; i++)
+        binary_data[i] = (char)rand_r(&fill_seed);
+
+    struct bench_session *all = calloc(sessions, sizeof(*all));
+    pthread_t *threads = calloc(sessions, sizeof(*threads));
+    if (all == NULL || threads == NULL)
+    {
+        perror("Error allocating sessions");
+        exit(1);
+    }
+    printf("Running %d sessions, %s: %s\n", sessions,
+           duration_ms > 0 ? "timed" : "fixed count", mix);
+    start_ms = now_ms();
+    for (int i = 0; i < sessions; i++)
+    {
+        all[i].id = i;
+        all[i].socket = -1;
+        all[i].seed = seed + (unsigned int)i * 7919;
+        all[i].next_request_id = 1;
+        if (pthread_create(&threads[i], NULL, run_session, &all[i]) != 0)
+        {
+            perror("Error creating session thread");
+            exit(1);
+        }
+    }
+    for (int i = 0; i < sessions; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    double elapsed = (now_ms() - start_ms) / 1000;
+
+    // Merge the sessions' latencies per command type
+    struct op_stats totals[OP_COUNT] = {0};
+    int unreachable = 0;
+    for (int i = 0; i < sessions; i++)
+    {
+        unreachable += all[i].failed;
+        for (int op = 0; op < OP_COUNT; op++)
+        {
+            struct op_stats *from = &all[i].stats[op];
+            for (size_t j = 0; j < from->count; j++)
+                record(&totals[op], from->latencies[j], 0, 0);
+            totals[op].errors += from->errors;
+            totals[op].bytes += from->bytes;
+            free(from->latencies);
+        }
+        free(all[i].files);
+    }
+    if (unreachable > 0)
+    {
+        printf("%d sessions could not reach Smain\n", unreachable);
+    }
+
+    printf("%-8s %8s %7s %9s %9s %9s %9s %9s %9s\n", "command", "count", "errors", "ops/s", "MB/s", "p50 ms",
+           "p99 ms", "p99.9 ms", "max ms");
+    size_t count = 0, errors = 0;
+    long long bytes = 0;
+    for (int op = 0; op < OP_COUNT; op++)
+    {
+        struct op_stats *stats = &totals[op];
+        if (stats->count == 0)
+            continue;
+        qsort(stats->latencies, stats->count, sizeof(double), compare_doubles);
+        printf("%-8s %8zu %7zu %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f\n", op_names[op], stats->count, stats->errors,
+               stats->count / elapsed, stats->bytes / 1e6 / elapsed, percentile(stats, 50), percentile(stats, 99),
+               percentile(stats, 99.9), stats->latencies[stats->count - 1]);
+        count += stats->count;
+        errors += stats->errors;
+        bytes += stats->bytes;
+        free(stats->latencies);
+    }
+    printf("%zu commands (%zu failed) in %.2f s: %.1f ops/s, %.2f MB/s\n", count, errors, elapsed, count / elapsed,
+           bytes / 1e6 / elapsed);
+    free(all);
+    free(threads);
+    free(text_data);
+    free(binary_data);
+    return errors > 0 || unreachable > 0;
+}
+
+// Parse "name:weight,..."; with sizes, each name is a size such as 4k or 1m.
+// Returns -1 if the list is malformed.
+int parse_weights(struct weights *w, const char *spec, int sizes)
+{
+    char copy[512];
+    snprintf(copy, sizeof(copy), "%s", spec);
+    memset(w, 0, sizeof(*w));
+    char *save = NULL;
+    for (char *item = strtok_r(copy, ",", &save); item != NULL; item = strtok_r(NULL, ",", &save))
+    {
+        char *colon = strchr(item, ':');
+        if (w->count == MAX_WEIGHTS || colon == NULL || colon - item >= (long)sizeof(w->names[0]) || atoi(colon + 1) <= 0)
+            return -1;
+        *colon = '\0';
+        snprintf(w->names[w->count], sizeof(w->names[0]), "%s", item);
+        if (sizes)
+        {
+            char *end;
+            long long value = strtoll(item, &end, 10);
+            value *= *end == 'k' || *end == 'K' ? 1024 : *end == 'm' || *end == 'M' ? 1024 * 1024 : 1;
+            if (value <= 0)
+                return -1;
+            w->values[w->count] = value;
+        }
+        w->weight[w->count] = atoi(colon + 1);
+        w->total += w->weight[w->count];
+        w->count++;
+    }
+    return w->count > 0 ? 0 : -1;
+}
+
+// Pick an entry by weight
+int pick(const struct weights *w, unsigned int *seed)
+{
+    int r = rand_r(seed) % w->total;
+    for (int i = 0; i < w->count; i++)
+    {
+        if (r < w->weight[i])
+            return i;
+        r -= w->weight[i];
+    }
+    return w->count - 1;
+}
+
+// Session thread: upload a few files to work with, issue commands until the
+// run is over, then remove what it stored
+void *run_session(void *arg)
+{
+    struct bench_session *b = arg;
+    b->buffer = malloc(FS_MAX_PAYLOAD + 1);
+    if (b->buffer == NULL || bench_connect(b) < 0)
+    {
+        b->failed = 1;
+        free(b->buffer);
+        return NULL;
+    }
+    long long bytes;
+    for (int i = 0; i < PRELOAD_FILES; i++)
+    {
+        bench_ufile(b, &bytes);
+    }
+
+    while (1)
+    {
+        pthread_mutex_lock(&ops_lock);
+        int more = duration_ms > 0 ? now_ms() - start_ms < duration_ms : ops_started < total_ops;
+        ops_started += more;
+        pthread_mutex_unlock(&ops_lock);
+        if (!more)
+            break;
+
+        enum bench_op op = OP_UFILE;
+        const char *name = op_mix.names[pick(&op_mix, &b->seed)];
+        for (int i = 0; i < OP_COUNT; i++)
+        {
+            if (strcmp(name, op_names[i]) == 0)
+                op = i;
+        }
+        if ((op == OP_DFILE || op == OP_RMFILE) && b->file_count == 0)
+        {
+            op = OP_UFILE; // Nothing stored to download or remove yet
+        }
+        bytes = 0;
+        double started = now_ms();
+        int result = run_op(b, op, &bytes);
+        record(&b->stats[op], now_ms() - started, result != 0, bytes);
+        if (result < 0 && bench_connect(b) < 0)
+        {
+            b->failed = 1;
+            break;
+        }
+    }
+
+    while (!keep_files && !b->failed && b->file_count > 0)
+    {
+        bytes = 0;
+        if (run_op(b, OP_RMFILE, &bytes) < 0)
+            break;
+    }
+    if (b->socket >= 0)
+        close(b->socket);
+    free(b->buffer);
+    return NULL;
+}
+
+// (Re)connect the session to Smain
+int bench_connect(struct bench_session *b)
+{
+    if (b->socket >= 0)
+        close(b->socket);
+    struct sockaddr_in server_addr = {0};
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SMAIN_PORT);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    b->socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (b->socket < 0 || connect(b->socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        fprintf(stderr, "Session %d: Error connecting to server: %s\n", b->id, strerror(errno));
+        if (b->socket >= 0)
+            close(b->socket);
+        b->socket = -1;
+        return -1;
+    }
+    fs_set_nodelay(b->socket);
+    return 0;
+}
+
+// Issue one command and wait for its response. Returns 0 on success, 1 if
+// Smain reported an error, -1 if the connection failed.
+int run_op(struct bench_session *b, enum bench_op op, long long *bytes)
+{
+    char path[64];
+    if (op == OP_UFILE)
+    {
+        return bench_ufile(b, bytes);
+    }
+    if (op == OP_DFILE || op == OP_RMFILE)
+    {
+        size_t i = rand_r(&b->seed) % b->file_count;
+        snprintf(path, sizeof(path), "~/smain/bench/s%d/%s", b->id, b->files[i].name);
+        if (op == OP_RMFILE)
+        {
+            b->files[i] = b->files[--b->file_count]; // Gone whatever the reply says
+            return bench_request(b, FS_OP_RMFILE, path, bytes);
+        }
+        return bench_request(b, FS_OP_DFILE, path, bytes);
+    }
+    if (op == OP_DISPLAY)
+    {
+        snprintf(path, sizeof(path), "~/smain/bench/s%d", b->id);
+        return bench_request(b, FS_OP_DISPLAY, path, bytes);
+    }
+    snprintf(path, sizeof(path), ".%s", type_mix.names[pick(&type_mix, &b->seed)]);
+    return bench_request(b, FS_OP_DTAR, path, bytes);
+}
+
+// Upload a new file of a size and type drawn from the mix
+int bench_ufile(struct bench_session *b, long long *bytes)
+{
+    const char *extension = type_mix.names[pick(&type_mix, &b->seed)];
+    long long size = size_mix.values[pick(&size_mix, &b->seed)];
+    const char *data = strcmp(extension, "pdf") == 0 ? binary_data : text_data;
+    struct bench_file file;
+    snprintf(file.name, sizeof(file.name), "f%u.%s", b->sequence++, extension);
+    file.size = size;
+
+    char path[64], size_str[32];
+    snprintf(path, sizeof(path), "~/smain/bench/s%d", b->id);
+    snprintf(size_str, sizeof(size_str), "%lld", size);
+    const char *request_args[] = {file.name, path, size_str};
+    if (fs_send_request(b->socket, FS_OP_UFILE, b->next_request_id++, 3, request_args) < 0)
+        return -1;
+    for (long long sent = 0; sent < size;)
+    {
+        uint32_t len = size - sent < FS_MAX_PAYLOAD ? (uint32_t)(size - sent) : FS_MAX_PAYLOAD;
+        if (fs_send_frame(b->socket, FS_OP_DATA, 0, 0, data + sent, len) < 0)
+            return -1;
+        sent += len;
+    }
+    uint32_t crc = crc32c(0, data, size); // As the client sends it
+    if (fs_send_eof(b->socket, 0, &crc) < 0)
+        return -1;
+    int result = wait_reply(b, bytes);
+    *bytes = size;
+    if (result == 0)
+    {
+        if (b->file_count == b->file_capacity)
+        {
+            size_t capacity = b->file_capacity > 0 ? 2 * b->file_capacity : 64;
+            struct bench_file *files = realloc(b->files, capacity * sizeof(*files));
+            if (files == NULL)
+                return result; // Not tracked, so left behind
+            b->files = files;
+            b->file_capacity = capacity;
+        }
+        b->files[b->file_count++] = file;
+    }
+    return result;
+}
+
+// Send a request with one argument and wait for its reply
+int bench_request(struct bench_session *b, uint8_t opcode, const char *arg, long long *bytes)
+{
+    const char *request_args[] = {arg};
+    if (fs_send_request(b->socket, opcode, b->next_request_id++, 1, request_args) < 0)
+        return -1;
+    return wait_reply(b, bytes);
+}
+
+// Read frames up to the REPLY, adding the DATA bytes to *bytes. Returns 0 on
+// success (a partial listing included), 1 on an error reply, -1 if the
+// connection failed.
+int wait_reply(struct bench_session *b, long long *bytes)
+{
+    struct fs_frame frame;
+    while (fs_recv_frame(b->socket, &frame, b->buffer, FS_MAX_PAYLOAD) == 1)
+    {
+        if (frame.opcode == FS_OP_REPLY)
+        {
+            return (frame.flags & FS_FLAG_ERROR) ? 1 : 0;
+        }
+        if (frame.opcode == FS_OP_DATA)
+        {
+            *bytes += fs_data_length(&frame);
+        }
+    }
+    return -1;
+}
+
+void record(struct op_stats *stats, double ms, int failed, long long bytes)
+{
+    if (stats->count == stats->capacity)
+    {
+        size_t capacity = stats->capacity > 0 ? 2 * stats->capacity : 256;
+        double *latencies = realloc(stats->latencies, capacity * sizeof(double));
+        if (latencies == NULL)
+            return;
+        stats->latencies = latencies;
+        stats->capacity = capacity;
+    }
+    stats->latencies[stats->count++] = ms;
+    stats->errors += failed;
+    stats->bytes += bytes;
+}
+
+int compare_doubles(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+// The p-th percentile of sorted latencies (nearest rank)
+double percentile(const struct op_stats *stats, double p)
+{
+    size_t rank = (size_t)(p / 100 * stats->count + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    return stats->latencies[(rank > stats->count ? stats->count : rank) - 1];
+}
+
+double now_ms(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000.0 + now.tv_nsec / 1e6;
+}
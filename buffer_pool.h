@@ -0,0 +1,95 @@
+// Pool of fixed-size I/O buffers shared by the connections of a process
+//
+// Frame payloads and queued output are held in buffers of one size, large
+// enough for a full frame, that are taken from the pool only while data is
+// in flight and handed back as soon as it has been consumed or sent. An idle
+// connection therefore holds no I/O memory, and the process reuses a small
+// working set of buffers instead of calling malloc for every frame. Up to
+// max_idle released buffers are kept for reuse; the rest go back to malloc.
+//
+// The pool is protected by a mutex so Stext and Spdf worker threads can
+// share one; Smain uses one pool per worker process.
+#ifndef FS_BUFFER_POOL_H
+#define FS_BUFFER_POOL_H
+
+#include <stdlib.h>
+#include <pthread.h>
+
+// A released buffer; the link lives in the buffer's own first bytes
+struct pool_buffer
+{
+    struct pool_buffer *next;
+};
+
+struct buffer_pool
+{
+    size_t size;       // Bytes in every buffer
+    size_t max_idle;   // Released buffers kept for reuse
+    struct pool_buffer *idle;
+    size_t idle_count;
+    size_t in_use;     // Buffers currently handed out
+    size_t peak_in_use;
+    pthread_mutex_t lock;
+};
+
+#define BUFFER_POOL_INITIALIZER(size, max_idle) {(size), (max_idle), NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER}
+
+// Take a buffer of pool->size bytes; returns NULL if memory is exhausted
+static inline void *buffer_get(struct buffer_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    struct pool_buffer *buffer = pool->idle;
+    if (buffer != NULL)
+    {
+        pool->idle = buffer->next;
+        pool->idle_count--;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (buffer == NULL)
+    {
+        buffer = malloc(pool->size < sizeof(*buffer) ? sizeof(*buffer) : pool->size);
+        if (buffer == NULL)
+        {
+            return NULL;
+        }
+    }
+    pthread_mutex_lock(&pool->lock);
+    if (++pool->in_use > pool->peak_in_use)
+    {
+        pool->peak_in_use = pool->in_use;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return buffer;
+}
+
+// Hand a buffer back to the pool (NULL is ignored)
+static inline void buffer_put(struct buffer_pool *pool, void *ptr)
+{
+    struct pool_buffer *buffer = ptr;
+    if (buffer == NULL)
+    {
+        return;
+    }
+    pthread_mutex_lock(&pool->lock);
+    pool->in_use--;
+    if (pool->idle_count < pool->max_idle)
+    {
+        buffer->next = pool->idle;
+        pool->idle = buffer;
+        pool->idle_count++;
+        buffer = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    free(buffer);
+}
+
+// Bytes of buffer memory the pool has allocated, busy or idle
+static inline size_t buffer_pool_bytes(struct buffer_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    size_t bytes = (pool->in_use + pool->idle_count) * pool->size;
+    pthread_mutex_unlock(&pool->lock);
+    return bytes;
+}
+
+#endif
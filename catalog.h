@@ -0,0 +1,444 @@
+// Namespace catalog shared by the Smain worker processes
+//
+// Records every file stored under ~/smain with the server that holds it
+// (Smain itself, Stext or Spdf, and which instance of a sharded tier), its
+// size and mtime, so display and existence checks are answered
+// without asking the storage servers. It also keeps the number the primary
+// gave the file's last write, which tells whether a replica may serve it.
+// The table lives in a shared anonymous mapping created before the workers
+// are forked: an upload or delete finished by one worker is seen by all of
+// them. A robust process-shared mutex guards it, so a worker that dies while
+// holding the lock does not wedge the others.
+//
+// Entries are chained by a hash of their full path for lookups and by a
+// hash of their directory for listings, so display only walks the entries
+// of one directory. A server's part of the catalog is trusted only once its
+// index has been loaded completely; until then catalog_known() is false and
+// callers fall back to asking the server.
+//
+// A file whose path is too long for an entry is left out on its own: lookups
+// of it return -1, and an entry for its directory's path plus a '/' (which no
+// file's key can be) makes catalog_list send listings of that directory to
+// the servers. If the table runs out of entries, the location's files are
+// answered by its servers from then on, and its index is not fetched again.
+#ifndef FS_CATALOG_H
+#define FS_CATALOG_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sys/mman.h>
+
+#define CATALOG_PATH_MAX 256 // Longer paths are not cataloged; their server is then asked directly
+
+// Server holding a file
+enum catalog_location
+{
+    CATALOG_SMAIN,
+    CATALOG_STEXT,
+    CATALOG_SPDF,
+    CATALOG_LOCATIONS
+};
+
+struct catalog_entry
+{
+    int32_t next;     // Next entry in the same path bucket, or -1
+    int32_t dir_next; // Next entry in the same directory bucket, or -1
+    int location;
+    int shard;         // Instance of the location's tier holding the file
+    long long size;
+    long long mtime;
+    uint64_t version;  // Primary's number for the file's last write (replica.h); 0 when not known
+    char path[CATALOG_PATH_MAX];
+};
+
+// A file reported by a server's index, merged with catalog_merge
+struct catalog_record
+{
+    char *path;
+    int shard;
+    long long size;
+    long long mtime;
+};
+
+struct catalog
+{
+    pthread_mutex_t lock;
+    int known[CATALOG_LOCATIONS];          // The location's files are all in the catalog
+    int full[CATALOG_LOCATIONS];           // The table had no entry left for one of the location's files
+    unsigned removals[CATALOG_LOCATIONS];  // Bumped by every delete, to detect a racing index load
+    uint32_t capacity;                     // Entries available
+    uint32_t mask;                         // Bucket count - 1
+    uint32_t used;                         // Entries ever handed out
+    uint32_t count;                        // Entries in use
+    int32_t free_list;                     // Released entries, linked through next
+    int32_t *path_heads;
+    int32_t *dir_heads;
+    struct catalog_entry *entries;
+};
+
+// FNV-1a over len bytes
+static inline uint32_t catalog_hash(const char *s, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return hash;
+}
+
+// Length of the directory part of a path (up to its last '/')
+static inline size_t catalog_dir_len(const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? (size_t)(slash - path) : 0;
+}
+
+// Map a catalog for capacity entries; must be called before forking the workers
+static inline struct catalog *catalog_create(uint32_t capacity)
+{
+    uint32_t buckets = 1;
+    while (buckets < capacity)
+        buckets <<= 1;
+    size_t size = sizeof(struct catalog) + 2 * buckets * sizeof(int32_t) + (size_t)capacity * sizeof(struct catalog_entry);
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        return NULL;
+    }
+    struct catalog *c = region;
+    c->capacity = capacity;
+    c->mask = buckets - 1;
+    c->free_list = -1;
+    c->path_heads = (int32_t *)(c + 1);
+    c->dir_heads = c->path_heads + buckets;
+    c->entries = (struct catalog_entry *)(c->dir_heads + buckets);
+    memset(c->path_heads, 0xff, 2 * buckets * sizeof(int32_t)); // All chains empty (-1)
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&c->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return c;
+}
+
+static inline void catalog_lock(struct catalog *c)
+{
+    if (pthread_mutex_lock(&c->lock) == EOWNERDEAD)
+    {
+        // A worker died holding the lock; an update is a few stores into
+        // the table, so carry on with it as it is
+        pthread_mutex_consistent(&c->lock);
+    }
+}
+
+static inline void catalog_unlock(struct catalog *c)
+{
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Copy path into key, of size bytes, with repeated and trailing '/' removed,
+// so that "~/smain/d1/" and "~/smain/d1//a.c" name the same entries as a client
+// typing them without the extra slashes. Returns the key length, or -1 if it
+// does not fit.
+static inline int catalog_key_size(char *key, size_t size, const char *path)
+{
+    size_t len = 0;
+    for (const char *p = path; *p != '\0'; p++)
+    {
+        if (*p == '/' && len > 0 && key[len - 1] == '/')
+            continue;
+        if (len == size - 1)
+            return -1;
+        key[len++] = *p;
+    }
+    if (len > 1 && key[len - 1] == '/')
+        len--;
+    key[len] = '\0';
+    return (int)len;
+}
+
+static inline int catalog_key(char key[CATALOG_PATH_MAX], const char *path)
+{
+    return catalog_key_size(key, CATALOG_PATH_MAX, path);
+}
+
+// Index of the entry for a key, or -1; the lock must be held
+static inline int32_t catalog_find_locked(struct catalog *c, const char *key)
+{
+    int32_t i = c->path_heads[catalog_hash(key, strlen(key)) & c->mask];
+    while (i >= 0 && strcmp(c->entries[i].path, key) != 0)
+    {
+        i = c->entries[i].next;
+    }
+    return i;
+}
+
+// Take an entry for key and chain it in; the lock must be held. Returns its
+// index, or -1 if the table is full
+static inline int32_t catalog_insert_locked(struct catalog *c, const char *key, int len)
+{
+    if (c->free_list < 0 && c->used == c->capacity)
+    {
+        return -1;
+    }
+    int32_t i;
+    if (c->free_list >= 0)
+    {
+        i = c->free_list;
+        c->free_list = c->entries[i].next;
+    }
+    else
+    {
+        i = (int32_t)c->used++;
+    }
+    struct catalog_entry *e = &c->entries[i];
+    memcpy(e->path, key, len + 1);
+    uint32_t bucket = catalog_hash(key, len) & c->mask;
+    e->next = c->path_heads[bucket];
+    c->path_heads[bucket] = i;
+    uint32_t dir_bucket = catalog_hash(key, catalog_dir_len(key)) & c->mask;
+    e->dir_next = c->dir_heads[dir_bucket];
+    c->dir_heads[dir_bucket] = i;
+    c->count++;
+    return i;
+}
+
+// The table has no entry left for a file of location: its files are no
+// longer known, for good; the lock must be held
+static inline int catalog_overflow_locked(struct catalog *c, int location)
+{
+    c->known[location] = 0;
+    c->full[location] = 1;
+    return -1;
+}
+
+// Leave out a file whose path is too long for an entry, marking its
+// directory so listings of it go to the servers; the lock must be held
+static inline int catalog_skip_locked(struct catalog *c, const char *path, int location)
+{
+    char full_key[PATH_MAX];
+    if (catalog_key_size(full_key, sizeof(full_key), path) < 0)
+    {
+        return 0; // Not a path any server has either
+    }
+    size_t dir_len = catalog_dir_len(full_key);
+    if (dir_len + 1 >= CATALOG_PATH_MAX)
+    {
+        return 0; // The directory does not fit either, so catalog_list never answers for it
+    }
+    char key[CATALOG_PATH_MAX];
+    memcpy(key, full_key, dir_len + 1); // Up to and with the '/'
+    key[dir_len + 1] = '\0';
+    int32_t i = catalog_find_locked(c, key);
+    if (i < 0 && (i = catalog_insert_locked(c, key, (int)dir_len + 1)) < 0)
+    {
+        return catalog_overflow_locked(c, location);
+    }
+    c->entries[i].location = -1; // Never listed or looked up as a file
+    return 0;
+}
+
+// Add or update a file; the lock must be held. An existing entry is left
+// alone unless replace is set. A path too long for an entry is left out on
+// its own. Returns -1 when the table is full, after which the location is no
+// longer known.
+static inline int catalog_put_locked(struct catalog *c, const char *path, int location, int shard, long long size,
+                                     long long mtime, uint64_t version, int replace)
+{
+    char key[CATALOG_PATH_MAX];
+    int len = catalog_key(key, path);
+    if (len < 0)
+    {
+        return catalog_skip_locked(c, path, location);
+    }
+    int32_t i = catalog_find_locked(c, key);
+    if (i >= 0 && !replace)
+    {
+        return 0;
+    }
+    if (i < 0 && (i = catalog_insert_locked(c, key, len)) < 0)
+    {
+        return catalog_overflow_locked(c, location);
+    }
+    struct catalog_entry *e = &c->entries[i];
+    e->location = location;
+    e->shard = shard;
+    e->size = size;
+    e->mtime = mtime;
+    e->version = version;
+    return 0;
+}
+
+// Record a stored file, replacing what was known about it
+static inline int catalog_put(struct catalog *c, const char *path, int location, int shard, long long size,
+                              long long mtime, uint64_t version)
+{
+    catalog_lock(c);
+    int result = catalog_put_locked(c, path, location, shard, size, mtime, version, 1);
+    catalog_unlock(c);
+    return result;
+}
+
+// Note a later write of a cataloged file, with the primary's number for it;
+// a file no longer cataloged is left out
+static inline void catalog_touch(struct catalog *c, const char *path, long long mtime, uint64_t version)
+{
+    char key[CATALOG_PATH_MAX];
+    if (catalog_key(key, path) < 0)
+    {
+        return;
+    }
+    catalog_lock(c);
+    int32_t i = catalog_find_locked(c, key);
+    if (i >= 0)
+    {
+        c->entries[i].mtime = mtime;
+        c->entries[i].version = version;
+    }
+    catalog_unlock(c);
+}
+
+// Forget a deleted file
+static inline void catalog_remove(struct catalog *c, const char *path, int location)
+{
+    char key[CATALOG_PATH_MAX];
+    int len = catalog_key(key, path);
+    catalog_lock(c);
+    c->removals[location]++;
+    int32_t i = len >= 0 ? catalog_find_locked(c, key) : -1;
+    if (i >= 0)
+    {
+        int32_t *link = &c->path_heads[catalog_hash(key, len) & c->mask];
+        while (*link != i)
+            link = &c->entries[*link].next;
+        *link = c->entries[i].next;
+        link = &c->dir_heads[catalog_hash(key, catalog_dir_len(key)) & c->mask];
+        while (*link != i)
+            link = &c->entries[*link].dir_next;
+        *link = c->entries[i].dir_next;
+        c->entries[i].next = c->free_list;
+        c->free_list = i;
+        c->count--;
+    }
+    catalog_unlock(c);
+}
+
+// Copy the entry for path into *out; returns 1 if found, 0 if not, -1 if
+// the path is too long to be cataloged
+static inline int catalog_lookup(struct catalog *c, const char *path, struct catalog_entry *out)
+{
+    char key[CATALOG_PATH_MAX];
+    if (catalog_key(key, path) < 0)
+    {
+        return -1;
+    }
+    catalog_lock(c);
+    int32_t i = catalog_find_locked(c, key);
+    if (i >= 0 && out != NULL)
+    {
+        *out = c->entries[i];
+    }
+    catalog_unlock(c);
+    return i >= 0;
+}
+
+// Is every file of the location in the catalog?
+static inline int catalog_known(struct catalog *c, int location)
+{
+    catalog_lock(c);
+    int known = c->known[location];
+    catalog_unlock(c);
+    return known;
+}
+
+// Is the location's index loaded, or not worth loading because the table is full?
+static inline int catalog_settled(struct catalog *c, int location)
+{
+    catalog_lock(c);
+    int settled = c->known[location] || c->full[location];
+    catalog_unlock(c);
+    return settled;
+}
+
+// Deletes seen so far for a location; pass to catalog_merge
+static inline unsigned catalog_removals(struct catalog *c, int location)
+{
+    catalog_lock(c);
+    unsigned removals = c->removals[location];
+    catalog_unlock(c);
+    return removals;
+}
+
+// Merge a location's index, fetched after catalog_removals returned
+// removals, and mark the location known. Entries written since are kept. If a
+// file was deleted meanwhile the index may list it, so nothing is merged and
+// -1 is returned to have the caller fetch it again. Returns -2 if the table
+// filled up, which fetching again does not help.
+static inline int catalog_merge(struct catalog *c, int location, unsigned removals, const struct catalog_record *records,
+                                size_t count)
+{
+    catalog_lock(c);
+    if (c->removals[location] != removals)
+    {
+        catalog_unlock(c);
+        return -1;
+    }
+    c->known[location] = 1;
+    for (size_t i = 0; i < count; i++)
+    {
+        catalog_put_locked(c, records[i].path, location, records[i].shard, records[i].size, records[i].mtime, 0, 0);
+    }
+    int full = c->full[location];
+    catalog_unlock(c);
+    return full ? -2 : 0;
+}
+
+// Does dir have files too long to be cataloged? Then it is listed by its servers
+static inline int catalog_incomplete(struct catalog *c, const char *dir)
+{
+    char key[CATALOG_PATH_MAX];
+    int dir_len = catalog_key(key, dir);
+    if (dir_len < 0 || dir_len + 1 >= CATALOG_PATH_MAX)
+    {
+        return 1; // Nothing under it fits in the catalog
+    }
+    key[dir_len] = '/';
+    key[dir_len + 1] = '\0';
+    catalog_lock(c);
+    int32_t i = catalog_find_locked(c, key);
+    catalog_unlock(c);
+    return i >= 0;
+}
+
+// Call emit for the name of every file of a location directly inside dir;
+// check catalog_incomplete first
+static inline void catalog_list(struct catalog *c, const char *dir, int location,
+                                void (*emit)(void *ctx, const char *name), void *ctx)
+{
+    char key[CATALOG_PATH_MAX];
+    int dir_len = catalog_key(key, dir);
+    if (dir_len < 0)
+    {
+        return;
+    }
+    catalog_lock(c);
+    int32_t i = c->dir_heads[catalog_hash(key, dir_len) & c->mask];
+    for (; i >= 0; i = c->entries[i].dir_next)
+    {
+        const struct catalog_entry *e = &c->entries[i];
+        if (e->location == location && catalog_dir_len(e->path) == (size_t)dir_len &&
+            strncmp(e->path, key, dir_len) == 0)
+        {
+            emit(ctx, e->path + dir_len + 1);
+        }
+    }
+    catalog_unlock(c);
+}
+
+#endif
@@ -0,0 +1,1058 @@
+// Content-addressed chunk store shared by Stext and Spdf, and the chunking
+// the client uses to upload into it
+//
+// A file is cut into chunks at content-defined boundaries: a gear hash rolls
+// over the bytes and a chunk ends where the top bits of the hash are zero, so
+// an insertion or deletion only changes the chunks around it. With
+// deduplication on (-d), every chunk is kept once under .chunks/ in the
+// store, named by its SHA-256, and the stored file is a small manifest
+// listing its chunks. Reference counts are held in memory and rebuilt from
+// the manifests at startup; a chunk is deleted with its last reference.
+// Manifests are read whether or not -d is given, and plain files stored
+// without it are read as before.
+//
+// Uploads of .txt and .pdf files send the chunk list first. The server
+// answers with a NEED bitmap of the chunks it does not have (all of them
+// without -d) and only those chunks follow, compressed where that pays off.
+#ifndef FS_CHUNK_STORE_H
+#define FS_CHUNK_STORE_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "compress.h"
+
+#define CHUNK_MIN 2048                  // No boundary is looked for before this many bytes
+#define CHUNK_MAX FS_MAX_PAYLOAD        // A chunk always fits one DATA frame
+#define CHUNK_MASK 0xFFF8000000000000ULL // 13 bits: about one boundary per 8 KB past CHUNK_MIN
+#define CHUNK_RECORD 36                 // A SHA-256 and a 4-byte length, on disk and on the wire
+#define CHUNK_HEADER 24                 // Manifest magic, file size and chunk count
+#define CHUNK_MAGIC "\0fschnk1"         // Starts every manifest; no text or PDF file starts with NUL
+#define CHUNK_DIR ".chunks"             // Chunk files, inside the store root
+
+// One chunk of a file
+struct chunk_record
+{
+    unsigned char hash[32]; // SHA-256 of the chunk
+    uint32_t length;
+};
+
+// The chunks of a stored file, in order
+struct chunk_manifest
+{
+    long long size;
+    size_t count;
+    struct chunk_record *records;
+};
+
+// ---------------------------------------------------------------------------
+// SHA-256 (FIPS 180-4)
+
+struct sha256
+{
+    uint32_t state[8];
+    uint64_t length;         // Bytes hashed so far
+    unsigned char block[64]; // Input waiting for a full block
+    size_t used;
+};
+
+static const uint32_t sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2};
+
+#define SHA256_ROTR(x, n) (((x) >> (n)) | ((x) << (32 - (n))))
+
+static inline void sha256_compress(uint32_t state[8], const unsigned char *block)
+{
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++)
+    {
+        w[i] = (uint32_t)block[4 * i] << 24 | (uint32_t)block[4 * i + 1] << 16 | (uint32_t)block[4 * i + 2] << 8 |
+               block[4 * i + 3];
+    }
+    for (int i = 16; i < 64; i++)
+    {
+        uint32_t s0 = SHA256_ROTR(w[i - 15], 7) ^ SHA256_ROTR(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = SHA256_ROTR(w[i - 2], 17) ^ SHA256_ROTR(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (int i = 0; i < 64; i++)
+    {
+        uint32_t t1 = h + (SHA256_ROTR(e, 6) ^ SHA256_ROTR(e, 11) ^ SHA256_ROTR(e, 25)) + ((e & f) ^ (~e & g)) +
+                      sha256_k[i] + w[i];
+        uint32_t t2 = (SHA256_ROTR(a, 2) ^ SHA256_ROTR(a, 13) ^ SHA256_ROTR(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+static inline void sha256_init(struct sha256 *s)
+{
+    static const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a,
+                                        0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(s->state, initial, sizeof(initial));
+    s->length = 0;
+    s->used = 0;
+}
+
+static inline void sha256_update(struct sha256 *s, const void *data, size_t len)
+{
+    const unsigned char *p = data;
+    s->length += len;
+    if (s->used > 0)
+    {
+        size_t n = 64 - s->used < len ? 64 - s->used : len;
+        memcpy(s->block + s->used, p, n);
+        s->used += n;
+        p += n;
+        len -= n;
+        if (s->used < 64)
+            return;
+        sha256_compress(s->state, s->block);
+        s->used = 0;
+    }
+    for (; len >= 64; p += 64, len -= 64)
+    {
+        sha256_compress(s->state, p);
+    }
+    memcpy(s->block, p, len);
+    s->used = len;
+}
+
+static inline void sha256_final(struct sha256 *s, unsigned char out[32])
+{
+    uint64_t bits = s->length * 8;
+    unsigned char pad[72] = {0x80};
+    size_t pad_len = (s->used < 56 ? 56 : 120) - s->used;
+    for (int i = 0; i < 8; i++)
+    {
+        pad[pad_len + i] = (unsigned char)(bits >> (56 - 8 * i));
+    }
+    sha256_update(s, pad, pad_len + 8);
+    for (int i = 0; i < 8; i++)
+    {
+        out[4 * i] = (unsigned char)(s->state[i] >> 24);
+        out[4 * i + 1] = (unsigned char)(s->state[i] >> 16);
+        out[4 * i + 2] = (unsigned char)(s->state[i] >> 8);
+        out[4 * i + 3] = (unsigned char)s->state[i];
+    }
+}
+
+static inline void sha256(const void *data, size_t len, unsigned char out[32])
+{
+    struct sha256 s;
+    sha256_init(&s);
+    sha256_update(&s, data, len);
+    sha256_final(&s, out);
+}
+
+// ---------------------------------------------------------------------------
+// Chunking
+
+// Pseudo-random 64-bit value for a byte value, for the gear hash
+static inline uint64_t chunk_gear(unsigned char byte)
+{
+    uint64_t x = (byte + 1) * 0x9E3779B97F4A7C15ULL;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    return x ^ (x >> 31);
+}
+
+// Length of the chunk starting at data. len must be at least CHUNK_MAX
+// unless the rest of the file is shorter, so boundaries never depend on how
+// the file was read.
+static inline size_t chunk_boundary(const unsigned char *data, size_t len)
+{
+    if (len <= CHUNK_MIN)
+        return len;
+    size_t limit = len < CHUNK_MAX ? len : CHUNK_MAX;
+    uint64_t hash = 0;
+    for (size_t i = CHUNK_MIN; i < limit; i++)
+    {
+        hash = (hash << 1) + chunk_gear(data[i]);
+        if ((hash & CHUNK_MASK) == 0)
+            return i + 1;
+    }
+    return limit;
+}
+
+// Cut an open file into chunks and hash them. Returns the number of chunks
+// (the array is malloc'd into *records) or -1 on a read or memory error
+static inline long chunk_scan(int file, struct chunk_record **records)
+{
+    unsigned char *buffer = malloc(2 * CHUNK_MAX);
+    size_t start = 0, have = 0, count = 0, capacity = 0;
+    int eof = 0;
+    *records = NULL;
+    while (buffer != NULL)
+    {
+        if (!eof && have < CHUNK_MAX)
+        {
+            // Top up so a whole maximum-size chunk is visible
+            memmove(buffer, buffer + start, have);
+            start = 0;
+            ssize_t n = read(file, buffer + have, 2 * CHUNK_MAX - have);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n < 0)
+                break;
+            if (n == 0)
+                eof = 1;
+            have += n;
+            continue;
+        }
+        if (have == 0)
+        {
+            free(buffer);
+            return (long)count;
+        }
+        if (count == capacity)
+        {
+            capacity = capacity ? capacity * 2 : 64;
+            struct chunk_record *grown = realloc(*records, capacity * sizeof(**records));
+            if (grown == NULL)
+                break;
+            *records = grown;
+        }
+        size_t len = chunk_boundary(buffer + start, have);
+        sha256(buffer + start, len, (*records)[count].hash);
+        (*records)[count++].length = (uint32_t)len;
+        start += len;
+        have -= len;
+    }
+    free(buffer);
+    free(*records);
+    *records = NULL;
+    return -1;
+}
+
+static inline void chunk_put_record(unsigned char *out, const struct chunk_record *record)
+{
+    memcpy(out, record->hash, 32);
+    out[32] = (unsigned char)(record->length >> 24);
+    out[33] = (unsigned char)(record->length >> 16);
+    out[34] = (unsigned char)(record->length >> 8);
+    out[35] = (unsigned char)record->length;
+}
+
+static inline void chunk_get_record(const unsigned char *in, struct chunk_record *record)
+{
+    memcpy(record->hash, in, 32);
+    record->length = (uint32_t)in[32] << 24 | (uint32_t)in[33] << 16 | (uint32_t)in[34] << 8 | in[35];
+}
+
+// ---------------------------------------------------------------------------
+// Reference counts: an open-addressing table keyed by chunk hash
+
+struct chunk_slot
+{
+    unsigned char hash[32];
+    uint32_t refs; // 0 marks a free slot
+};
+
+struct chunk_table
+{
+    struct chunk_slot *slots;
+    size_t capacity; // Power of two
+    size_t count;
+};
+
+static inline size_t chunk_home(const struct chunk_table *t, const unsigned char *hash)
+{
+    uint64_t h;
+    memcpy(&h, hash, sizeof(h)); // SHA-256 bits are already uniform
+    return (size_t)h & (t->capacity - 1);
+}
+
+static inline struct chunk_slot *chunk_table_find(struct chunk_table *t, const unsigned char *hash)
+{
+    if (t->capacity == 0)
+        return NULL;
+    for (size_t i = chunk_home(t, hash);; i = (i + 1) & (t->capacity - 1))
+    {
+        if (t->slots[i].refs == 0)
+            return NULL;
+        if (memcmp(t->slots[i].hash, hash, 32) == 0)
+            return &t->slots[i];
+    }
+}
+
+// Add n references to a chunk, inserting it if new; returns -1 if out of memory
+static inline int chunk_table_add(struct chunk_table *t, const unsigned char *hash, uint32_t n)
+{
+    struct chunk_slot *slot = chunk_table_find(t, hash);
+    if (slot != NULL)
+    {
+        slot->refs += n;
+        return 0;
+    }
+    if ((t->count + 1) * 10 > t->capacity * 7)
+    {
+        // Grow to keep probe sequences short
+        struct chunk_table grown = {calloc(t->capacity ? t->capacity * 2 : 1024, sizeof(struct chunk_slot)),
+                                    t->capacity ? t->capacity * 2 : 1024, 0};
+        if (grown.slots == NULL)
+            return -1;
+        for (size_t i = 0; i < t->capacity; i++)
+        {
+            if (t->slots[i].refs != 0)
+                chunk_table_add(&grown, t->slots[i].hash, t->slots[i].refs);
+        }
+        free(t->slots);
+        *t = grown;
+    }
+    size_t i = chunk_home(t, hash);
+    while (t->slots[i].refs != 0)
+        i = (i + 1) & (t->capacity - 1);
+    memcpy(t->slots[i].hash, hash, 32);
+    t->slots[i].refs = n;
+    t->count++;
+    return 0;
+}
+
+// Drop n references to a chunk; returns the references left (0 once it is gone)
+static inline uint32_t chunk_table_sub(struct chunk_table *t, const unsigned char *hash, uint32_t n)
+{
+    struct chunk_slot *slot = chunk_table_find(t, hash);
+    if (slot == NULL)
+        return 0;
+    if (slot->refs > n)
+    {
+        slot->refs -= n;
+        return slot->refs;
+    }
+    // Free the slot, shifting later members of its probe run back into the gap
+    size_t mask = t->capacity - 1;
+    size_t hole = (size_t)(slot - t->slots);
+    for (size_t j = (hole + 1) & mask; t->slots[j].refs != 0; j = (j + 1) & mask)
+    {
+        size_t home = chunk_home(t, t->slots[j].hash);
+        int stays = hole <= j ? (hole < home && home <= j) : (hole < home || home <= j);
+        if (!stays)
+        {
+            t->slots[hole] = t->slots[j];
+            hole = j;
+        }
+    }
+    t->slots[hole].refs = 0;
+    t->count--;
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// The store
+
+struct chunk_store
+{
+    char root[PATH_MAX - 80]; // Store directory, e.g. ~/stext; leaves room for a chunk path
+    int dedup;           // New uploads are kept as chunks (-d)
+    struct chunk_table refs;
+    long long chunk_bytes; // Bytes held in chunk files
+    pthread_mutex_t lock;
+};
+
+static inline void chunk_path(const struct chunk_store *cs, const unsigned char *hash, char *out, size_t size)
+{
+    char hex[65];
+    for (int i = 0; i < 32; i++)
+        snprintf(hex + 2 * i, 3, "%02x", hash[i]);
+    snprintf(out, size, "%s/" CHUNK_DIR "/%.2s/%s", cs->root, hex, hex);
+}
+
+// Read the manifest at path. Returns 1 with *m filled in, 0 if path is a plain
+// file, -1 if it cannot be read or is a damaged manifest (errno is set)
+static inline int chunk_manifest_load(const char *path, struct chunk_manifest *m)
+{
+    unsigned char header[CHUNK_HEADER];
+    memset(m, 0, sizeof(*m));
+    int file = open(path, O_RDONLY);
+    if (file < 0)
+        return -1;
+    struct stat st;
+    ssize_t n = read(file, header, sizeof(header));
+    if (n != (ssize_t)sizeof(header) || memcmp(header, CHUNK_MAGIC, 8) != 0 || fstat(file, &st) < 0)
+    {
+        close(file);
+        return 0;
+    }
+    m->size = (long long)fs_get_u64(header + 8);
+    uint64_t count = fs_get_u64(header + 16);
+    if ((uint64_t)st.st_size != CHUNK_HEADER + count * CHUNK_RECORD)
+    {
+        close(file);
+        errno = EINVAL;
+        return -1;
+    }
+    size_t bytes = (size_t)count * CHUNK_RECORD;
+    unsigned char *raw = malloc(bytes ? bytes : 1);
+    m->records = malloc(count ? count * sizeof(*m->records) : 1);
+    size_t have = 0;
+    while (raw != NULL && have < bytes && (n = read(file, raw + have, bytes - have)) > 0)
+        have += n;
+    close(file);
+    long long total = 0;
+    for (size_t i = 0; raw != NULL && m->records != NULL && have == bytes && i < count; i++)
+    {
+        chunk_get_record(raw + i * CHUNK_RECORD, &m->records[i]);
+        total += m->records[i].length;
+    }
+    free(raw);
+    if (m->records == NULL || have != bytes || total != m->size)
+    {
+        free(m->records);
+        m->records = NULL;
+        errno = raw == NULL ? ENOMEM : EINVAL;
+        return -1;
+    }
+    m->count = (size_t)count;
+    return 1;
+}
+
+// Write a manifest to a new temporary file next to path; returns its name (malloc'd) or NULL
+static inline char *chunk_manifest_write(const char *path, const struct chunk_record *records, size_t count,
+                                         long long size)
+{
+    size_t name_len = strlen(path) + 8;
+    char *tmp = malloc(name_len);
+    if (tmp == NULL)
+        return NULL;
+    snprintf(tmp, name_len, "%s.XXXXXX", path); // Never ends in .txt or .pdf, so never listed
+    int file = mkstemp(tmp);
+    if (file < 0)
+    {
+        free(tmp);
+        return NULL;
+    }
+    fchmod(file, 0644);
+    unsigned char header[CHUNK_HEADER];
+    memcpy(header, CHUNK_MAGIC, 8);
+    fs_put_u64(header + 8, (uint64_t)size);
+    fs_put_u64(header + 16, (uint64_t)count);
+    int ok = write(file, header, sizeof(header)) == (ssize_t)sizeof(header);
+    unsigned char record[CHUNK_RECORD];
+    for (size_t i = 0; ok && i < count; i++)
+    {
+        chunk_put_record(record, &records[i]);
+        ok = write(file, record, sizeof(record)) == (ssize_t)sizeof(record);
+    }
+    if (close(file) < 0 || !ok)
+    {
+        unlink(tmp);
+        free(tmp);
+        return NULL;
+    }
+    return tmp;
+}
+
+// Drop references to chunks, deleting those no longer used; the lock must be held
+static inline void chunk_release_locked(struct chunk_store *cs, const struct chunk_record *records, size_t count)
+{
+    for (size_t i = 0; i < count; i++)
+    {
+        if (chunk_table_find(&cs->refs, records[i].hash) != NULL && chunk_table_sub(&cs->refs, records[i].hash, 1) == 0)
+        {
+            char path[PATH_MAX];
+            chunk_path(cs, records[i].hash, path, sizeof(path));
+            if (unlink(path) == 0)
+                cs->chunk_bytes -= records[i].length;
+        }
+    }
+}
+
+static inline void chunk_release(struct chunk_store *cs, const struct chunk_record *records, size_t count)
+{
+    pthread_mutex_lock(&cs->lock);
+    chunk_release_locked(cs, records, count);
+    pthread_mutex_unlock(&cs->lock);
+}
+
+// Take a reference to a chunk if the store has it; returns 1 if it did
+static inline int chunk_pin(struct chunk_store *cs, const unsigned char *hash)
+{
+    pthread_mutex_lock(&cs->lock);
+    struct chunk_slot *slot = chunk_table_find(&cs->refs, hash);
+    if (slot != NULL)
+        slot->refs++;
+    pthread_mutex_unlock(&cs->lock);
+    return slot != NULL;
+}
+
+// Store a chunk (unless another upload just did) with refs references to it
+static inline int chunk_put(struct chunk_store *cs, const struct chunk_record *record, const void *data, uint32_t refs)
+{
+    char path[PATH_MAX], tmp[PATH_MAX];
+    chunk_path(cs, record->hash, path, sizeof(path));
+    snprintf(tmp, sizeof(tmp), "%s/" CHUNK_DIR "/tmp.XXXXXX", cs->root);
+    // Written outside the lock; only the rename into place is serialised
+    int file = mkstemp(tmp);
+    if (file < 0)
+        return -1;
+    fchmod(file, 0644);
+    int ok = write(file, data, record->length) == (ssize_t)record->length;
+    if (close(file) < 0 || !ok)
+    {
+        unlink(tmp);
+        return -1;
+    }
+    pthread_mutex_lock(&cs->lock);
+    int result = 0;
+    if (chunk_table_find(&cs->refs, record->hash) != NULL)
+    {
+        unlink(tmp); // Stored meanwhile by a concurrent upload
+        chunk_table_add(&cs->refs, record->hash, refs);
+    }
+    else
+    {
+        char *slash = strrchr(path, '/');
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+        if (rename(tmp, path) < 0 || chunk_table_add(&cs->refs, record->hash, refs) < 0)
+        {
+            unlink(tmp);
+            result = -1;
+        }
+        else
+        {
+            cs->chunk_bytes += record->length;
+        }
+    }
+    pthread_mutex_unlock(&cs->lock);
+    return result;
+}
+
+// Move the manifest tmp into place at path, releasing the chunks of the file it replaces
+static inline int chunk_file_replace(struct chunk_store *cs, const char *path, const char *tmp)
+{
+    struct chunk_manifest old;
+    pthread_mutex_lock(&cs->lock);
+    int had_manifest = chunk_manifest_load(path, &old) == 1;
+    int result = rename(tmp, path);
+    if (result == 0 && had_manifest)
+        chunk_release_locked(cs, old.records, old.count);
+    pthread_mutex_unlock(&cs->lock);
+    if (had_manifest)
+        free(old.records);
+    return result;
+}
+
+// Delete a stored file, releasing its chunks if it is a manifest; returns remove()'s result
+static inline int chunk_file_remove(struct chunk_store *cs, const char *path)
+{
+    struct chunk_manifest old;
+    pthread_mutex_lock(&cs->lock);
+    int had_manifest = chunk_manifest_load(path, &old) == 1;
+    int result = remove(path);
+    int saved_errno = errno;
+    if (result == 0 && had_manifest)
+        chunk_release_locked(cs, old.records, old.count);
+    pthread_mutex_unlock(&cs->lock);
+    if (had_manifest)
+        free(old.records);
+    errno = saved_errno;
+    return result;
+}
+
+// Count the chunk references of every manifest under dir
+static inline void chunk_scan_manifests(struct chunk_store *cs, const char *dir, size_t *files)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(d)) != NULL)
+    {
+        if (entry->d_name[0] == '.')
+            continue; // ., .. and the chunk directory itself
+        char path[PATH_MAX];
+        struct stat st;
+        if (snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name) >= (int)sizeof(path) || lstat(path, &st) < 0)
+            continue;
+        struct chunk_manifest m;
+        if (S_ISDIR(st.st_mode))
+        {
+            chunk_scan_manifests(cs, path, files);
+        }
+        else if (S_ISREG(st.st_mode) && chunk_manifest_load(path, &m) == 1)
+        {
+            for (size_t i = 0; i < m.count; i++)
+                chunk_table_add(&cs->refs, m.records[i].hash, 1);
+            free(m.records);
+            (*files)++;
+        }
+    }
+    closedir(d);
+}
+
+// Open the store under root: count the references of every manifest and
+// delete chunk files nothing refers to (left by a crash). Returns 0 or -1
+static inline int chunk_store_open(struct chunk_store *cs, const char *root, int dedup, size_t *files)
+{
+    memset(cs, 0, sizeof(*cs));
+    pthread_mutex_init(&cs->lock, NULL);
+    snprintf(cs->root, sizeof(cs->root), "%s", root);
+    cs->dedup = dedup;
+    *files = 0;
+    char dir[PATH_MAX];
+    snprintf(dir, sizeof(dir), "%s/" CHUNK_DIR, root);
+    if (mkdir(dir, 0755) < 0 && errno != EEXIST)
+        return -1;
+    chunk_scan_manifests(cs, root, files);
+
+    DIR *top = opendir(dir);
+    struct dirent *sub;
+    while (top != NULL && (sub = readdir(top)) != NULL)
+    {
+        if (sub->d_name[0] == '.')
+            continue;
+        char sub_path[PATH_MAX];
+        if (snprintf(sub_path, sizeof(sub_path), "%s/%s", dir, sub->d_name) >= (int)sizeof(sub_path))
+            continue;
+        DIR *d = opendir(sub_path);
+        struct dirent *entry;
+        while (d != NULL && (entry = readdir(d)) != NULL)
+        {
+            if (entry->d_name[0] == '.')
+                continue;
+            char path[PATH_MAX];
+            if (snprintf(path, sizeof(path), "%s/%s", sub_path, entry->d_name) >= (int)sizeof(path))
+                continue;
+            unsigned char hash[32];
+            int valid = strlen(entry->d_name) == 64;
+            for (int i = 0; valid && i < 32; i++)
+                valid = sscanf(entry->d_name + 2 * i, "%2hhx", &hash[i]) == 1;
+            struct stat st;
+            if (valid && chunk_table_find(&cs->refs, hash) != NULL && stat(path, &st) == 0)
+                cs->chunk_bytes += st.st_size;
+            else
+                unlink(path);
+        }
+        if (d != NULL)
+            closedir(d);
+        if (d == NULL)
+            unlink(sub_path); // A stray temporary file
+    }
+    if (top != NULL)
+        closedir(top);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Reading stored files, plain or chunked
+
+struct chunk_reader
+{
+    struct chunk_store *cs;
+    struct chunk_manifest m; // m.records is NULL for a plain file
+    size_t next;             // Next chunk to open
+    int fd;                  // Plain file, or the chunk being read
+    uint32_t left;           // Bytes left in the current chunk
+};
+
+// Open a stored file for reading. Returns 1 for a chunked file, whose chunks
+// stay pinned until chunk_reader_close, 0 for a plain file (r->fd) or -1
+static inline int chunk_reader_open(struct chunk_store *cs, const char *path, struct chunk_reader *r)
+{
+    memset(r, 0, sizeof(*r));
+    r->cs = cs;
+    r->fd = -1;
+    int rc = chunk_manifest_load(path, &r->m);
+    if (rc == 0)
+    {
+        r->fd = open(path, O_RDONLY);
+        return r->fd >= 0 ? 0 : -1;
+    }
+    if (rc < 0)
+        return -1;
+    pthread_mutex_lock(&cs->lock);
+    size_t pinned = 0;
+    for (; pinned < r->m.count; pinned++)
+    {
+        struct chunk_slot *slot = chunk_table_find(&cs->refs, r->m.records[pinned].hash);
+        if (slot == NULL)
+            break; // Deleted under us
+        slot->refs++;
+    }
+    if (pinned < r->m.count)
+        chunk_release_locked(cs, r->m.records, pinned);
+    pthread_mutex_unlock(&cs->lock);
+    if (pinned < r->m.count)
+    {
+        free(r->m.records);
+        r->m.records = NULL;
+        errno = ENOENT;
+        return -1;
+    }
+    return 1;
+}
+
+// Open the next chunk of a chunked file; returns its descriptor and length, or -1 at the end
+static inline int chunk_reader_next(struct chunk_reader *r, uint32_t *length)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    r->fd = -1;
+    if (r->next == r->m.count)
+        return -1;
+    const struct chunk_record *record = &r->m.records[r->next++];
+    char path[PATH_MAX];
+    chunk_path(r->cs, record->hash, path, sizeof(path));
+    r->fd = open(path, O_RDONLY);
+    r->left = record->length;
+    *length = record->length;
+    return r->fd;
+}
+
+// Pass over the chunks before offset in a chunked file, so chunk_reader_next
+// opens the chunk holding it; returns how far into that chunk offset lies
+static inline uint32_t chunk_reader_seek(struct chunk_reader *r, long long offset)
+{
+    while (r->next < r->m.count && offset >= r->m.records[r->next].length)
+    {
+        offset -= r->m.records[r->next++].length;
+    }
+    return (uint32_t)offset;
+}
+
+// Read the file's contents in order; returns bytes read, 0 at the end, -1 on error
+static inline ssize_t chunk_reader_read(struct chunk_reader *r, char *buf, size_t len)
+{
+    if (r->m.records == NULL)
+        return read(r->fd, buf, len);
+    while (r->left == 0)
+    {
+        uint32_t length;
+        if (r->next == r->m.count)
+            return 0;
+        if (chunk_reader_next(r, &length) < 0)
+            return -1;
+    }
+    ssize_t n = read(r->fd, buf, len < r->left ? len : r->left);
+    if (n == 0)
+        return -1; // Chunk shorter than recorded
+    if (n > 0)
+        r->left -= n;
+    return n;
+}
+
+static inline void chunk_reader_close(struct chunk_reader *r)
+{
+    if (r->fd >= 0)
+        close(r->fd);
+    if (r->m.records != NULL)
+    {
+        chunk_release(r->cs, r->m.records, r->m.count);
+        free(r->m.records);
+    }
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+// tar_source callbacks, so archives and indexes see chunked files' contents
+static inline long long chunk_tar_size(void *ctx, const char *path, long long disk_size)
+{
+    (void)ctx;
+    struct chunk_manifest m;
+    if (chunk_manifest_load(path, &m) != 1)
+        return disk_size;
+    free(m.records);
+    return m.size;
+}
+
+static inline void *chunk_tar_open(void *ctx, const char *path)
+{
+    struct chunk_reader *r = malloc(sizeof(*r));
+    if (r != NULL && chunk_reader_open(ctx, path, r) < 0)
+    {
+        free(r);
+        r = NULL;
+    }
+    return r;
+}
+
+static inline ssize_t chunk_tar_read(void *handle, char *buf, size_t len)
+{
+    return chunk_reader_read(handle, buf, len);
+}
+
+static inline void chunk_tar_close(void *handle)
+{
+    chunk_reader_close(handle);
+    free(handle);
+}
+
+// ---------------------------------------------------------------------------
+// Receiving a chunked upload
+
+// Outcome of chunk_receive, for the server's log
+struct chunk_upload
+{
+    size_t chunks; // Chunks in the file
+    size_t sent;   // Chunks that had to be sent
+    long long bytes;      // Bytes of the chunks sent
+    long long wire_bytes; // What they took on the wire, after compression
+};
+
+// Receive a file sent as chunks into path (NULL to refuse it after reading
+// the chunk list): read the chunk list, send a NEED bitmap of the chunks
+// required, then take those chunks as DATA frames, decoding compressed ones.
+// buffer holds
+// FS_MAX_PAYLOAD + 1 bytes. Returns 0 once stored, 1 if refused (error says
+// why), -1 if the socket failed and -2 if Smain aborted the upload.
+static inline int chunk_receive(struct chunk_store *cs, int sock, uint32_t request_id, const char *path,
+                                long long size, char *buffer, const char **error, struct chunk_upload *upload)
+{
+    struct chunk_record *records = NULL;
+    size_t count = 0;
+    size_t limit = size >= 0 ? (size_t)(size / CHUNK_MIN) + 1 : 0; // Only the last chunk may be short
+    long long total = 0;
+    struct fs_frame frame;
+    int result = 0;
+    *error = path == NULL ? "Error: Invalid filepath" : NULL;
+    memset(upload, 0, sizeof(*upload));
+
+    // The chunk list: DATA frames of whole records until EOF
+    while (1)
+    {
+        if (fs_recv_frame(sock, &frame, buffer, FS_MAX_PAYLOAD) != 1)
+        {
+            free(records);
+            return -1;
+        }
+        if (frame.opcode == FS_OP_REPLY)
+        {
+            free(records);
+            return -2;
+        }
+        if (frame.opcode != FS_OP_DATA)
+        {
+            free(records);
+            errno = EPROTO;
+            return -1;
+        }
+        size_t n = frame.length / CHUNK_RECORD;
+        if (*error == NULL && (frame.length % CHUNK_RECORD != 0 || count + n > limit))
+            *error = "Error: Invalid chunk list";
+        if (*error == NULL && n > 0)
+        {
+            struct chunk_record *grown = realloc(records, (count + n) * sizeof(*records));
+            if (grown == NULL)
+                *error = "Error: Out of memory";
+            else
+                records = grown;
+        }
+        for (size_t i = 0; *error == NULL && i < n; i++)
+        {
+            chunk_get_record((unsigned char *)buffer + i * CHUNK_RECORD, &records[count]);
+            if (records[count].length == 0 || records[count].length > CHUNK_MAX)
+                *error = "Error: Invalid chunk list";
+            total += records[count++].length;
+        }
+        if (frame.flags & FS_FLAG_EOF)
+            break;
+    }
+    if (*error == NULL && total != size)
+        *error = "Error: Chunk list does not match the file size";
+
+    // Decide what is needed. With dedup, chunks already stored are pinned for
+    // the new manifest; of repeats within the file only the first is sent
+    unsigned char *need = *error == NULL ? calloc(count / 8 + 1, 1) : NULL;
+    uint32_t *repeats = *error == NULL ? calloc(count + 1, sizeof(uint32_t)) : NULL;
+    unsigned char *held = *error == NULL ? calloc(count + 1, 1) : NULL; // References this upload owns
+    struct chunk_table wanted = {0};                                      // Needed hash -> its first record + 1
+    int file = -1;
+    uint32_t crc = 0; // Of the chunks written into file
+    if (*error == NULL && (need == NULL || repeats == NULL || held == NULL))
+        *error = "Error: Out of memory";
+    for (size_t i = 0; *error == NULL && i < count; i++)
+    {
+        struct chunk_slot *first = cs->dedup ? chunk_table_find(&wanted, records[i].hash) : NULL;
+        if (first != NULL)
+        {
+            repeats[first->refs - 1]++;
+        }
+        else if (cs->dedup && chunk_pin(cs, records[i].hash))
+        {
+            held[i] = 1;
+        }
+        else
+        {
+            need[i / 8] |= (unsigned char)(1 << (i % 8));
+            repeats[i] = 1;
+            upload->sent++;
+            if (cs->dedup && chunk_table_add(&wanted, records[i].hash, (uint32_t)i + 1) < 0)
+                *error = "Error: Out of memory";
+        }
+    }
+    upload->chunks = count;
+    free(wanted.slots);
+    if (*error == NULL && !cs->dedup)
+    {
+        // Without dedup every chunk is sent and written straight into the file
+        chunk_file_remove(cs, path); // A chunked copy releases its chunks
+        file = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (file < 0)
+            *error = "Error creating file";
+    }
+
+    if (*error == NULL)
+    {
+        // The NEED bitmap, bit i for chunk i; the last frame is flagged EOF
+        size_t bytes = (count + 7) / 8, sent = 0;
+        do
+        {
+            size_t n = bytes - sent < FS_MAX_PAYLOAD ? bytes - sent : FS_MAX_PAYLOAD;
+            uint16_t flags = sent + n == bytes ? FS_FLAG_EOF : 0;
+            if (fs_send_frame(sock, FS_OP_NEED, flags | FS_FLAG_COMPRESSED, request_id, need + sent, (uint32_t)n) < 0)
+                result = -1;
+            sent += n;
+        } while (result == 0 && sent < bytes);
+
+        // The needed chunks, in order, one per DATA frame. With the thread's
+        // io_uring, writes into file go on while the next chunks arrive
+        size_t next = 0;
+        char *plain = NULL; // Decoded chunk, once a compressed one arrives
+        struct fs_uring_writer writer;
+        int async = file >= 0 && fs_uring != NULL && fs_uring_writer_init(&writer, file) == 0;
+        while (result == 0)
+        {
+            char *into = async ? fs_uring_writer_buffer(&writer) : NULL;
+            into = into != NULL ? into : buffer;
+            char *chunk = into;
+            if (fs_recv_frame(sock, &frame, into, FS_MAX_PAYLOAD) != 1)
+            {
+                result = -1;
+                break;
+            }
+            upload->wire_bytes += frame.length;
+            if ((frame.flags & FS_FLAG_COMPRESSED) && plain == NULL && (plain = malloc(FS_MAX_PAYLOAD + 1)) == NULL)
+            {
+                result = -1;
+                break;
+            }
+            if (compress_decode(&frame, &chunk, plain) < 0)
+            {
+                result = -1; // Out of step with the sender
+                break;
+            }
+            upload->bytes += frame.length;
+            if (frame.opcode == FS_OP_REPLY)
+            {
+                result = -2;
+                break;
+            }
+            if (frame.opcode != FS_OP_DATA)
+            {
+                errno = EPROTO;
+                result = -1;
+                break;
+            }
+            while (next < count && !(need[next / 8] & (1 << (next % 8))))
+                next++;
+            if (frame.length > 0 && *error == NULL)
+            {
+                unsigned char hash[32];
+                if (next == count || frame.length != records[next].length)
+                {
+                    *error = "Error: Unexpected chunk";
+                }
+                else
+                {
+                    sha256(chunk, frame.length, hash);
+                    if (memcmp(hash, records[next].hash, 32) != 0)
+                        *error = "Error: Chunk does not match its hash";
+                    else if (file >= 0 && async && fs_uring_write(&writer, chunk, frame.length) < 0)
+                        *error = "Error writing to file";
+                    else if (file >= 0 && !async && write(file, chunk, frame.length) != (ssize_t)frame.length)
+                        *error = "Error writing to file";
+                    else if (file < 0 && chunk_put(cs, &records[next], chunk, repeats[next]) < 0)
+                        *error = "Error writing chunk";
+                    else
+                    {
+                        held[next] = 1;
+                        if (file >= 0)
+                            crc = crc32c(crc, chunk, frame.length);
+                    }
+                }
+                next++;
+            }
+            if (frame.flags & FS_FLAG_EOF)
+                break;
+        }
+        free(plain);
+        if (async && fs_uring_writer_finish(&writer) < 0 && result == 0 && *error == NULL)
+            *error = "Error writing to file";
+        while (result == 0 && *error == NULL && next < count && !(need[next / 8] & (1 << (next % 8))))
+            next++;
+        if (result == 0 && *error == NULL && next != count)
+            *error = "Error: Incomplete file transfer";
+    }
+
+    if (result == 0 && *error == NULL && cs->dedup)
+    {
+        char *tmp = chunk_manifest_write(path, records, count, size);
+        if (tmp == NULL || chunk_file_replace(cs, path, tmp) < 0)
+        {
+            if (tmp != NULL)
+                unlink(tmp);
+            *error = "Error writing file manifest";
+        }
+        free(tmp);
+    }
+    if (file >= 0 && result == 0 && *error == NULL)
+        crc32c_store(file, crc); // Sent with whole-file downloads, like a file stored in one stream
+    if (file >= 0 && close(file) < 0 && *error == NULL)
+        *error = "Error writing to file";
+    if (result != 0 || *error != NULL)
+    {
+        // Give back what this upload took: one reference per pinned chunk,
+        // one per occurrence for a chunk it stored
+        pthread_mutex_lock(&cs->lock);
+        for (size_t i = 0; held != NULL && cs->dedup && i < count; i++)
+        {
+            for (uint32_t k = 0; held[i] && k < (repeats[i] ? repeats[i] : 1); k++)
+                chunk_release_locked(cs, &records[i], 1);
+        }
+        pthread_mutex_unlock(&cs->lock);
+        if (file >= 0)
+            unlink(path);
+    }
+    free(need);
+    free(repeats);
+    free(held);
+    free(records);
+    if (result != 0)
+        return result;
+    return *error != NULL ? 1 : 0;
+}
+
+#endif
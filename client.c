@@ -1,429 +1,1315 @@
-// Include necessary header files for the program
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <unistd.h>
-#include <arpa/inet.h>
-#include <sys/socket.h>
-#include <fcntl.h>
-#include <errno.h>
-#include <signal.h>
-#include <sys/stat.h>
-
-#define MAX_BUFFER 1000024 // Maximum buffer size for I/O operations
-#define SMAIN_PORT 4530 // Port number for server connection
-#define CHUNK_SIZE 8192 // Size of data chunks to send or receive
-
-// Function prototypes
-void send_file(int socket, const char *filename);
-void receive_file(int socket, const char *filename);
-int validate_command(char *command, char *args);
-void handle_display(int client_socket, const char *pathname);
-void receive_tar_file(int socket, const char *filename);
-
-// Signal handler for segmentation faults
-void segfault_handler(int signal)
-{
-    fprintf(stderr, "Caught segmentation fault!\n");
-    exit(1);
-}
-
-int main()
-{
-    signal(SIGSEGV, segfault_handler);
-    int client_socket;
-    struct sockaddr_in server_addr;
-    char buffer[MAX_BUFFER];
-    char *server_ip = "127.0.0.1";
-    ssize_t bytes_sent, bytes_received;
-
-    while (1)
-    {
-        // Create a new socket for each request
-        client_socket = socket(AF_INET, SOCK_STREAM, 0);
-        if (client_socket < 0)
-        {
-            perror("Error creating socket");
-            continue; // Try again for the next command
-        }
-
-        // Set up server address structure
-        server_addr.sin_family = AF_INET;
-        server_addr.sin_port = htons(SMAIN_PORT);
-        server_addr.sin_addr.s_addr = inet_addr(server_ip);
-
-        // Connect to the server
-        if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
-        {
-            perror("Error connecting to server");
-            close(client_socket);
-            continue; // Try again for the next command
-        }
-
-        // Prompt user for input
-        printf("client24s$ ");
-        fflush(stdout);
-        if (fgets(buffer, MAX_BUFFER, stdin) == NULL)
-        {
-            perror("Error reading input");
-            break;
-        }
-        buffer[strcspn(buffer, "\n")] = 0; // Remove newline
-
-        // Exit the loop if the command is "exit"
-        if (strcmp(buffer, "exit") == 0)
-        {
-            break;
-        }
-
-        char command_copy[MAX_BUFFER];
-        strcpy(command_copy, buffer);              // Copy the input buffer to command_copy
-        char *command = strtok(command_copy, " "); // Extract command from input
-        char *args = strtok(NULL, "");             // Extract arguments from input
-
-        // Validate the command syntax
-        if (!validate_command(command, args))
-        {
-            printf("Invalid command syntax\n");
-            continue;
-        }
-
-        // Send command to the server
-        bytes_sent = send(client_socket, buffer, strlen(buffer), 0);
-        if (bytes_sent < 0)
-        {
-            perror("Error sending message");
-            continue;
-        }
-
-        // Handle specific commands
-        if (strcmp(command, "ufile") == 0)
-        {
-            char *filename = strtok(args, " ");
-            if (access(filename, F_OK) == -1)
-            {
-                printf("Error: File %s does not exist\n", filename);
-                continue;
-            }
-            send_file(client_socket, filename); // Send file to the server
-        }
-        else if (strcmp(command, "rmfile") == 0)
-        {
-            char response[MAX_BUFFER];
-            int bytes_received = recv(client_socket, response, MAX_BUFFER - 1, 0);
-            if (bytes_received > 0)
-            {
-                response[bytes_received] = '\0';
-                printf("%s\n", response); // Print server response
-            }
-            else if (bytes_received == 0)
-            {
-                printf("Server closed the connection.\n");
-            }
-            else
-            {
-                perror("Error receiving server response");
-            }
-            continue; // Move to the next command
-        }
-        else if (strcmp(command, "dfile") == 0)
-        {
-            char *filename = strtok(args, " ");
-            if (filename != NULL)
-            {
-                char *base_filename = strrchr(filename, '/');
-                base_filename = (base_filename == NULL) ? filename : base_filename + 1;
-                receive_file(client_socket, base_filename); // Receive file from the server
-            }
-            else
-            {
-                printf("Error: No filename specified for download.\n");
-            }
-            continue;
-        }
-        else if (strncmp(command, "dtar", 4) == 0)
-        {
-            if (args != NULL)
-            {
-                char dtar_command[MAX_BUFFER];
-                snprintf(dtar_command, sizeof(dtar_command), "dtar %s", args);
-                send(client_socket, dtar_command, strlen(dtar_command), 0);
-
-                char tar_filename[20];
-                snprintf(tar_filename, sizeof(tar_filename), "%s.tar", args + 1);
-                receive_tar_file(client_socket, tar_filename); // Receive tar file from the server
-            }
-            else
-            {
-                printf("Error: No file extension specified for dtar.\n");
-            }
-        }
-     else if (strncmp(buffer, "display", 7) == 0) {
-    char *pathname = buffer + 8;  // Skip "display " (7 characters + 1 space)
-    if (strlen(pathname) > 0) {
-        handle_display(client_socket, pathname);
-    } else {
-        printf("Invalid display command format\n");
-    }
-   continue;  // Skip the general response handling
-}
-        else
-        {
-            printf("Unknown command\n");
-            continue;
-        }
-        // continue;
-
-        // Receive and print the server's response
-        char response[MAX_BUFFER];
-        int bytes_received = recv(client_socket, response, MAX_BUFFER - 1, 0);
-        if (bytes_received > 0)
-        {
-            response[bytes_received] = '\0';
-        }
-        else if (bytes_received == 0)
-        {
-            printf("Server closed the connection.\n");
-        }
-        else
-        {
-            perror("Error receiving server response"); // Print error message if receiving fails
-        }
-
-        buffer[bytes_received] = '\0';
-        // Close the socket
-        close(client_socket);
-        printf("\n");
-    }
-
-    return 0;
-}
-// Validate the command and arguments
-int validate_command(char *command, char *args)
-{
-    if (strcmp(command, "ufile") == 0)
-    {
-        char *filename = strtok(args, " ");
-        char *path = strtok(NULL, " ");
-        return (filename != NULL && path != NULL && strstr(path, "~/smain") == path);
-    }
-    else if (strcmp(command, "rmfile") == 0)
-    {
-        return (args != NULL && strstr(args, "~/smain") == args &&
-                (strstr(args, ".c") || strstr(args, ".txt") || strstr(args, ".pdf")));
-    }
-    else if (strcmp(command, "dfile") == 0)
-    {
-        return (args != NULL && strstr(args, "~/smain") == args &&
-                (strstr(args, ".c") || strstr(args, ".txt") || strstr(args, ".pdf")));
-    }
-    else if (strcmp(command, "dtar") == 0)
-    {
-        return (args != NULL && (strcmp(args, ".c") == 0 || strcmp(args, ".txt") == 0 || strcmp(args, ".pdf") == 0));
-    }
-    else if (strcmp(command, "display") == 0)
-    {
-        return (args != NULL && strstr(args, "~/smain") == args);
-    }
-    return 0;
-}
-// Send a file to the server
-void send_file(int client_socket, const char *file_path)
-{
-    FILE *file = fopen(file_path, "rb"); // Open file in binary read mode
-    if (!file)
-    {
-        perror("Failed to open file");
-        send(client_socket, "Error: File not found.\n", 23, 0);
-        return;
-    }
-
-    fseek(file, 0, SEEK_END); // Move to the end of the file to get its size
-    long file_size = ftell(file);
-    fseek(file, 0, SEEK_SET); // Move back to the beginning of the file
-
-    char size_buffer[32];
-    snprintf(size_buffer, sizeof(size_buffer), "%ld", file_size);
-    send(client_socket, size_buffer, strlen(size_buffer), 0); // Send file size to the server
-
-    char buffer[CHUNK_SIZE];
-    size_t bytes_read;
-    long total_sent = 0;
-    while ((bytes_read = fread(buffer, 1, sizeof(buffer), file)) > 0)
-    {
-        ssize_t bytes_sent = send(client_socket, buffer, bytes_read, 0);
-        if (bytes_sent < 0)
-        {
-            perror("Error sending file data"); // Print error message if sending data fails
-            break;
-        }
-        total_sent += bytes_sent;
-    }
-
-    fclose(file);
-
-    if (total_sent == file_size)
-    {
-        printf("File sent successfully: %s\n", file_path);
-        send(client_socket, "File sent successfully.\n", 24, 0);
-    }
-    else
-    {
-        printf("Error: Incomplete file transfer. Sent %ld/%ld bytes\n", total_sent, file_size);
-        send(client_socket, "Error: Incomplete file transfer.\n", 32, 0);
-    }
-}
-// Receive a file from the server
-void receive_file(int socket, const char *filename)
-{
-    char size_str[32]; // Buffer to hold the size of the file as a string
-                       // Receive the size of the file from the server
-    ssize_t size_received = recv(socket, size_str, sizeof(size_str) - 1, 0);
-    if (size_received <= 0)
-    {
-        fprintf(stderr, "Error receiving file size\n");
-        return;
-    }
-    size_str[size_received] = '\0'; // Null-terminate the size string
-    size_t file_size = strtoull(size_str, NULL, 10);
-
-    // Send acknowledgment
-    send(socket, "ACK", 3, 0);
-
-    int file = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644);
-    if (file < 0)
-    {
-        perror("Error opening file for writing");
-        return;
-    }
-    // Buffer to hold data received from the server
-    char buffer[MAX_BUFFER];
-    size_t total_received = 0;
-    // Loop until the entire file is received
-    while (total_received < file_size)
-    {
-        // Determine the number of bytes to receive in this iteration
-        ssize_t bytes_to_receive = (file_size - total_received < sizeof(buffer)) ? (file_size - total_received) : sizeof(buffer);
-        // Receive data from the server
-        ssize_t bytes_received = recv(socket, buffer, bytes_to_receive, 0);
-        if (bytes_received <= 0)
-        {
-            if (bytes_received < 0)
-            {
-                perror("Error receiving file data");
-            }
-            break;
-        }
-        // Write the received data to the file
-        ssize_t bytes_written = write(file, buffer, bytes_received);
-        if (bytes_written != bytes_received) // Check if writing data to the file was successful
-        {
-            fprintf(stderr, "Error writing to file\n");
-            break;
-        }
-        total_received += bytes_received; // Update the total received data count
-    }
-
-    close(file);
-    // Check if the entire file was received
-    if (total_received == file_size)
-    {
-        printf("File downloaded successfully: %s\n", filename);
-    }
-    else
-    {
-        printf("Error: Incomplete file transfer. Received %zu/%zu bytes\n", total_received, file_size);
-        // Remove the incomplete file
-        unlink(filename);
-    }
-
-    // Wait for server's completion message
-    char server_response[MAX_BUFFER];
-    ssize_t response_size = recv(socket, server_response, sizeof(server_response) - 1, 0);
-    if (response_size > 0)
-    {
-        server_response[response_size] = '\0'; // Null-terminate the server response
-    }
-    else
-    {
-        printf("No response from server after file transfer.\n");
-    }
-}
-
-void handle_display(int client_socket, const char *pathname)
-{
-    char command[MAX_BUFFER];
-    snprintf(command, sizeof(command), "display %s", pathname);
-
-    if (send(client_socket, command, strlen(command), 0) < 0)
-    {
-        perror("Error sending display command");
-        return;
-    }
-
-    char response[MAX_BUFFER];
-    ssize_t bytes_received = recv(client_socket, response, sizeof(response) - 1, 0);
-    if (bytes_received > 0)
-    {
-        response[bytes_received] = '\0';
-        printf("Files in %s:\n%s", pathname, response);
-    }
-    else
-    {
-        printf("Error receiving display response\n");
-    }
-}
-// Receive a tar file from the server
-void receive_tar_file(int server_socket, const char *filename)
-{
-    // After sending the "dtar .txt" command
-    char size_buffer[32];
-    ssize_t size_received = recv(server_socket, size_buffer, sizeof(size_buffer) - 1, 0);
-    if (size_received <= 0)
-    {
-        perror("Error receiving file size");
-        return;
-    }
-    size_buffer[size_received] = '\0';
-    size_t expected_size = atoll(size_buffer);
-
-    // Then proceed with receiving the file data
-
-    FILE *file = fopen(filename, "wb"); // Open file in binary write mode
-    if (file == NULL)
-    {
-        perror("Error opening file for writing");
-        return;
-    }
-    // Buffer to hold data received from the server
-    char buffer[MAX_BUFFER];
-    size_t total_received = 0;
-    // Loop until the entire file is received
-    while (total_received < expected_size)
-    {
-        ssize_t bytes_received = recv(server_socket, buffer, sizeof(buffer), 0);
-        if (bytes_received <= 0) // Check if receiving data was successful
-        {
-            if (bytes_received == 0)
-            {
-                printf("Connection closed by server\n");
-            }
-            else
-            {
-                perror("recv failed");
-            }
-            break;
-        }
-        fwrite(buffer, 1, bytes_received, file); // Write received data to file
-        total_received += bytes_received;
-    }
-    // Check if the entire file was received
-    if (total_received == expected_size)
-    {
-        printf("Tar file downloaded successfully: %s\n", filename);
-    }
-    else
-    {
-        printf("Error: Incomplete file transfer. Received %zu/%zu bytes\n", total_received, expected_size);
-    }
-}
+// Include necessary header files for the program
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <signal.h>
+#include <pthread.h>
+#include <glob.h>
+#include <dirent.h>
+#include <time.h>
+#include <sys/stat.h>
+#include "protocol.h"
+#include "chunk_store.h"
+#include "compress.h"
+
+#define MAX_COMMAND (2 * PATH_MAX + 64) // Longest command line: a command and two paths
+#define MAX_MESSAGE FS_MAX_MESSAGE       // Server replies printed to the user
+#define SMAIN_PORT 4530 // Port number for server connection
+#define CHUNK_SIZE 8192 // Size of data chunks to send or receive
+#define PIPELINE_DEPTH 32 // Commands a script keeps in flight unless -p says otherwise
+#define BATCH_STREAMS 4   // Connections a batch upload uses unless -j says otherwise
+
+// What a command is waiting for from Smain
+enum command_kind
+{
+    CMD_MESSAGE, // Nothing: only its notes are printed, in turn
+    CMD_UFILE,
+    CMD_DFILE,
+    CMD_RMFILE,
+    CMD_DTAR,
+    CMD_DISPLAY,
+    CMD_STATS,
+};
+
+// State of the NEED bitmap of a chunked upload
+enum need_state
+{
+    NEED_WAIT,    // Not received yet
+    NEED_READY,   // Complete; the chunks can be sent
+    NEED_REFUSED, // Smain replied instead; nothing more is sent
+    NEED_FAILED,  // The connection failed
+};
+
+// A command sent to Smain whose response has not been handled yet. Smain
+// answers the commands of a connection in order, so these form a queue.
+struct pending
+{
+    enum command_kind kind;
+    char *name;             // Local file written by dfile and dtar, or the directory of display
+    long long offset;       // dfile: where the download is written, -1 for a new file
+    int chunked;            // ufile sent as chunks: its NEED bitmap is handed to the sending side
+    int compress;           // ufile: Smain takes compressed DATA frames
+    long long size;         // ufile: size of the file
+    struct batch *batch;    // ufile: the batch upload it belongs to, which reports it
+    int sent;               // The command and its upload are out (or failed), so notes is complete
+    enum need_state need_state;
+    unsigned char *need;    // The NEED bitmap received so far
+    size_t need_len;
+    int need_compressed;    // The NEED frames said the storage server decodes compressed chunks
+    char notes[MAX_MESSAGE]; // What sending the command reported, printed before its response
+    size_t notes_len;
+    struct pending *next;
+};
+
+// The connection to Smain. The main thread reads commands and sends them,
+// uploads included, without waiting for earlier responses; the receiver
+// thread handles the responses in order and prints them.
+struct session
+{
+    int socket;           // Connection to Smain, or -1
+    int depth;            // Most commands in flight at once
+    int broken;           // The connection failed; the next command reconnects
+    int closing;          // No more commands will be queued
+    int receiver_running; // The receiver thread handles the queue
+    int compress_uploads; // Smain's last reply said it takes compressed uploads
+    pthread_t receiver;
+    pthread_mutex_t lock;
+    pthread_cond_t changed; // A response was handled, a NEED bitmap arrived or a command was queued
+    struct pending *head, *tail;
+    int in_flight;        // Commands queued
+    uint32_t next_request_id; // Identifier of the next request sent on this connection
+    struct batch *batch;  // The batch upload this session sends, if any
+};
+
+// A ufile of a glob or a directory: its files are spread over parallel
+// sessions, each pipelined, and reported together
+struct batch
+{
+    char **files;      // Local paths
+    char **paths;      // Directory each file is stored in
+    long long *sizes;
+    size_t count, capacity;
+    size_t next;       // Next file to send
+    size_t stored, failed;
+    long long bytes, total_bytes;
+    struct timespec start, last_report;
+    pthread_mutex_t lock;
+};
+
+// Function prototypes
+void session_init(struct session *s, int depth);
+void session_command(struct session *s, char *line);
+int session_ufile(struct session *s, struct pending *p, const char *filename, const char *name, const char *path);
+int session_connect(struct session *s);
+void session_close(struct session *s);
+void *receive_responses(void *arg);
+int receive_response(struct session *s, struct pending *p);
+int receive_need(int socket, struct pending *p, char *reply, size_t reply_size);
+struct pending *pending_create(enum command_kind kind);
+void pending_queue(struct session *s, struct pending *p, int sent);
+void pending_sent(struct session *s, struct pending *p, int result);
+void pending_message(struct session *s, struct pending *p);
+void note(struct pending *p, const char *format, ...);
+void batch_upload(struct session *s, const char *source, const char *path);
+int batch_collect(struct batch *b, const char *source, const char *path);
+void batch_run(struct batch *b, int streams);
+void *batch_stream(void *arg);
+void batch_report(struct batch *b, struct pending *p, int stored, const char *reply);
+void batch_free(struct batch *b);
+double seconds_between(const struct timespec *from, const struct timespec *to);
+int send_file(int socket, struct pending *p, const char *filename);
+int send_file_chunks(struct session *s, struct pending *p, const char *filename);
+int receive_file(int socket, const char *filename, long long offset);
+int validate_command(char *command, char *args);
+int receive_display(int client_socket, const char *pathname);
+int receive_stats(int client_socket);
+int receive_tar_file(int socket, const char *filename);
+int receive_download(int socket, const char *filename, long long offset, char *reply, size_t reply_size);
+int receive_reply(int socket, char *reply, size_t reply_size);
+
+int batch_streams = BATCH_STREAMS; // Connections a batch upload uses
+int chunk_uploads;                 // -d: .txt and .pdf uploads go as chunks, for storage servers that deduplicate
+__thread int smain_decodes;        // The last reply this receiver thread read said Smain takes compressed uploads
+
+// Signal handler for segmentation faults
+void segfault_handler(int signal)
+{
+    fprintf(stderr, "Caught segmentation fault!\n");
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    signal(SIGSEGV, segfault_handler);
+    signal(SIGPIPE, SIG_IGN); // A lost server fails the upload's sendfile() instead of killing the client
+    char buffer[MAX_COMMAND];
+
+    // Typed commands run one at a time; a script keeps several in flight
+    struct session s;
+    session_init(&s, isatty(STDIN_FILENO) ? 1 : PIPELINE_DEPTH);
+    int opt;
+    while ((opt = getopt(argc, argv, "p:j:d")) != -1)
+    {
+        if (opt == 'p' && atoi(optarg) > 0)
+        {
+            s.depth = atoi(optarg);
+        }
+        else if (opt == 'j' && atoi(optarg) > 0)
+        {
+            batch_streams = atoi(optarg);
+        }
+        else if (opt == 'd')
+        {
+            chunk_uploads = 1;
+        }
+        else
+        {
+            fprintf(stderr, "Usage: %s [-p pipeline_depth] [-j upload_streams] [-d]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    while (1)
+    {
+        // Wait for room in the pipeline; at depth one the last command has finished printing
+        pthread_mutex_lock(&s.lock);
+        while (s.in_flight >= s.depth)
+        {
+            pthread_cond_wait(&s.changed, &s.lock);
+        }
+        pthread_mutex_unlock(&s.lock);
+
+        // Prompt user for input
+        if (s.depth == 1)
+        {
+            printf("client24s$ ");
+            fflush(stdout);
+        }
+        if (fgets(buffer, sizeof(buffer), stdin) == NULL)
+        {
+            if (ferror(stdin))
+                perror("Error reading input");
+            break;
+        }
+        buffer[strcspn(buffer, "\n")] = 0; // Remove newline
+
+        // Exit the loop if the command is "exit"
+        if (strcmp(buffer, "exit") == 0)
+        {
+            break;
+        }
+        session_command(&s, buffer);
+    }
+
+    // Let the responses still in flight arrive
+    session_close(&s);
+    return 0;
+}
+
+void session_init(struct session *s, int depth)
+{
+    memset(s, 0, sizeof(*s));
+    s->socket = -1;
+    s->depth = depth;
+    s->next_request_id = 1;
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_cond_init(&s->changed, NULL);
+}
+
+// Send one command line to Smain, queueing it for the receiver thread
+void session_command(struct session *s, char *line)
+{
+    char command_copy[MAX_COMMAND];
+    strcpy(command_copy, line);                // Copy the input buffer to command_copy
+    char *command = strtok(command_copy, " "); // Extract command from input
+    char *args = strtok(NULL, "");             // Extract arguments from input
+
+    // Validate the command syntax
+    struct pending *p = pending_create(CMD_MESSAGE);
+    if (p == NULL)
+    {
+        perror("Error allocating command");
+        return;
+    }
+    if (command == NULL || !validate_command(command, args))
+    {
+        note(p, "Invalid command syntax\n");
+        pending_message(s, p);
+        return;
+    }
+    if (strcmp(command, "ufile") != 0 && strcmp(command, "rmfile") != 0 && strcmp(command, "dfile") != 0 &&
+        strcmp(command, "dtar") != 0 && strcmp(command, "display") != 0 && strcmp(command, "stats") != 0)
+    {
+        note(p, "Unknown command\n");
+        pending_message(s, p);
+        return;
+    }
+    char *filename = NULL, *path = NULL;
+    char ufile_copy[MAX_COMMAND];
+    if (strcmp(command, "ufile") == 0)
+    {
+        // validate_command tokenized args in place, so split a fresh copy
+        strcpy(ufile_copy, line);
+        strtok(ufile_copy, " ");
+        filename = strtok(NULL, " ");
+        path = strtok(NULL, " ");
+        struct stat file_stat;
+        if (strpbrk(filename, "*?[") != NULL || (stat(filename, &file_stat) == 0 && S_ISDIR(file_stat.st_mode)))
+        {
+            // A glob or a directory: its files go over parallel connections
+            free(p);
+            batch_upload(s, filename, path);
+            return;
+        }
+    }
+    if (session_connect(s) < 0)
+    {
+        note(p, "Error connecting to server: %s\n", strerror(errno));
+        pending_message(s, p);
+        return;
+    }
+    if (filename != NULL)
+    {
+        if (session_ufile(s, p, filename, filename, path) < 0)
+        {
+            note(p, "Error: File %s does not exist\n", filename);
+            pending_message(s, p);
+        }
+        return;
+    }
+
+    // Send command to the server as a single request frame
+    int client_socket = s->socket;
+    uint32_t request_id = s->next_request_id++;
+    int bytes_sent = 0;
+    if (strcmp(command, "rmfile") == 0)
+    {
+        p->kind = CMD_RMFILE;
+        pending_queue(s, p, 0);
+        const char *request_args[] = {args};
+        bytes_sent = fs_send_request(client_socket, FS_OP_RMFILE, request_id, 1, request_args);
+    }
+    else if (strcmp(command, "dfile") == 0)
+    {
+        // dfile <path> [-c | <offset> [<length>]]: -c continues a partial download
+        char *filename = strtok(args, " ");
+        char *offset_arg = strtok(NULL, " ");
+        char *length_arg = strtok(NULL, " ");
+        char *base_filename = strrchr(filename, '/');
+        base_filename = (base_filename == NULL) ? filename : base_filename + 1;
+        char offset_str[32];
+        long long offset = -1; // Where the download is written; -1 starts a new file
+        if (offset_arg != NULL && strcmp(offset_arg, "-c") == 0)
+        {
+            struct stat partial;
+            offset = stat(base_filename, &partial) == 0 ? (long long)partial.st_size : 0;
+            snprintf(offset_str, sizeof(offset_str), "%lld", offset);
+            offset_arg = offset_str;
+            length_arg = NULL;
+        }
+        else if (offset_arg != NULL)
+        {
+            offset = strtoll(offset_arg, NULL, 10);
+        }
+        p->kind = CMD_DFILE;
+        p->name = strdup(base_filename);
+        p->offset = offset;
+        pending_queue(s, p, 0);
+        const char *request_args[] = {filename, offset_arg, length_arg};
+        int request_argc = length_arg != NULL ? 3 : offset_arg != NULL ? 2 : 1;
+        // Offer to take the file compressed; the server decides whether it is worth it
+        bytes_sent = fs_send_request_flags(client_socket, FS_OP_DFILE, FS_FLAG_COMPRESSED, request_id, request_argc,
+                                           request_args);
+    }
+    else if (strcmp(command, "dtar") == 0)
+    {
+        char tar_filename[20];
+        snprintf(tar_filename, sizeof(tar_filename), "%s.tar", args + 1);
+        p->kind = CMD_DTAR;
+        p->name = strdup(tar_filename);
+        pending_queue(s, p, 0);
+        const char *request_args[] = {args};
+        bytes_sent = fs_send_request_flags(client_socket, FS_OP_DTAR, FS_FLAG_COMPRESSED, request_id, 1, request_args);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        p->kind = CMD_STATS;
+        pending_queue(s, p, 0);
+        const char *request_args[] = {args};
+        bytes_sent = fs_send_request(client_socket, FS_OP_STATS, request_id, args != NULL ? 1 : 0, request_args);
+    }
+    else
+    {
+        p->kind = CMD_DISPLAY;
+        p->name = strdup(args);
+        pending_queue(s, p, 0);
+        const char *request_args[] = {args};
+        bytes_sent = fs_send_request(client_socket, FS_OP_DISPLAY, request_id, 1, request_args);
+    }
+    pending_sent(s, p, bytes_sent);
+}
+
+// Queue a ufile of the local file filename, stored as name in path, and send
+// it followed by the file's content. Returns -1, leaving p unqueued, if the
+// file does not exist.
+int session_ufile(struct session *s, struct pending *p, const char *filename, const char *name, const char *path)
+{
+    struct stat file_stat;
+    if (stat(filename, &file_stat) == -1)
+    {
+        return -1;
+    }
+    char size_str[32];
+    snprintf(size_str, sizeof(size_str), "%lld", (long long)file_stat.st_size);
+    // With -d, text and PDF files go as chunks, so the storage server can skip those it has;
+    // otherwise they are streamed like any other file
+    const char *extension = strrchr(name, '.');
+    p->kind = CMD_UFILE;
+    p->size = file_stat.st_size;
+    p->chunked = chunk_uploads && extension != NULL && (strcmp(extension, ".txt") == 0 || strcmp(extension, ".pdf") == 0);
+    pending_queue(s, p, 0);
+    const char *request_args[] = {name, path, size_str, "chunks"};
+    int bytes_sent = fs_send_request(s->socket, FS_OP_UFILE, s->next_request_id++, p->chunked ? 4 : 3, request_args);
+    // The file content follows the command immediately, no ACK round trip
+    if (bytes_sent >= 0)
+    {
+        bytes_sent = p->chunked ? send_file_chunks(s, p, filename) : send_file(s->socket, p, filename);
+    }
+    pending_sent(s, p, bytes_sent);
+    return 0;
+}
+
+// Make sure the session has a working connection, reconnecting after a
+// failure once the receiver has finished with the old one. Returns -1 if
+// Smain cannot be reached.
+int session_connect(struct session *s)
+{
+    pthread_mutex_lock(&s->lock);
+    int usable = s->receiver_running && !s->broken;
+    pthread_mutex_unlock(&s->lock);
+    if (usable)
+    {
+        return 0;
+    }
+    if (s->socket >= 0)
+    {
+        pthread_join(s->receiver, NULL); // It stops once the commands of the old connection are reported
+        close(s->socket);
+        s->socket = -1;
+    }
+
+    // Set up server address structure
+    struct sockaddr_in server_addr;
+    server_addr.sin_family = AF_INET;
+    server_addr.sin_port = htons(SMAIN_PORT);
+    server_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+    int client_socket = socket(AF_INET, SOCK_STREAM, 0);
+    if (client_socket < 0)
+    {
+        return -1;
+    }
+    if (connect(client_socket, (struct sockaddr *)&server_addr, sizeof(server_addr)) < 0)
+    {
+        int saved = errno;
+        close(client_socket);
+        errno = saved;
+        return -1;
+    }
+    fs_set_nodelay(client_socket);
+    s->socket = client_socket;
+    s->broken = 0;
+    s->receiver_running = 1;
+    if (pthread_create(&s->receiver, NULL, receive_responses, s) != 0)
+    {
+        s->receiver_running = 0;
+        close(client_socket);
+        s->socket = -1;
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for every queued response, then close the connection
+void session_close(struct session *s)
+{
+    pthread_mutex_lock(&s->lock);
+    s->closing = 1;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+    if (s->socket >= 0)
+    {
+        pthread_join(s->receiver, NULL);
+        close(s->socket);
+        s->socket = -1;
+    }
+}
+
+// Receiver thread: handle the responses to queued commands in order until
+// the session closes or the connection fails with nothing left queued
+void *receive_responses(void *arg)
+{
+    struct session *s = arg;
+    pthread_mutex_lock(&s->lock);
+    while (1)
+    {
+        while (s->head == NULL && !s->broken && !s->closing)
+        {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+        struct pending *p = s->head;
+        if (p == NULL)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&s->lock);
+        int result = receive_response(s, p);
+        fflush(stdout);
+        pthread_mutex_lock(&s->lock);
+        if ((result == -1 || result == -2) && p->kind != CMD_MESSAGE && !s->broken)
+        {
+            // Whatever is queued behind it fails at once rather than waiting on the socket
+            s->broken = 1;
+            shutdown(s->socket, SHUT_RDWR);
+        }
+        s->compress_uploads = smain_decodes;
+        s->head = p->next;
+        if (s->head == NULL)
+            s->tail = NULL;
+        s->in_flight--;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+        free(p->need);
+        free(p->name);
+        free(p);
+        pthread_mutex_lock(&s->lock);
+    }
+    s->receiver_running = 0;
+    pthread_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// Handle and print the response to one command. Returns the result of
+// receiving it: -1 or -2 when the connection failed.
+int receive_response(struct session *s, struct pending *p)
+{
+    char response[MAX_MESSAGE];
+    int result = 0;
+    if (p->chunked)
+    {
+        // The sending side waits for the NEED bitmap before it sends the chunks
+        result = receive_need(s->socket, p, response, sizeof(response));
+        pthread_mutex_lock(&s->lock);
+        p->need_state = result == 0 ? NEED_READY : result > 0 ? NEED_REFUSED : NEED_FAILED;
+        pthread_cond_broadcast(&s->changed);
+        pthread_mutex_unlock(&s->lock);
+    }
+    if ((p->kind == CMD_UFILE || p->kind == CMD_RMFILE) && result == 0)
+    {
+        result = receive_reply(s->socket, response, sizeof(response));
+    }
+
+    // What sending reported comes first
+    pthread_mutex_lock(&s->lock);
+    while (!p->sent)
+    {
+        pthread_cond_wait(&s->changed, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+    if (p->batch != NULL)
+    {
+        batch_report(p->batch, p, result == 0, response);
+        return result;
+    }
+    fputs(p->notes, stdout);
+
+    switch (p->kind)
+    {
+    case CMD_MESSAGE:
+        return 0;
+    case CMD_UFILE:
+    case CMD_RMFILE:
+        if (result >= 0)
+        {
+            printf("%s\n", response); // Print server response
+        }
+        break;
+    case CMD_DFILE:
+        result = receive_file(s->socket, p->name, p->offset); // Receive file from the server
+        break;
+    case CMD_DTAR:
+        result = receive_tar_file(s->socket, p->name); // Receive tar file from the server
+        break;
+    case CMD_DISPLAY:
+        result = receive_display(s->socket, p->name);
+        break;
+    case CMD_STATS:
+        result = receive_stats(s->socket);
+        break;
+    }
+    printf("\n");
+    return result;
+}
+
+// Read the NEED bitmap of a chunked upload into p. Returns 0 once it is
+// complete, 1 if the server refused the upload instead (its reply is left in
+// reply), -1 if the connection failed.
+int receive_need(int socket, struct pending *p, char *reply, size_t reply_size)
+{
+    char *buffer = malloc(FS_MAX_PAYLOAD + 1);
+    struct fs_frame frame;
+    int result = buffer != NULL ? 0 : -1;
+    snprintf(reply, reply_size, "Server closed the connection.");
+    while (result == 0)
+    {
+        if (fs_recv_frame(socket, &frame, buffer, FS_MAX_PAYLOAD) != 1)
+        {
+            perror("Error receiving server response");
+            result = -1;
+        }
+        else if (frame.opcode == FS_OP_REPLY)
+        {
+            snprintf(reply, reply_size, "%s", buffer);
+            smain_decodes = (frame.flags & FS_FLAG_COMPRESSED) != 0;
+            result = 1;
+        }
+        else if (frame.opcode == FS_OP_NEED)
+        {
+            unsigned char *grown = realloc(p->need, p->need_len + frame.length + 1);
+            if (grown == NULL)
+            {
+                result = -1;
+                break;
+            }
+            p->need = grown;
+            memcpy(p->need + p->need_len, buffer, frame.length);
+            p->need_len += frame.length;
+            p->need_compressed = (frame.flags & FS_FLAG_COMPRESSED) != 0;
+            if (frame.flags & FS_FLAG_EOF)
+                break;
+        }
+    }
+    free(buffer);
+    return result;
+}
+
+struct pending *pending_create(enum command_kind kind)
+{
+    struct pending *p = calloc(1, sizeof(*p));
+    if (p != NULL)
+    {
+        p->kind = kind;
+        p->offset = -1;
+    }
+    return p;
+}
+
+// Add a command to the queue the receiver works through; sent says it is already complete
+void pending_queue(struct session *s, struct pending *p, int sent)
+{
+    pthread_mutex_lock(&s->lock);
+    p->sent = sent;
+    p->compress = s->compress_uploads;
+    if (s->tail != NULL)
+        s->tail->next = p;
+    else
+        s->head = p;
+    s->tail = p;
+    s->in_flight++;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// The command and its upload are out, or failed to go out (result < 0); the
+// receiver may print its notes
+void pending_sent(struct session *s, struct pending *p, int result)
+{
+    if (result < 0)
+    {
+        // The receiver reports the lost connection for this command and any queued behind it
+        note(p, "Error sending message: %s\n", strerror(errno));
+        shutdown(s->socket, SHUT_RDWR);
+    }
+    pthread_mutex_lock(&s->lock);
+    p->sent = 1;
+    pthread_cond_broadcast(&s->changed);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Print a command's notes in turn with the responses still in flight, or
+// right away when nothing is
+void pending_message(struct session *s, struct pending *p)
+{
+    pthread_mutex_lock(&s->lock);
+    int queued = s->receiver_running;
+    pthread_mutex_unlock(&s->lock);
+    if (queued)
+    {
+        pending_queue(s, p, 1);
+        return;
+    }
+    fputs(p->notes, stdout);
+    free(p);
+}
+
+// Add to what is printed for a command before its response
+void note(struct pending *p, const char *format, ...)
+{
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(p->notes + p->notes_len, sizeof(p->notes) - p->notes_len, format, ap);
+    va_end(ap);
+    if (n > 0)
+    {
+        p->notes_len += (size_t)n < sizeof(p->notes) - p->notes_len ? (size_t)n : sizeof(p->notes) - p->notes_len - 1;
+    }
+}
+
+// Upload every .c, .txt and .pdf file a glob or directory names to path,
+// over batch_streams connections at once
+void batch_upload(struct session *s, const char *source, const char *path)
+{
+    // Earlier commands finish printing first
+    pthread_mutex_lock(&s->lock);
+    while (s->in_flight > 0)
+    {
+        pthread_cond_wait(&s->changed, &s->lock);
+    }
+    pthread_mutex_unlock(&s->lock);
+
+    struct batch b = {0};
+    pthread_mutex_init(&b.lock, NULL);
+    glob_t matches;
+    int collected = 0;
+    if (glob(source, 0, NULL, &matches) == 0)
+    {
+        for (size_t i = 0; collected == 0 && i < matches.gl_pathc; i++)
+        {
+            collected = batch_collect(&b, matches.gl_pathv[i], path);
+        }
+        globfree(&matches);
+    }
+    if (collected < 0)
+    {
+        perror("Error listing files");
+    }
+    else if (b.count == 0)
+    {
+        printf("Error: No .c, .txt or .pdf files match %s\n", source);
+    }
+    else
+    {
+        batch_run(&b, batch_streams);
+    }
+    batch_free(&b);
+    printf("\n");
+}
+
+// Add source to the batch: a file to be stored in path, or the files of a
+// directory, those of its subdirectories stored below path. Symbolic links
+// inside a directory are skipped. Returns -1 if memory runs out.
+int batch_collect(struct batch *b, const char *source, const char *path)
+{
+    struct stat st;
+    if (stat(source, &st) < 0)
+    {
+        return 0;
+    }
+    if (S_ISDIR(st.st_mode))
+    {
+        DIR *dir = opendir(source);
+        if (dir == NULL)
+        {
+            printf("Error: Cannot read directory %s: %s\n", source, strerror(errno));
+            return 0;
+        }
+        struct dirent *entry;
+        int result = 0;
+        while (result == 0 && (entry = readdir(dir)) != NULL)
+        {
+            char child[PATH_MAX], child_path[PATH_MAX];
+            struct stat child_stat;
+            snprintf(child, sizeof(child), "%s/%s", source, entry->d_name);
+            if (entry->d_name[0] == '.' || lstat(child, &child_stat) < 0 || S_ISLNK(child_stat.st_mode))
+                continue;
+            snprintf(child_path, sizeof(child_path), "%s/%s", path, entry->d_name);
+            result = batch_collect(b, child, S_ISDIR(child_stat.st_mode) ? child_path : path);
+        }
+        closedir(dir);
+        return result;
+    }
+    const char *extension = strrchr(source, '.');
+    if (!S_ISREG(st.st_mode) || extension == NULL ||
+        (strcmp(extension, ".c") != 0 && strcmp(extension, ".txt") != 0 && strcmp(extension, ".pdf") != 0))
+    {
+        return 0;
+    }
+    if (b->count == b->capacity)
+    {
+        size_t capacity = b->capacity > 0 ? 2 * b->capacity : 64;
+        char **files = realloc(b->files, capacity * sizeof(*files));
+        if (files != NULL)
+            b->files = files;
+        char **paths = realloc(b->paths, capacity * sizeof(*paths));
+        if (paths != NULL)
+            b->paths = paths;
+        long long *sizes = realloc(b->sizes, capacity * sizeof(*sizes));
+        if (sizes != NULL)
+            b->sizes = sizes;
+        if (files == NULL || paths == NULL || sizes == NULL)
+            return -1;
+        b->capacity = capacity;
+    }
+    b->files[b->count] = strdup(source);
+    b->paths[b->count] = strdup(path);
+    if (b->files[b->count] == NULL || b->paths[b->count] == NULL)
+    {
+        free(b->files[b->count]);
+        free(b->paths[b->count]);
+        return -1;
+    }
+    b->sizes[b->count] = st.st_size;
+    b->total_bytes += st.st_size;
+    b->count++;
+    return 0;
+}
+
+double seconds_between(const struct timespec *from, const struct timespec *to)
+{
+    return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) / 1e9;
+}
+
+// Send the batch over streams sessions, each pipelined, and print a summary
+void batch_run(struct batch *b, int streams)
+{
+    if ((size_t)streams > b->count)
+        streams = (int)b->count;
+    struct session *sessions = calloc(streams, sizeof(*sessions));
+    pthread_t *threads = calloc(streams, sizeof(*threads));
+    if (sessions == NULL || threads == NULL)
+    {
+        perror("Error allocating upload streams");
+        free(sessions);
+        free(threads);
+        return;
+    }
+    printf("Uploading %zu files (%.1f MB) over %d connections\n", b->count, b->total_bytes / 1e6, streams);
+    fflush(stdout);
+    clock_gettime(CLOCK_MONOTONIC, &b->start);
+    b->last_report = b->start;
+    int started = 0;
+    for (int i = 0; i < streams; i++)
+    {
+        session_init(&sessions[i], PIPELINE_DEPTH);
+        sessions[i].batch = b;
+        if (pthread_create(&threads[started], NULL, batch_stream, &sessions[i]) == 0)
+            started++;
+    }
+    if (started == 0)
+    {
+        batch_stream(&sessions[0]); // No threads to spare: one stream from here
+    }
+    for (int i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    double elapsed = seconds_between(&b->start, &now);
+    printf("Stored %zu of %zu files, %.1f MB in %.2f s (%.1f MB/s)", b->stored, b->count, b->bytes / 1e6, elapsed,
+           elapsed > 0 ? b->bytes / 1e6 / elapsed : 0.0);
+    if (b->failed > 0)
+    {
+        printf(", %zu failed", b->failed);
+    }
+    printf("\n");
+    for (int i = 0; i < streams; i++)
+    {
+        pthread_mutex_destroy(&sessions[i].lock);
+        pthread_cond_destroy(&sessions[i].changed);
+    }
+    free(sessions);
+    free(threads);
+}
+
+// One connection of a batch: send the batch's next file while there is room
+// in the pipeline; the receiver thread reports each one
+void *batch_stream(void *arg)
+{
+    struct session *s = arg;
+    struct batch *b = s->batch;
+    while (1)
+    {
+        pthread_mutex_lock(&s->lock);
+        while (s->in_flight >= s->depth)
+        {
+            pthread_cond_wait(&s->changed, &s->lock);
+        }
+        pthread_mutex_unlock(&s->lock);
+
+        pthread_mutex_lock(&b->lock);
+        size_t i = b->next < b->count ? b->next++ : b->count;
+        pthread_mutex_unlock(&b->lock);
+        if (i == b->count)
+        {
+            break;
+        }
+        struct pending *p = pending_create(CMD_UFILE);
+        if (p == NULL || (p->name = strdup(b->files[i])) == NULL)
+        {
+            free(p);
+            pthread_mutex_lock(&b->lock);
+            b->failed++;
+            pthread_mutex_unlock(&b->lock);
+            continue;
+        }
+        p->batch = b;
+        p->size = b->sizes[i];
+        const char *name = strrchr(b->files[i], '/');
+        name = name != NULL ? name + 1 : b->files[i];
+        int connected = session_connect(s) == 0;
+        if (!connected)
+        {
+            note(p, "Error connecting to server: %s\n", strerror(errno));
+        }
+        else if (session_ufile(s, p, b->files[i], name, b->paths[i]) == 0)
+        {
+            continue;
+        }
+        else
+        {
+            note(p, "Error: File %s does not exist\n", b->files[i]);
+        }
+        batch_report(b, p, 0, "");
+        free(p->name);
+        free(p);
+        if (!connected)
+        {
+            break; // Smain is down; the files left over are counted as not stored
+        }
+    }
+    session_close(s);
+    return NULL;
+}
+
+// Count a finished upload of the batch. A failed one is printed with its
+// messages; the progress is printed at most once a second.
+void batch_report(struct batch *b, struct pending *p, int stored, const char *reply)
+{
+    pthread_mutex_lock(&b->lock);
+    if (stored)
+    {
+        b->stored++;
+        b->bytes += p->size;
+    }
+    else
+    {
+        b->failed++;
+        printf("Failed to upload %s\n%s", p->name, p->notes);
+        if (reply[0] != '\0')
+            printf("%s\n", reply);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    if (seconds_between(&b->last_report, &now) >= 1.0 && b->stored + b->failed < b->count)
+    {
+        double elapsed = seconds_between(&b->start, &now);
+        printf("Progress: %zu of %zu files, %.1f of %.1f MB, %.1f MB/s\n", b->stored + b->failed, b->count,
+               b->bytes / 1e6, b->total_bytes / 1e6, b->bytes / 1e6 / elapsed);
+        b->last_report = now;
+    }
+    fflush(stdout);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void batch_free(struct batch *b)
+{
+    for (size_t i = 0; i < b->count; i++)
+    {
+        free(b->files[i]);
+        free(b->paths[i]);
+    }
+    free(b->files);
+    free(b->paths);
+    free(b->sizes);
+    pthread_mutex_destroy(&b->lock);
+}
+
+// Validate the command and arguments
+int validate_command(char *command, char *args)
+{
+    if (strcmp(command, "ufile") == 0)
+    {
+        char *filename = strtok(args, " ");
+        char *path = strtok(NULL, " ");
+        return (filename != NULL && path != NULL && strstr(path, "~/smain") == path);
+    }
+    else if (strcmp(command, "rmfile") == 0)
+    {
+        return (args != NULL && strstr(args, "~/smain") == args &&
+                (strstr(args, ".c") || strstr(args, ".txt") || strstr(args, ".pdf")));
+    }
+    else if (strcmp(command, "dfile") == 0)
+    {
+        return (args != NULL && strstr(args, "~/smain") == args &&
+                (strstr(args, ".c") || strstr(args, ".txt") || strstr(args, ".pdf")));
+    }
+    else if (strcmp(command, "dtar") == 0)
+    {
+        return (args != NULL && (strcmp(args, ".c") == 0 || strcmp(args, ".txt") == 0 || strcmp(args, ".pdf") == 0));
+    }
+    else if (strcmp(command, "display") == 0)
+    {
+        return (args != NULL && strstr(args, "~/smain") == args);
+    }
+    else if (strcmp(command, "stats") == 0)
+    {
+        return (args == NULL || strcmp(args, "-m") == 0);
+    }
+    return 0;
+}
+// Send a file to the server as DATA frames, compressed if Smain takes them;
+// returns -1 if the connection failed
+int send_file(int client_socket, struct pending *p, const char *file_path)
+{
+    int file = open(file_path, O_RDONLY); // Open file for reading
+    struct stat file_stat;
+    if (file < 0 || fstat(file, &file_stat) < 0)
+    {
+        note(p, "Failed to open file: %s\n", strerror(errno));
+        if (file >= 0)
+            close(file);
+        // Terminate the announced stream so the server can reject the upload
+        return fs_send_frame(client_socket, FS_OP_DATA, FS_FLAG_EOF, 0, NULL, 0);
+    }
+
+    long file_size = file_stat.st_size;
+    struct compressor compressor;
+    char *buffer = p->compress ? malloc(2 * FS_MAX_PAYLOAD) : NULL;
+    compress_init(&compressor, buffer != NULL, file_path, buffer != NULL ? (unsigned char *)buffer + FS_MAX_PAYLOAD : NULL);
+    uint32_t crc = 0;
+    long long total_sent = compress_send_file_data(client_socket, file, 0, file_size, &compressor, buffer, &crc);
+    if (total_sent >= 0 && fs_send_eof(client_socket, 0, &crc) < 0)
+    {
+        total_sent = -1;
+    }
+    free(buffer);
+    close(file);
+    if (total_sent < 0)
+    {
+        return -1; // Reported as a failed send
+    }
+
+    if (total_sent == file_size)
+    {
+        note(p, "File sent successfully: %s\n", file_path);
+        if (compressor.wire_bytes < compressor.raw_bytes)
+        {
+            note(p, "Compressed %lld bytes to %lld\n", compressor.raw_bytes, compressor.wire_bytes);
+        }
+    }
+    else
+    {
+        note(p, "Error: Incomplete file transfer. Sent %lld/%ld bytes\n", total_sent, file_size);
+    }
+    return 0;
+}
+
+// Upload a file as chunks: send its chunk list, then, once the receiver has
+// the server's NEED bitmap, the chunks it asks for, compressed if its NEED
+// frames say it decodes them. Returns 0 once they are sent or the server
+// refused the upload, -1 if the connection failed.
+int send_file_chunks(struct session *s, struct pending *p, const char *file_path)
+{
+    int client_socket = s->socket;
+    struct chunk_record *records = NULL;
+    long count = -1;
+    int file = open(file_path, O_RDONLY);
+    if (file < 0 || (count = chunk_scan(file, &records)) < 0)
+    {
+        note(p, "Failed to read file: %s\n", strerror(errno));
+        // An empty chunk list does not add up to the announced size, so the server refuses it
+        count = 0;
+    }
+
+    // The chunk list, as many records per DATA frame as fit
+    unsigned char *buffer = malloc(FS_MAX_PAYLOAD + 1);
+    int result = buffer != NULL ? 0 : -1;
+    size_t per_frame = FS_MAX_PAYLOAD / CHUNK_RECORD, used = 0;
+    for (long i = 0; result == 0 && i < count; i++)
+    {
+        chunk_put_record(buffer + used * CHUNK_RECORD, &records[i]);
+        if (++used == per_frame)
+        {
+            result = fs_send_frame(client_socket, FS_OP_DATA, 0, 0, buffer, (uint32_t)(used * CHUNK_RECORD));
+            used = 0;
+        }
+    }
+    if (result == 0)
+    {
+        result = fs_send_frame(client_socket, FS_OP_DATA, FS_FLAG_EOF, 0, buffer, (uint32_t)(used * CHUNK_RECORD));
+    }
+
+    // The server's answer: the NEED bitmap, or a REPLY refusing the upload
+    pthread_mutex_lock(&s->lock);
+    while (result == 0 && p->need_state == NEED_WAIT)
+    {
+        pthread_cond_wait(&s->changed, &s->lock);
+    }
+    enum need_state state = p->need_state;
+    pthread_mutex_unlock(&s->lock);
+    int refused = result == 0 && state == NEED_REFUSED;
+    if (result == 0 && state != NEED_READY)
+    {
+        result = refused ? 0 : -1;
+    }
+
+    // The needed chunks, in order, one DATA frame each
+    struct compressor compressor;
+    unsigned char *packed = result == 0 && !refused && p->need_compressed ? malloc(FS_MAX_PAYLOAD) : NULL;
+    compress_init(&compressor, packed != NULL, file_path, packed);
+    off_t offset = 0;
+    long sent = 0;
+    long long sent_bytes = 0;
+    for (long i = 0; result == 0 && !refused && i < count; offset += records[i].length, i++)
+    {
+        if ((size_t)i / 8 >= p->need_len || !(p->need[i / 8] & (1 << (i % 8))))
+            continue;
+        size_t have = 0;
+        while (have < records[i].length)
+        {
+            ssize_t n = pread(file, buffer + have, records[i].length - have, offset + have);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                break;
+            have += n;
+        }
+        if (have < records[i].length)
+        {
+            // The file changed since it was chunked; the server refuses the mismatch
+            note(p, "Error: File %s changed while being sent\n", file_path);
+            break;
+        }
+        result = compress_send(client_socket, &compressor, 0, 0, buffer, records[i].length);
+        sent++;
+        sent_bytes += records[i].length;
+    }
+    if (result == 0 && !refused)
+    {
+        result = fs_send_frame(client_socket, FS_OP_DATA, FS_FLAG_EOF, 0, NULL, 0);
+    }
+    if (result == 0 && !refused)
+    {
+        note(p, "File sent successfully: %s\n", file_path);
+        if (sent < count)
+        {
+            note(p, "%ld of %ld chunks were already stored; sent %lld bytes\n", count - sent, count, sent_bytes);
+        }
+        if (compressor.wire_bytes < compressor.raw_bytes)
+        {
+            note(p, "Compressed %lld bytes to %lld\n", compressor.raw_bytes, compressor.wire_bytes);
+        }
+    }
+    if (file >= 0)
+        close(file);
+    free(records);
+    free(packed);
+    free(buffer);
+    return result;
+}
+
+// Wait for the REPLY that completes a request, skipping anything before it.
+// Returns 0 on success, 1 if the server reported an error, -1 if the connection failed.
+int receive_reply(int socket, char *reply, size_t reply_size)
+{
+    return receive_download(socket, NULL, -1, reply, reply_size);
+}
+
+// Receive a SIZE/DATA stream into filename (or stdout when filename is NULL
+// and the stream is a listing) until the REPLY that completes the request.
+// The data is written from offset into the existing file, or into a new file
+// when offset is -1. Returns 0 on success, 1 if the server reported an error,
+// 2 if a listing is incomplete (a storage server did not answer), -1 if the
+// connection failed, -2 if it failed after part of the file was written.
+// Compressed DATA frames are decoded, and a download whose checksum trailer
+// does not match the data counts as an error.
+int receive_download(int socket, const char *filename, long long offset, char *reply, size_t reply_size)
+{
+    char *received = malloc(2 * (FS_MAX_PAYLOAD + 1)); // A frame as received, then decoded
+    struct fs_frame frame;
+    int file = -1;
+    int result = -1;
+    long long bytes = 0, wire_bytes = 0;
+    uint32_t crc = 0, expected;
+    int damaged = 0;
+
+    snprintf(reply, reply_size, "Server closed the connection.");
+    if (received == NULL)
+    {
+        return -1;
+    }
+    while (fs_recv_frame(socket, &frame, received, FS_MAX_PAYLOAD) == 1)
+    {
+        char *buffer = received;
+        if (frame.opcode == FS_OP_REPLY)
+        {
+            snprintf(reply, reply_size, "%s", buffer);
+            result = (frame.flags & FS_FLAG_ERROR) ? 1 : (frame.flags & FS_FLAG_PARTIAL) ? 2 : 0;
+            smain_decodes = (frame.flags & FS_FLAG_COMPRESSED) != 0;
+            break;
+        }
+        wire_bytes += frame.opcode == FS_OP_DATA ? frame.length : 0;
+        if (fs_get_checksum(&frame, buffer, &expected))
+        {
+            damaged = expected != crc;
+            continue;
+        }
+        if (frame.opcode == FS_OP_DATA && compress_decode(&frame, &buffer, received + FS_MAX_PAYLOAD + 1) < 0)
+        {
+            snprintf(reply, reply_size, "Corrupt compressed data from the server.");
+            break;
+        }
+        if (frame.opcode == FS_OP_SIZE && filename != NULL && file < 0)
+        {
+            // The size arrives only once the server has the file open
+            file = open(filename, O_WRONLY | O_CREAT | (offset < 0 ? O_TRUNC : 0), 0644);
+            if (file >= 0 && offset > 0 && lseek(file, offset, SEEK_SET) < 0)
+            {
+                close(file);
+                file = -1;
+            }
+            if (file < 0)
+            {
+                perror("Error opening file for writing");
+            }
+            if (frame.length >= 16)
+            {
+                // A range: its length, then the size of the whole file
+                unsigned long long length = fs_get_u64((unsigned char *)buffer);
+                printf("Receiving bytes %lld-%lld of %llu\n", offset, offset + (long long)length,
+                       (unsigned long long)fs_get_u64((unsigned char *)buffer + 8));
+            }
+        }
+        else if (frame.opcode == FS_OP_DATA && frame.length > 0)
+        {
+            bytes += frame.length;
+            crc = crc32c(crc, buffer, frame.length);
+            if (filename == NULL)
+            {
+                fwrite(buffer, 1, frame.length, stdout);
+            }
+            else if (file >= 0 && write(file, buffer, frame.length) != (ssize_t)frame.length)
+            {
+                fprintf(stderr, "Error writing to file\n");
+                close(file);
+                file = -1;
+                if (offset < 0)
+                    unlink(filename);
+            }
+        }
+    }
+    if (result < 0)
+    {
+        perror("Error receiving server response");
+    }
+    if (result == 0 && damaged)
+    {
+        snprintf(reply, reply_size, "Error: Checksum mismatch, the download was damaged.");
+        result = 1;
+    }
+    if (file >= 0)
+    {
+        close(file);
+        result = result < 0 ? -2 : result;
+    }
+    if (result == 0 && filename != NULL && wire_bytes < bytes)
+    {
+        printf("Received %lld bytes compressed to %lld\n", bytes, wire_bytes);
+    }
+    free(received);
+    return result;
+}
+
+// Receive a file from the server, written from offset (-1 for a new file)
+int receive_file(int socket, const char *filename, long long offset)
+{
+    char server_response[MAX_MESSAGE];
+    int result = receive_download(socket, filename, offset, server_response, sizeof(server_response));
+    struct stat partial;
+    // Check if the entire file was received
+    if (result == 0)
+    {
+        printf("File downloaded successfully: %s\n", filename);
+    }
+    else if (result == -2 && stat(filename, &partial) == 0 && partial.st_size > 0)
+    {
+        // Keep what arrived so the download can continue where it stopped
+        printf("%s\n", server_response);
+        printf("Download interrupted: %lld bytes kept in %s; continue with dfile <path> -c\n",
+               (long long)partial.st_size, filename);
+    }
+    else
+    {
+        printf("%s\n", server_response);
+        // Remove the incomplete file, unless it held data from before this download
+        if (offset < 0)
+        {
+            unlink(filename);
+        }
+    }
+    return result;
+}
+
+// Receive and print the listing of a display command
+int receive_display(int client_socket, const char *pathname)
+{
+    printf("Files in %s:\n", pathname);
+    char response[MAX_MESSAGE];
+    int result = receive_download(client_socket, NULL, -1, response, sizeof(response));
+    if (result == 2)
+    {
+        printf("Warning: %s\n", response); // Some servers' files are not listed
+    }
+    else if (result != 0)
+    {
+        printf("Error receiving display response\n");
+    }
+    return result;
+}
+// Receive and print the metrics of the servers
+int receive_stats(int client_socket)
+{
+    char response[MAX_MESSAGE];
+    int result = receive_download(client_socket, NULL, -1, response, sizeof(response));
+    if (result != 0)
+    {
+        printf("Error receiving stats: %s\n", response);
+    }
+    return result;
+}
+
+// Receive a tar file from the server
+int receive_tar_file(int server_socket, const char *filename)
+{
+    char server_response[MAX_MESSAGE];
+    int result = receive_download(server_socket, filename, -1, server_response, sizeof(server_response));
+    // Check if the entire file was received
+    if (result == 0)
+    {
+        printf("Tar file downloaded successfully: %s\n", filename);
+    }
+    else
+    {
+        printf("Error: %s\n", server_response);
+        unlink(filename);
+    }
+    return result;
+}
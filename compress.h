@@ -0,0 +1,306 @@
+// On-the-wire compression of DATA frames, shared by all programs
+//
+// A DATA frame flagged FS_FLAG_COMPRESSED carries its payload as an LZ4
+// block (the raw block format, without the frame format around it): a run
+// of sequences, each a token, literals and a back-reference into the bytes
+// already decoded. Frames never exceed FS_MAX_PAYLOAD before or after
+// compression, so every frame is compressed on its own and decodes into one
+// frame-sized buffer.
+//
+// Compression is negotiated per transfer. The receiver says it decodes
+// compressed frames by setting FS_FLAG_COMPRESSED on the frame that precedes
+// the data: the dfile/dtar request (passed on by Smain as get/tar), the NEED
+// bitmap of a chunked upload, or any REPLY from Smain for later .c uploads.
+// The sender then compresses only files that are worth it: never .pdf
+// files, which are compressed already, and only while the first frame of the
+// transfer shrinks by at least an eighth. A frame that does not shrink goes
+// out as it is.
+#ifndef FS_COMPRESS_H
+#define FS_COMPRESS_H
+
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "protocol.h"
+
+#define LZ4_HASH_BITS 12    // Match finder table of 4096 positions
+#define LZ4_MIN_MATCH 4     // Shortest back-reference
+#define LZ4_LAST_LITERALS 5 // The block ends with at least this many literals
+#define LZ4_MATCH_LIMIT 12  // No match starts this close to the end
+#define COMPRESS_MIN_FRAME 256 // Smaller frames are not worth compressing
+
+static inline uint32_t lz4_read32(const unsigned char *p)
+{
+    uint32_t value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static inline uint32_t lz4_hash(uint32_t value)
+{
+    return (value * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// Append the extra bytes of a length that did not fit its 4-bit token field
+static inline int lz4_put_length(unsigned char *dst, int out, int capacity, int len)
+{
+    for (; len >= 255; len -= 255)
+    {
+        if (out >= capacity)
+            return -1;
+        dst[out++] = 255;
+    }
+    if (out >= capacity)
+        return -1;
+    dst[out++] = (unsigned char)len;
+    return out;
+}
+
+// Append one sequence: literals, then a match of match_len bytes at offset
+// back (none for the last sequence). Returns the new output length, or -1
+// if it does not fit.
+static inline int lz4_put_sequence(unsigned char *dst, int out, int capacity, const unsigned char *literals,
+                                   int literal_len, int offset, int match_len)
+{
+    if (out >= capacity)
+        return -1;
+    int token = out++;
+    dst[token] = (unsigned char)((literal_len >= 15 ? 15 : literal_len) << 4);
+    if (literal_len >= 15 && (out = lz4_put_length(dst, out, capacity, literal_len - 15)) < 0)
+        return -1;
+    if (literal_len > capacity - out)
+        return -1;
+    memcpy(dst + out, literals, literal_len);
+    out += literal_len;
+    if (match_len == 0)
+        return out;
+    if (capacity - out < 2)
+        return -1;
+    dst[out++] = (unsigned char)(offset & 0xff);
+    dst[out++] = (unsigned char)(offset >> 8);
+    match_len -= LZ4_MIN_MATCH;
+    dst[token] |= (unsigned char)(match_len >= 15 ? 15 : match_len);
+    if (match_len >= 15 && (out = lz4_put_length(dst, out, capacity, match_len - 15)) < 0)
+        return -1;
+    return out;
+}
+
+// Compress n bytes (at most FS_MAX_PAYLOAD) of src into an LZ4 block of at
+// most capacity bytes. Returns the block's length, or 0 if it does not fit.
+static inline int lz4_compress(const unsigned char *src, int n, unsigned char *dst, int capacity)
+{
+    uint16_t table[1 << LZ4_HASH_BITS]; // Last position seen for each hash; positions fit since n <= 64 KB
+    memset(table, 0, sizeof(table));
+    int out = 0, anchor = 0;
+    int limit = n - LZ4_MATCH_LIMIT;
+    for (int pos = 1; pos < limit;)
+    {
+        uint32_t sequence = lz4_read32(src + pos);
+        uint32_t hash = lz4_hash(sequence);
+        int candidate = table[hash];
+        table[hash] = (uint16_t)pos;
+        if (lz4_read32(src + candidate) != sequence || pos - candidate > 65535)
+        {
+            pos += 1 + ((pos - anchor) >> 6); // Step faster through data that does not repeat
+            continue;
+        }
+        while (pos > anchor && candidate > 0 && src[pos - 1] == src[candidate - 1])
+        {
+            pos--;
+            candidate--;
+        }
+        int len = LZ4_MIN_MATCH;
+        while (pos + len < n - LZ4_LAST_LITERALS && src[pos + len] == src[candidate + len])
+            len++;
+        out = lz4_put_sequence(dst, out, capacity, src + anchor, pos - anchor, pos - candidate, len);
+        if (out < 0)
+            return 0;
+        pos += len;
+        anchor = pos;
+        if (pos < limit)
+            table[lz4_hash(lz4_read32(src + pos - 2))] = (uint16_t)(pos - 2);
+    }
+    out = lz4_put_sequence(dst, out, capacity, src + anchor, n - anchor, 0, 0);
+    return out < 0 ? 0 : out;
+}
+
+// Decode an LZ4 block of n bytes into dst; returns the decoded length, or -1
+// if the block is malformed or decodes to more than capacity bytes
+static inline int lz4_decompress(const unsigned char *src, int n, unsigned char *dst, int capacity)
+{
+    int in = 0, out = 0;
+    while (in < n)
+    {
+        int token = src[in++];
+        int len = token >> 4;
+        if (len == 15)
+        {
+            unsigned char extra;
+            do
+            {
+                if (in >= n)
+                    return -1;
+                extra = src[in++];
+                len += extra;
+            } while (extra == 255);
+        }
+        if (len > n - in || len > capacity - out)
+            return -1;
+        memcpy(dst + out, src + in, len);
+        in += len;
+        out += len;
+        if (in == n)
+            break; // The last sequence has only literals
+        if (n - in < 2)
+            return -1;
+        int offset = src[in] | (src[in + 1] << 8);
+        in += 2;
+        if (offset == 0 || offset > out)
+            return -1;
+        len = token & 15;
+        if (len == 15)
+        {
+            unsigned char extra;
+            do
+            {
+                if (in >= n)
+                    return -1;
+                extra = src[in++];
+                len += extra;
+            } while (extra == 255);
+        }
+        len += LZ4_MIN_MATCH;
+        if (len > capacity - out)
+            return -1;
+        if (offset >= len)
+        {
+            memcpy(dst + out, dst + out - offset, len);
+        }
+        else
+        {
+            for (int i = 0; i < len; i++) // Overlapping match: repeats the last offset bytes
+                dst[out + i] = dst[out - offset + i];
+        }
+        out += len;
+    }
+    return out;
+}
+
+// Compression state of one outgoing DATA stream
+struct compressor
+{
+    int enabled;          // Frames are still worth compressing
+    int sampled;          // The first frame has been tried
+    unsigned char *out;   // Room for one compressed frame (FS_MAX_PAYLOAD bytes)
+    long long raw_bytes;  // Payload bytes before compression
+    long long wire_bytes; // Payload bytes sent
+};
+
+// Is a file of this name worth compressing?
+static inline int compress_suits(const char *name)
+{
+    const char *extension = name != NULL ? strrchr(name, '.') : NULL;
+    return extension == NULL || strcmp(extension, ".pdf") != 0;
+}
+
+// Start a stream of the named file; accepted says the receiver decodes
+// compressed frames. out is a buffer of FS_MAX_PAYLOAD bytes; while it is
+// NULL frames are sent as they are.
+static inline void compress_init(struct compressor *c, int accepted, const char *name, unsigned char *out)
+{
+    c->enabled = accepted && compress_suits(name);
+    c->sampled = 0;
+    c->out = out;
+    c->raw_bytes = 0;
+    c->wire_bytes = 0;
+}
+
+// Compress one frame's payload into c->out. Returns its compressed length,
+// or 0 to send the payload as it is. The first frame is the sample: if it
+// does not compress well, the rest of the stream is not tried.
+static inline uint32_t compress_frame(struct compressor *c, const void *data, uint32_t len)
+{
+    int packed = 0;
+    if (c->enabled && c->out != NULL && len >= COMPRESS_MIN_FRAME)
+    {
+        packed = lz4_compress(data, (int)len, c->out, (int)(len - len / 8));
+        if (!c->sampled && packed == 0)
+            c->enabled = 0;
+        c->sampled = 1;
+    }
+    c->raw_bytes += len;
+    c->wire_bytes += packed > 0 ? (uint32_t)packed : len;
+    return (uint32_t)packed;
+}
+
+// Send data as a DATA frame, compressed if that pays off
+static inline int compress_send(int sock, struct compressor *c, uint32_t request_id, uint16_t flags, const void *data,
+                                uint32_t len)
+{
+    uint32_t packed = compress_frame(c, data, len);
+    if (packed > 0)
+    {
+        return fs_send_frame(sock, FS_OP_DATA, flags | FS_FLAG_COMPRESSED, request_id, c->out, packed);
+    }
+    return fs_send_frame(sock, FS_OP_DATA, flags, request_id, data, len);
+}
+
+// fs_send_file_data, compressing the frames while that pays off. buffer
+// holds FS_MAX_PAYLOAD bytes. Once the stream is not compressed any more the
+// rest of the file goes out with sendfile(), unless crc is given: the bytes
+// are added to it before they are compressed.
+static inline long long compress_send_file_data(int sock, int file, uint32_t request_id, uint64_t size,
+                                                struct compressor *c, char *buffer, uint32_t *crc)
+{
+    uint64_t total_sent = 0;
+    while (c->enabled && c->out != NULL && buffer != NULL && total_sent < size)
+    {
+        size_t want = size - total_sent < FS_MAX_PAYLOAD ? (size_t)(size - total_sent) : FS_MAX_PAYLOAD;
+        ssize_t bytes_read = read(file, buffer, want);
+        if (bytes_read < 0 && errno == EINTR)
+            continue;
+        if (bytes_read <= 0)
+            return (long long)total_sent; // Short file; the receiver sees the mismatch against the size
+        if (crc != NULL)
+            *crc = crc32c(*crc, buffer, (size_t)bytes_read);
+        if (compress_send(sock, c, request_id, 0, buffer, (uint32_t)bytes_read) < 0)
+            return -1;
+        total_sent += bytes_read;
+    }
+    if (total_sent == size)
+    {
+        return (long long)total_sent;
+    }
+    long long rest = fs_send_file_data(sock, file, request_id, size - total_sent, crc);
+    if (rest > 0)
+    {
+        c->raw_bytes += rest;
+        c->wire_bytes += rest;
+    }
+    return rest < 0 ? -1 : (long long)total_sent + rest;
+}
+
+// Decode a received frame flagged FS_FLAG_COMPRESSED into plain (FS_MAX_PAYLOAD
+// + 1 bytes) and point *payload at it, updating frame->length. Frames that are
+// not compressed are left alone. Returns 0, or -1 if the payload is corrupt.
+static inline int compress_decode(struct fs_frame *frame, char **payload, char *plain)
+{
+    if (!(frame->flags & FS_FLAG_COMPRESSED))
+    {
+        return 0;
+    }
+    int len = lz4_decompress((const unsigned char *)*payload, (int)frame->length, (unsigned char *)plain, FS_MAX_PAYLOAD);
+    if (len < 0)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    plain[len] = '\0';
+    *payload = plain;
+    frame->length = (uint32_t)len;
+    frame->flags &= ~FS_FLAG_COMPRESSED;
+    return 0;
+}
+
+#endif
@@ -0,0 +1,135 @@
+// CRC32C (Castagnoli) checksums of file contents, shared by all programs
+//
+// Every DATA stream of a file may end with a checksum trailer (see
+// FS_FLAG_CHECKSUM in protocol.h): the CRC32C of the stream's bytes, which
+// the sender computes as it reads them and the receiver as it writes them.
+// A stored file keeps its checksum in the extended attribute CRC32C_XATTR,
+// set when it is received, so a whole-file download can send the stored
+// value without reading the file, and the receiver's check covers the disk
+// as well as the wire. Files on a file system without user extended
+// attributes simply have no stored checksum.
+//
+// On x86 processors with SSE4.2 the crc32 instruction does the work, eight
+// bytes at a time; elsewhere a slicing-by-8 table does.
+#ifndef FS_CRC32C_H
+#define FS_CRC32C_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/xattr.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#define CRC32C_POLY 0x82f63b78u              // Castagnoli polynomial, reflected
+#define CRC32C_XATTR "user.filesync3.crc32c" // Stored checksum of a file, 4 bytes big-endian
+
+static uint32_t crc32c_table[8][256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static int crc32c_hardware;
+
+static inline void crc32c_init(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+            crc = (crc >> 1) ^ (crc & 1 ? CRC32C_POLY : 0);
+        crc32c_table[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int t = 1; t < 8; t++)
+            crc32c_table[t][i] = (crc32c_table[t - 1][i] >> 8) ^ crc32c_table[0][crc32c_table[t - 1][i] & 0xff];
+    }
+#ifdef CRC32C_X86
+    __builtin_cpu_init();
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static inline uint32_t crc32c_software(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7) != 0)
+    {
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+        len--;
+    }
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        word ^= crc; // Little-endian: the low bytes come first
+        crc = crc32c_table[7][word & 0xff] ^ crc32c_table[6][(word >> 8) & 0xff] ^
+              crc32c_table[5][(word >> 16) & 0xff] ^ crc32c_table[4][(word >> 24) & 0xff] ^
+              crc32c_table[3][(word >> 32) & 0xff] ^ crc32c_table[2][(word >> 40) & 0xff] ^
+              crc32c_table[1][(word >> 48) & 0xff] ^ crc32c_table[0][word >> 56];
+    }
+    while (len-- > 0)
+        crc = (crc >> 8) ^ crc32c_table[0][(crc ^ *p++) & 0xff];
+    return crc;
+}
+
+#ifdef CRC32C_X86
+__attribute__((target("sse4.2"))) static inline uint32_t crc32c_sse42(uint32_t crc, const unsigned char *p, size_t len)
+{
+    while (len > 0 && ((uintptr_t)p & 7) != 0)
+    {
+        crc = _mm_crc32_u8(crc, *p++);
+        len--;
+    }
+#ifdef __x86_64__
+    uint64_t wide = crc;
+    for (; len >= 8; p += 8, len -= 8)
+    {
+        uint64_t word;
+        memcpy(&word, p, sizeof(word));
+        wide = _mm_crc32_u64(wide, word);
+    }
+    crc = (uint32_t)wide;
+#endif
+    for (; len >= 4; p += 4, len -= 4)
+    {
+        uint32_t word;
+        memcpy(&word, p, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    while (len-- > 0)
+        crc = _mm_crc32_u8(crc, *p++);
+    return crc;
+}
+#endif
+
+// Extend the checksum crc (0 to start) over len more bytes
+static inline uint32_t crc32c(uint32_t crc, const void *data, size_t len)
+{
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#ifdef CRC32C_X86
+    if (crc32c_hardware)
+        return ~crc32c_sse42(crc, data, len);
+#endif
+    return ~crc32c_software(crc, data, len);
+}
+
+// Keep a file's checksum with it; returns -1 if the file system does not take it
+static inline int crc32c_store(int fd, uint32_t crc)
+{
+    unsigned char value[4] = {crc >> 24, crc >> 16, crc >> 8, crc};
+    return fsetxattr(fd, CRC32C_XATTR, value, sizeof(value), 0);
+}
+
+// Read a file's stored checksum; returns -1 if it has none
+static inline int crc32c_load(int fd, uint32_t *crc)
+{
+    unsigned char value[4];
+    if (fgetxattr(fd, CRC32C_XATTR, value, sizeof(value)) != (ssize_t)sizeof(value))
+        return -1;
+    *crc = (uint32_t)value[0] << 24 | (uint32_t)value[1] << 16 | (uint32_t)value[2] << 8 | value[3];
+    return 0;
+}
+
+#endif
@@ -0,0 +1,96 @@
+// Consistent hash ring placing files on the members of a storage tier
+//
+// Every member (a Stext or Spdf instance, named host:port) is hashed onto a
+// 32-bit ring at HASH_RING_POINTS positions, and a key belongs to the first
+// member point at or after the key's own hash. Adding a member takes over
+// only the keys that now fall just before its points, about 1/N of them, and
+// removing one hands its keys to the next points; the rest stay where they
+// are. Many points per member keep the shares even.
+//
+// The ring is built once at startup and only read afterwards, so it needs
+// no locking and forked workers share it as is.
+#ifndef FS_HASH_RING_H
+#define FS_HASH_RING_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define HASH_RING_MAX_MEMBERS 16
+#define HASH_RING_POINTS 64 // Positions of each member on the ring
+
+struct hash_ring_point
+{
+    uint32_t hash;
+    int member;
+};
+
+struct hash_ring
+{
+    int count; // Points in use, sorted by hash
+    struct hash_ring_point points[HASH_RING_MAX_MEMBERS * HASH_RING_POINTS];
+};
+
+// FNV-1a, finished with the murmur3 mixer so similar keys spread over the ring
+static inline uint32_t hash_ring_hash(const char *data, size_t len)
+{
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+    {
+        hash = (hash ^ (unsigned char)data[i]) * 16777619u;
+    }
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+static inline int hash_ring_compare(const void *a, const void *b)
+{
+    const struct hash_ring_point *x = a, *y = b;
+    return x->hash < y->hash ? -1 : x->hash > y->hash;
+}
+
+// Put a member on the ring under its name; returns -1 if the ring is full
+static inline int hash_ring_add(struct hash_ring *ring, const char *name, int member)
+{
+    if (ring->count + HASH_RING_POINTS > HASH_RING_MAX_MEMBERS * HASH_RING_POINTS)
+    {
+        return -1;
+    }
+    for (int i = 0; i < HASH_RING_POINTS; i++)
+    {
+        char point[128];
+        int len = snprintf(point, sizeof(point), "%s#%d", name, i);
+        ring->points[ring->count].hash = hash_ring_hash(point, (size_t)len);
+        ring->points[ring->count].member = member;
+        ring->count++;
+    }
+    qsort(ring->points, ring->count, sizeof(ring->points[0]), hash_ring_compare);
+    return 0;
+}
+
+// The member a key belongs to; 0 on an empty ring
+static inline int hash_ring_lookup(const struct hash_ring *ring, const char *key)
+{
+    if (ring->count == 0)
+    {
+        return 0;
+    }
+    uint32_t hash = hash_ring_hash(key, strlen(key));
+    int low = 0, high = ring->count; // First point with a hash >= the key's is in [low, high]
+    while (low < high)
+    {
+        int mid = low + (high - low) / 2;
+        if (ring->points[mid].hash < hash)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+    return ring->points[low < ring->count ? low : 0].member; // Past the last point wraps around
+}
+
+#endif
@@ -0,0 +1,387 @@
+// Write-behind journal of .txt and .pdf uploads waiting for their storage server
+//
+// When Smain runs with -J, an upload is written to the journal and fsynced,
+// and the client gets its reply right away; a forwarder process sends the
+// journaled files on to Stext and Spdf in the background. A job is the
+// uploaded file itself, at the same path below the journal root as below
+// ~/smain. A newer upload of a path replaces the older job still waiting, so
+// only the latest contents are sent. A download of a path finds its job by
+// the same name.
+//
+// Jobs are written under .tmp and renamed into place once they are on disk,
+// so a job is either complete or absent after a crash; leftovers in .tmp are
+// deleted at startup. The fsyncs are left to a committer thread in each
+// worker, which takes every job queued meanwhile in one go (group commit)
+// and reports back through a pipe the worker's event loop watches, so a slow
+// disk holds up the uploads being committed and nothing else. Renames,
+// cancellations and the forwarder's removal of a job it has sent all hold
+// the lock file. That way a job replaced while it was being sent is not
+// mistaken for the one that went out.
+//
+// A job its server keeps refusing is moved to .dead, at the same path below
+// it, so it stops holding up the forwarder and stays for an operator.
+#ifndef FS_JOURNAL_H
+#define FS_JOURNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+#define JOURNAL_TMP ".tmp"   // Jobs being written
+#define JOURNAL_LOCK ".lock" // Taken while jobs are put in place or removed
+#define JOURNAL_DEAD ".dead" // Jobs their server refused for good
+
+// A written job waiting for the committer
+struct journal_commit
+{
+    struct journal_commit *next;
+    int fd;        // The job's file, closed by the committer
+    char *tmp;     // Its name under .tmp
+    char *rel;     // The uploaded path below ~/smain
+    long long size;
+    int result;    // 0 once the job is in place, -1 if it was discarded
+    void *owner;   // Whoever waits for the result; cleared under the lock if it stops waiting
+};
+
+struct journal
+{
+    char *root;  // Absolute; jobs are at root + the path below ~/smain
+    int wake[2]; // Written to when a job is committed, to wake the forwarder
+    // The committer of this worker process
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    struct journal_commit *queue, *queue_tail; // Waiting to be committed
+    struct journal_commit *done;               // Committed, not yet collected
+    int done_pipe[2];                          // Written to when jobs are done
+};
+
+// Create every missing directory of path
+static inline int journal_mkdirs(const char *path)
+{
+    char copy[4096];
+    snprintf(copy, sizeof(copy), "%s", path);
+    for (char *slash = strchr(copy + 1, '/'); slash != NULL; slash = strchr(slash + 1, '/'))
+    {
+        *slash = '\0';
+        if (mkdir(copy, 0755) < 0 && errno != EEXIST)
+            return -1;
+        *slash = '/';
+    }
+    return mkdir(copy, 0755) < 0 && errno != EEXIST ? -1 : 0;
+}
+
+// Open the journal at root, creating it if needed; returns -1 on failure
+static inline int journal_open(struct journal *j, const char *root)
+{
+    char tmp[4096];
+    snprintf(tmp, sizeof(tmp), "%s/%s", root, JOURNAL_TMP);
+    if (journal_mkdirs(tmp) < 0 || pipe(j->wake) < 0)
+        return -1;
+    fcntl(j->wake[0], F_SETFL, fcntl(j->wake[0], F_GETFL) | O_NONBLOCK);
+    fcntl(j->wake[1], F_SETFL, fcntl(j->wake[1], F_GETFL) | O_NONBLOCK);
+    j->root = strdup(root);
+
+    // Uploads cut short by a crash never got their reply
+    DIR *dir = opendir(tmp);
+    struct dirent *entry;
+    while (dir != NULL && (entry = readdir(dir)) != NULL)
+    {
+        char path[4096 + 256];
+        snprintf(path, sizeof(path), "%s/%s", tmp, entry->d_name);
+        if (entry->d_name[0] != '.')
+            unlink(path);
+    }
+    if (dir != NULL)
+        closedir(dir);
+    return j->root != NULL ? 0 : -1;
+}
+
+// The lock serializing changes to the jobs. Each call opens the lock file
+// anew, since flock locks held through a descriptor shared by forked
+// processes would not keep them apart.
+static inline int journal_lock(const struct journal *j)
+{
+    char path[4096];
+    snprintf(path, sizeof(path), "%s/%s", j->root, JOURNAL_LOCK);
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (fd >= 0 && flock(fd, LOCK_EX) < 0)
+    {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
+
+static inline void journal_unlock(int fd)
+{
+    if (fd >= 0)
+        close(fd); // Releases the lock
+}
+
+// Where the job of a path below ~/smain (starting with '/') is kept
+static inline void journal_job(const struct journal *j, const char *rel, char *out, size_t size)
+{
+    snprintf(out, size, "%s%s", j->root, rel);
+}
+
+// Create a file to write a job into; its name is left in tmp
+static inline int journal_create(const struct journal *j, char *tmp, size_t size)
+{
+    snprintf(tmp, size, "%s/%s/upload-XXXXXX", j->root, JOURNAL_TMP);
+    return mkstemp(tmp);
+}
+
+static inline void journal_commit_free(struct journal_commit *c)
+{
+    free(c->tmp);
+    free(c->rel);
+    free(c);
+}
+
+// Commit queued jobs until the process ends: fsync each file, rename the
+// batch into place under one lock, then fsync the directories holding them
+static inline void *journal_committer(void *arg)
+{
+    struct journal *j = arg;
+    while (1)
+    {
+        pthread_mutex_lock(&j->lock);
+        while (j->queue == NULL)
+            pthread_cond_wait(&j->ready, &j->lock);
+        struct journal_commit *batch = j->queue;
+        j->queue = j->queue_tail = NULL;
+        pthread_mutex_unlock(&j->lock);
+
+        for (struct journal_commit *c = batch; c != NULL; c = c->next)
+        {
+            c->result = fsync(c->fd);
+            close(c->fd);
+            c->fd = -1;
+        }
+        int lock = journal_lock(j);
+        char job[4096];
+        for (struct journal_commit *c = batch; c != NULL; c = c->next)
+        {
+            journal_job(j, c->rel, job, sizeof(job));
+            char *slash = strrchr(job, '/');
+            *slash = '\0';
+            if (lock < 0 || c->result < 0 || journal_mkdirs(job) < 0)
+                c->result = -1;
+            *slash = '/';
+            if (c->result == 0 && rename(c->tmp, job) < 0)
+                c->result = -1;
+            if (c->result < 0)
+                unlink(c->tmp);
+        }
+        journal_unlock(lock);
+        // A rename lasts once the directory holding it is on disk
+        char synced[4096] = "";
+        for (struct journal_commit *c = batch; c != NULL; c = c->next)
+        {
+            journal_job(j, c->rel, job, sizeof(job));
+            *strrchr(job, '/') = '\0';
+            if (c->result < 0 || strcmp(job, synced) == 0)
+                continue;
+            int dir = open(job, O_RDONLY | O_DIRECTORY);
+            if (dir >= 0)
+            {
+                fsync(dir);
+                close(dir);
+            }
+            snprintf(synced, sizeof(synced), "%s", job);
+        }
+
+        struct journal_commit *last = batch;
+        while (last->next != NULL)
+            last = last->next;
+        pthread_mutex_lock(&j->lock);
+        last->next = j->done;
+        j->done = batch;
+        pthread_mutex_unlock(&j->lock);
+        char byte = 1;
+        if (write(j->done_pipe[1], &byte, 1) < 0 && errno != EAGAIN)
+            perror("Error reporting journal commits");
+        if (write(j->wake[1], &byte, 1) < 0 && errno != EAGAIN)
+            perror("Error waking the forwarder");
+    }
+    return NULL;
+}
+
+// Start this process's committer; returns the descriptor that becomes
+// readable when commits are done, or -1
+static inline int journal_start_committer(struct journal *j)
+{
+    pthread_t thread;
+    pthread_mutex_init(&j->lock, NULL);
+    pthread_cond_init(&j->ready, NULL);
+    j->queue = j->queue_tail = j->done = NULL;
+    if (pipe(j->done_pipe) < 0)
+        return -1;
+    fcntl(j->done_pipe[0], F_SETFL, fcntl(j->done_pipe[0], F_GETFL) | O_NONBLOCK);
+    fcntl(j->done_pipe[1], F_SETFL, fcntl(j->done_pipe[1], F_GETFL) | O_NONBLOCK);
+    if (pthread_create(&thread, NULL, journal_committer, j) != 0)
+        return -1;
+    pthread_detach(thread);
+    return j->done_pipe[0];
+}
+
+// Queue a written job, whose file fd the committer takes over, to be made
+// durable and put in place of any older job for the same path
+static inline struct journal_commit *journal_submit(struct journal *j, int fd, const char *tmp, const char *rel,
+                                                    long long size, void *owner)
+{
+    struct journal_commit *c = calloc(1, sizeof(*c));
+    if (c == NULL || (c->tmp = strdup(tmp)) == NULL || (c->rel = strdup(rel)) == NULL)
+    {
+        if (c != NULL)
+            journal_commit_free(c);
+        return NULL;
+    }
+    c->fd = fd;
+    c->size = size;
+    c->owner = owner;
+    pthread_mutex_lock(&j->lock);
+    if (j->queue_tail != NULL)
+        j->queue_tail->next = c;
+    else
+        j->queue = c;
+    j->queue_tail = c;
+    pthread_cond_signal(&j->ready);
+    pthread_mutex_unlock(&j->lock);
+    return c;
+}
+
+// Stop waiting for a job's commit; it still goes through
+static inline void journal_abandon(struct journal *j, struct journal_commit *c)
+{
+    pthread_mutex_lock(&j->lock);
+    c->owner = NULL;
+    pthread_mutex_unlock(&j->lock);
+}
+
+// Take the jobs committed since the last call, to be freed with
+// journal_commit_free
+static inline struct journal_commit *journal_collect(struct journal *j)
+{
+    char drain[256];
+    while (read(j->done_pipe[0], drain, sizeof(drain)) > 0)
+        ;
+    pthread_mutex_lock(&j->lock);
+    struct journal_commit *done = j->done;
+    j->done = NULL;
+    pthread_mutex_unlock(&j->lock);
+    return done;
+}
+
+// Drop the job of a path, if there is one; returns 1 if one was dropped
+static inline int journal_cancel(struct journal *j, const char *rel)
+{
+    char job[4096];
+    journal_job(j, rel, job, sizeof(job));
+    int lock = journal_lock(j);
+    int removed = unlink(job) == 0;
+    journal_unlock(lock);
+    return removed;
+}
+
+// After the job with inode ino was sent: remove it if it is still the one in
+// place and return 0; return 1 if a newer upload replaced it, or -1 if it
+// was cancelled meanwhile
+static inline int journal_settle(struct journal *j, const char *rel, ino_t ino)
+{
+    char job[4096];
+    journal_job(j, rel, job, sizeof(job));
+    struct stat st;
+    int lock = journal_lock(j);
+    int result = stat(job, &st) < 0 ? -1 : st.st_ino != ino ? 1 : 0;
+    if (result == 0)
+        unlink(job);
+    journal_unlock(lock);
+    return result;
+}
+
+// After the job with inode ino was refused for good: move it to .dead if it
+// is still the one in place, leaving where it went in dead, and return 0;
+// return 1 if a newer upload replaced it, or -1 if it was cancelled
+// meanwhile or could not be moved
+static inline int journal_bury(struct journal *j, const char *rel, ino_t ino, char *dead, size_t size)
+{
+    char job[4096];
+    journal_job(j, rel, job, sizeof(job));
+    snprintf(dead, size, "%s/%s%s", j->root, JOURNAL_DEAD, rel);
+    struct stat st;
+    int lock = journal_lock(j);
+    int result = stat(job, &st) < 0 ? -1 : st.st_ino != ino ? 1 : 0;
+    if (result == 0)
+    {
+        char *slash = strrchr(dead, '/');
+        *slash = '\0';
+        if (journal_mkdirs(dead) < 0)
+            result = -1;
+        *slash = '/';
+        if (result == 0 && rename(job, dead) < 0)
+            result = -1;
+    }
+    journal_unlock(lock);
+    return result;
+}
+
+// Call fn with the path (below ~/smain) of every job under dir, which is
+// rel below the root; directories emptied by sent jobs are removed
+static inline void journal_scan(struct journal *j, const char *rel, void (*fn)(void *ctx, const char *rel), void *ctx)
+{
+    char path[4096];
+    journal_job(j, rel, path, sizeof(path));
+    DIR *dir = opendir(path);
+    if (dir == NULL)
+        return;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0 ||
+            (rel[0] == '\0' && (strcmp(entry->d_name, JOURNAL_TMP) == 0 || strcmp(entry->d_name, JOURNAL_LOCK) == 0 ||
+                                 strcmp(entry->d_name, JOURNAL_DEAD) == 0)))
+            continue;
+        char child[4096];
+        snprintf(child, sizeof(child), "%s/%s", rel, entry->d_name);
+        char child_path[4096];
+        journal_job(j, child, child_path, sizeof(child_path));
+        struct stat st;
+        if (stat(child_path, &st) < 0)
+            continue;
+        if (S_ISDIR(st.st_mode))
+        {
+            journal_scan(j, child, fn, ctx);
+            int lock = journal_lock(j);
+            rmdir(child_path); // Fails unless it is empty
+            journal_unlock(lock);
+        }
+        else if (S_ISREG(st.st_mode))
+        {
+            fn(ctx, child);
+        }
+    }
+    closedir(dir);
+}
+
+// Wait up to timeout_ms (-1: for good) for a job to be committed
+static inline void journal_wait(struct journal *j, int timeout_ms)
+{
+    struct pollfd wake = {.fd = j->wake[0], .events = POLLIN};
+    if (poll(&wake, 1, timeout_ms) > 0)
+    {
+        char drain[256];
+        while (read(j->wake[0], drain, sizeof(drain)) > 0)
+            ;
+    }
+}
+
+#endif
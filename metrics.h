@@ -0,0 +1,264 @@
+// Request counters and latency histograms of a server, in shared memory
+//
+// Each server keeps its metrics in a POSIX shared memory segment named after
+// it (/filesync3-smain, /filesync3-stext, /filesync3-spdf), created afresh at
+// startup. Smain's workers inherit the mapping and Spdf's and Stext's threads
+// share it; all of them update it with relaxed atomic adds, so recording
+// never takes a lock. Any process can map a segment read-only to look at the
+// server live: Smain does so for Stext and Spdf to answer `stats`.
+//
+// Latencies go into histograms with power-of-two buckets of microseconds.
+// Percentiles are read off them as the upper bound of the bucket they fall
+// in, so they are accurate to a factor of two.
+//
+// Smain also hands out trace ids from its segment: each client request gets
+// one, and every frame Smain sends to Spdf or Stext for it carries it as its
+// request id. All three servers log a span line per request in the same
+// format, so grepping for the id lines up one request's hops.
+#ifndef FS_METRICS_H
+#define FS_METRICS_H
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "protocol.h"
+
+#define METRICS_MAGIC 0x46534d32 // "FSM2"; a segment of another layout is not read
+#define METRICS_OPS 40           // Indexed by opcode
+#define METRICS_BUCKETS 32       // Bucket i counts latencies below 2^i microseconds; the last takes the rest
+
+struct metrics_op
+{
+    uint64_t requests;
+    uint64_t errors;                   // Answered with an error REPLY, or the connection failed
+    uint64_t latency_us;               // Sum of the latencies
+    uint64_t latency[METRICS_BUCKETS];
+};
+
+struct metrics
+{
+    uint32_t magic;
+    int64_t started;          // Unix time the server started
+    uint64_t connections;     // Connections accepted
+    int64_t open_connections;
+    uint64_t bytes_in;        // Bytes received from clients (Smain) or from Smain (Spdf, Stext)
+    uint64_t bytes_out;       // Bytes sent to them
+    uint64_t trace_ids;       // Last trace id handed out
+    struct metrics_op ops[METRICS_OPS];
+};
+
+static inline void metrics_add(uint64_t *counter, uint64_t n)
+{
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t metrics_read(const uint64_t *counter)
+{
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static inline long long metrics_now_us(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000LL + now.tv_nsec / 1000;
+}
+
+// Create the server's segment, replacing one left by an earlier run. If
+// shared memory is unavailable the metrics live in an anonymous shared
+// mapping instead, still shared with forked children but not visible to
+// other processes. Returns NULL only if memory runs out.
+static inline struct metrics *metrics_create(const char *server)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/filesync3-%s", server);
+    shm_unlink(name);
+    void *region = MAP_FAILED;
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+    if (fd >= 0)
+    {
+        if (ftruncate(fd, sizeof(struct metrics)) == 0)
+            region = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
+    }
+    if (region == MAP_FAILED)
+    {
+        perror("Error creating the metrics segment, keeping metrics private");
+        region = mmap(NULL, sizeof(struct metrics), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED)
+            return NULL;
+    }
+    struct metrics *m = region;
+    memset(m, 0, sizeof(*m));
+    m->started = time(NULL);
+    m->magic = METRICS_MAGIC;
+    return m;
+}
+
+// Map another server's segment read-only; NULL if it is not running
+static inline const struct metrics *metrics_open(const char *server)
+{
+    char name[64];
+    snprintf(name, sizeof(name), "/filesync3-%s", server);
+    int fd = shm_open(name, O_RDONLY, 0);
+    if (fd < 0)
+        return NULL;
+    void *region = mmap(NULL, sizeof(struct metrics), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (region == MAP_FAILED)
+        return NULL;
+    const struct metrics *m = region;
+    if (m->magic != METRICS_MAGIC)
+    {
+        munmap(region, sizeof(struct metrics));
+        return NULL;
+    }
+    return m;
+}
+
+static inline void metrics_close(const struct metrics *m)
+{
+    munmap((void *)m, sizeof(struct metrics));
+}
+
+// A trace id no other request of this server run has; never 0
+static inline uint32_t metrics_trace_id(struct metrics *m)
+{
+    uint32_t id;
+    do
+    {
+        id = (uint32_t)(__atomic_add_fetch(&m->trace_ids, 1, __ATOMIC_RELAXED));
+    } while (id == 0);
+    return id;
+}
+
+// Log a span of the trace format common to all servers: which request (by
+// trace id) spent how long where, and when it started in wall-clock time.
+// details holds extra " key=value" fields.
+static inline void metrics_span(const char *server, uint32_t trace_id, const char *op, long long duration_us,
+                                const char *status, const char *details)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    long long start = now.tv_sec * 1000000LL + now.tv_nsec / 1000 - duration_us;
+    printf("span trace=%08x server=%s op=%s start=%lld.%06lld dur_us=%lld status=%s%s\n", trace_id, server, op,
+           start / 1000000, start % 1000000, duration_us, status, details);
+}
+
+// Record a finished request
+static inline void metrics_request(struct metrics *m, uint8_t opcode, long long latency_us, int failed)
+{
+    if (m == NULL || opcode >= METRICS_OPS)
+        return;
+    struct metrics_op *op = &m->ops[opcode];
+    int bucket = 0;
+    while (bucket < METRICS_BUCKETS - 1 && latency_us >= (1LL << bucket))
+        bucket++;
+    metrics_add(&op->requests, 1);
+    metrics_add(&op->errors, failed ? 1 : 0);
+    metrics_add(&op->latency_us, latency_us > 0 ? (uint64_t)latency_us : 0);
+    metrics_add(&op->latency[bucket], 1);
+}
+
+// The latency in milliseconds below which p percent of the requests finished
+static inline double metrics_percentile(const struct metrics_op *op, double p)
+{
+    uint64_t total = metrics_read(&op->requests), seen = 0;
+    uint64_t rank = (uint64_t)(p / 100 * total + 0.999999);
+    for (int i = 0; i < METRICS_BUCKETS; i++)
+    {
+        seen += metrics_read(&op->latency[i]);
+        if (seen >= rank && seen > 0)
+            return (1LL << i) / 1000.0;
+    }
+    return 0;
+}
+
+// Append text to out, keeping it NUL-terminated; returns the new length
+static inline size_t metrics_append(char *out, size_t capacity, size_t len, const char *format, ...)
+    __attribute__((format(printf, 4, 5)));
+static inline size_t metrics_append(char *out, size_t capacity, size_t len, const char *format, ...)
+{
+    if (len >= capacity)
+        return len;
+    va_list ap;
+    va_start(ap, format);
+    int n = vsnprintf(out + len, capacity - len, format, ap);
+    va_end(ap);
+    return n < 0 ? len : len + (size_t)n < capacity ? len + (size_t)n : capacity - 1;
+}
+
+// Describe a server's metrics into out: a table for people, or with machine
+// set one "name{labels} value" line per counter in the Prometheus text format
+static inline size_t metrics_format(const struct metrics *m, const char *server, int machine, char *out,
+                                    size_t capacity)
+{
+    size_t len = 0;
+    long long uptime = (long long)(time(NULL) - m->started);
+    uint64_t connections = metrics_read(&m->connections);
+    long long open = __atomic_load_n(&m->open_connections, __ATOMIC_RELAXED);
+    uint64_t bytes_in = metrics_read(&m->bytes_in), bytes_out = metrics_read(&m->bytes_out);
+    if (machine)
+    {
+        len = metrics_append(out, capacity, len,
+                             "filesync3_uptime_seconds{server=\"%s\"} %lld\n"
+                             "filesync3_connections_total{server=\"%s\"} %llu\n"
+                             "filesync3_open_connections{server=\"%s\"} %lld\n"
+                             "filesync3_received_bytes_total{server=\"%s\"} %llu\n"
+                             "filesync3_sent_bytes_total{server=\"%s\"} %llu\n",
+                             server, uptime, server, (unsigned long long)connections, server, open, server,
+                             (unsigned long long)bytes_in, server, (unsigned long long)bytes_out);
+    }
+    else
+    {
+        len = metrics_append(out, capacity, len,
+                             "%s: up %lld s, %llu connections (%lld open), %.1f MB received, %.1f MB sent\n"
+                             "  %-8s %10s %8s %9s %9s %9s\n",
+                             server, uptime, (unsigned long long)connections, open, bytes_in / 1e6, bytes_out / 1e6,
+                             "request", "count", "errors", "mean ms", "p50 ms", "p99 ms");
+    }
+    for (int i = 0; i < METRICS_OPS; i++)
+    {
+        const struct metrics_op *op = &m->ops[i];
+        uint64_t requests = metrics_read(&op->requests);
+        if (requests == 0)
+            continue;
+        const char *name = fs_opcode_name((uint8_t)i);
+        uint64_t errors = metrics_read(&op->errors), latency_us = metrics_read(&op->latency_us);
+        if (!machine)
+        {
+            len = metrics_append(out, capacity, len, "  %-8s %10llu %8llu %9.2f %9.2f %9.2f\n", name,
+                                 (unsigned long long)requests, (unsigned long long)errors,
+                                 latency_us / 1000.0 / requests, metrics_percentile(op, 50), metrics_percentile(op, 99));
+            continue;
+        }
+        len = metrics_append(out, capacity, len,
+                             "filesync3_requests_total{server=\"%s\",request=\"%s\"} %llu\n"
+                             "filesync3_errors_total{server=\"%s\",request=\"%s\"} %llu\n",
+                             server, name, (unsigned long long)requests, server, name, (unsigned long long)errors);
+        uint64_t cumulative = 0;
+        for (int b = 0; b < METRICS_BUCKETS - 1; b++)
+        {
+            cumulative += metrics_read(&op->latency[b]);
+            len = metrics_append(out, capacity, len,
+                                 "filesync3_latency_microseconds_bucket{server=\"%s\",request=\"%s\",le=\"%lld\"} %llu\n",
+                                 server, name, 1LL << b, (unsigned long long)cumulative);
+            if (cumulative == requests)
+                break; // The higher buckets hold the same count
+        }
+        len = metrics_append(out, capacity, len,
+                             "filesync3_latency_microseconds_bucket{server=\"%s\",request=\"%s\",le=\"+Inf\"} %llu\n"
+                             "filesync3_latency_microseconds_sum{server=\"%s\",request=\"%s\"} %llu\n"
+                             "filesync3_latency_microseconds_count{server=\"%s\",request=\"%s\"} %llu\n",
+                             server, name, (unsigned long long)requests, server, name,
+                             (unsigned long long)latency_us, server, name, (unsigned long long)requests);
+    }
+    return len;
+}
+
+#endif
@@ -0,0 +1,954 @@
+// Wire protocol shared by Smain, Stext, Spdf and the client
+//
+// Every message is a frame: a fixed 16-byte header followed by `length`
+// payload bytes. All header fields are in network byte order.
+//
+//   0       2         3        4       6          8            12         16
+//   +-------+---------+--------+-------+----------+------------+----------+
+//   | magic | version | opcode | flags | reserved | request id |  length  |
+//   +-------+---------+--------+-------+----------+------------+----------+
+//
+// Requests carry their arguments as a sequence of NUL-terminated strings.
+// File contents travel as DATA frames, the last of which has FS_FLAG_EOF set;
+// downloads announce the total with a SIZE frame first. The EOF frame of a
+// file may carry the CRC32C of the stream's bytes instead of data, flagged
+// FS_FLAG_CHECKSUM; the receiver checks it against the bytes it got. Every request is
+// completed by exactly one REPLY frame, so a sender can write a command, its
+// arguments and the whole payload back-to-back without waiting for ACKs.
+#ifndef FS_PROTOCOL_H
+#define FS_PROTOCOL_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/tcp.h>
+#include <sys/uio.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
+#include "crc32c.h"
+#include "uring.h"
+
+#define FS_MAGIC 0x4653         // "FS"
+#define FS_VERSION 1            // Bumped on incompatible header changes
+#define FS_HEADER_SIZE 16       // Size of the fixed frame header
+#define FS_MAX_PAYLOAD 65536    // Largest payload accepted in a single frame
+#define FS_MAX_ARGS 8           // Largest number of arguments in a request
+#define FS_MAX_MESSAGE (PATH_MAX + 256) // Room for a reply or error message that quotes a path
+
+// Frame opcodes
+enum fs_opcode
+{
+    // Client -> Smain requests
+    FS_OP_UFILE = 1, // args: filename, destination path, size[, "chunks"]
+    FS_OP_DFILE,     // args: file path[, offset[, length]]
+    FS_OP_RMFILE,    // args: file path
+    FS_OP_DTAR,      // args: file extension
+    FS_OP_DISPLAY,   // args: directory path
+    FS_OP_STATS,     // args: ["-m" for the machine-readable form]; DATA: metrics of all servers
+
+    // Smain -> Stext/Spdf requests
+    FS_OP_STORE = 16, // args: filename, directory path, size[, "chunks"]
+    FS_OP_GET,        // args: file path[, offset[, length]]
+    FS_OP_LIST,       // args: directory path
+    FS_OP_REMOVE,     // args: file path
+    FS_OP_TAR,        // args: file extension
+    FS_OP_INDEX,      // no args; DATA records of path, size, mtime (NUL-terminated strings)
+
+    // Transfer and completion frames, valid in both directions
+    FS_OP_DATA = 32, // payload: raw file bytes
+    FS_OP_SIZE,      // payload: 8-byte total size of the following DATA stream, then for a range the file's size
+    FS_OP_REPLY,     // payload: human readable status message
+    FS_OP_NEED,      // payload: bitmap of the chunks a chunked upload must send (bit i = chunk i, LSB first)
+};
+
+// Frame flags
+#define FS_FLAG_EOF 0x0001   // Last DATA frame of a stream
+#define FS_FLAG_ERROR 0x0002 // REPLY reports a failure
+#define FS_FLAG_PARTIAL 0x0004 // REPLY to display: some servers' files are missing from the listing
+#define FS_FLAG_COMPRESSED 0x0008 // DATA payload is an LZ4 block (compress.h); on a request, NEED or
+                                  // REPLY: the sender decodes compressed DATA frames
+#define FS_FLAG_CHECKSUM 0x0010 // EOF DATA frame: the payload is the CRC32C of the stream's decoded bytes
+#define FS_CHECKSUM_SIZE 4      // Bytes of that trailer, big-endian
+#define FS_FLAG_SEQUENCE 0x0020 // Replication (replica.h). STORE or REMOVE from a primary to its replica: the last
+                                // two arguments are the write's sequence number and the one sent before it. GET to
+                                // a replica: the last argument is the write the replica must have applied. REPLY to
+                                // a STORE or REMOVE: the message is followed by a NUL and the write's number
+
+// Decoded frame header
+struct fs_frame
+{
+    uint8_t opcode;
+    uint16_t flags;
+    uint32_t request_id;
+    uint32_t length;
+};
+
+// Return a printable name for an opcode
+static inline const char *fs_opcode_name(uint8_t opcode)
+{
+    switch (opcode)
+    {
+    case FS_OP_UFILE: return "ufile";
+    case FS_OP_DFILE: return "dfile";
+    case FS_OP_RMFILE: return "rmfile";
+    case FS_OP_DTAR: return "dtar";
+    case FS_OP_DISPLAY: return "display";
+    case FS_OP_STATS: return "stats";
+    case FS_OP_STORE: return "store";
+    case FS_OP_GET: return "get";
+    case FS_OP_LIST: return "list";
+    case FS_OP_REMOVE: return "remove";
+    case FS_OP_TAR: return "tar";
+    case FS_OP_INDEX: return "index";
+    case FS_OP_DATA: return "data";
+    case FS_OP_SIZE: return "size";
+    case FS_OP_REPLY: return "reply";
+    case FS_OP_NEED: return "need";
+    default: return "unknown";
+    }
+}
+
+// Store a 64-bit value in network byte order
+static inline void fs_put_u64(unsigned char *out, uint64_t value)
+{
+    for (int i = 7; i >= 0; i--)
+    {
+        out[i] = (unsigned char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+// Load a 64-bit value stored in network byte order
+static inline uint64_t fs_get_u64(const unsigned char *in)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++)
+    {
+        value = (value << 8) | in[i];
+    }
+    return value;
+}
+
+// Serialize a frame header into FS_HEADER_SIZE bytes
+static inline void fs_encode_header(unsigned char *out, uint8_t opcode, uint16_t flags, uint32_t request_id, uint32_t length)
+{
+    uint16_t magic = htons(FS_MAGIC);
+    uint16_t net_flags = htons(flags);
+    uint32_t net_id = htonl(request_id);
+    uint32_t net_length = htonl(length);
+
+    memcpy(out, &magic, 2);
+    out[2] = FS_VERSION;
+    out[3] = opcode;
+    memcpy(out + 4, &net_flags, 2);
+    out[6] = 0; // Reserved
+    out[7] = 0;
+    memcpy(out + 8, &net_id, 4);
+    memcpy(out + 12, &net_length, 4);
+}
+
+// Parse a frame header; returns -1 if the magic, version or length is invalid
+static inline int fs_decode_header(const unsigned char *in, struct fs_frame *frame)
+{
+    uint16_t magic, flags;
+    uint32_t request_id, length;
+
+    memcpy(&magic, in, 2);
+    memcpy(&flags, in + 4, 2);
+    memcpy(&request_id, in + 8, 4);
+    memcpy(&length, in + 12, 4);
+
+    if (ntohs(magic) != FS_MAGIC || in[2] != FS_VERSION)
+    {
+        return -1;
+    }
+    frame->opcode = in[3];
+    frame->flags = ntohs(flags);
+    frame->request_id = ntohl(request_id);
+    frame->length = ntohl(length);
+    if (frame->length > FS_MAX_PAYLOAD)
+    {
+        return -1;
+    }
+    return 0;
+}
+
+// Turn off Nagle's algorithm on a connection. Connections are kept open for
+// many requests, and a response is several small frames, so otherwise the
+// later frames wait for the peer's delayed ACK of the first (40 ms).
+static inline void fs_set_nodelay(int sock)
+{
+    int on = 1;
+    setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+}
+
+// What the calling thread moved through these helpers, for the servers' metrics
+struct fs_io_counters
+{
+    uint64_t sent, received;
+    uint64_t error_replies; // REPLY frames flagged FS_FLAG_ERROR
+};
+static __thread struct fs_io_counters fs_io;
+
+// A thread can move its file transfers through its own io_uring (uring.h):
+// fs_uring_start() gives it one, with FS_URING_DEPTH buffers, and the stream
+// helpers below keep that many reads or writes in flight. Threads without a
+// ring, or where io_uring is unavailable, use blocking calls
+#define FS_URING_DEPTH 4                      // Reads or writes of one transfer in flight at once
+#define FS_URING_SLOT (FS_MAX_PAYLOAD + 4096) // One buffer: a frame header, its payload and a NUL, in whole pages
+static __thread struct uring *fs_uring;
+
+static inline struct uring *fs_uring_start(void)
+{
+    if (fs_uring == NULL)
+        fs_uring = uring_create(2 * FS_URING_DEPTH, FS_URING_DEPTH, FS_URING_SLOT);
+    return fs_uring;
+}
+
+// io_uring_enter() itself failed: the thread goes back to blocking calls.
+// The ring is not freed, as operations may still be running on its buffers
+static inline void fs_uring_lost(void)
+{
+    fs_uring = NULL;
+}
+
+// Send the whole buffer, retrying on short writes; returns 0 or -1
+static inline int fs_send_all(int fd, const void *buf, size_t len)
+{
+    const char *p = buf;
+    while (len > 0)
+    {
+        ssize_t sent = send(fd, p, len, MSG_NOSIGNAL);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        fs_io.sent += sent;
+        p += sent;
+        len -= sent;
+    }
+    return 0;
+}
+
+// Receive exactly len bytes; returns 1 on success, 0 on EOF before the first byte, -1 on error
+static inline int fs_recv_all(int fd, void *buf, size_t len)
+{
+    char *p = buf;
+    size_t have = 0;
+    while (have < len)
+    {
+        ssize_t got = recv(fd, p + have, len - have, 0);
+        if (got < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (got == 0)
+        {
+            if (have == 0)
+                return 0;
+            errno = ECONNRESET; // Peer closed in the middle of a frame
+            return -1;
+        }
+        have += got;
+        fs_io.received += got;
+    }
+    return 1;
+}
+
+// Send one frame (header and payload in a single sendmsg where possible)
+static inline int fs_send_frame(int fd, uint8_t opcode, uint16_t flags, uint32_t request_id, const void *payload, uint32_t length)
+{
+    unsigned char header[FS_HEADER_SIZE];
+    fs_encode_header(header, opcode, flags, request_id, length);
+
+    struct iovec iov[2] = {{header, FS_HEADER_SIZE}, {(void *)payload, length}};
+    struct msghdr msg = {0};
+    msg.msg_iov = iov;
+    msg.msg_iovlen = length > 0 ? 2 : 1;
+    size_t total = FS_HEADER_SIZE + (size_t)length;
+    ssize_t sent;
+    do
+    {
+        sent = sendmsg(fd, &msg, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    if (sent < 0)
+    {
+        return -1;
+    }
+    fs_io.sent += sent;
+    if (opcode == FS_OP_REPLY && (flags & FS_FLAG_ERROR))
+        fs_io.error_replies++;
+    if ((size_t)sent == total)
+    {
+        return 0;
+    }
+    // Finish a short write byte-exactly
+    if ((size_t)sent < FS_HEADER_SIZE)
+    {
+        if (fs_send_all(fd, header + sent, FS_HEADER_SIZE - sent) < 0)
+            return -1;
+        sent = FS_HEADER_SIZE;
+    }
+    return fs_send_all(fd, (const char *)payload + (sent - FS_HEADER_SIZE), total - sent);
+}
+
+// Receive one frame into payload (capacity bytes, one more is reserved for a
+// terminating NUL); returns 1 on a frame, 0 on clean EOF, -1 on error
+static inline int fs_recv_frame(int fd, struct fs_frame *frame, void *payload, size_t capacity)
+{
+    unsigned char header[FS_HEADER_SIZE];
+    int rc = fs_recv_all(fd, header, FS_HEADER_SIZE);
+    if (rc <= 0)
+    {
+        return rc;
+    }
+    if (fs_decode_header(header, frame) < 0 || frame->length > capacity)
+    {
+        errno = EPROTO;
+        return -1;
+    }
+    if (frame->length > 0 && fs_recv_all(fd, payload, frame->length) != 1)
+    {
+        return -1;
+    }
+    ((char *)payload)[frame->length] = '\0';
+    return 1;
+}
+
+// Read the CRC32C out of a checksum trailer; returns 0 if frame is not one.
+// A frame flagged FS_FLAG_CHECKSUM never holds file data
+static inline int fs_get_checksum(const struct fs_frame *frame, const void *payload, uint32_t *crc)
+{
+    if (frame->opcode != FS_OP_DATA || !(frame->flags & FS_FLAG_CHECKSUM) || frame->length != FS_CHECKSUM_SIZE)
+    {
+        return 0;
+    }
+    const unsigned char *p = payload;
+    *crc = (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 | (uint32_t)p[2] << 8 | p[3];
+    return 1;
+}
+
+// Bytes of file data in a DATA frame: none in a checksum trailer
+static inline uint32_t fs_data_length(const struct fs_frame *frame)
+{
+    return (frame->flags & FS_FLAG_CHECKSUM) ? 0 : frame->length;
+}
+
+// Encode a checksum trailer
+static inline void fs_put_checksum(unsigned char out[FS_CHECKSUM_SIZE], uint32_t crc)
+{
+    out[0] = crc >> 24;
+    out[1] = crc >> 16;
+    out[2] = crc >> 8;
+    out[3] = crc;
+}
+
+// End a DATA stream, with a checksum trailer unless crc is NULL
+static inline int fs_send_eof(int fd, uint32_t request_id, const uint32_t *crc)
+{
+    unsigned char trailer[FS_CHECKSUM_SIZE];
+    if (crc == NULL)
+    {
+        return fs_send_frame(fd, FS_OP_DATA, FS_FLAG_EOF, request_id, NULL, 0);
+    }
+    fs_put_checksum(trailer, *crc);
+    return fs_send_frame(fd, FS_OP_DATA, FS_FLAG_EOF | FS_FLAG_CHECKSUM, request_id, trailer, sizeof(trailer));
+}
+
+// Pack argv as consecutive NUL-terminated strings; returns the packed length or -1
+static inline int fs_pack_args(char *out, size_t capacity, int argc, const char *const argv[])
+{
+    size_t used = 0;
+    for (int i = 0; i < argc; i++)
+    {
+        size_t len = strlen(argv[i]) + 1;
+        if (used + len > capacity)
+        {
+            return -1;
+        }
+        memcpy(out + used, argv[i], len);
+        used += len;
+    }
+    return (int)used;
+}
+
+// Split a request payload into its arguments in place; returns the argument count
+static inline int fs_unpack_args(char *payload, size_t length, char *argv[], int max_args)
+{
+    int argc = 0;
+    size_t pos = 0;
+    while (pos < length && argc < max_args)
+    {
+        argv[argc++] = payload + pos;
+        pos += strnlen(payload + pos, length - pos) + 1;
+    }
+    payload[length] = '\0'; // The last argument may have arrived unterminated
+    return argc;
+}
+
+// Send a request frame with the given flags carrying argc string arguments
+static inline int fs_send_request_flags(int fd, uint8_t opcode, uint16_t flags, uint32_t request_id, int argc,
+                                        const char *const argv[])
+{
+    char payload[FS_MAX_PAYLOAD];
+    int length = fs_pack_args(payload, sizeof(payload), argc, argv);
+    if (length < 0)
+    {
+        errno = EMSGSIZE;
+        return -1;
+    }
+    return fs_send_frame(fd, opcode, flags, request_id, payload, (uint32_t)length);
+}
+
+// Send a request frame carrying argc string arguments
+static inline int fs_send_request(int fd, uint8_t opcode, uint32_t request_id, int argc, const char *const argv[])
+{
+    return fs_send_request_flags(fd, opcode, 0, request_id, argc, argv);
+}
+
+// Send a REPLY frame with a text message
+static inline int fs_send_reply(int fd, uint32_t request_id, int is_error, const char *message)
+{
+    size_t length = strlen(message);
+    if (length > FS_MAX_PAYLOAD)
+    {
+        length = FS_MAX_PAYLOAD;
+    }
+    return fs_send_frame(fd, FS_OP_REPLY, is_error ? FS_FLAG_ERROR : 0, request_id, message, (uint32_t)length);
+}
+
+// Send the success REPLY of a write a primary numbered for its replicas
+static inline int fs_send_reply_sequence(int fd, uint32_t request_id, const char *message, uint64_t sequence)
+{
+    char payload[FS_MAX_MESSAGE + 32];
+    int length = snprintf(payload, sizeof(payload), "%s%c%llu", message, '\0', (unsigned long long)sequence);
+    if (length < 0 || length >= (int)sizeof(payload))
+    {
+        return fs_send_reply(fd, request_id, 0, message);
+    }
+    return fs_send_frame(fd, FS_OP_REPLY, FS_FLAG_SEQUENCE, request_id, payload, (uint32_t)length);
+}
+
+// The sequence number a REPLY carries, or 0 if it has none
+static inline uint64_t fs_reply_sequence(const struct fs_frame *frame, const char *payload)
+{
+    if (!(frame->flags & FS_FLAG_SEQUENCE))
+    {
+        return 0;
+    }
+    size_t message = strnlen(payload, frame->length);
+    if (message + 1 >= frame->length)
+    {
+        return 0;
+    }
+    char number[24];
+    size_t length = frame->length - message - 1 < sizeof(number) - 1 ? frame->length - message - 1 : sizeof(number) - 1;
+    memcpy(number, payload + message + 1, length);
+    number[length] = '\0';
+    return strtoull(number, NULL, 10);
+}
+
+// Announce the size of the DATA stream that follows
+static inline int fs_send_size(int fd, uint32_t request_id, uint64_t size)
+{
+    unsigned char payload[8];
+    fs_put_u64(payload, size);
+    return fs_send_frame(fd, FS_OP_SIZE, 0, request_id, payload, sizeof(payload));
+}
+
+// Announce the DATA stream of a ranged download: size bytes of a total-byte file
+static inline int fs_send_range_size(int fd, uint32_t request_id, uint64_t size, uint64_t total)
+{
+    unsigned char payload[16];
+    fs_put_u64(payload, size);
+    fs_put_u64(payload + 8, total);
+    return fs_send_frame(fd, FS_OP_SIZE, 0, request_id, payload, sizeof(payload));
+}
+
+// Parse the optional offset and length arguments of a download; a missing
+// length (-1) means up to the end of the file. Returns -1 if either is invalid
+static inline int fs_parse_range(const char *offset_str, const char *length_str, long long *offset, long long *length)
+{
+    char *end;
+    *offset = 0;
+    *length = -1;
+    if (offset_str != NULL)
+    {
+        errno = 0;
+        *offset = strtoll(offset_str, &end, 10);
+        if (errno != 0 || end == offset_str || *end != '\0' || *offset < 0)
+            return -1;
+    }
+    if (length_str != NULL)
+    {
+        errno = 0;
+        *length = strtoll(length_str, &end, 10);
+        if (errno != 0 || end == length_str || *end != '\0' || *length < 0)
+            return -1;
+    }
+    return 0;
+}
+
+// Send count bytes of file straight from the page cache with sendfile();
+// returns 0 when done, -1 if the socket failed, or 1 if nothing was sent
+// because the file or socket does not support sendfile
+static inline int fs_sendfile_all(int sock, int file, size_t count)
+{
+    int sent_any = 0;
+    while (count > 0)
+    {
+        ssize_t sent = sendfile(sock, file, NULL, count);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (!sent_any && (errno == EINVAL || errno == ENOSYS))
+                return 1;
+            return -1;
+        }
+        if (sent == 0)
+        {
+            return -1; // File shrank below the size in the frame header
+        }
+        sent_any = 1;
+        fs_io.sent += sent;
+        count -= sent;
+    }
+    return 0;
+}
+
+// The read()+send() loop of fs_send_file_data() on the thread's io_uring:
+// frames are read ahead at their offsets in the file, each into its own
+// buffer behind room for its header, while the oldest one goes out. Sends
+// stay one at a time so frames leave in order. start is the file position;
+// returns the number of bytes sent, or -1 if the socket failed
+static inline long long fs_uring_send_file_data(int sock, int file, off_t start, uint32_t request_id, uint64_t size,
+                                                uint32_t *crc)
+{
+    struct uring *r = fs_uring;
+    int32_t got[FS_URING_DEPTH];   // Bytes read into each buffer; -1 while its read is in flight
+    uint32_t want[FS_URING_DEPTH]; // Bytes asked of each read
+    uint64_t requested = 0, total_sent = 0;
+    unsigned reads = 0, sends = 0; // Frames read so far, and sent
+    uint32_t frame_sent = 0;       // Bytes of the frame going out that are sent
+    int sending = 0, done = 0, failed = 0;
+    while (1)
+    {
+        while (!done && !failed && requested < size && reads - sends < FS_URING_DEPTH)
+        {
+            unsigned i = reads % FS_URING_DEPTH;
+            want[i] = size - requested < FS_MAX_PAYLOAD ? (uint32_t)(size - requested) : FS_MAX_PAYLOAD;
+            got[i] = -1;
+            if (uring_queue_file(r, 0, file, i, uring_buffer(r, i) + FS_HEADER_SIZE, want[i], start + requested, i) < 0)
+            {
+                failed = 1;
+                break;
+            }
+            requested += want[i];
+            reads++;
+        }
+        unsigned i = sends % FS_URING_DEPTH;
+        if (!sending && !done && !failed && sends < reads && got[i] >= 0)
+        {
+            char *frame = uring_buffer(r, i);
+            if (got[i] == 0)
+            {
+                done = 1; // Short file; the receiver sees the mismatch against the size
+            }
+            else
+            {
+                if (crc != NULL)
+                    *crc = crc32c(*crc, frame + FS_HEADER_SIZE, (size_t)got[i]);
+                fs_encode_header((unsigned char *)frame, FS_OP_DATA, 0, request_id, (uint32_t)got[i]);
+                frame_sent = 0;
+                sending = 1;
+                if (uring_queue(r, IORING_OP_SEND, sock, frame, FS_HEADER_SIZE + got[i], 0, FS_URING_DEPTH) < 0)
+                {
+                    failed = 1;
+                    sending = 0;
+                }
+            }
+        }
+        if (r->queued == 0 && r->inflight == 0)
+            break;
+        if (uring_submit(r, 1) < 0)
+        {
+            fs_uring_lost();
+            return -1;
+        }
+        uint64_t tag;
+        int32_t res;
+        while (uring_reap(r, &tag, &res))
+        {
+            if (tag < FS_URING_DEPTH)
+            {
+                got[tag] = res < 0 ? 0 : res; // A read error ends the stream like a short file
+                continue;
+            }
+            unsigned j = sends % FS_URING_DEPTH;
+            uint32_t length = FS_HEADER_SIZE + (uint32_t)got[j];
+            if (res <= 0)
+            {
+                failed = 1;
+                sending = 0;
+                continue;
+            }
+            fs_io.sent += res;
+            frame_sent += (uint32_t)res;
+            if (frame_sent < length)
+            {
+                if (uring_queue(r, IORING_OP_SEND, sock, uring_buffer(r, j) + frame_sent, length - frame_sent, 0,
+                                FS_URING_DEPTH) < 0)
+                {
+                    failed = 1;
+                    sending = 0;
+                }
+                continue;
+            }
+            sending = 0;
+            total_sent += (uint64_t)got[j];
+            done = done || (uint32_t)got[j] < want[j];
+            sends++;
+        }
+    }
+    lseek(file, start + (off_t)total_sent, SEEK_SET);
+    return failed ? -1 : (long long)total_sent;
+}
+
+// Send size bytes from file as DATA frames, without ending the stream;
+// returns the number of bytes sent, or -1 if the socket failed. The payload
+// goes out with sendfile() where possible and falls back to read()+send(),
+// pipelined through the thread's io_uring if it has one.
+// Given crc, the bytes sent are added to it; they are then read through a
+// buffer, since they have to pass through the CPU anyway
+static inline long long fs_send_file_data(int sock, int file, uint32_t request_id, uint64_t size, uint32_t *crc)
+{
+    unsigned char buffer[FS_MAX_PAYLOAD];
+    uint64_t total_sent = 0;
+    int use_sendfile = crc == NULL;
+    // Each header announces its exact length before the payload is sent, so
+    // only regular files, and only the bytes they already hold, qualify
+    uint64_t available = 0;
+    struct stat st;
+    off_t start = lseek(file, 0, SEEK_CUR);
+    if (start < 0 || fstat(file, &st) < 0 || !S_ISREG(st.st_mode))
+    {
+        use_sendfile = 0;
+    }
+    else if (st.st_size > start)
+    {
+        available = (uint64_t)(st.st_size - start);
+    }
+    while (use_sendfile && total_sent < size && total_sent < available)
+    {
+        uint64_t left = (size < available ? size : available) - total_sent;
+        size_t want = left < FS_MAX_PAYLOAD ? (size_t)left : FS_MAX_PAYLOAD;
+        unsigned char header[FS_HEADER_SIZE];
+        fs_encode_header(header, FS_OP_DATA, 0, request_id, (uint32_t)want);
+        if (send(sock, header, FS_HEADER_SIZE, MSG_NOSIGNAL | MSG_MORE) != FS_HEADER_SIZE)
+        {
+            return -1;
+        }
+        fs_io.sent += FS_HEADER_SIZE;
+        int rc = fs_sendfile_all(sock, file, want);
+        if (rc < 0)
+        {
+            return -1;
+        }
+        if (rc > 0)
+        {
+            // The header is already out, so this frame's payload is copied
+            // and the rest of the stream takes the read()+send() path
+            use_sendfile = 0;
+            size_t have = 0;
+            while (have < want)
+            {
+                ssize_t bytes_read = read(file, buffer + have, want - have);
+                if (bytes_read < 0 && errno == EINTR)
+                    continue;
+                if (bytes_read <= 0)
+                    return -1;
+                have += bytes_read;
+            }
+            if (fs_send_all(sock, buffer, want) < 0)
+            {
+                return -1;
+            }
+        }
+        total_sent += want;
+    }
+    if (fs_uring != NULL && start >= 0 && total_sent < size)
+    {
+        long long rest = fs_uring_send_file_data(sock, file, start + (off_t)total_sent, request_id, size - total_sent, crc);
+        return rest < 0 ? -1 : (long long)total_sent + rest;
+    }
+    while (total_sent < size)
+    {
+        size_t want = size - total_sent < sizeof(buffer) ? (size_t)(size - total_sent) : sizeof(buffer);
+        ssize_t bytes_read = read(file, buffer, want);
+        if (bytes_read <= 0)
+        {
+            if (bytes_read < 0 && errno == EINTR)
+                continue;
+            break; // Short file; the receiver sees the mismatch against the size
+        }
+        if (crc != NULL)
+        {
+            *crc = crc32c(*crc, buffer, (size_t)bytes_read);
+        }
+        if (fs_send_frame(sock, FS_OP_DATA, 0, request_id, buffer, (uint32_t)bytes_read) < 0)
+        {
+            return -1;
+        }
+        total_sent += bytes_read;
+    }
+    return (long long)total_sent;
+}
+
+// Stream size bytes from file as DATA frames, ending with an EOF frame
+// carrying their checksum: the file's stored one if it is sent whole, so it
+// still goes out with sendfile(), or else one computed on the way. Returns
+// the number of bytes sent, or -1 if the socket failed
+static inline long long fs_send_stream(int sock, int file, uint32_t request_id, uint64_t size)
+{
+    struct stat st;
+    uint32_t crc = 0;
+    int stored = lseek(file, 0, SEEK_CUR) == 0 && fstat(file, &st) == 0 && (uint64_t)st.st_size == size &&
+                 crc32c_load(file, &crc) == 0;
+    long long total_sent = fs_send_file_data(sock, file, request_id, size, stored ? NULL : &crc);
+    if (total_sent < 0 || fs_send_eof(sock, request_id, &crc) < 0)
+    {
+        return -1;
+    }
+    return total_sent;
+}
+
+// Send an in-memory buffer as a DATA stream ending with an EOF frame
+static inline int fs_send_buffer(int sock, uint32_t request_id, const void *data, size_t len)
+{
+    const char *p = data;
+    while (len > 0)
+    {
+        uint32_t chunk = len < FS_MAX_PAYLOAD ? (uint32_t)len : FS_MAX_PAYLOAD;
+        if (fs_send_frame(sock, FS_OP_DATA, 0, request_id, p, chunk) < 0)
+        {
+            return -1;
+        }
+        p += chunk;
+        len -= chunk;
+    }
+    return fs_send_frame(sock, FS_OP_DATA, FS_FLAG_EOF, request_id, NULL, 0);
+}
+
+// Writes of a received stream through the thread's io_uring: each payload
+// lands in a ring buffer and is written from there at its offset in the
+// file while the next frames arrive. A buffer is reused once its write is done
+struct fs_uring_writer
+{
+    int file;
+    off_t offset;  // Where the next write goes
+    unsigned next; // Buffer the next payload goes into
+    unsigned busy; // Bit per buffer whose write is in flight
+    uint32_t length[FS_URING_DEPTH], written[FS_URING_DEPTH];
+    off_t at[FS_URING_DEPTH];
+    int error;     // errno of the first failed write
+};
+
+// Returns -1 if file has no position to write from
+static inline int fs_uring_writer_init(struct fs_uring_writer *w, int file)
+{
+    memset(w, 0, sizeof(*w));
+    w->file = file;
+    w->offset = lseek(file, 0, SEEK_CUR);
+    return w->offset < 0 ? -1 : 0;
+}
+
+// Wait for at least one write to complete, continuing short ones
+static inline void fs_uring_writer_wait(struct fs_uring_writer *w)
+{
+    struct uring *r = fs_uring;
+    if (uring_submit(r, 1) < 0)
+    {
+        w->error = w->error ? w->error : errno;
+        w->busy = 0;
+        fs_uring_lost();
+        return;
+    }
+    uint64_t i;
+    int32_t res;
+    while (uring_reap(r, &i, &res))
+    {
+        if (res > 0)
+            w->written[i] += (uint32_t)res;
+        if (res > 0 && w->written[i] < w->length[i] && w->error == 0 &&
+            uring_queue_file(r, 1, w->file, (unsigned)i, uring_buffer(r, (unsigned)i) + w->written[i],
+                             w->length[i] - w->written[i], w->at[i] + w->written[i], i) == 0)
+            continue;
+        if (res <= 0 && w->error == 0)
+            w->error = res < 0 ? -res : EIO;
+        w->busy &= ~(1u << i);
+    }
+}
+
+// The buffer for the next payload, once its last write is done; NULL if the ring failed
+static inline char *fs_uring_writer_buffer(struct fs_uring_writer *w)
+{
+    while (fs_uring != NULL && (w->busy & (1u << w->next)))
+        fs_uring_writer_wait(w);
+    return fs_uring != NULL ? uring_buffer(fs_uring, w->next) : NULL;
+}
+
+// Write length bytes of data at the next offset, copying them into the
+// buffer unless they were received there; returns -1 (errno set) once a write has failed
+static inline int fs_uring_write(struct fs_uring_writer *w, const void *data, uint32_t length)
+{
+    char *buffer = w->error == 0 ? fs_uring_writer_buffer(w) : NULL;
+    if (buffer != NULL)
+    {
+        unsigned i = w->next;
+        if (data != buffer)
+            memcpy(buffer, data, length);
+        w->length[i] = length;
+        w->written[i] = 0;
+        w->at[i] = w->offset;
+        if (uring_queue_file(fs_uring, 1, w->file, i, buffer, length, (uint64_t)w->offset, i) == 0)
+            w->busy |= 1u << i;
+        else
+            w->error = errno;
+        w->next = (i + 1) % FS_URING_DEPTH;
+    }
+    w->offset += length;
+    if (w->error != 0)
+    {
+        errno = w->error;
+        return -1;
+    }
+    return 0;
+}
+
+// Wait for every write and leave the file position after them; returns 0,
+// or -1 with errno set if one failed
+static inline int fs_uring_writer_finish(struct fs_uring_writer *w)
+{
+    while (fs_uring != NULL && w->busy != 0)
+        fs_uring_writer_wait(w);
+    lseek(w->file, w->offset, SEEK_SET);
+    if (w->error != 0)
+    {
+        errno = w->error;
+        return -1;
+    }
+    return 0;
+}
+
+// Receive a DATA stream into file (or discard it when file is -1) until the
+// EOF frame, setting *crc (if given) to the checksum of the bytes received.
+// Returns the number of bytes received, -1 on a socket/protocol error, -2 if
+// the peer aborted the stream with a REPLY (its message is left in reply, if
+// given), -3 if writing to file failed (errno is preserved) or -4 if the
+// bytes do not match the stream's checksum trailer.
+static inline long long fs_recv_stream(int sock, int file, char *reply, size_t reply_size, uint32_t *crc)
+{
+    char payload[FS_MAX_PAYLOAD + 1];
+    struct fs_frame frame;
+    long long total = 0;
+    int write_failed = 0;
+    uint32_t computed = 0, expected = 0;
+    int checked = 0; // The stream ended with a checksum trailer
+    struct fs_uring_writer writer;
+    int async = file >= 0 && fs_uring != NULL && fs_uring_writer_init(&writer, file) == 0;
+
+    while (1)
+    {
+        // With a ring, payloads are received straight into its buffers
+        char *data = async ? fs_uring_writer_buffer(&writer) : NULL;
+        data = data != NULL ? data : payload;
+        if (fs_recv_frame(sock, &frame, data, FS_MAX_PAYLOAD) != 1)
+        {
+            if (async)
+                fs_uring_writer_finish(&writer);
+            return -1;
+        }
+        if (frame.opcode == FS_OP_REPLY)
+        {
+            if (reply != NULL && reply_size > 0)
+            {
+                snprintf(reply, reply_size, "%s", data);
+            }
+            if (async)
+                fs_uring_writer_finish(&writer);
+            return -2;
+        }
+        if (frame.opcode != FS_OP_DATA)
+        {
+            if (async)
+                fs_uring_writer_finish(&writer);
+            errno = EPROTO;
+            return -1;
+        }
+        if (fs_get_checksum(&frame, data, &expected))
+        {
+            checked = 1;
+            frame.length = 0;
+        }
+        computed = frame.length > 0 && (file >= 0 || crc != NULL) ? crc32c(computed, data, frame.length) : computed;
+        // Keep consuming after a write failure so the connection stays in sync
+        if (!write_failed && frame.length > 0 && async)
+        {
+            if (fs_uring_write(&writer, data, frame.length) < 0)
+                write_failed = errno;
+        }
+        else if (!write_failed && frame.length > 0 && file >= 0)
+        {
+            size_t written = 0;
+            while (written < frame.length)
+            {
+                ssize_t n = write(file, payload + written, frame.length - written);
+                if (n < 0)
+                {
+                    if (errno == EINTR)
+                        continue;
+                    write_failed = errno;
+                    break;
+                }
+                written += n;
+            }
+        }
+        total += frame.length;
+        if (frame.flags & FS_FLAG_EOF)
+        {
+            break;
+        }
+    }
+    if (async && fs_uring_writer_finish(&writer) < 0 && !write_failed)
+    {
+        write_failed = errno;
+    }
+    if (crc != NULL)
+    {
+        *crc = computed;
+    }
+    if (write_failed)
+    {
+        errno = write_failed;
+        return -3;
+    }
+    if (checked && computed != expected && (file >= 0 || crc != NULL))
+    {
+        return -4;
+    }
+    return total;
+}
+
+#endif
@@ -0,0 +1,360 @@
+// Cache of the .txt and .pdf files Smain downloads from Stext and Spdf
+//
+// A dfile of a file in the cache is answered from Smain's memory, without
+// asking its storage server. The cache lives in a shared anonymous mapping
+// created before the workers are forked, so a file one worker fetched is
+// served by all of them, and a robust process-shared mutex guards it like
+// the catalog's.
+//
+// Its byte budget is cut into READ_CACHE_BLOCK blocks; a file takes a chain
+// of them. When a new file does not fit, the least recently used ones are
+// evicted until it does. A file larger than an eighth of the budget (or
+// READ_CACHE_OBJECT_MAX) is never cached, so one download cannot flush the
+// rest.
+//
+// An upload or delete of a path drops it from the cache. A download started
+// before the write may still be fetching the old contents; every path maps
+// to one of READ_CACHE_STRIPES version counters, which the write bumps, and
+// a fill whose counter moved since it started is thrown away.
+#ifndef FS_READ_CACHE_H
+#define FS_READ_CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "catalog.h"
+#include "metrics.h"
+
+#define READ_CACHE_BLOCK 16384                    // Bytes of a block of cached data
+#define READ_CACHE_OBJECT_MAX (8 * 1024 * 1024)   // Largest file ever cached
+#define READ_CACHE_STRIPES 4096                   // Version counters paths are spread over
+
+struct read_cache_entry
+{
+    int32_t next;        // Next entry in the same bucket, or the next free entry; -1 at the end
+    int32_t lru_prev;    // Neighbours in recency order; -1 at either end
+    int32_t lru_next;
+    int32_t first_block; // Chain of the file's blocks, -1 for an empty file
+    long long size;
+    char path[CATALOG_PATH_MAX];
+};
+
+struct read_cache
+{
+    pthread_mutex_t lock;
+    uint32_t blocks;             // Blocks in the budget, and entries available
+    uint32_t mask;               // Bucket count - 1
+    uint32_t used;               // Entries ever handed out
+    int32_t free_entries;        // Released entries, linked through next
+    int32_t free_blocks;         // Unused blocks, linked through block_next
+    uint32_t free_block_count;
+    int32_t lru_head, lru_tail;  // Most and least recently used entries
+    long long object_max;        // Largest file cached
+    uint64_t hits, misses, fills, evictions, invalidations;
+    uint64_t files;              // Entries in use
+    uint64_t bytes;              // File bytes held
+    uint32_t versions[READ_CACHE_STRIPES];
+    int32_t *heads;
+    int32_t *block_next;
+    struct read_cache_entry *entries;
+    char *data;
+};
+
+// Map a cache of budget bytes; must be called before forking the workers.
+// Returns NULL if the memory cannot be had.
+static inline struct read_cache *read_cache_create(long long budget)
+{
+    uint32_t blocks = budget / READ_CACHE_BLOCK > 0 ? (uint32_t)(budget / READ_CACHE_BLOCK) : 1;
+    uint32_t buckets = 1;
+    while (buckets < blocks)
+        buckets <<= 1;
+    size_t size = sizeof(struct read_cache) + (size_t)buckets * sizeof(int32_t) + (size_t)blocks * sizeof(int32_t) +
+                  (size_t)blocks * sizeof(struct read_cache_entry) + (size_t)blocks * READ_CACHE_BLOCK;
+    void *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        return NULL;
+    }
+    struct read_cache *c = region;
+    c->blocks = blocks;
+    c->mask = buckets - 1;
+    c->free_entries = -1;
+    c->lru_head = c->lru_tail = -1;
+    c->object_max = (long long)blocks * READ_CACHE_BLOCK / 8;
+    if (c->object_max > READ_CACHE_OBJECT_MAX)
+        c->object_max = READ_CACHE_OBJECT_MAX;
+    c->heads = (int32_t *)(c + 1);
+    c->block_next = c->heads + buckets;
+    c->entries = (struct read_cache_entry *)(c->block_next + blocks);
+    c->data = (char *)(c->entries + blocks);
+    memset(c->heads, 0xff, (size_t)buckets * sizeof(int32_t)); // All chains empty (-1)
+    for (uint32_t i = 0; i < blocks; i++)
+        c->block_next[i] = i + 1 < blocks ? (int32_t)(i + 1) : -1;
+    c->free_blocks = 0;
+    c->free_block_count = blocks;
+
+    pthread_mutexattr_t attr;
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&c->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return c;
+}
+
+static inline void read_cache_lock(struct read_cache *c)
+{
+    if (pthread_mutex_lock(&c->lock) == EOWNERDEAD)
+    {
+        // A worker died holding the lock; the structure may be half updated,
+        // so start over from an empty cache rather than trust it
+        memset(c->heads, 0xff, (size_t)(c->mask + 1) * sizeof(int32_t));
+        for (uint32_t i = 0; i < c->blocks; i++)
+            c->block_next[i] = i + 1 < c->blocks ? (int32_t)(i + 1) : -1;
+        c->free_blocks = 0;
+        c->free_block_count = c->blocks;
+        c->free_entries = -1;
+        c->used = 0;
+        c->lru_head = c->lru_tail = -1;
+        c->files = c->bytes = 0;
+        for (int i = 0; i < READ_CACHE_STRIPES; i++)
+            c->versions[i]++; // Fills under way may have been half-inserted
+        pthread_mutex_consistent(&c->lock);
+    }
+}
+
+static inline void read_cache_unlock(struct read_cache *c)
+{
+    pthread_mutex_unlock(&c->lock);
+}
+
+// Find the entry of a normalized path; -1 if it is not cached
+static inline int32_t read_cache_find(struct read_cache *c, const char *key, size_t len)
+{
+    int32_t i = c->heads[catalog_hash(key, len) & c->mask];
+    while (i >= 0 && strcmp(c->entries[i].path, key) != 0)
+        i = c->entries[i].next;
+    return i;
+}
+
+static inline void read_cache_lru_unlink(struct read_cache *c, int32_t i)
+{
+    struct read_cache_entry *e = &c->entries[i];
+    if (e->lru_prev >= 0)
+        c->entries[e->lru_prev].lru_next = e->lru_next;
+    else
+        c->lru_head = e->lru_next;
+    if (e->lru_next >= 0)
+        c->entries[e->lru_next].lru_prev = e->lru_prev;
+    else
+        c->lru_tail = e->lru_prev;
+}
+
+static inline void read_cache_lru_push(struct read_cache *c, int32_t i)
+{
+    struct read_cache_entry *e = &c->entries[i];
+    e->lru_prev = -1;
+    e->lru_next = c->lru_head;
+    if (c->lru_head >= 0)
+        c->entries[c->lru_head].lru_prev = i;
+    else
+        c->lru_tail = i;
+    c->lru_head = i;
+}
+
+// Drop an entry, handing its blocks back
+static inline void read_cache_drop(struct read_cache *c, int32_t i)
+{
+    struct read_cache_entry *e = &c->entries[i];
+    int32_t *link = &c->heads[catalog_hash(e->path, strlen(e->path)) & c->mask];
+    while (*link != i)
+        link = &c->entries[*link].next;
+    *link = e->next;
+    read_cache_lru_unlink(c, i);
+    for (int32_t b = e->first_block; b >= 0;)
+    {
+        int32_t next = c->block_next[b];
+        c->block_next[b] = c->free_blocks;
+        c->free_blocks = b;
+        c->free_block_count++;
+        b = next;
+    }
+    c->files--;
+    c->bytes -= e->size;
+    e->next = c->free_entries;
+    c->free_entries = i;
+}
+
+// The version counter of a path, to be handed to read_cache_put with the
+// contents fetched after reading it
+static inline uint32_t read_cache_version(struct read_cache *c, const char *path)
+{
+    char key[CATALOG_PATH_MAX];
+    int len = catalog_key(key, path);
+    return len < 0 ? 0 : __atomic_load_n(&c->versions[catalog_hash(key, len) % READ_CACHE_STRIPES], __ATOMIC_ACQUIRE);
+}
+
+// Can a file of this size be cached?
+static inline int read_cache_fits(const struct read_cache *c, long long size)
+{
+    return size >= 0 && size <= c->object_max;
+}
+
+// Copy length bytes (-1: to the end) of a cached file from offset into a new
+// buffer; sets *total to the file's size. Returns the buffer, to be freed by
+// the caller, or NULL on a miss. An offset past the end is a miss too, so
+// the storage server reports it.
+static inline char *read_cache_get(struct read_cache *c, const char *path, long long offset, long long *length,
+                                   long long *total)
+{
+    char key[CATALOG_PATH_MAX];
+    int len = catalog_key(key, path);
+    if (len < 0)
+        return NULL;
+    read_cache_lock(c);
+    int32_t i = read_cache_find(c, key, len);
+    struct read_cache_entry *e = i >= 0 ? &c->entries[i] : NULL;
+    char *out = NULL;
+    if (e != NULL && offset <= e->size)
+    {
+        long long want = *length < 0 || *length > e->size - offset ? e->size - offset : *length;
+        out = malloc(want > 0 ? want : 1);
+        if (out != NULL)
+        {
+            // Skip to the block holding offset, then copy block by block
+            int32_t b = e->first_block;
+            long long skip = offset;
+            for (; skip >= READ_CACHE_BLOCK; skip -= READ_CACHE_BLOCK)
+                b = c->block_next[b];
+            for (long long copied = 0; copied < want; b = c->block_next[b], skip = 0)
+            {
+                long long n = READ_CACHE_BLOCK - skip < want - copied ? READ_CACHE_BLOCK - skip : want - copied;
+                memcpy(out + copied, c->data + (size_t)b * READ_CACHE_BLOCK + skip, n);
+                copied += n;
+            }
+            *length = want;
+            *total = e->size;
+            read_cache_lru_unlink(c, i);
+            read_cache_lru_push(c, i);
+        }
+    }
+    c->hits += out != NULL;
+    c->misses += out == NULL;
+    read_cache_unlock(c);
+    return out;
+}
+
+// Cache the complete contents of a file, unless a write to its path bumped
+// the version since it was fetched. Evicts the least recently used files to
+// make room.
+static inline void read_cache_put(struct read_cache *c, const char *path, const char *data, long long size,
+                                  uint32_t version)
+{
+    char key[CATALOG_PATH_MAX];
+    int len = catalog_key(key, path);
+    if (len < 0 || !read_cache_fits(c, size))
+        return;
+    uint32_t need = (uint32_t)((size + READ_CACHE_BLOCK - 1) / READ_CACHE_BLOCK);
+    read_cache_lock(c);
+    if (c->versions[catalog_hash(key, len) % READ_CACHE_STRIPES] != version)
+    {
+        read_cache_unlock(c);
+        return;
+    }
+    int32_t i = read_cache_find(c, key, len);
+    if (i >= 0)
+        read_cache_drop(c, i); // Another worker fetched it meanwhile; keep the newer copy
+    while (c->lru_tail >= 0 && (c->free_block_count < need || (c->free_entries < 0 && c->used == c->blocks)))
+    {
+        read_cache_drop(c, c->lru_tail);
+        c->evictions++;
+    }
+    if (c->free_entries >= 0)
+    {
+        i = c->free_entries;
+        c->free_entries = c->entries[i].next;
+    }
+    else
+    {
+        i = (int32_t)c->used++;
+    }
+    struct read_cache_entry *e = &c->entries[i];
+    memcpy(e->path, key, (size_t)len + 1);
+    e->size = size;
+    e->first_block = -1;
+    int32_t *tail = &e->first_block;
+    for (long long copied = 0; copied < size; copied += READ_CACHE_BLOCK)
+    {
+        int32_t b = c->free_blocks;
+        c->free_blocks = c->block_next[b];
+        c->free_block_count--;
+        long long n = size - copied < READ_CACHE_BLOCK ? size - copied : READ_CACHE_BLOCK;
+        memcpy(c->data + (size_t)b * READ_CACHE_BLOCK, data + copied, n);
+        *tail = b;
+        tail = &c->block_next[b];
+    }
+    *tail = -1;
+    uint32_t bucket = catalog_hash(key, len) & c->mask;
+    e->next = c->heads[bucket];
+    c->heads[bucket] = i;
+    read_cache_lru_push(c, i);
+    c->files++;
+    c->bytes += size;
+    c->fills++;
+    read_cache_unlock(c);
+}
+
+// A path was written or deleted: drop it, and fail fills of it already under way
+static inline void read_cache_invalidate(struct read_cache *c, const char *path)
+{
+    char key[CATALOG_PATH_MAX];
+    int len = catalog_key(key, path);
+    if (len < 0)
+        return;
+    read_cache_lock(c);
+    c->versions[catalog_hash(key, len) % READ_CACHE_STRIPES]++;
+    int32_t i = read_cache_find(c, key, len);
+    if (i >= 0)
+    {
+        read_cache_drop(c, i);
+        c->invalidations++;
+    }
+    read_cache_unlock(c);
+}
+
+// Describe the cache's counters like metrics_format does a server's
+static inline size_t read_cache_format(struct read_cache *c, int machine, char *out, size_t capacity)
+{
+    read_cache_lock(c);
+    uint64_t hits = c->hits, misses = c->misses, fills = c->fills, evictions = c->evictions;
+    uint64_t invalidations = c->invalidations, files = c->files, bytes = c->bytes;
+    read_cache_unlock(c);
+    unsigned long long budget = (unsigned long long)c->blocks * READ_CACHE_BLOCK;
+    if (machine)
+    {
+        return metrics_append(out, capacity, 0,
+                              "filesync3_cache_hits_total{server=\"smain\"} %llu\n"
+                              "filesync3_cache_misses_total{server=\"smain\"} %llu\n"
+                              "filesync3_cache_fills_total{server=\"smain\"} %llu\n"
+                              "filesync3_cache_evictions_total{server=\"smain\"} %llu\n"
+                              "filesync3_cache_invalidations_total{server=\"smain\"} %llu\n"
+                              "filesync3_cache_files{server=\"smain\"} %llu\n"
+                              "filesync3_cache_bytes{server=\"smain\"} %llu\n"
+                              "filesync3_cache_budget_bytes{server=\"smain\"} %llu\n",
+                              (unsigned long long)hits, (unsigned long long)misses, (unsigned long long)fills,
+                              (unsigned long long)evictions, (unsigned long long)invalidations,
+                              (unsigned long long)files, (unsigned long long)bytes, budget);
+    }
+    return metrics_append(out, capacity, 0,
+                          "smain cache: %llu hits, %llu misses (%.1f%% hit), %llu fills, %llu evictions, "
+                          "%llu invalidations; %llu files, %.1f of %.1f MB\n",
+                          (unsigned long long)hits, (unsigned long long)misses,
+                          hits + misses > 0 ? 100.0 * hits / (hits + misses) : 0.0, (unsigned long long)fills,
+                          (unsigned long long)evictions, (unsigned long long)invalidations, (unsigned long long)files,
+                          bytes / 1e6, budget / 1e6);
+}
+
+#endif
@@ -0,0 +1,372 @@
+// Asynchronous replication of a storage server's writes to its replicas
+//
+// A Stext or Spdf started with -r passes every store and delete it completes
+// on to one or more replicas: servers of the same kind, which Smain can then
+// read from. The request is answered as soon as the local write is done;
+// each replica has a thread and a queue of its own, so a slow or unreachable
+// replica holds up nothing but its own queue. Operations reach a replica in
+// the order they were done here. One that fails for want of a connection is
+// retried every second until the replica takes it, so a replica that was
+// down catches up once it is back. A store reads the file when it is sent:
+// if it was overwritten meanwhile the newer contents go, and if it is gone
+// the delete that follows is all the replica needs.
+//
+// A replica more than REPLICA_QUEUE_LIMIT operations behind loses the oldest
+// ones; they are counted and logged, and the replica has to be re-seeded.
+//
+// Every write is numbered, in the order it was done, from the time in
+// microseconds so numbers keep rising across restarts. The primary's reply
+// carries the number and Smain keeps it with the file. A replica is sent
+// each write with its number and the one it was sent before, which tells it
+// whether it missed any: it tracks the run of writes it applied with none
+// missed or refused in between, and serves a read only if the number Smain
+// passes along falls in that run. A replica that lost writes, was refused
+// one or restarted serves only files written after that.
+#ifndef FS_REPLICA_H
+#define FS_REPLICA_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include "protocol.h"
+#include "chunk_store.h"
+
+#define REPLICA_MAX 8                // Replicas of one server
+#define REPLICA_QUEUE_LIMIT 100000   // Operations a replica may fall behind by
+#define REPLICA_RETRY_DELAY 1        // Seconds between attempts to reach a replica
+#define REPLICA_TIMEOUT 30           // Seconds a replica may stall an operation before the connection is dropped
+
+// A write waiting to be passed on
+struct replica_op
+{
+    struct replica_op *next;
+    uint8_t opcode;    // FS_OP_STORE or FS_OP_REMOVE
+    uint32_t trace_id; // Trace id of the write, so the replica's span lines up with it
+    uint64_t sequence; // Number of the write
+    char *path;        // As Smain named it: the directory of a store, the file of a delete
+    char *name;        // Store: the file name
+    char *local;       // Store: the file in this server's store, read when sent
+};
+
+struct replica
+{
+    char name[64]; // host:port, for messages
+    struct sockaddr_in addr;
+    int sock;      // Kept open between operations; -1 when not connected
+    struct chunk_store *store;
+    struct replica_op *head, *tail;
+    size_t queued;
+    unsigned long long dropped; // Operations lost to a full queue
+    unsigned long long gaps;    // dropped as of the last operation the replica took
+    uint64_t sent;              // Number of the last operation the replica took
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    pthread_t thread;
+};
+
+struct replica_set
+{
+    int count;
+    struct replica members[REPLICA_MAX];
+    pthread_mutex_t lock;
+    uint64_t sequence;    // Number of the last write passed on
+    uint64_t first, last; // As a replica: the run of the primary's writes applied here, none missed
+};
+
+// Set up the numbering; call once before replica_start or any write
+static inline void replica_init(struct replica_set *set)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    pthread_mutex_init(&set->lock, NULL);
+    // A replica has taken nothing numbered from here, so it sees the first write as following a gap
+    set->sequence = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+}
+
+// As a replica: note that the primary's write sequence, sent after
+// previous, was applied (ok) or refused
+static inline void replica_applied(struct replica_set *set, uint64_t sequence, uint64_t previous, int ok)
+{
+    pthread_mutex_lock(&set->lock);
+    if (!ok)
+    {
+        set->first = sequence + 1; // Nothing up to it can be trusted
+        set->last = sequence;
+    }
+    else if (sequence != set->last)
+    {
+        // Applied again after its reply was lost: nothing changes. Otherwise the run goes on, or starts over
+        if (previous == 0 || previous != set->last)
+            set->first = sequence;
+        set->last = sequence;
+    }
+    pthread_mutex_unlock(&set->lock);
+}
+
+// As a replica: has the primary's write sequence been applied here?
+static inline int replica_has(struct replica_set *set, uint64_t sequence)
+{
+    pthread_mutex_lock(&set->lock);
+    int has = set->last != 0 && sequence >= set->first && sequence <= set->last;
+    pthread_mutex_unlock(&set->lock);
+    return has;
+}
+
+static inline void replica_op_free(struct replica_op *op)
+{
+    free(op->path);
+    free(op->name);
+    free(op->local);
+    free(op);
+}
+
+// Send a stored file, plain or chunked, as the DATA stream of a store;
+// returns 0, or -1 if the connection failed
+static inline int replica_send_file(struct replica *r, struct chunk_reader *reader, long long size, uint32_t id)
+{
+    // A plain file with a stored checksum goes out with sendfile()
+    uint32_t crc = 0;
+    uint32_t *sum = reader->m.records == NULL && crc32c_load(reader->fd, &crc) == 0 ? NULL : &crc;
+    long long sent = 0;
+    if (reader->m.records == NULL)
+    {
+        sent = fs_send_file_data(r->sock, reader->fd, id, (uint64_t)size, sum);
+    }
+    uint32_t length;
+    while (reader->m.records != NULL && sent >= 0 && chunk_reader_next(reader, &length) >= 0)
+    {
+        long long chunk_sent = fs_send_file_data(r->sock, reader->fd, id, length, sum);
+        sent = chunk_sent < 0 ? -1 : sent + chunk_sent;
+    }
+    // A short file makes the replica refuse the store, which is logged
+    if (sent < 0 || fs_send_eof(r->sock, id, &crc) < 0)
+        return -1;
+    return 0;
+}
+
+// Apply one operation on the replica, which took previous before it (0
+// after a gap). Returns 0 once the replica took it, refused or not, 1 if
+// there was nothing to send, -1 if the connection failed and it should be
+// tried again
+static inline int replica_apply(struct replica *r, struct replica_op *op, uint64_t previous)
+{
+    if (r->sock < 0)
+    {
+        r->sock = socket(AF_INET, SOCK_STREAM, 0);
+        struct timeval timeout = {REPLICA_TIMEOUT, 0};
+        if (r->sock >= 0)
+        {
+            setsockopt(r->sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+            setsockopt(r->sock, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+        }
+        if (r->sock < 0 || connect(r->sock, (struct sockaddr *)&r->addr, sizeof(r->addr)) < 0)
+        {
+            if (r->sock >= 0)
+                close(r->sock);
+            r->sock = -1;
+            return -1;
+        }
+        fs_set_nodelay(r->sock);
+    }
+
+    char sequence[24], previous_str[24];
+    snprintf(sequence, sizeof(sequence), "%llu", (unsigned long long)op->sequence);
+    snprintf(previous_str, sizeof(previous_str), "%llu", (unsigned long long)previous);
+    int sent;
+    if (op->opcode == FS_OP_STORE)
+    {
+        struct chunk_reader reader;
+        struct stat st;
+        if (chunk_reader_open(r->store, op->local, &reader) < 0)
+        {
+            return 1; // Deleted since; its delete is queued behind
+        }
+        long long size = reader.m.records != NULL ? reader.m.size : fstat(reader.fd, &st) == 0 ? st.st_size : 0;
+        char size_str[32];
+        snprintf(size_str, sizeof(size_str), "%lld", size);
+        const char *args[] = {op->name, op->path, size_str, sequence, previous_str};
+        sent = fs_send_request_flags(r->sock, FS_OP_STORE, FS_FLAG_SEQUENCE, op->trace_id, 5, args) < 0
+                   ? -1
+                   : replica_send_file(r, &reader, size, op->trace_id);
+        chunk_reader_close(&reader);
+    }
+    else
+    {
+        const char *args[] = {op->path, sequence, previous_str};
+        sent = fs_send_request_flags(r->sock, FS_OP_REMOVE, FS_FLAG_SEQUENCE, op->trace_id, 3, args);
+    }
+
+    char message[FS_MAX_MESSAGE + 1];
+    struct fs_frame frame;
+    if (sent < 0 || fs_recv_frame(r->sock, &frame, message, FS_MAX_MESSAGE) != 1 || frame.opcode != FS_OP_REPLY)
+    {
+        close(r->sock);
+        r->sock = -1;
+        return -1;
+    }
+    if (frame.flags & FS_FLAG_ERROR)
+    {
+        message[frame.length] = '\0';
+        printf("Replica %s refused %s %s%s%s: %s\n", r->name, fs_opcode_name(op->opcode), op->path,
+               op->name != NULL ? "/" : "", op->name != NULL ? op->name : "", message);
+    }
+    return 0;
+}
+
+// Pass the queued operations on to one replica, in order, for good
+static inline void *replica_thread(void *arg)
+{
+    struct replica *r = arg;
+    int reported = 0; // The replica being unreachable has been logged
+    while (1)
+    {
+        pthread_mutex_lock(&r->lock);
+        while (r->head == NULL)
+            pthread_cond_wait(&r->ready, &r->lock);
+        struct replica_op *op = r->head; // Stays at the head until it is done
+        size_t queued = r->queued;
+        unsigned long long dropped = r->dropped;
+        uint64_t previous = dropped == r->gaps ? r->sent : 0; // Writes lost since the last one it took break the run
+        pthread_mutex_unlock(&r->lock);
+
+        int applied = replica_apply(r, op, previous);
+        if (applied < 0)
+        {
+            if (!reported)
+                printf("Replica %s unreachable, %zu operations waiting\n", r->name, queued);
+            reported = 1;
+            sleep(REPLICA_RETRY_DELAY);
+            continue;
+        }
+        if (reported)
+            printf("Replica %s reachable again\n", r->name);
+        reported = 0;
+
+        pthread_mutex_lock(&r->lock);
+        if (applied == 0)
+        {
+            r->sent = op->sequence;
+            r->gaps = dropped;
+        }
+        r->head = op->next;
+        if (r->head == NULL)
+            r->tail = NULL;
+        r->queued--;
+        pthread_mutex_unlock(&r->lock);
+        replica_op_free(op);
+    }
+    return NULL;
+}
+
+// Start a replication thread for each host:port of a comma-separated list;
+// returns -1 if the list is invalid
+static inline int replica_start(struct replica_set *set, const char *list, int default_port, struct chunk_store *store)
+{
+    char *members = strdup(list);
+    char *save = NULL;
+    for (char *member = strtok_r(members, ",", &save); member != NULL; member = strtok_r(NULL, ",", &save))
+    {
+        struct replica *r = &set->members[set->count];
+        char *colon = strrchr(member, ':');
+        int port = colon != NULL ? atoi(colon + 1) : default_port;
+        if (colon != NULL)
+            *colon = '\0';
+        struct addrinfo hints = {.ai_family = AF_INET, .ai_socktype = SOCK_STREAM}, *found = NULL;
+        if (set->count == REPLICA_MAX || port <= 0 || port > 65535 || getaddrinfo(member, NULL, &hints, &found) != 0)
+        {
+            fprintf(stderr, "Error: Invalid replica %s (at most %d, as host:port)\n", member, REPLICA_MAX);
+            free(members);
+            return -1;
+        }
+        memcpy(&r->addr, found->ai_addr, sizeof(r->addr));
+        r->addr.sin_port = htons(port);
+        freeaddrinfo(found);
+        snprintf(r->name, sizeof(r->name), "%s:%d", member, port);
+        r->sock = -1;
+        r->store = store;
+        r->sent = set->sequence;
+        pthread_mutex_init(&r->lock, NULL);
+        pthread_cond_init(&r->ready, NULL);
+        if (pthread_create(&r->thread, NULL, replica_thread, r) != 0)
+        {
+            perror("Error starting the replication thread");
+            free(members);
+            return -1;
+        }
+        pthread_detach(r->thread);
+        set->count++;
+        printf("Replicating writes to %s\n", r->name);
+    }
+    free(members);
+    return 0;
+}
+
+// Number a completed write and queue it for every replica; returns its
+// number. path is the directory of a store, named as Smain sent it, or the
+// deleted file; name and local are the stored file's name and where it is here
+static inline uint64_t replica_push(struct replica_set *set, uint8_t opcode, uint32_t trace_id, const char *path,
+                                    const char *name, const char *local)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_REALTIME, &now);
+    uint64_t micros = (uint64_t)now.tv_sec * 1000000 + (uint64_t)now.tv_nsec / 1000;
+    // Numbered and queued under the lock, so every replica gets the writes in number order
+    pthread_mutex_lock(&set->lock);
+    uint64_t sequence = set->sequence = micros > set->sequence ? micros : set->sequence + 1;
+    for (int i = 0; i < set->count; i++)
+    {
+        struct replica *r = &set->members[i];
+        struct replica_op *op = calloc(1, sizeof(*op));
+        if (op == NULL || (op->path = strdup(path)) == NULL || (name != NULL && (op->name = strdup(name)) == NULL) ||
+            (local != NULL && (op->local = strdup(local)) == NULL))
+        {
+            perror("Error queueing a replication");
+            if (op != NULL)
+                replica_op_free(op);
+            pthread_mutex_lock(&r->lock);
+            r->dropped++; // The replica must not count on having it
+            pthread_mutex_unlock(&r->lock);
+            continue;
+        }
+        op->opcode = opcode;
+        op->trace_id = trace_id;
+        op->sequence = sequence;
+        pthread_mutex_lock(&r->lock);
+        if (r->queued == REPLICA_QUEUE_LIMIT)
+        {
+            // Drop the oldest operation but the one being sent
+            struct replica_op *oldest = r->head->next;
+            if (oldest != NULL)
+            {
+                r->head->next = oldest->next;
+                if (r->tail == oldest)
+                    r->tail = r->head;
+                replica_op_free(oldest);
+                r->queued--;
+                if (r->dropped++ % 1000 == 0)
+                    fprintf(stderr, "Replica %s is too far behind: %llu operations dropped, re-seed it\n", r->name,
+                            r->dropped);
+            }
+        }
+        if (r->tail != NULL)
+            r->tail->next = op;
+        else
+            r->head = op;
+        r->tail = op;
+        r->queued++;
+        pthread_cond_signal(&r->ready);
+        pthread_mutex_unlock(&r->lock);
+    }
+    pthread_mutex_unlock(&set->lock);
+    return sequence;
+}
+
+#endif
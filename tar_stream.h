@@ -0,0 +1,621 @@
+// Streaming ustar/pax archive writer shared by Smain, Stext and Spdf
+//
+// tar_open walks a store directory once and records the regular files whose
+// names end in a given extension, which fixes the exact archive size up
+// front (the SIZE frame is sent before any data). tar_read then produces the
+// archive bytes on demand: for every file a header block (preceded by a pax
+// extended header when the name or size does not fit ustar), the file body
+// read straight from disk, and zero padding to the 512-byte block size,
+// followed by the two zero end-of-archive blocks. Nothing is staged in a
+// temporary file and memory use does not depend on file sizes.
+//
+// A file that changes between tar_open and tar_read is truncated or
+// zero-padded to the size recorded in its header so the archive stays valid.
+// Hidden directories (such as the chunk store's .chunks) are not archived.
+//
+// tar_filter passes an archive made elsewhere on without the entries whose
+// names another writer has, so Smain can put journaled uploads in place of
+// the storage servers' copies of the same paths.
+#ifndef FS_TAR_STREAM_H
+#define FS_TAR_STREAM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+#define TAR_BLOCK 512
+#define TAR_MAX_USTAR_SIZE 077777777777LL // Largest size that fits the 11-digit octal field
+
+// A regular file to be archived
+struct tar_entry
+{
+    char *path;  // Absolute path on disk
+    char *name;  // Name inside the archive, relative to the store root
+    long long size;
+    mode_t mode;
+    time_t mtime;
+    int fd;      // Opened ahead by tar_hold, or -1
+};
+
+// Where file contents come from when a store keeps files in another form
+// than their contents (chunk manifests); tar_open reads plain files instead
+struct tar_source
+{
+    void *ctx;
+    long long (*size)(void *ctx, const char *path, long long disk_size); // Size of the contents
+    void *(*open)(void *ctx, const char *path);                          // NULL if unreadable
+    ssize_t (*read)(void *handle, char *buf, size_t len);
+    void (*close)(void *handle);
+};
+
+// Archive being generated
+struct tar_writer
+{
+    const struct tar_source *source; // NULL for plain files
+
+    struct tar_entry *entries;
+    size_t count, capacity;
+    long long total; // Exact size of the archive in bytes
+
+    // Streaming position
+    size_t current;      // Entry being produced
+    int stage;           // 0: headers, 1: body, 2: padding, 3: trailer, 4: done
+    char *header;        // Header blocks of the current entry
+    size_t header_len, header_off;
+    int file;            // Body of the current entry, or -1 if it could not be opened
+    void *handle;        // Body of the current entry when read through the source
+    long long body_left; // Body bytes still owed for the current entry
+    size_t pad_left;     // Zero bytes still owed (padding or trailer)
+};
+
+// Number of bytes needed to pad len up to a whole block
+static inline size_t tar_padding(long long len)
+{
+    return (size_t)((TAR_BLOCK - len % TAR_BLOCK) % TAR_BLOCK);
+}
+
+// Does the archive name fit ustar's name/prefix fields? Sets *split to the
+// index of the '/' separating prefix and name (0 when no prefix is needed)
+static inline int tar_fits_ustar(const char *name, size_t *split)
+{
+    size_t len = strlen(name);
+    *split = 0;
+    if (len <= 100)
+        return 1;
+    // Split at a '/' leaving at most 155 bytes of prefix and 100 of name
+    for (size_t i = len - 1; i > 0; i--)
+    {
+        if (name[i] == '/' && i <= 155 && len - i - 1 <= 100 && len - i - 1 > 0)
+        {
+            *split = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Append a pax record "<len> key=value\n", where len counts the whole record
+static inline size_t tar_pax_record(char *out, const char *key, const char *value)
+{
+    size_t body = strlen(key) + strlen(value) + 3; // ' ', '=', '\n'
+    size_t len = body + 1;
+    char digits[32];
+    // The length prefix counts its own digits
+    while (1)
+    {
+        size_t total = body + (size_t)snprintf(digits, sizeof(digits), "%zu", len);
+        if (total == len)
+            break;
+        len = total;
+    }
+    return (size_t)sprintf(out, "%zu %s=%s\n", len, key, value);
+}
+
+// Fill one 512-byte ustar header block
+static inline void tar_fill_header(char *block, const char *name, size_t split, long long size, mode_t mode,
+                                   time_t mtime, char typeflag)
+{
+    memset(block, 0, TAR_BLOCK);
+    if (split > 0)
+    {
+        memcpy(block + 345, name, split);                           // prefix
+        strncpy(block, name + split + 1, 100);                      // name
+    }
+    else
+    {
+        strncpy(block, name, 100);
+    }
+    snprintf(block + 100, 8, "%07o", (unsigned)(mode & 07777));      // mode
+    snprintf(block + 108, 8, "%07o", 0);                            // uid
+    snprintf(block + 116, 8, "%07o", 0);                            // gid
+    snprintf(block + 124, 12, "%011llo", size <= TAR_MAX_USTAR_SIZE ? (unsigned long long)size : 0ULL);
+    snprintf(block + 136, 12, "%011llo", (unsigned long long)(mtime > 0 ? mtime : 0) & TAR_MAX_USTAR_SIZE);
+    block[156] = typeflag;
+    memcpy(block + 257, "ustar", 6);                                // magic, NUL terminated
+    memcpy(block + 263, "00", 2);                                   // version
+
+    // Checksum: sum of all bytes with the checksum field taken as spaces
+    memset(block + 148, ' ', 8);
+    unsigned int sum = 0;
+    for (int i = 0; i < TAR_BLOCK; i++)
+        sum += (unsigned char)block[i];
+    snprintf(block + 148, 8, "%06o", sum);
+    block[155] = ' ';
+}
+
+// Build the header blocks for an entry; returns their length or -1
+static inline long long tar_build_header(const struct tar_entry *entry, char **out)
+{
+    size_t split;
+    int needs_pax = !tar_fits_ustar(entry->name, &split) || entry->size > TAR_MAX_USTAR_SIZE;
+    size_t pax_len = 0;
+    char *pax = NULL;
+
+    if (needs_pax)
+    {
+        pax = malloc(strlen(entry->name) + 64);
+        if (pax == NULL)
+            return -1;
+        pax_len += tar_pax_record(pax + pax_len, "path", entry->name);
+        if (entry->size > TAR_MAX_USTAR_SIZE)
+        {
+            char size_str[32];
+            snprintf(size_str, sizeof(size_str), "%lld", entry->size);
+            pax_len += tar_pax_record(pax + pax_len, "size", size_str);
+        }
+    }
+
+    size_t len = TAR_BLOCK + (needs_pax ? TAR_BLOCK + pax_len + tar_padding(pax_len) : 0);
+    char *blocks = calloc(1, len);
+    if (blocks == NULL)
+    {
+        free(pax);
+        return -1;
+    }
+    char *p = blocks;
+    if (needs_pax)
+    {
+        // Extended header carrying the real name and size; the ustar header gets a truncated name
+        tar_fill_header(p, "PaxHeader", 0, (long long)pax_len, 0644, entry->mtime, 'x');
+        memcpy(p + TAR_BLOCK, pax, pax_len);
+        p += TAR_BLOCK + pax_len + tar_padding(pax_len);
+        tar_fill_header(p, entry->name + (strlen(entry->name) > 100 ? strlen(entry->name) - 100 : 0), 0, entry->size,
+                        entry->mode, entry->mtime, '0');
+    }
+    else
+    {
+        tar_fill_header(p, entry->name, split, entry->size, entry->mode, entry->mtime, '0');
+    }
+    free(pax);
+    *out = blocks;
+    return (long long)len;
+}
+
+// Record the files under dir (recursively) whose names end in suffix
+static inline int tar_collect(struct tar_writer *tw, const char *dir, size_t root_len, const char *suffix)
+{
+    DIR *d = opendir(dir);
+    if (d == NULL)
+        return errno == ENOENT ? 0 : -1; // An empty store has nothing to archive
+    struct dirent *entry;
+    size_t suffix_len = strlen(suffix);
+    int result = 0;
+    while (result == 0 && (entry = readdir(d)) != NULL)
+    {
+        if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0)
+            continue;
+        size_t path_len = strlen(dir) + strlen(entry->d_name) + 2;
+        char *path = malloc(path_len);
+        if (path == NULL)
+        {
+            result = -1;
+            break;
+        }
+        snprintf(path, path_len, "%s/%s", dir, entry->d_name);
+
+        struct stat st;
+        if (lstat(path, &st) < 0)
+        {
+            free(path);
+            continue; // Removed while walking
+        }
+        if (S_ISDIR(st.st_mode) && entry->d_name[0] == '.')
+        {
+            free(path);
+            continue; // Store metadata
+        }
+        if (S_ISDIR(st.st_mode))
+        {
+            result = tar_collect(tw, path, root_len, suffix);
+            free(path);
+            continue;
+        }
+        size_t name_len = strlen(entry->d_name);
+        if (!S_ISREG(st.st_mode) || name_len < suffix_len || strcmp(entry->d_name + name_len - suffix_len, suffix) != 0)
+        {
+            free(path);
+            continue;
+        }
+
+        if (tw->count == tw->capacity)
+        {
+            size_t capacity = tw->capacity ? tw->capacity * 2 : 64;
+            struct tar_entry *entries = realloc(tw->entries, capacity * sizeof(*entries));
+            if (entries == NULL)
+            {
+                free(path);
+                result = -1;
+                break;
+            }
+            tw->entries = entries;
+            tw->capacity = capacity;
+        }
+        struct tar_entry *e = &tw->entries[tw->count++];
+        e->path = path;
+        e->name = path + root_len + 1; // Relative to the store root
+        e->size = tw->source != NULL ? tw->source->size(tw->source->ctx, path, st.st_size) : st.st_size;
+        e->mode = st.st_mode;
+        e->mtime = st.st_mtime;
+        e->fd = -1;
+
+        // Account for the entry's headers, body and padding
+        size_t split;
+        size_t name_bytes = strlen(e->name);
+        tw->total += TAR_BLOCK + e->size + tar_padding(e->size);
+        if (!tar_fits_ustar(e->name, &split) || e->size > TAR_MAX_USTAR_SIZE)
+        {
+            char *blocks;
+            long long header_len = tar_build_header(e, &blocks);
+            if (header_len < 0)
+            {
+                result = -1;
+                break;
+            }
+            free(blocks);
+            tw->total += header_len - TAR_BLOCK;
+        }
+        (void)name_bytes;
+    }
+    closedir(d);
+    return result;
+}
+
+// Stop reading the current entry's body
+static inline void tar_close_body(struct tar_writer *tw)
+{
+    if (tw->file >= 0)
+        close(tw->file);
+    if (tw->handle != NULL)
+        tw->source->close(tw->handle);
+    tw->file = -1;
+    tw->handle = NULL;
+}
+
+// Release everything held by the writer
+static inline void tar_close(struct tar_writer *tw)
+{
+    for (size_t i = 0; i < tw->count; i++)
+    {
+        if (tw->entries[i].fd >= 0)
+            close(tw->entries[i].fd);
+        free(tw->entries[i].path);
+    }
+    free(tw->entries);
+    free(tw->header);
+    tar_close_body(tw);
+    memset(tw, 0, sizeof(*tw));
+    tw->file = -1;
+}
+
+// Prepare an archive of the files under root ending in suffix, reading them
+// through source unless it is NULL. Returns 0 or -1
+static inline int tar_open_source(struct tar_writer *tw, const char *root, const char *suffix,
+                                  const struct tar_source *source)
+{
+    memset(tw, 0, sizeof(*tw));
+    tw->file = -1;
+    tw->source = source;
+    if (tar_collect(tw, root, strlen(root), suffix) < 0)
+    {
+        tar_close(tw);
+        return -1;
+    }
+    tw->total += 2 * TAR_BLOCK; // End-of-archive marker
+    return 0;
+}
+
+// Prepare an archive of the plain files under root ending in suffix
+static inline int tar_open(struct tar_writer *tw, const char *root, const char *suffix)
+{
+    return tar_open_source(tw, root, suffix, NULL);
+}
+
+// Produce up to len more bytes of the archive. Returns the number of bytes
+// written to buf, 0 once the archive is complete, or -1 on failure
+static inline ssize_t tar_read(struct tar_writer *tw, char *buf, size_t len)
+{
+    size_t produced = 0;
+    while (produced < len && tw->stage != 4)
+    {
+        if (tw->stage == 0)
+        {
+            if (tw->header == NULL)
+            {
+                if (tw->current == tw->count)
+                {
+                    tw->stage = 3;
+                    tw->pad_left = 2 * TAR_BLOCK;
+                    continue;
+                }
+                struct tar_entry *e = &tw->entries[tw->current];
+                long long header_len = tar_build_header(e, &tw->header);
+                if (header_len < 0)
+                    return -1;
+                tw->header_len = (size_t)header_len;
+                tw->header_off = 0;
+                if (e->fd >= 0)
+                    tw->file = e->fd;
+                else if (tw->source != NULL)
+                    tw->handle = tw->source->open(tw->source->ctx, e->path);
+                else
+                    tw->file = open(e->path, O_RDONLY);
+                e->fd = -1;
+                tw->body_left = e->size;
+            }
+            size_t n = tw->header_len - tw->header_off;
+            if (n > len - produced)
+                n = len - produced;
+            memcpy(buf + produced, tw->header + tw->header_off, n);
+            produced += n;
+            tw->header_off += n;
+            if (tw->header_off == tw->header_len)
+            {
+                free(tw->header);
+                tw->header = NULL;
+                tw->stage = 1;
+            }
+        }
+        else if (tw->stage == 1)
+        {
+            if (tw->body_left == 0)
+            {
+                tar_close_body(tw);
+                tw->pad_left = tar_padding(tw->entries[tw->current].size);
+                tw->stage = 2;
+                continue;
+            }
+            size_t want = len - produced;
+            if ((long long)want > tw->body_left)
+                want = (size_t)tw->body_left;
+            ssize_t n = tw->file >= 0     ? read(tw->file, buf + produced, want)
+                        : tw->handle != NULL ? tw->source->read(tw->handle, buf + produced, want)
+                                             : 0;
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+            {
+                // Unreadable or shrunk: pad with zeros to the size in the header
+                tar_close_body(tw);
+                memset(buf + produced, 0, want);
+                n = (ssize_t)want;
+            }
+            produced += (size_t)n;
+            tw->body_left -= n;
+        }
+        else
+        {
+            size_t n = tw->pad_left < len - produced ? tw->pad_left : len - produced;
+            memset(buf + produced, 0, n);
+            produced += n;
+            tw->pad_left -= n;
+            if (tw->pad_left == 0)
+            {
+                if (tw->stage == 3)
+                {
+                    tw->stage = 4;
+                }
+                else
+                {
+                    tw->current++;
+                    tw->stage = 0;
+                }
+            }
+        }
+    }
+    return (ssize_t)produced;
+}
+
+
+static inline int tar_entry_compare(const void *a, const void *b)
+{
+    return strcmp(((const struct tar_entry *)a)->name, ((const struct tar_entry *)b)->name);
+}
+
+// Sort the entries by name for tar_lookup and open their files now, so the
+// archive has them as they are even if they are deleted or replaced before
+// their turn; an entry that cannot be opened yet is opened at its turn
+static inline void tar_hold(struct tar_writer *tw)
+{
+    qsort(tw->entries, tw->count, sizeof(*tw->entries), tar_entry_compare);
+    for (size_t i = 0; i < tw->count && tw->source == NULL; i++)
+        tw->entries[i].fd = open(tw->entries[i].path, O_RDONLY);
+}
+
+// The entry archived under name, or NULL; the entries must have been sorted by tar_hold
+static inline const struct tar_entry *tar_lookup(const struct tar_writer *tw, const char *name)
+{
+    struct tar_entry key = {.name = (char *)name};
+    return bsearch(&key, tw->entries, tw->count, sizeof(*tw->entries), tar_entry_compare);
+}
+
+#define TAR_HELD_MAX (16 * TAR_BLOCK) // Most header bytes read before an entry's name is known
+
+// Passes an archive stream on without the entries another archive has, reading
+// each entry's name from its headers (pax or ustar) as the stream goes by
+struct tar_filter
+{
+    const struct tar_writer *except; // Entries left out by name, sorted by tar_hold
+    char held[TAR_HELD_MAX];         // Header blocks of the entry being read, until its name is known
+    size_t held_len;
+    size_t want;                     // Bytes missing from the header block or pax data being read
+    int stage;                       // 0: header block, 1: pax data, 2: body, 3: the rest as it is
+    size_t pax_off, pax_len;         // The pax data in held, while it is read
+    size_t path_off, path_len;       // The name the pax data gives, if path_len > 0
+    long long pax_size;              // The size the pax data gives, or -1
+    long long body_left;             // Body and padding bytes of the current entry still to come
+    int dropping;                    // The current entry is left out
+};
+
+static inline void tar_filter_init(struct tar_filter *f, const struct tar_writer *except)
+{
+    memset(f, 0, sizeof(*f));
+    f->except = except;
+    f->want = TAR_BLOCK;
+    f->pax_size = -1;
+}
+
+// Value of a numeric ustar field
+static inline long long tar_octal(const char *field, size_t len)
+{
+    long long value = 0;
+    size_t i = 0;
+    while (i < len && field[i] == ' ')
+        i++;
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+        value = value * 8 + (field[i] - '0');
+    return value;
+}
+
+// Pick the path and size out of the pax records in held
+static inline void tar_filter_pax(struct tar_filter *f)
+{
+    const char *data = f->held + f->pax_off;
+    size_t off = 0;
+    while (off < f->pax_len)
+    {
+        size_t rec = 0, i = off;
+        while (i < f->pax_len && data[i] >= '0' && data[i] <= '9')
+            rec = rec * 10 + (size_t)(data[i++] - '0');
+        if (rec == 0 || off + rec > f->pax_len || i + 1 >= off + rec || data[i] != ' ')
+            return; // Malformed
+        const char *key = data + i + 1;
+        const char *end = data + off + rec - 1; // The record's '\n'
+        const char *eq = memchr(key, '=', (size_t)(end - key));
+        if (eq != NULL && eq - key == 4 && memcmp(key, "path", 4) == 0)
+        {
+            f->path_off = (size_t)(eq + 1 - f->held);
+            f->path_len = (size_t)(end - eq - 1);
+        }
+        else if (eq != NULL && eq - key == 4 && memcmp(key, "size", 4) == 0)
+        {
+            f->pax_size = 0;
+            for (const char *p = eq + 1; p < end && *p >= '0' && *p <= '9'; p++)
+                f->pax_size = f->pax_size * 10 + (*p - '0');
+        }
+        off += rec;
+    }
+}
+
+// Feed len more bytes of the stream through the filter, handing what is kept
+// to emit. Returns 0, or -1 as soon as emit fails, without touching f again
+static inline int tar_filter_write(struct tar_filter *f, const char *data, size_t len,
+                                   int (*emit)(void *ctx, const char *data, size_t len), void *ctx)
+{
+    while (len > 0)
+    {
+        if (f->stage >= 2)
+        {
+            size_t n = f->stage == 3 || (long long)len < f->body_left ? len : (size_t)f->body_left;
+            if ((f->stage == 3 || !f->dropping) && emit(ctx, data, n) < 0)
+                return -1;
+            data += n;
+            len -= n;
+            if (f->stage == 2 && (f->body_left -= (long long)n) == 0)
+                f->stage = 0;
+            continue;
+        }
+        if (f->held_len + f->want > sizeof(f->held))
+        {
+            // Headers too long to be ours: pass the rest on untouched
+            if (emit(ctx, f->held, f->held_len) < 0)
+                return -1;
+            f->held_len = 0;
+            f->stage = 3;
+            continue;
+        }
+        size_t n = len < f->want ? len : f->want;
+        memcpy(f->held + f->held_len, data, n);
+        f->held_len += n;
+        f->want -= n;
+        data += n;
+        len -= n;
+        if (f->want > 0)
+            continue;
+        f->want = TAR_BLOCK;
+        if (f->stage == 1)
+        {
+            tar_filter_pax(f);
+            f->stage = 0;
+            continue;
+        }
+
+        const char *block = f->held + f->held_len - TAR_BLOCK;
+        size_t zeros = 0;
+        while (zeros < TAR_BLOCK && block[zeros] == '\0')
+            zeros++;
+        if (zeros == TAR_BLOCK)
+        {
+            // End-of-archive marker: it and whatever follows are passed on
+            if (emit(ctx, f->held, f->held_len) < 0)
+                return -1;
+            f->held_len = 0;
+            f->stage = 3;
+            continue;
+        }
+        long long size = tar_octal(block + 124, 12);
+        if (block[156] == 'x')
+        {
+            f->pax_off = f->held_len;
+            f->pax_len = (size_t)size;
+            f->want = (size_t)size + tar_padding(size);
+            f->stage = f->want > 0 ? 1 : 0;
+            continue;
+        }
+
+        char name[TAR_HELD_MAX];
+        if (f->path_len > 0)
+        {
+            memcpy(name, f->held + f->path_off, f->path_len);
+            name[f->path_len] = '\0';
+        }
+        else
+        {
+            size_t prefix = strnlen(block + 345, 155);
+            memcpy(name, block + 345, prefix);
+            if (prefix > 0)
+                name[prefix++] = '/';
+            size_t base = strnlen(block, 100);
+            memcpy(name + prefix, block, base);
+            name[prefix + base] = '\0';
+        }
+        if (f->pax_size >= 0)
+            size = f->pax_size;
+        f->dropping = tar_lookup(f->except, name) != NULL;
+        if (!f->dropping && emit(ctx, f->held, f->held_len) < 0)
+            return -1;
+        f->held_len = 0;
+        f->path_len = 0;
+        f->pax_size = -1;
+        f->body_left = size + (long long)tar_padding(size);
+        f->stage = f->body_left > 0 ? 2 : 0;
+    }
+    return 0;
+}
+
+#endif
@@ -0,0 +1,265 @@
+// Minimal io_uring ring for disk and socket I/O, over the raw system calls
+//
+// A ring is a submission queue the program fills with operations and a
+// completion queue the kernel fills with their results; one io_uring_enter()
+// call hands over any number of operations and can wait for results, so a
+// transfer keeps several reads, writes and sends in flight at once instead
+// of blocking in each in turn. A ring comes with buffer_count buffers of
+// buffer_size bytes, registered with the kernel where the memlock limit
+// allows so reads and writes into them skip the per-call page pinning.
+//
+// A ring is not thread-safe: each thread or process that does I/O through
+// one has its own. uring_create() returns NULL on kernels without io_uring,
+// where it is disabled, or where it lacks an operation used here (plain
+// reads, writes and sends came in 5.6), and callers fall back to blocking
+// system calls.
+#ifndef FS_URING_H
+#define FS_URING_H
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+
+struct uring
+{
+    int fd;
+    unsigned entries;    // Submission queue size
+    unsigned queued;     // Operations prepared but not yet handed to the kernel
+    unsigned inflight;   // Operations handed over whose completion has not been reaped
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_map, *cq_map;
+    size_t sq_map_size, cq_map_size;
+    char *buffers;       // buffer_count buffers of buffer_size bytes
+    size_t buffer_size;
+    unsigned buffer_count;
+    int fixed;           // The buffers are registered: use the _FIXED reads and writes
+};
+
+static inline void uring_destroy(struct uring *r)
+{
+    if (r == NULL)
+        return;
+    if (r->sqes != NULL)
+        munmap(r->sqes, r->entries * sizeof(struct io_uring_sqe));
+    if (r->cq_map != NULL && r->cq_map != r->sq_map)
+        munmap(r->cq_map, r->cq_map_size);
+    if (r->sq_map != NULL)
+        munmap(r->sq_map, r->sq_map_size);
+    if (r->buffers != NULL)
+        munmap(r->buffers, r->buffer_size * r->buffer_count);
+    if (r->fd >= 0)
+        close(r->fd);
+    free(r);
+}
+
+// Does the ring's kernel support every operation used here? Kernels before
+// 5.6 accept a ring but fail reads, writes and sends with -EINVAL; they also
+// lack the probe, which then fails
+static inline int uring_supported(int fd)
+{
+    static const uint8_t needed[] = {IORING_OP_READ, IORING_OP_WRITE, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+                                     IORING_OP_SEND};
+    struct io_uring_probe *probe = calloc(1, sizeof(*probe) + 256 * sizeof(struct io_uring_probe_op));
+    int supported = probe != NULL && syscall(__NR_io_uring_register, fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    for (size_t i = 0; supported && i < sizeof(needed); i++)
+    {
+        supported = needed[i] <= probe->last_op && (probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return supported;
+}
+
+// Set up a ring of entries operations with its buffers; NULL if io_uring is unavailable
+static inline struct uring *uring_create(unsigned entries, unsigned buffer_count, size_t buffer_size)
+{
+    struct uring *r = calloc(1, sizeof(*r));
+    if (r == NULL)
+        return NULL;
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0 || !uring_supported(r->fd))
+    {
+        if (r->fd >= 0)
+            close(r->fd);
+        free(r);
+        return NULL;
+    }
+    r->entries = p.sq_entries;
+    r->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP)
+    {
+        // One mapping holds both queues
+        r->sq_map_size = r->cq_map_size = r->sq_map_size > r->cq_map_size ? r->sq_map_size : r->cq_map_size;
+    }
+    r->sq_map = mmap(NULL, r->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_map == MAP_FAILED)
+    {
+        r->sq_map = NULL;
+        uring_destroy(r);
+        return NULL;
+    }
+    r->cq_map = (p.features & IORING_FEAT_SINGLE_MMAP)
+                    ? r->sq_map
+                    : mmap(NULL, r->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   r->fd, IORING_OFF_SQES);
+    r->buffer_size = buffer_size;
+    r->buffer_count = buffer_count;
+    r->buffers = buffer_count > 0 ? mmap(NULL, buffer_size * buffer_count, PROT_READ | PROT_WRITE,
+                                         MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)
+                                  : NULL;
+    if (r->cq_map == MAP_FAILED || r->sqes == MAP_FAILED || r->buffers == MAP_FAILED)
+    {
+        r->cq_map = r->cq_map == MAP_FAILED ? NULL : r->cq_map;
+        r->sqes = r->sqes == MAP_FAILED ? NULL : r->sqes;
+        r->buffers = r->buffers == MAP_FAILED ? NULL : r->buffers;
+        uring_destroy(r);
+        return NULL;
+    }
+    char *sq = r->sq_map, *cq = r->cq_map;
+    r->sq_head = (unsigned *)(sq + p.sq_off.head);
+    r->sq_tail = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+
+    // Registration pins the buffers, which RLIMIT_MEMLOCK may not allow; plain reads and writes work anyway
+    struct iovec *iov = buffer_count > 0 ? calloc(buffer_count, sizeof(*iov)) : NULL;
+    for (unsigned i = 0; iov != NULL && i < buffer_count; i++)
+    {
+        iov[i].iov_base = r->buffers + i * buffer_size;
+        iov[i].iov_len = buffer_size;
+    }
+    r->fixed = iov != NULL && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov, buffer_count) == 0;
+    free(iov);
+    return r;
+}
+
+static inline char *uring_buffer(struct uring *r, unsigned i)
+{
+    return r->buffers + (size_t)i * r->buffer_size;
+}
+
+// Hand the prepared operations to the kernel and wait until at least
+// wait_nr completions are ready; returns -1 on failure (errno is set)
+static inline int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    while (r->queued > 0 || wait_nr > 0)
+    {
+        int n = (int)syscall(__NR_io_uring_enter, r->fd, r->queued, wait_nr, wait_nr > 0 ? IORING_ENTER_GETEVENTS : 0,
+                             NULL, 0);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        r->queued -= (unsigned)n;
+        r->inflight += (unsigned)n;
+        if (r->queued == 0)
+            break;
+    }
+    return 0;
+}
+
+// Take back the operations prepared but not handed to the kernel, after
+// uring_submit failed; the kernel only reads the queue when it is entered
+static inline void uring_discard(struct uring *r)
+{
+    __atomic_store_n(r->sq_tail, *r->sq_tail - r->queued, __ATOMIC_RELEASE);
+    r->queued = 0;
+}
+
+// The next free submission entry, cleared and counted as queued. The queue
+// is handed over first if it is full
+static inline struct io_uring_sqe *uring_get_sqe(struct uring *r)
+{
+    if (r->queued == r->entries && uring_submit(r, 0) < 0)
+        return NULL;
+    unsigned tail = *r->sq_tail;
+    unsigned index = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_array[index] = index;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    r->queued++;
+    return sqe;
+}
+
+// Queue an operation on fd: a read, write or send of len bytes at addr,
+// at offset in the file (ignored for sockets)
+static inline int uring_queue(struct uring *r, uint8_t opcode, int fd, const void *addr, uint32_t len, uint64_t offset,
+                              uint64_t user_data)
+{
+    struct io_uring_sqe *sqe = uring_get_sqe(r);
+    if (sqe == NULL)
+        return -1;
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)addr;
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    if (opcode == IORING_OP_SEND)
+        sqe->msg_flags = MSG_NOSIGNAL;
+    return 0;
+}
+
+// Queue a read or write of the file at offset into or from addr, which lies
+// in ring buffer i
+static inline int uring_queue_file(struct uring *r, int write, int fd, unsigned i, const void *addr, uint32_t len,
+                                   uint64_t offset, uint64_t user_data)
+{
+    uint8_t opcode = r->fixed ? (write ? IORING_OP_WRITE_FIXED : IORING_OP_READ_FIXED)
+                              : (write ? IORING_OP_WRITE : IORING_OP_READ);
+    if (uring_queue(r, opcode, fd, addr, len, offset, user_data) < 0)
+        return -1;
+    r->sqes[(*r->sq_tail - 1) & *r->sq_mask].buf_index = (uint16_t)i;
+    return 0;
+}
+
+// Take one completion off the queue; returns 0 if there is none yet
+static inline int uring_reap(struct uring *r, uint64_t *user_data, int32_t *res)
+{
+    unsigned head = *r->cq_head;
+    if (head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE))
+        return 0;
+    struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+    *user_data = cqe->user_data;
+    *res = cqe->res;
+    __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+    r->inflight--;
+    return 1;
+}
+
+// Have completions signal an eventfd, for an event loop to watch; returns
+// it, or -1. Only those that complete after their submission returned
+// signal it: the caller reaps the others itself, without a wakeup
+static inline int uring_event_fd(struct uring *r)
+{
+    int efd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (efd >= 0 && syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_EVENTFD_ASYNC, &efd, 1) < 0)
+    {
+        close(efd);
+        return -1;
+    }
+    return efd;
+}
+
+#endif